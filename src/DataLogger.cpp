@@ -1,13 +1,17 @@
 #include "DataLogger.h"
 #include "config.h"
 #include "Settings.h"
+#include "LogArchive.h"
+#include "ResponsePool.h"
 #include <SPIFFS.h>
 #include <ArduinoJson.h>
 #include <Time.h>
 
 struct DataPoint {
+    uint32_t sequence;
     time_t timestamp;
     float temperature;
+    float evaporatorTemperature;
     bool compressorState;
     bool defrostState;
     bool fanState;
@@ -18,84 +22,102 @@ struct DataPoint {
 DataPoint dataHistory[DATA_HISTORY_SIZE];
 int dataHistoryIndex = 0;
 unsigned long lastLogTime = 0;
+uint32_t lastSequence = 0;  // Sequence number of the newest sample, 0 = none yet
+uint32_t bootId = 0;        // Changes on every boot so clients can detect sequence resets
+
+// The header is not stored in the segments, /download_log prepends it
+const char *LOG_CSV_HEADER = "Date,Time,Temperature,CompressorState,DefrostState,FanState,RemainingDefrostTime,RemainingDripTime\n";
+
+SegmentedLog csvLog = {DATA_FILE, "/temperature_log", ".csv", LOG_SEGMENT_SIZE, LOG_MAX_SEGMENTS, 0, 0};
 
 void setupDataLogging() {
-    if (!SPIFFS.exists(DATA_FILE)) {
-        File file = SPIFFS.open(DATA_FILE, FILE_WRITE);
-        if (file) {
-            file.println("Date,Time,Temperature,CompressorState,DefrostState,FanState,RemainingDefrostTime,RemainingDripTime");
-            file.close();
-        }
-    }
+    bootId = esp_random();
+    registerSegmentedLog(csvLog);
+}
+
+static DataPoint sampleCurrentState() {
+    // Use currentTemperature instead of calling readTemperature
+    DataPoint data = {
+        0,
+        time(nullptr),
+        currentTemperature,
+        evaporatorTemperature,
+        digitalRead(COMPRESSOR_RELAY_PIN) == HIGH,
+        digitalRead(DEFROST_RELAY_PIN) == HIGH,
+        digitalRead(FAN_RELAY_PIN) == HIGH,
+        isDefrosting ? (int)((settings.MdF * 60000 - (millis() - lastDefrostTime)) / 1000) : 0,
+        isDraining ? (int)((settings.Fdt * 60000 - (millis() - drainingStartTime)) / 1000) : 0
+    };
+    return data;
 }
 
 void logDataIfNeeded() {
-    if (millis() - lastLogTime >= 5000) { // Log every 5 seconds
-        time_t now = time(nullptr);
-        
-        // Use currentTemperature instead of calling readTemperature
-        float temp = currentTemperature;
-        
-        DataPoint newData = {
-            now,
-            temp,
-            digitalRead(COMPRESSOR_RELAY_PIN) == HIGH,
-            digitalRead(DEFROST_RELAY_PIN) == HIGH,
-            digitalRead(FAN_RELAY_PIN) == HIGH,
-            isDefrosting ? (int)((settings.MdF * 60000 - (millis() - lastDefrostTime)) / 1000) : 0,
-            isDraining ? (int)((settings.Fdt * 60000 - (millis() - drainingStartTime)) / 1000) : 0
-        };
-        
+    if (millis() - lastLogTime >= 5000) { // Sample the dashboard history every 5 seconds
+        DataPoint newData = sampleCurrentState();
+        newData.sequence = ++lastSequence;
+
         dataHistory[dataHistoryIndex] = newData;
         dataHistoryIndex = (dataHistoryIndex + 1) % DATA_HISTORY_SIZE;
 
-        File file = SPIFFS.open(DATA_FILE, FILE_APPEND);
-        if (file) {
-            char dateStr[11];
-            char timeStr[9];
-            strftime(dateStr, sizeof(dateStr), "%Y-%m-%d", localtime(&now));
-            strftime(timeStr, sizeof(timeStr), "%H:%M:%S", localtime(&now));
-            
-            file.printf("%s,%s,%.1f,%d,%d,%d,%d,%d\n",
-                        dateStr,
-                        timeStr,
-                        newData.temperature,
-                        newData.compressorState,
-                        newData.defrostState,
-                        newData.fanState,
-                        newData.remainingDefrostTime,
-                        newData.remainingDripTime);
-            file.close();
-        } else {
-            Serial.println("Error: Failed to open log file");
-        }
-
         lastLogTime = millis();
     }
 }
 
-String getLatestDataJSON() {
-    JsonDocument doc;
-    JsonObject data = doc.to<JsonObject>();
-    int index = (dataHistoryIndex - 1 + DATA_HISTORY_SIZE) % DATA_HISTORY_SIZE;
-    
+void appendLogRow() {
+    DataPoint data = sampleCurrentState();
+
+    File file = SPIFFS.open(DATA_FILE, FILE_APPEND);
+    if (file) {
+        char dateStr[11];
+        char timeStr[9];
+        strftime(dateStr, sizeof(dateStr), "%Y-%m-%d", localtime(&data.timestamp));
+        strftime(timeStr, sizeof(timeStr), "%H:%M:%S", localtime(&data.timestamp));
+
+        file.printf("%s,%s,%.1f,%d,%d,%d,%d,%d\n",
+                    dateStr,
+                    timeStr,
+                    data.temperature,
+                    data.compressorState,
+                    data.defrostState,
+                    data.fanState,
+                    data.remainingDefrostTime,
+                    data.remainingDripTime);
+        size_t size = file.size();
+        file.close();
+
+        if (size >= LOG_SEGMENT_SIZE) {
+            sealLogSegment(csvLog);
+        }
+    } else {
+        Serial.println("Error: Failed to open log file");
+    }
+}
+
+static void fillDataPointJSON(JsonObject point, const DataPoint &data) {
     char dateStr[11];
     char timeStr[9];
-    strftime(dateStr, sizeof(dateStr), "%Y-%m-%d", localtime(&dataHistory[index].timestamp));
-    strftime(timeStr, sizeof(timeStr), "%H:%M:%S", localtime(&dataHistory[index].timestamp));
-    
-    data["date"] = dateStr;
-    data["time"] = timeStr;
-    data["temp"] = dataHistory[index].temperature;
-    data["compressor"] = dataHistory[index].compressorState;
-    data["defrost"] = dataHistory[index].defrostState;
-    data["fan"] = dataHistory[index].fanState;
-    data["remainingDefrostTime"] = dataHistory[index].remainingDefrostTime;
-    data["remainingDripTime"] = dataHistory[index].remainingDripTime;
+    strftime(dateStr, sizeof(dateStr), "%Y-%m-%d", localtime(&data.timestamp));
+    strftime(timeStr, sizeof(timeStr), "%H:%M:%S", localtime(&data.timestamp));
 
-    String response;
-    serializeJson(doc, response);
-    return response;
+    point["seq"] = data.sequence;
+    point["date"] = dateStr;
+    point["time"] = timeStr;
+    point["temp"] = data.temperature;
+    point["compressor"] = data.compressorState;
+    point["defrost"] = data.defrostState;
+    point["fan"] = data.fanState;
+    point["remainingDefrostTime"] = data.remainingDefrostTime;
+    point["remainingDripTime"] = data.remainingDripTime;
+}
+
+void sendLogDownload(AsyncWebServerRequest *request) {
+    sendLogArchive(request, csvLog, "text/csv", "temperature_log.csv", LOG_CSV_HEADER);
+}
+
+void fillLatestDataJSON(JsonDocument &doc) {
+    JsonObject data = doc.to<JsonObject>();
+    int index = (dataHistoryIndex - 1 + DATA_HISTORY_SIZE) % DATA_HISTORY_SIZE;
+    fillDataPointJSON(data, dataHistory[index]);
 }
 
 String getDataJSON(unsigned long startTime, unsigned long endTime) {
@@ -105,25 +127,156 @@ String getDataJSON(unsigned long startTime, unsigned long endTime) {
     for (int i = 0; i < DATA_HISTORY_SIZE; i++) {
         int index = (dataHistoryIndex - 1 - i + DATA_HISTORY_SIZE) % DATA_HISTORY_SIZE;
         if (dataHistory[index].timestamp >= startTime && dataHistory[index].timestamp <= endTime) {
-            JsonObject point = dataArray.add<JsonObject>();
-            
-            char dateStr[11];
-            char timeStr[9];
-            strftime(dateStr, sizeof(dateStr), "%Y-%m-%d", localtime(&dataHistory[index].timestamp));
-            strftime(timeStr, sizeof(timeStr), "%H:%M:%S", localtime(&dataHistory[index].timestamp));
-            
-            point["date"] = dateStr;
-            point["time"] = timeStr;
-            point["temp"] = dataHistory[index].temperature;
-            point["compressor"] = dataHistory[index].compressorState;
-            point["defrost"] = dataHistory[index].defrostState;
-            point["fan"] = dataHistory[index].fanState;
-            point["remainingDefrostTime"] = dataHistory[index].remainingDefrostTime;
-            point["remainingDripTime"] = dataHistory[index].remainingDripTime;
+            fillDataPointJSON(dataArray.add<JsonObject>(), dataHistory[index]);
         }
     }
 
     String response;
     serializeJson(doc, response);
     return response;
+}
+
+// The ring holds the last min(lastSequence, DATA_HISTORY_SIZE) samples contiguously
+static uint32_t firstAvailableSequence() {
+    return lastSequence > (uint32_t)DATA_HISTORY_SIZE ? lastSequence - DATA_HISTORY_SIZE + 1 : 1;
+}
+
+// A cursor older than the ring (missed samples) or ahead of it (device rebooted)
+// cannot be continued; the client has to re-baseline from the full history.
+static bool isSequenceGap(uint32_t sequence) {
+    return sequence + 1 < firstAvailableSequence() || sequence > lastSequence;
+}
+
+static int countDataSince(uint32_t sequence, int maxRecords) {
+    uint32_t next = isSequenceGap(sequence) ? firstAvailableSequence() : sequence + 1;
+    return next > lastSequence ? 0 : (int)min(lastSequence - next + 1, (uint32_t)maxRecords);
+}
+
+void fillDataSinceJSON(JsonDocument &doc, uint32_t sequence, int maxRecords) {
+    doc["boot"] = bootId;
+
+    uint32_t firstAvailable = firstAvailableSequence();
+    doc["first"] = firstAvailable;
+    doc["last"] = lastSequence;
+
+    bool gap = isSequenceGap(sequence);
+    doc["gap"] = gap;
+    if (lastSequence > 0) {
+        int lastIndex = (dataHistoryIndex - 1 + DATA_HISTORY_SIZE) % DATA_HISTORY_SIZE;
+        doc["lastTimestamp"] = (unsigned long)dataHistory[lastIndex].timestamp;
+    }
+
+    JsonArray records = doc["records"].to<JsonArray>();
+    uint32_t next = gap ? firstAvailable : sequence + 1;
+    for (int count = 0; next <= lastSequence && count < maxRecords; next++, count++) {
+        int index = (dataHistoryIndex - 1 - (int)(lastSequence - next) + DATA_HISTORY_SIZE) % DATA_HISTORY_SIZE;
+        fillDataPointJSON(records.add<JsonObject>(), dataHistory[index]);
+    }
+    doc["more"] = next <= lastSequence;
+}
+
+void sendDataSince(AsyncWebServerRequest *request, uint32_t sequence, int maxRecords) {
+    bool usePool = countDataSince(sequence, maxRecords) <= DATA_SINCE_POOLED_RECORDS;
+    sendJsonResponse(request, EP_DATA_SINCE, [sequence, maxRecords](JsonDocument &doc) {
+        fillDataSinceJSON(doc, sequence, maxRecords);
+    }, 200, usePool);
+}
+
+// Binary history format (little-endian), oldest point first:
+//   "XH", version, flags (bit0: evaporator column present)
+//   uint16 count, uint32 base epoch (timestamp of the first point)
+//   count x zigzag varint timestamp deltas (first delta is relative to base)
+//   count x int16 temperature in 0.1 degC (INT16_MIN = invalid)
+//   3 bit-planes of ceil(count/8) bytes: compressor, defrost, fan (LSB first)
+//   [count x int16 evaporator temperature in 0.1 degC]
+int16_t packTemperature(float temperature) {
+    if (isnan(temperature) || temperature < -3276.0f || temperature > 3276.0f) {
+        return INT16_MIN;
+    }
+    return (int16_t)lroundf(temperature * 10.0f);
+}
+
+static void writeInt16(Print &out, int16_t value) {
+    out.write((uint8_t)(value & 0xFF));
+    out.write((uint8_t)((uint16_t)value >> 8));
+}
+
+static void writeVarint(Print &out, int32_t value) {
+    uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+    while (zigzag >= 0x80) {
+        out.write((uint8_t)(zigzag | 0x80));
+        zigzag >>= 7;
+    }
+    out.write((uint8_t)zigzag);
+}
+
+// Calls fn(point) for every logged point in [startTime, endTime], oldest first.
+template <typename Fn>
+static void forEachPointInRange(unsigned long startTime, unsigned long endTime, Fn fn) {
+    for (int i = 0; i < DATA_HISTORY_SIZE; i++) {
+        const DataPoint &point = dataHistory[(dataHistoryIndex + i) % DATA_HISTORY_SIZE];
+        // Compared unsigned like getDataJSON: (time_t)ULONG_MAX, the default end, is -1
+        unsigned long timestamp = (unsigned long)point.timestamp;
+        if (timestamp != 0 && timestamp >= startTime && timestamp <= endTime) {
+            fn(point);
+        }
+    }
+}
+
+void writeDataBinary(Print &out, unsigned long startTime, unsigned long endTime, bool includeEvaporator) {
+    uint16_t count = 0;
+    time_t baseTime = 0;
+    forEachPointInRange(startTime, endTime, [&](const DataPoint &point) {
+        if (count == 0) {
+            baseTime = point.timestamp;
+        }
+        count++;
+    });
+
+    out.write('X');
+    out.write('H');
+    out.write((uint8_t)DATA_BINARY_VERSION);
+    out.write((uint8_t)(includeEvaporator ? 0x01 : 0x00));
+    out.write((uint8_t)(count & 0xFF));
+    out.write((uint8_t)(count >> 8));
+    for (int shift = 0; shift < 32; shift += 8) {
+        out.write((uint8_t)((uint32_t)baseTime >> shift));
+    }
+
+    time_t previous = baseTime;
+    forEachPointInRange(startTime, endTime, [&](const DataPoint &point) {
+        writeVarint(out, (int32_t)(point.timestamp - previous));
+        previous = point.timestamp;
+    });
+
+    forEachPointInRange(startTime, endTime, [&](const DataPoint &point) {
+        writeInt16(out, packTemperature(point.temperature));
+    });
+
+    for (int plane = 0; plane < 3; plane++) {
+        uint8_t bits = 0;
+        int bit = 0;
+        forEachPointInRange(startTime, endTime, [&](const DataPoint &point) {
+            bool state = plane == 0 ? point.compressorState
+                       : plane == 1 ? point.defrostState
+                                    : point.fanState;
+            if (state) {
+                bits |= (uint8_t)(1 << bit);
+            }
+            if (++bit == 8) {
+                out.write(bits);
+                bits = 0;
+                bit = 0;
+            }
+        });
+        if (bit != 0) {
+            out.write(bits);
+        }
+    }
+
+    if (includeEvaporator) {
+        forEachPointInRange(startTime, endTime, [&](const DataPoint &point) {
+            writeInt16(out, packTemperature(point.evaporatorTemperature));
+        });
+    }
 }
\ No newline at end of file
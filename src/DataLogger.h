@@ -1,8 +1,20 @@
 #pragma once
 
 #include <Arduino.h>
+#include <ArduinoJson.h>
+
+class AsyncWebServerRequest;
 
 void setupDataLogging();
 void logDataIfNeeded();
-String getLatestDataJSON();
-String getDataJSON(unsigned long startTime, unsigned long endTime);
\ No newline at end of file
+void appendLogRow();
+void sendLogDownload(AsyncWebServerRequest *request);
+void fillLatestDataJSON(JsonDocument &doc);
+String getDataJSON(unsigned long startTime, unsigned long endTime);
+void fillDataSinceJSON(JsonDocument &doc, uint32_t sequence, int maxRecords);
+void sendDataSince(AsyncWebServerRequest *request, uint32_t sequence, int maxRecords);
+
+// Compact columnar encoding of the history served by /data_bin
+constexpr uint8_t DATA_BINARY_VERSION = 1;
+int16_t packTemperature(float temperature);  // 0.1 degC, INT16_MIN when invalid
+void writeDataBinary(Print &out, unsigned long startTime, unsigned long endTime, bool includeEvaporator);
\ No newline at end of file
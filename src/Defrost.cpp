@@ -0,0 +1,193 @@
+#include "Defrost.h"
+#include "config.h"
+#include "Settings.h"
+#include "Hardware.h"
+
+const unsigned long FROST_SETTLE_MS = 60000;      // Evaporator pull-down after a compressor start, not sampled
+const unsigned long FROST_MIN_CYCLE_MS = 120000;  // Shorter cycles give no usable pull-down rate
+const int FROST_CLEAN_CYCLES = 2;                 // Cycles after a defrost that define the clean coil
+const float FROST_EWMA_ALPHA = 0.3;               // Smoothing of the per-cycle indicators
+const float FROST_DELTA_FULL = 0.3;               // Difference grown by 30 %: fully iced
+const float FROST_PULLDOWN_FULL = 0.5;            // Pull-down rate halved: fully iced
+
+// The pull-down rate also follows the door load, so it weighs least
+const float FROST_WEIGHT_RUN = 0.3;
+const float FROST_WEIGHT_DELTA = 0.5;
+const float FROST_WEIGHT_PULLDOWN = 0.2;
+
+static const char *const DEFROST_REASONS[] = {"none", "start-up", "interval", "frost"};
+
+DefrostState defrost;
+
+static void resetFrostEstimate() {
+  defrost.frostRunMillis = 0;
+  defrost.frostDeltaSum = 0;
+  defrost.frostDeltaSamples = 0;
+  defrost.frostCleanCycles = 0;
+  defrost.cleanDelta = defrost.cleanPullDown = NAN;
+  defrost.currentDelta = defrost.currentPullDown = NAN;
+  defrost.frostLevel = 0;
+}
+
+static float learn(float average, float sample, int count) {
+  if (isnan(sample)) return average;
+  if (isnan(average)) return sample;
+  return average + (sample - average) / (count + 1);
+}
+
+static float smooth(float average, float sample) {
+  if (isnan(sample)) return average;
+  if (isnan(average)) return sample;
+  return average + FROST_EWMA_ALPHA * (sample - average);
+}
+
+// A completed compressor cycle: the first ones after a defrost set the clean
+// coil, later ones move the current indicators
+static void finishFrostCycle(unsigned long now) {
+  unsigned long duration = now - defrost.frostCycleStart;
+  if (duration < FROST_MIN_CYCLE_MS || isnan(currentTemperature) || isnan(defrost.frostCycleStartTemperature)) {
+    return;
+  }
+  float pullDown = (defrost.frostCycleStartTemperature - currentTemperature) / (duration / 60000.0);
+  float delta = defrost.frostDeltaSamples ? defrost.frostDeltaSum / defrost.frostDeltaSamples : NAN;
+
+  if (defrost.frostCleanCycles < FROST_CLEAN_CYCLES) {
+    defrost.cleanPullDown = learn(defrost.cleanPullDown, pullDown, defrost.frostCleanCycles);
+    defrost.cleanDelta = learn(defrost.cleanDelta, delta, defrost.frostCleanCycles);
+    defrost.frostCleanCycles++;
+    defrost.currentPullDown = defrost.cleanPullDown;
+    defrost.currentDelta = defrost.cleanDelta;
+  } else {
+    defrost.currentPullDown = smooth(defrost.currentPullDown, pullDown);
+    defrost.currentDelta = smooth(defrost.currentDelta, delta);
+  }
+}
+
+static float indicator(float value) {
+  return constrain(value, 0.0f, 1.0f);
+}
+
+// Indicators count as zero until the clean coil is learned
+static float computeFrostLevel() {
+  bool hasEvaporator = settings.P2P == "y";
+  bool learned = defrost.frostCleanCycles >= FROST_CLEAN_CYCLES;
+  float weighted = FROST_WEIGHT_RUN * indicator(defrost.frostRunMillis / (settings.IdF * 3600000.0));
+  float weights = FROST_WEIGHT_RUN + FROST_WEIGHT_PULLDOWN + (hasEvaporator ? FROST_WEIGHT_DELTA : 0);
+
+  if (learned && defrost.cleanPullDown > 0 && !isnan(defrost.currentPullDown)) {
+    weighted += FROST_WEIGHT_PULLDOWN * indicator((1 - defrost.currentPullDown / defrost.cleanPullDown) / FROST_PULLDOWN_FULL);
+  }
+  if (learned && hasEvaporator && defrost.cleanDelta > 0 && !isnan(defrost.currentDelta)) {
+    weighted += FROST_WEIGHT_DELTA * indicator((defrost.currentDelta / defrost.cleanDelta - 1) / FROST_DELTA_FULL);
+  }
+  return 100 * weighted / weights;
+}
+
+void updateDefrost() {
+  unsigned long now = millis();
+  unsigned long elapsed = now - defrost.lastDefrostUpdate;
+  defrost.lastDefrostUpdate = now;
+
+  if (isDefrostOn && !defrost.lastDefrostOn) {
+    defrost.defrostsSinceBoot++;
+    defrost.lastDefrostReason = defrost.requestReason;
+  } else if (!isDefrostOn && defrost.lastDefrostOn) {
+    resetFrostEstimate();  // The coil is clean again
+  }
+  defrost.lastDefrostOn = isDefrostOn;
+
+  // Hot gas defrost runs the compressor, dripping leaves the coil wet: neither is a cooling cycle
+  if (isDefrostOn || isDraining) {
+    defrost.lastFrostCompressorOn = false;
+    return;
+  }
+
+  if (isCompressorOn && !defrost.lastFrostCompressorOn) {
+    defrost.frostCycleStart = now;
+    defrost.frostCycleStartTemperature = currentTemperature;
+    defrost.frostDeltaSum = 0;
+    defrost.frostDeltaSamples = 0;
+  } else if (isCompressorOn) {
+    defrost.frostRunMillis += elapsed;
+    if (now - defrost.frostCycleStart >= FROST_SETTLE_MS && !isnan(currentTemperature) && !isnan(evaporatorTemperature)) {
+      defrost.frostDeltaSum += currentTemperature - evaporatorTemperature;
+      defrost.frostDeltaSamples++;
+    }
+  } else if (defrost.lastFrostCompressorOn) {
+    finishFrostCycle(now);
+  }
+  defrost.lastFrostCompressorOn = isCompressorOn;
+  defrost.frostLevel = computeFrostLevel();
+}
+
+static DefrostReason defrostNeeded(unsigned long now) {
+  unsigned long sinceLast = now - lastDefrostTime;  // Since boot before the first defrost
+  if (defrost.defrostsSinceBoot == 0 && settings.dPo == "y") {
+    return REASON_STARTUP;
+  }
+  if (sinceLast >= settings.IdF * 3600000UL) {
+    return REASON_INTERVAL;
+  }
+  if (settings.dEM == "y" && sinceLast >= settings.IdM * 3600000UL && defrost.frostLevel >= settings.dFL) {
+    return REASON_FROST;
+  }
+  return REASON_NONE;
+}
+
+bool isDefrostDue() {
+  unsigned long now = millis();
+  if (!defrost.isDefrostRequested) {
+    defrost.requestReason = defrostNeeded(now);
+    if (defrost.requestReason == REASON_NONE) {
+      return false;
+    }
+    defrost.isDefrostRequested = true;
+    defrost.defrostRequestTime = now;
+    Serial.printf("Defrost requested (%s, frost %.0f%%)\n", DEFROST_REASONS[defrost.requestReason], defrost.frostLevel);
+  }
+  if (now - defrost.defrostRequestTime < settings.dSd * 60000UL) {
+    return false;
+  }
+  defrost.isDefrostRequested = false;
+  return true;
+}
+
+void resetDefrost() {
+  defrost.lastDefrostUpdate = millis();
+  defrost.lastDefrostOn = isDefrostOn;
+  defrost.lastFrostCompressorOn = false;
+  defrost.defrostsSinceBoot = 0;
+  defrost.isDefrostRequested = false;
+  defrost.requestReason = defrost.lastDefrostReason = REASON_NONE;
+  resetFrostEstimate();
+}
+
+float getFrostLevel() {
+  return defrost.frostLevel;
+}
+
+void fillDefrostJSON(JsonDocument &doc) {
+  unsigned long now = millis();
+  unsigned long sinceLast = now - lastDefrostTime;
+  doc["mode"] = settings.dEM == "y" ? "demand" : "interval";
+  doc["frostLevel"] = round(defrost.frostLevel * 10) / 10.0;
+  doc["runMinutes"] = defrost.frostRunMillis / 60000;
+  doc["cleanCycles"] = defrost.frostCleanCycles;
+  if (!isnan(defrost.cleanDelta)) doc["cleanDelta"] = round(defrost.cleanDelta * 100) / 100.0;
+  if (!isnan(defrost.currentDelta)) doc["delta"] = round(defrost.currentDelta * 100) / 100.0;
+  if (!isnan(defrost.cleanPullDown)) doc["cleanPullDown"] = round(defrost.cleanPullDown * 1000) / 1000.0;
+  if (!isnan(defrost.currentPullDown)) doc["pullDown"] = round(defrost.currentPullDown * 1000) / 1000.0;
+  doc["defrosting"] = isDefrostOn;
+  doc["draining"] = isDraining;
+  doc["requested"] = defrost.isDefrostRequested;
+  if (defrost.isDefrostRequested) {
+    unsigned long startDelay = settings.dSd * 60000UL;
+    unsigned long waited = now - defrost.defrostRequestTime;
+    doc["startsIn"] = waited < startDelay ? (startDelay - waited) / 1000 : 0;
+  }
+  doc["defrosts"] = defrost.defrostsSinceBoot;
+  doc["lastReason"] = DEFROST_REASONS[defrost.lastDefrostReason];
+  doc["minutesSinceLast"] = sinceLast / 60000;
+  unsigned long maximum = settings.IdF * 3600000UL;
+  doc["forcedIn"] = sinceLast < maximum ? (maximum - sinceLast) / 60000 : 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Defrost scheduling. With dEM = "n" a defrost is due every IdF hours. With
+// dEM = "y" it is due once the frost level reaches dFL percent, but no sooner
+// than IdM and no later than IdF hours after the previous defrost. dPo = "y"
+// adds a defrost at start-up, and dSd delays every start once it is due.
+//
+// The frost level (0..100 %) is a weighted sum of three indicators. Each is
+// measured against the clean coil, learned in the first compressor cycles
+// after a defrost, and updated once per loop or per compressor cycle:
+//   - compressor run time since the defrost, against IdF hours of running
+//   - growth of the cabinet-evaporator difference while the compressor runs
+//     (frost insulates the coil, so the evaporator runs colder)
+//   - drop of the cabinet pull-down rate over a compressor cycle
+// Without an evaporator probe the difference indicator is left out.
+
+enum DefrostReason : uint8_t { REASON_NONE, REASON_STARTUP, REASON_INTERVAL, REASON_FROST };
+
+// Scheduler and frost estimate of the zone being controlled
+struct DefrostState {
+  unsigned long lastDefrostUpdate = 0;
+  bool lastDefrostOn = false;
+  bool lastFrostCompressorOn = false;
+  uint32_t defrostsSinceBoot = 0;
+  bool isDefrostRequested = false;
+  unsigned long defrostRequestTime = 0;
+  DefrostReason requestReason = REASON_NONE;
+  DefrostReason lastDefrostReason = REASON_NONE;
+
+  // Frost estimate since the last defrost
+  unsigned long frostRunMillis = 0;
+  unsigned long frostCycleStart = 0;
+  float frostCycleStartTemperature = 0;
+  double frostDeltaSum = 0;
+  uint32_t frostDeltaSamples = 0;
+  int frostCleanCycles = 0;
+  float cleanDelta = NAN;        // degC, cabinet minus evaporator with a clean coil
+  float cleanPullDown = NAN;     // degC per minute
+  float currentDelta = NAN;
+  float currentPullDown = NAN;
+  float frostLevel = 0;
+};
+
+extern DefrostState defrost;
+
+void updateDefrost();   // Every loop, before the defrost decision
+bool isDefrostDue();    // Call while neither defrosting nor draining
+void resetDefrost();    // Scheduler and estimate as after boot
+float getFrostLevel();
+void fillDefrostJSON(JsonDocument &doc);
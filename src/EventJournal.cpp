@@ -0,0 +1,408 @@
+#include "EventJournal.h"
+#include "config.h"
+#include "Settings.h"
+#include "Hardware.h"
+#include "DataLogger.h"
+#include "LogArchive.h"
+#include "FaultDetector.h"
+#include <SPIFFS.h>
+#include <ESPAsyncWebServer.h>
+#include <ArduinoJson.h>
+#include <memory>
+#include <sys/time.h>
+
+static const char *const EVENT_NAMES[] = {
+  "snapshot", "compressor", "defrost", "drain", "fan",
+  "highAlarm", "lowAlarm", "door", "energySaving", "temperature", "fault"
+};
+
+JournalListener journalListener = nullptr;
+bool journalStarted = false;
+uint8_t lastJournalStates = 0;
+uint8_t lastJournalFaults = 0;
+float lastJournalTemperature = 0.0;
+unsigned long lastJournalTemperatureTime = 0;
+
+SegmentedLog journalLog = {JOURNAL_FILE, "/events", ".bin", JOURNAL_SEGMENT_SIZE, JOURNAL_MAX_SEGMENTS, 0, 0};
+
+static uint8_t currentJournalStates() {
+  uint8_t states = 0;
+  if (isCompressorOn) states |= JOURNAL_STATE_BIT(EVT_COMPRESSOR);
+  if (isDefrostOn) states |= JOURNAL_STATE_BIT(EVT_DEFROST);
+  if (isDraining) states |= JOURNAL_STATE_BIT(EVT_DRAIN);
+  if (isFanOn) states |= JOURNAL_STATE_BIT(EVT_FAN);
+  if (highTempAlert) states |= JOURNAL_STATE_BIT(EVT_HIGH_ALARM);
+  if (lowTempAlert) states |= JOURNAL_STATE_BIT(EVT_LOW_ALARM);
+  if (digitalRead(DOOR_SENSOR_PIN) == LOW) states |= JOURNAL_STATE_BIT(EVT_DOOR);
+  if (energySavingMode) states |= JOURNAL_STATE_BIT(EVT_ENERGY_SAVING);
+  return states;
+}
+
+static JournalRecord makeRecord(JournalEventType type, uint8_t value) {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+
+  JournalRecord record;
+  record.time = (uint32_t)tv.tv_sec;
+  record.millis = (uint16_t)(tv.tv_usec / 1000);
+  record.type = type;
+  record.value = value;
+  record.temperature = packTemperature(currentTemperature);
+  record.evaporator = packTemperature(evaporatorTemperature);
+  return record;
+}
+
+static size_t appendRecords(const JournalRecord *records, int count) {
+  File file = SPIFFS.open(JOURNAL_FILE, FILE_APPEND);
+  if (!file) {
+    Serial.println("Error: Failed to open event journal");
+    return 0;
+  }
+  file.write((const uint8_t *)records, count * sizeof(JournalRecord));
+  size_t size = file.size();
+  file.close();
+  return size;
+}
+
+static void writeRecords(const JournalRecord *records, int count) {
+  size_t size = appendRecords(records, count);
+  if (size == 0) {
+    return;
+  }
+
+  if (journalListener) {
+    journalListener(records, count);
+  }
+
+  if (size >= JOURNAL_SEGMENT_SIZE) {
+    sealLogSegment(journalLog);
+    // Every segment starts with a snapshot, so the oldest one left after
+    // retention still anchors the replay in sendEvents()
+    JournalRecord snapshot = makeRecord(EVT_SNAPSHOT, lastJournalStates);
+    appendRecords(&snapshot, 1);
+  }
+}
+
+void setupEventJournal() {
+  registerSegmentedLog(journalLog);
+}
+
+JournalRecord sampleJournalSnapshot() {
+  return makeRecord(EVT_SNAPSHOT, currentJournalStates());
+}
+
+void setJournalListener(JournalListener listener) {
+  journalListener = listener;
+}
+
+const char *journalEventName(uint8_t type) {
+  return type <= EVT_FAULT ? EVENT_NAMES[type] : "unknown";
+}
+
+bool updateEventJournal() {
+  if (time(nullptr) < JOURNAL_MIN_VALID_TIME) {
+    return false;
+  }
+
+  uint8_t states = currentJournalStates();
+  JournalRecord records[EVT_FAULT + 1];
+  int count = 0;
+
+  if (!journalStarted) {
+    // Anchor the timeline at boot, writeRecords() adds one to every new segment
+    records[count++] = makeRecord(EVT_SNAPSHOT, states);
+    journalStarted = true;
+  } else {
+    uint8_t changed = states ^ lastJournalStates;
+    for (uint8_t type = EVT_COMPRESSOR; type <= EVT_ENERGY_SAVING; type++) {
+      uint8_t bit = JOURNAL_STATE_BIT((JournalEventType)type);
+      if (changed & bit) {
+        records[count++] = makeRecord((JournalEventType)type, (states & bit) ? 1 : 0);
+      }
+    }
+  }
+  lastJournalStates = states;
+
+  if (faultFlags != lastJournalFaults) {
+    records[count++] = makeRecord(EVT_FAULT, faultFlags);
+    lastJournalFaults = faultFlags;
+  }
+
+  if (count == 0 &&
+      (fabs(currentTemperature - lastJournalTemperature) >= settings.LdB ||
+       millis() - lastJournalTemperatureTime >= (unsigned long)settings.LMi * 60000UL)) {
+    records[count++] = makeRecord(EVT_TEMPERATURE, 0);
+  }
+
+  if (count == 0) {
+    return false;
+  }
+
+  // Every record carries the temperature, so any record restarts the deadband
+  lastJournalTemperature = currentTemperature;
+  lastJournalTemperatureTime = millis();
+  writeRecords(records, count);
+  return true;
+}
+
+// Reassembles records from the byte stream of a (possibly compressed) segment
+template <typename Fn>
+struct JournalRecordReader {
+  Fn &fn;
+  JournalRecord record;
+  size_t filled;
+
+  static void sink(void *context, const uint8_t *data, size_t length) {
+    JournalRecordReader *reader = (JournalRecordReader *)context;
+    while (length > 0) {
+      size_t chunk = min(length, sizeof(JournalRecord) - reader->filled);
+      memcpy((uint8_t *)&reader->record + reader->filled, data, chunk);
+      reader->filled += chunk;
+      data += chunk;
+      length -= chunk;
+      if (reader->filled == sizeof(JournalRecord)) {
+        reader->fn(reader->record);
+        reader->filled = 0;
+      }
+    }
+  }
+};
+
+// Calls fn(record, segment, index) for every journal record, oldest segment
+// first; index counts the records within the segment
+template <typename Fn>
+static void forEachJournalRecord(Fn fn) {
+  for (int segment = journalLog.firstSegment; segment <= journalLog.nextSegment; segment++) {
+    uint32_t index = 0;
+    auto visit = [&](const JournalRecord &record) { fn(record, segment, index++); };
+    JournalRecordReader<decltype(visit)> reader = {visit, {}, 0};
+    readLogSegment(journalLog, segment, JournalRecordReader<decltype(visit)>::sink, &reader);
+  }
+}
+
+// Copies up to count records of a segment, starting at record first, and
+// returns how many there were
+static int readJournalRecords(int segment, uint32_t first, JournalRecord *records, int count) {
+  uint32_t index = 0;
+  int read = 0;
+  auto collect = [&](const JournalRecord &record) {
+    if (index++ >= first && read < count) {
+      records[read++] = record;
+    }
+  };
+  JournalRecordReader<decltype(collect)> reader = {collect, {}, 0};
+  readLogSegment(journalLog, segment, JournalRecordReader<decltype(collect)>::sink, &reader);
+  return read;
+}
+
+static void fillStatesJSON(JsonObject object, uint8_t states) {
+  for (uint8_t type = EVT_COMPRESSOR; type <= EVT_ENERGY_SAVING; type++) {
+    object[EVENT_NAMES[type]] = (states & JOURNAL_STATE_BIT((JournalEventType)type)) != 0;
+  }
+}
+
+// Prints 0.1 degC exactly, as a double would come out as 21.299999
+static int formatTenths(char *out, size_t size, int16_t tenths) {
+  int magnitude = abs(tenths);
+  return snprintf(out, size, "%s%d.%d", tenths < 0 ? "-" : "", magnitude / 10, magnitude % 10);
+}
+
+// State of one /events response. The summary is replayed when the request
+// arrives; the events are then read back from the journal a batch at a time
+// while the response goes out, so the body is never held in memory.
+struct EventStream {
+  enum Phase { HEAD, EVENTS, TAIL, DONE };
+
+  Phase phase = HEAD;
+  String head;                 // {"initial":{...},"events":[
+  String tail;                 // ],"truncated":...}
+  unsigned long endTime;
+  int segment;                 // Position of the next record to read
+  uint32_t index;
+  int remaining;               // Events still to send
+  bool firstEvent = true;
+  JournalRecord batch[JOURNAL_STREAM_BATCH];
+  int batchCount = 0;
+  int batchPosition = 0;
+  char text[128];              // One event
+  const char *piece = nullptr; // Being sent
+  size_t pieceLength = 0;
+  size_t pieceSent = 0;
+
+  bool nextRecord(JournalRecord &record) {
+    while (batchPosition == batchCount) {
+      if (segment > journalLog.nextSegment) {
+        return false;
+      }
+      batchCount = readJournalRecords(segment, index, batch, JOURNAL_STREAM_BATCH);
+      batchPosition = 0;
+      if (batchCount == 0) {
+        segment++;  // Read to the end, or dropped by retention since the request
+        index = 0;
+      } else {
+        index += batchCount;
+      }
+    }
+    record = batch[batchPosition++];
+    return true;
+  }
+
+  int formatEvent(const JournalRecord &record) {
+    int length = snprintf(text, sizeof(text), "%s{\"t\":%lu,\"ms\":%u,\"type\":\"%s\",\"value\":%u",
+                          firstEvent ? "" : ",", (unsigned long)record.time, record.millis,
+                          journalEventName(record.type), record.value);
+    if (record.temperature != INT16_MIN) {
+      length += snprintf(text + length, sizeof(text) - length, ",\"temp\":");
+      length += formatTenths(text + length, sizeof(text) - length, record.temperature);
+    }
+    if (record.evaporator != INT16_MIN) {
+      length += snprintf(text + length, sizeof(text) - length, ",\"evap\":");
+      length += formatTenths(text + length, sizeof(text) - length, record.evaporator);
+    }
+    length += snprintf(text + length, sizeof(text) - length, "}");
+    firstEvent = false;
+    return length;
+  }
+
+  // Points piece at the next part of the body, false at the end
+  bool nextPiece() {
+    switch (phase) {
+      case HEAD:
+        piece = head.c_str();
+        pieceLength = head.length();
+        phase = EVENTS;
+        return true;
+
+      case EVENTS: {
+        JournalRecord record;
+        while (remaining > 0 && nextRecord(record)) {
+          if (record.time > endTime) {
+            continue;
+          }
+          remaining--;
+          piece = text;
+          pieceLength = formatEvent(record);
+          return true;
+        }
+        piece = tail.c_str();
+        pieceLength = tail.length();
+        phase = TAIL;
+        return true;
+      }
+
+      case TAIL:
+        phase = DONE;
+        return false;
+
+      case DONE:
+        break;
+    }
+    return false;
+  }
+
+  size_t fill(uint8_t *buffer, size_t maxLen) {
+    size_t length = 0;
+    while (length < maxLen) {
+      if (pieceSent == pieceLength) {
+        if (!nextPiece()) {
+          break;
+        }
+        pieceSent = 0;
+      }
+      size_t chunk = min(maxLen - length, pieceLength - pieceSent);
+      memcpy(buffer + length, piece + pieceSent, chunk);
+      pieceSent += chunk;
+      length += chunk;
+    }
+    return length;
+  }
+};
+
+void sendEvents(AsyncWebServerRequest *request, unsigned long startTime, unsigned long endTime) {
+  std::shared_ptr<EventStream> stream = std::make_shared<EventStream>();
+  stream->endTime = endTime;
+
+  // Replay the journal: records before the window only update the state,
+  // records inside it are counted and feed the run-time statistics. Where
+  // the window opened is kept for reading the events back.
+  uint8_t states = 0;
+  bool windowOpened = false;
+  int eventCount = 0;
+  unsigned long compressorStarts = 0;
+  unsigned long defrostCount = 0;
+  double compressorRunTime = 0;
+  double compressorOnSince = 0;
+  JsonDocument doc;
+
+  auto openWindow = [&](int segment, uint32_t index) {
+    windowOpened = true;
+    fillStatesJSON(doc["initial"].to<JsonObject>(), states);
+    compressorOnSince = startTime;
+    stream->segment = segment;
+    stream->index = index;
+  };
+
+  forEachJournalRecord([&](const JournalRecord &record, int segment, uint32_t index) {
+    double t = record.time + record.millis / 1000.0;
+    if (record.time > endTime) {
+      return;
+    }
+
+    if (record.time >= startTime && !windowOpened) {
+      openWindow(segment, index);
+    }
+
+    uint8_t previous = states;
+    if (record.type == EVT_SNAPSHOT) {
+      states = record.value;
+    } else if (record.type <= EVT_ENERGY_SAVING) {
+      uint8_t bit = JOURNAL_STATE_BIT((JournalEventType)record.type);
+      states = record.value ? (states | bit) : (states & ~bit);
+    }
+
+    if (!windowOpened) {
+      return;
+    }
+
+    uint8_t compressorBit = JOURNAL_STATE_BIT(EVT_COMPRESSOR);
+    if (!(previous & compressorBit) && (states & compressorBit)) {
+      compressorStarts++;
+      compressorOnSince = t;
+    } else if ((previous & compressorBit) && !(states & compressorBit)) {
+      compressorRunTime += t - compressorOnSince;
+    }
+    uint8_t defrostBit = JOURNAL_STATE_BIT(EVT_DEFROST);
+    if (!(previous & defrostBit) && (states & defrostBit)) {
+      defrostCount++;
+    }
+    eventCount++;
+  });
+
+  if (!windowOpened) {
+    openWindow(journalLog.nextSegment + 1, 0);  // Nothing to read back
+  }
+
+  if (states & JOURNAL_STATE_BIT(EVT_COMPRESSOR)) {
+    double windowEnd = min((double)endTime, (double)time(nullptr));
+    compressorRunTime += max(0.0, windowEnd - compressorOnSince);
+  }
+  stream->remaining = min(eventCount, JOURNAL_MAX_EVENTS_JSON);
+
+  String initial;
+  serializeJson(doc, initial);
+  stream->head = initial.substring(0, initial.length() - 1) + ",\"events\":[";
+
+  doc.clear();
+  doc["truncated"] = eventCount > JOURNAL_MAX_EVENTS_JSON;
+  doc["compressorStarts"] = compressorStarts;
+  doc["compressorRunTime"] = compressorRunTime;
+  doc["defrosts"] = defrostCount;
+  String summary;
+  serializeJson(doc, summary);
+  stream->tail = "]," + summary.substring(1);
+
+  request->send(request->beginChunkedResponse("application/json",
+    [stream](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return stream->fill(buffer, maxLen);
+    }));
+}
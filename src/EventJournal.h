@@ -0,0 +1,47 @@
+#pragma once
+
+#include <Arduino.h>
+
+class AsyncWebServerRequest;
+
+enum JournalEventType : uint8_t {
+  EVT_SNAPSHOT = 0,      // Full state at boot and at the start of every segment, value = JOURNAL_STATE_* bits
+  EVT_COMPRESSOR,
+  EVT_DEFROST,
+  EVT_DRAIN,
+  EVT_FAN,
+  EVT_HIGH_ALARM,
+  EVT_LOW_ALARM,
+  EVT_DOOR,
+  EVT_ENERGY_SAVING,
+  EVT_TEMPERATURE,       // Temperature left the deadband or the max interval expired
+  EVT_FAULT              // Fault detector findings changed, value = FaultFlag bits
+};
+
+// State bits of a snapshot, bit n corresponds to event type n
+constexpr uint8_t JOURNAL_STATE_BIT(JournalEventType type) { return (uint8_t)(1 << (type - EVT_COMPRESSOR)); }
+
+struct __attribute__((packed)) JournalRecord {
+  uint32_t time;         // Epoch seconds
+  uint16_t millis;       // Sub-second part of the timestamp
+  uint8_t type;          // JournalEventType
+  uint8_t value;         // New state (0/1), state bits for EVT_SNAPSHOT, fault bits for EVT_FAULT
+  int16_t temperature;   // 0.1 degC
+  int16_t evaporator;    // 0.1 degC
+};
+
+// Records are only written once the clock is NTP-synced, so the journal never
+// contains boot-relative timestamps
+constexpr time_t JOURNAL_MIN_VALID_TIME = 1600000000;
+
+// Called with every batch of records written to the journal
+typedef void (*JournalListener)(const JournalRecord *records, int count);
+
+void setupEventJournal();
+bool updateEventJournal();
+void setJournalListener(JournalListener listener);
+JournalRecord sampleJournalSnapshot();  // Current state, not written to the journal
+const char *journalEventName(uint8_t type);
+// Sends the events in [startTime, endTime] with the states at startTime and
+// the compressor and defrost statistics of the window, streamed from the journal
+void sendEvents(AsyncWebServerRequest *request, unsigned long startTime, unsigned long endTime);
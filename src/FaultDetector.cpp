@@ -0,0 +1,245 @@
+#include "FaultDetector.h"
+#include "config.h"
+#include "Settings.h"
+#include "Hardware.h"
+
+const int FAULT_LEARN_CYCLES = 20;                 // Undisturbed cycles that set a baseline
+const float FAULT_RECENT_ALPHA = 0.3;
+const float FAULT_BASELINE_ALPHA = 0.02;
+const unsigned long FAULT_MIN_PERIOD_MS = 120000;  // Shorter ON/OFF periods are not rated
+const unsigned long FAULT_RESPONSE_MS = 600000;    // Time the temperatures get to follow the compressor
+const float FAULT_COIL_COOLING = 2;                // K the evaporator runs below the cabinet while cooling
+const float FAULT_COIL_STOPPED = 6;                // K below the cabinet a stopped evaporator warms up to...
+const float FAULT_CABINET_COOLING = 0.2;           // ...without a probe the cabinet falls this much per window while running
+const float FAULT_CABINET_STOPPED = 0.5;           // and less than this while stopped
+const float FAULT_PULL_DOWN_RAISE = 0.5;           // Recent pull-down below half the baseline
+const float FAULT_PULL_DOWN_CLEAR = 0.75;
+const float FAULT_ON_TIME_RAISE = 1.5;             // Recent ON time 50 % above the baseline...
+const float FAULT_ON_TIME_MARGIN = 5;              // ...and at least this many minutes longer
+const float FAULT_ON_TIME_CLEAR = 1.2;
+const float FAULT_ON_TIME_RUNNING = 2.5;           // A running period this much longer than the baseline
+const float FAULT_HEAT_LOAD_RAISE = 1.6;
+const float FAULT_HEAT_LOAD_CLEAR = 1.3;
+const unsigned long FAULT_DOOR_MAX_OPEN_MS = 300000;
+const unsigned long FAULT_DOOR_WINDOW_MS = 3600000; // Time constant of the door open share
+const float FAULT_DOOR_SHARE_RAISE = 0.25;
+const float FAULT_DOOR_SHARE_CLEAR = 0.15;
+
+static const char *const FAULT_NAMES[FAULT_COUNT] = {
+  "pullDown", "runTime", "noCooling", "stuckOn", "door", "heatLoad"
+};
+
+uint8_t faultFlags = 0;
+FaultDetectorState detector;
+
+static bool trained(const TrendMetric &metric) {
+  return metric.samples >= FAULT_LEARN_CYCLES;
+}
+
+static void addSample(TrendMetric &metric, float value, bool faulty) {
+  if (!trained(metric)) {
+    metric.baseline += (value - metric.baseline) / (metric.samples + 1);
+    metric.recent = metric.baseline;
+    metric.samples++;
+    return;
+  }
+  metric.recent += FAULT_RECENT_ALPHA * (value - metric.recent);
+  if (!faulty) {
+    metric.baseline += FAULT_BASELINE_ALPHA * (value - metric.baseline);
+  }
+}
+
+static void setFault(uint8_t flag, bool raised) {
+  if (raised == ((faultFlags & flag) != 0)) {
+    return;
+  }
+  faultFlags = raised ? faultFlags | flag : faultFlags & ~flag;
+  Serial.printf("Fault %s: %s\n", raised ? "raised" : "cleared", faultName(__builtin_ctz(flag)));
+}
+
+static void evaluateTrends() {
+  if (trained(detector.pullDownTrend) && detector.pullDownTrend.baseline > 0) {
+    if (detector.pullDownTrend.recent < detector.pullDownTrend.baseline * FAULT_PULL_DOWN_RAISE) {
+      setFault(FAULT_PULL_DOWN, true);
+    } else if (detector.pullDownTrend.recent > detector.pullDownTrend.baseline * FAULT_PULL_DOWN_CLEAR) {
+      setFault(FAULT_PULL_DOWN, false);
+    }
+  }
+  if (trained(detector.onTimeTrend)) {
+    if (detector.onTimeTrend.recent > detector.onTimeTrend.baseline * FAULT_ON_TIME_RAISE &&
+        detector.onTimeTrend.recent > detector.onTimeTrend.baseline + FAULT_ON_TIME_MARGIN) {
+      setFault(FAULT_RUN_TIME, true);
+    } else if (detector.onTimeTrend.recent < detector.onTimeTrend.baseline * FAULT_ON_TIME_CLEAR) {
+      setFault(FAULT_RUN_TIME, false);
+    }
+  }
+  if (trained(detector.warmUpTrend) && detector.warmUpTrend.baseline > 0) {
+    if (detector.warmUpTrend.recent > detector.warmUpTrend.baseline * FAULT_HEAT_LOAD_RAISE) {
+      setFault(FAULT_HEAT_LOAD, true);
+    } else if (detector.warmUpTrend.recent < detector.warmUpTrend.baseline * FAULT_HEAT_LOAD_CLEAR) {
+      setFault(FAULT_HEAT_LOAD, false);
+    }
+  }
+}
+
+static void finishPeriod(unsigned long now) {
+  unsigned long duration = now - detector.periodStart;
+  if (detector.periodDisturbed || duration < FAULT_MIN_PERIOD_MS || isnan(detector.periodStartTemperature) || isnan(currentTemperature)) {
+    return;
+  }
+  float minutes = duration / 60000.0;
+  if (detector.periodCompressorOn) {
+    addSample(detector.pullDownTrend, (detector.periodStartTemperature - currentTemperature) / minutes, faultFlags & FAULT_PULL_DOWN);
+    addSample(detector.onTimeTrend, minutes, faultFlags & FAULT_RUN_TIME);
+  } else {
+    addSample(detector.warmUpTrend, (currentTemperature - detector.periodStartTemperature) / minutes, faultFlags & FAULT_HEAT_LOAD);
+  }
+  evaluateTrends();
+}
+
+static void restartResponse(unsigned long now) {
+  detector.lastResponse = detector.responseWindowStart = now;
+  detector.responseWindowTemperature = currentTemperature;
+  detector.responseWindowDisturbed = false;
+}
+
+static void startPeriod(unsigned long now) {
+  detector.periodCompressorOn = isCompressorOn;
+  detector.periodStart = now;
+  detector.periodStartTemperature = currentTemperature;
+  // Pulling the cabinet down after a defrost takes longer than a normal cycle
+  detector.periodDisturbed = detector.defrostRecovery;
+  if (detector.periodCompressorOn) {
+    detector.defrostRecovery = false;
+  }
+  restartResponse(now);
+}
+
+// A running compressor keeps the evaporator well below the cabinet, a stopped
+// one lets it warm up; without that response for FAULT_RESPONSE_MS the relay
+// or the compressor has failed. Without an evaporator probe the cabinet has
+// to fall (or stop falling) over each window the door stays shut.
+static void checkResponse(unsigned long now) {
+  float evaporator = settings.P2P == "y" ? evaporatorTemperature : NAN;
+  uint8_t flag = detector.periodCompressorOn ? FAULT_NO_COOLING : FAULT_STUCK_ON;
+  bool responded;
+  if (!isnan(evaporator)) {
+    responded = detector.periodCompressorOn ? evaporator <= currentTemperature - FAULT_COIL_COOLING
+                                   : evaporator >= currentTemperature - FAULT_COIL_STOPPED;
+  } else if (now - detector.responseWindowStart >= FAULT_RESPONSE_MS) {
+    float change = currentTemperature - detector.responseWindowTemperature;
+    bool judged = !detector.responseWindowDisturbed && !isnan(change);
+    responded = !judged || (detector.periodCompressorOn ? change <= -FAULT_CABINET_COOLING : change > -FAULT_CABINET_STOPPED);
+    restartResponse(now);
+    if (!responded) {
+      setFault(flag, true);
+      return;
+    }
+  } else {
+    return;
+  }
+
+  if (responded) {
+    detector.lastResponse = now;
+    setFault(flag, false);
+  } else if (now - detector.lastResponse >= FAULT_RESPONSE_MS) {
+    setFault(flag, true);
+  }
+}
+
+static void updateDoor(unsigned long now, unsigned long elapsed) {
+  bool open = digitalRead(zonePins->door) == LOW;
+  if (open && !detector.faultDoorOpen) {
+    detector.doorOpenedAt = now;
+  }
+  detector.faultDoorOpen = open;
+  detector.doorOpenShare += ((open ? 1.0f : 0.0f) - detector.doorOpenShare) * min(1.0f, (float)elapsed / FAULT_DOOR_WINDOW_MS);
+
+  bool openTooLong = open && now - detector.doorOpenedAt >= FAULT_DOOR_MAX_OPEN_MS;
+  if (openTooLong || detector.doorOpenShare > FAULT_DOOR_SHARE_RAISE) {
+    setFault(FAULT_DOOR, true);
+  } else if (!open && detector.doorOpenShare < FAULT_DOOR_SHARE_CLEAR) {
+    setFault(FAULT_DOOR, false);
+  }
+}
+
+void setupFaultDetector() {
+  detector = FaultDetectorState();
+  detector.faultLastUpdate = millis();
+  detector.periodCompressorOn = isCompressorOn;
+  detector.periodStart = detector.lastResponse = detector.responseWindowStart = detector.faultLastUpdate;
+}
+
+void updateFaultDetector() {
+  unsigned long now = millis();
+  unsigned long elapsed = now - detector.faultLastUpdate;
+  detector.faultLastUpdate = now;
+
+  updateDoor(now, elapsed);
+  if (!canActivateOutputs()) {
+    restartResponse(now);
+    return;
+  }
+
+  if (isCompressorOn != detector.periodCompressorOn) {
+    finishPeriod(now);
+    startPeriod(now);
+  }
+  if (detector.faultDoorOpen || isDefrostOn || isDraining || isnan(currentTemperature)) {
+    detector.periodDisturbed = true;
+    detector.responseWindowDisturbed = true;
+  }
+  if (isDefrostOn || isDraining) {
+    detector.defrostRecovery = true;
+    restartResponse(now);
+    return;
+  }
+  checkResponse(now);
+
+  // A compressor that no longer stops never completes a cycle to rate
+  if (detector.periodCompressorOn && !detector.periodDisturbed && trained(detector.onTimeTrend) &&
+      (now - detector.periodStart) / 60000.0 > detector.onTimeTrend.baseline * FAULT_ON_TIME_RUNNING) {
+    setFault(FAULT_RUN_TIME, true);
+  }
+}
+
+const char *faultName(int index) {
+  return index >= 0 && index < FAULT_COUNT ? FAULT_NAMES[index] : "unknown";
+}
+
+void fillFaultNamesJSON(JsonArray list, uint8_t flags) {
+  for (int i = 0; i < FAULT_COUNT; i++) {
+    if (flags & (1 << i)) {
+      list.add(FAULT_NAMES[i]);
+    }
+  }
+}
+
+static void fillTrendJSON(JsonObject object, const TrendMetric &metric) {
+  object["samples"] = metric.samples;
+  if (metric.samples > 0) {
+    object["baseline"] = round(metric.baseline * 1000) / 1000.0;
+    object["recent"] = round(metric.recent * 1000) / 1000.0;
+  }
+}
+
+void fillFaultsJSON(JsonDocument &doc) {
+  doc["flags"] = faultFlags;
+  fillFaultNamesJSON(doc["active"].to<JsonArray>(), faultFlags);
+  fillTrendJSON(doc["pullDown"].to<JsonObject>(), detector.pullDownTrend);
+  fillTrendJSON(doc["onTime"].to<JsonObject>(), detector.onTimeTrend);
+  fillTrendJSON(doc["warmUp"].to<JsonObject>(), detector.warmUpTrend);
+  doc["doorOpenShare"] = round(detector.doorOpenShare * 1000) / 1000.0;
+  JsonObject period = doc["period"].to<JsonObject>();
+  period["compressor"] = detector.periodCompressorOn;
+  period["seconds"] = (millis() - detector.periodStart) / 1000;
+  period["rated"] = !detector.periodDisturbed;
+  period["sinceResponse"] = (millis() - detector.lastResponse) / 1000;
+}
+
+void fillAlertStatusJSON(JsonDocument &doc) {
+  doc["highTemp"] = highTempAlert;
+  doc["lowTemp"] = lowTempAlert;
+  doc["probeFailure"] = probeFailureAlert;
+  fillFaultNamesJSON(doc["faults"].to<JsonArray>(), faultFlags);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Online equipment fault and degradation detection from the signals the
+// loop already has: cabinet and evaporator temperature, compressor and
+// defrost state and the door contact. Every metric keeps O(1) state.
+//
+// Compressor cycles disturbed by a door opening, a defrost or draining, and
+// the pull-down after a defrost, are left out of the trends. A trend
+// compares a fast moving average of recent cycles with a slow baseline; the
+// baseline is the plain mean of the first FAULT_LEARN_CYCLES cycles and then
+// follows slowly, except while its fault is raised.
+
+enum FaultFlag : uint8_t {
+  FAULT_PULL_DOWN = 1 << 0,   // Cabinet pull-down per compressor cycle well below baseline
+  FAULT_RUN_TIME = 1 << 1,    // Compressor ON time per cycle trending up
+  FAULT_NO_COOLING = 1 << 2,  // Compressor ON without the temperature falling: relay or compressor
+  FAULT_STUCK_ON = 1 << 3,    // Compressor OFF but still cooling: welded relay contacts
+  FAULT_DOOR = 1 << 4,        // Door open too long or too often
+  FAULT_HEAT_LOAD = 1 << 5    // Warm-up with the door shut above baseline: gasket or insulation
+};
+
+constexpr int FAULT_COUNT = 6;
+
+// Fast and slow moving average of one per-cycle metric
+struct TrendMetric {
+  float baseline = 0;
+  float recent = 0;
+  uint16_t samples = 0;
+};
+
+// Detector state of the zone being controlled
+struct FaultDetectorState {
+  unsigned long faultLastUpdate = 0;
+  TrendMetric pullDownTrend;           // degC per minute over an ON period
+  TrendMetric onTimeTrend;             // Minutes
+  TrendMetric warmUpTrend;             // degC per minute over an OFF period
+  float doorOpenShare = 0;
+  bool faultDoorOpen = false;
+  unsigned long doorOpenedAt = 0;
+
+  // The current ON or OFF period of the compressor
+  bool periodCompressorOn = false;
+  unsigned long periodStart = 0;
+  float periodStartTemperature = NAN;
+  bool periodDisturbed = true;         // The period at boot has no known start
+  bool defrostRecovery = false;        // Until the first ON period after a defrost has ended
+  unsigned long lastResponse = 0;      // Last time the temperatures followed the compressor
+  unsigned long responseWindowStart = 0;
+  float responseWindowTemperature = NAN;
+  bool responseWindowDisturbed = false;
+};
+
+extern uint8_t faultFlags;
+extern FaultDetectorState detector;
+
+void setupFaultDetector();
+void updateFaultDetector();   // Every loop, after the outputs are set
+const char *faultName(int index);
+void fillFaultNamesJSON(JsonArray list, uint8_t flags);
+void fillFaultsJSON(JsonDocument &doc);
+void fillAlertStatusJSON(JsonDocument &doc);  // Alarm flags and the active findings
@@ -1,20 +1,26 @@
 #include "Hardware.h"
 #include "config.h"
 #include "Settings.h"
-#include <Adafruit_BME280.h>
+#include "Probes.h"
+#include "Defrost.h"
 #include <WiFi.h>
 
-Adafruit_BME280 bme;
-
-// Steinhart-Hart coefficients
-float A = 0.001129148;
-float B = 0.000234125;
-float C = 0.0000000876741;
-
 // State tracking variables
 bool isCompressorOn = false;
 bool isFanOn = false;
 bool isDefrostOn = false;
+unsigned long compressorSwitchTime = 0;
+
+const ZonePins *zonePins = &ZONE_PINS[0];
+bool compressorStartAllowed = true;
+bool defrostStartAllowed = true;
+bool startDeferred = false;
+
+float scheduleSetpointOffset = 0;
+float scheduleHysteresis = NAN;
+String scheduleFanMode;
+bool scheduleDefrostAllowed = true;
+bool energySavingScheduled = false;
 
 void setupHardware() {
   pinMode(COMPRESSOR_RELAY_PIN, OUTPUT);
@@ -27,16 +33,12 @@ void setupHardware() {
   digitalWrite(FAN_RELAY_PIN, LOW);  // Ensure fan is initially off
 
   attachInterrupt(digitalPinToInterrupt(DOOR_SENSOR_PIN), handleDigitalInput, CHANGE);
-
-  if (!bme.begin(0x76)) {
-    Serial.println("Could not find a valid BME280 sensor, check wiring!");
-  }
 }
 
 void IRAM_ATTR handleDigitalInput() {
     static unsigned long lastInterruptTime = 0;
     unsigned long interruptTime = millis();
-    if (interruptTime - lastInterruptTime > 200) {
+    if (interruptTime - lastInterruptTime > 200 && !energySavingScheduled) {
         if (energySavingMode) {
             exitEnergySavingMode();
         } else {
@@ -53,83 +55,72 @@ void setupWiFi() {
     Serial.println("Connecting to WiFi..");
   }
   Serial.println(WiFi.localIP());
-}
 
-float readTemperature(bool isEvaporatorSensor) {
-  if (useSimulatedTemperature) {
-    return simulatedTemperature;
-  }
-    
-  float temperature;
-  int sensorPin = isEvaporatorSensor ? EVAP_SENSOR_PIN : NTC_PIN;
-    
-  if (settings.useBME280 && !isEvaporatorSensor) {
-    temperature = bme.readTemperature();
-  } else {
-    int adcValue = analogRead(sensorPin);
-    float resistance = SERIES_RESISTOR / ((ADC_MAX / (float)adcValue) - 1);
-    float logR = log(resistance);
-    temperature = 1.0 / (A + B * logR + C * logR * logR * logR);
-    temperature = temperature - 273.15;  // Convert Kelvin to Celsius
-  }
-    
-  if (isEvaporatorSensor) {
-    temperature += settings.OE;
-  } else {
-    temperature += settings.Ot;
-  }
-    
-  return temperature;
+  configTime(gmtOffset_sec, daylightOffset_sec, ntpServer);
 }
 
-void calibrateSensor(float temp1, float temp2, float temp3) {
-  int adc1 = analogRead(NTC_PIN);
-  delay(1000);
-  int adc2 = analogRead(NTC_PIN);
-  delay(1000);
-  int adc3 = analogRead(NTC_PIN);
-
-  float r1 = SERIES_RESISTOR / ((ADC_MAX / (float)adc1) - 1);
-  float r2 = SERIES_RESISTOR / ((ADC_MAX / (float)adc2) - 1);
-  float r3 = SERIES_RESISTOR / ((ADC_MAX / (float)adc3) - 1);
-
-  float t1 = temp1 + 273.15;
-  float t2 = temp2 + 273.15;
-  float t3 = temp3 + 273.15;
-
-  float L1 = log(r1);
-  float L2 = log(r2);
-  float L3 = log(r3);
-
-  float Y1 = 1.0 / t1;
-  float Y2 = 1.0 / t2;
-  float Y3 = 1.0 / t3;
-
-  float U2 = (Y2 - Y1) / (L2 - L1);
-  float U3 = (Y3 - Y1) / (L3 - L1);
-
-  C = (U3 - U2) / (L3 - L2) / (L1 + L2 + L3);
-  B = U2 - C * (L1 * L1 + L1 * L2 + L2 * L2);
-  A = Y1 - (B + L1 * L1 * C) * L1;
+// Kept for callers of the two-probe API: the thermostat probe is the
+// regulation role, the evaporator probe the defrost termination role
+float readTemperature(bool isEvaporatorSensor) {
+  return roleTemperature(isEvaporatorSensor ? ROLE_DEFROST : ROLE_REGULATION);
 }
 
 bool canActivateOutputs() {
     return (millis() - startupTime) >= (settings.OdS * 1000);
 }
 
+static void setCompressor(bool on) {
+    if (on && !isCompressorOn && !compressorStartAllowed) {
+        startDeferred = true;
+        return;
+    }
+    if (on != isCompressorOn) {
+        isCompressorOn = on;
+        compressorSwitchTime = millis();
+        digitalWrite(zonePins->compressor, isCompressorOn ? HIGH : LOW);
+        Serial.printf("Compressor turned %s\n", isCompressorOn ? "ON" : "OFF");
+    }
+}
+
 void controlCompressor() {
-    if (!canActivateOutputs() || isDefrosting || isDraining) {
+    if (!canActivateOutputs()) {
         return;  // Don't activate compressor yet
     }
 
-    float effectiveSetpoint = settings.SEt;
+    // Hot gas defrost (tdF = in) needs the compressor, electric defrost and draining don't
+    if (isDefrosting || isDraining) {
+        setCompressor(isDefrosting && settings.tdF == "in");
+        return;
+    }
+
+    // Without a regulation reading the compressor runs a fixed cycle,
+    // COn minutes ON and COF minutes OFF (COn = 0: stays OFF, COF = 0: stays ON)
+    if (isnan(currentTemperature)) {
+        bool shouldCompressorBeOn;
+        if (settings.COn == 0) {
+            shouldCompressorBeOn = false;
+        } else if (settings.COF == 0) {
+            shouldCompressorBeOn = true;
+        } else {
+            unsigned long elapsed = millis() - compressorSwitchTime;
+            unsigned long period = (isCompressorOn ? settings.COn : settings.COF) * 60000UL;
+            shouldCompressorBeOn = elapsed >= period ? !isCompressorOn : isCompressorOn;
+        }
+        setCompressor(shouldCompressorBeOn);
+        Serial.printf("Current temp: probe fault, faulty probe cycle %d/%d min, Compressor: %s",
+                      settings.COn, settings.COF, isCompressorOn ? "ON" : "OFF");
+        return;
+    }
+
+    float effectiveSetpoint = settings.SEt + scheduleSetpointOffset;
     if (energySavingMode) {
         effectiveSetpoint += settings.HES;
     }
+    float hysteresis = isnan(scheduleHysteresis) ? settings.Hy : scheduleHysteresis;
 
     bool shouldCompressorBeOn = false;
 
-    if (currentTemperature > effectiveSetpoint + settings.Hy) {
+    if (currentTemperature > effectiveSetpoint + hysteresis) {
         shouldCompressorBeOn = true;
     } else if (currentTemperature < effectiveSetpoint) {
         shouldCompressorBeOn = false;
@@ -139,16 +130,11 @@ void controlCompressor() {
         shouldCompressorBeOn = isCompressorOn;
     }
 
-    // Only change the compressor state if it's different from the current state
-    if (shouldCompressorBeOn != isCompressorOn) {
-        isCompressorOn = shouldCompressorBeOn;
-        digitalWrite(COMPRESSOR_RELAY_PIN, isCompressorOn ? HIGH : LOW);
-        Serial.printf("Compressor turned %s\n", isCompressorOn ? "ON" : "OFF");
-    }
+    setCompressor(shouldCompressorBeOn);
 
     // For debugging purposes
     Serial.printf("Current temp: %.2f, Set point: %.2f, Hysteresis: %.2f, Compressor: %s", 
-                  currentTemperature, effectiveSetpoint, settings.Hy,
+                  currentTemperature, effectiveSetpoint, hysteresis,
                   isCompressorOn ? "ON" : "OFF");
 }
 
@@ -158,11 +144,20 @@ void handleDefrost() {
     }
 
     unsigned long currentTime = millis();
-    bool shouldDefrostBeOn = false;
-
-    // Start defrost if it's time and we're not already defrosting or draining
-    if (!isDefrostOn && !isDraining && (currentTime - lastDefrostTime) > (settings.IdF * 3600000)) {
-        shouldDefrostBeOn = true;
+    bool shouldDefrostBeOn = isDefrostOn;
+    updateDefrost();
+
+    // Start defrost if it's due and we're not already defrosting or draining.
+    // isDefrostDue() consumes the request, so it is only asked once a start is
+    // allowed; until then a pending request waits.
+    if (!isDefrostOn && !isDraining) {
+        if (!(defrostStartAllowed && scheduleDefrostAllowed)) {
+            if (defrost.isDefrostRequested) {
+                startDeferred = true;
+            }
+        } else if (isDefrostDue()) {
+            shouldDefrostBeOn = true;
+        }
     }
 
     // End defrost if maximum duration is reached or temperature is above dtE
@@ -182,7 +177,8 @@ void handleDefrost() {
     // Only change the defrost state if it's different from the current state
     if (shouldDefrostBeOn != isDefrostOn) {
         isDefrostOn = shouldDefrostBeOn;
-        digitalWrite(DEFROST_RELAY_PIN, isDefrostOn ? HIGH : LOW);
+        isDefrosting = isDefrostOn;
+        digitalWrite(zonePins->defrost, isDefrostOn ? HIGH : LOW);
         Serial.printf("Defrost turned %s\n", isDefrostOn ? "ON" : "OFF");
         if (isDefrostOn) {
             lastDefrostTime = currentTime;
@@ -194,26 +190,29 @@ void controlFan() {
     if (!canActivateOutputs() || isDefrosting || isDraining) {
         if (isFanOn) {
             isFanOn = false;
-            digitalWrite(FAN_RELAY_PIN, LOW);
+            digitalWrite(zonePins->fan, LOW);
             Serial.println("Fan turned OFF due to defrost/drain/startup delay");
         }
         return;
     }
 
     bool shouldFanBeOn = false;
-    // Check if evaporator temperature is below FSt
-    if (evaporatorTemperature <= settings.FSt || settings.P2P == "n") {
+    float fanProbeTemperature = roleTemperature(ROLE_FAN);
+    bool hasFanProbe = settings.P2P == "y" && !isnan(fanProbeTemperature);
+    const String &fanMode = scheduleFanMode.isEmpty() ? settings.FnC : scheduleFanMode;
+    // Check if the FAP probe temperature is below FSt
+    if (!hasFanProbe || fanProbeTemperature <= settings.FSt) {
         // Check fan operating mode
-        if (settings.FnC == "C_n" || settings.FnC == "C_Y") {
+        if (fanMode == "C_n" || fanMode == "C_Y") {
             // Fan runs with compressor
             shouldFanBeOn = isCompressorOn;
-        } else if (settings.FnC == "O_n" || settings.FnC == "O_Y") {
+        } else if (fanMode == "O_n" || fanMode == "O_Y") {
             // Fan runs continuously
             shouldFanBeOn = true;
         }
 
         // Check temperature differential (Fct)
-        if (settings.Fct > 0 && (currentTemperature - evaporatorTemperature) > settings.Fct) {
+        if (settings.Fct > 0 && hasFanProbe && (currentTemperature - fanProbeTemperature) > settings.Fct) {
             shouldFanBeOn = true;
         }
     }
@@ -221,7 +220,7 @@ void controlFan() {
     // Only change the fan state if it's different from the current state
     if (shouldFanBeOn != isFanOn) {
         isFanOn = shouldFanBeOn;
-        digitalWrite(FAN_RELAY_PIN, isFanOn ? HIGH : LOW);
+        digitalWrite(zonePins->fan, isFanOn ? HIGH : LOW);
         Serial.printf("Fan turned %s\n", isFanOn ? "ON" : "OFF");
     }
 
@@ -235,9 +234,11 @@ void checkErrors() {
     Serial.println("Error: Temperature out of expected range");
   }
 
-  // Check if BME280 is selected but not responding
-  if (settings.useBME280 && !bme.begin(0x76)) {
-    Serial.println("Error: BME280 selected but not responding");
+  // Check for probes that are not responding
+  for (int i = 0; i < getProbeCount(); i++) {
+    if (isnan(probeTemperature(i))) {
+      Serial.printf("Error: Probe P%d not responding\n", i + 1);
+    }
   }
 
   // Check if compressor is short cycling
@@ -268,6 +269,20 @@ void checkErrors() {
 }
 
 void checkAlerts(float temperature) {
+    // A missing reading raises the probe failure alarm; the temperature
+    // alarms keep their state until there is a reading to judge them by
+    if (isnan(temperature)) {
+        if (!probeFailureAlert) {
+            probeFailureAlert = true;
+            Serial.println("Probe failure alarm activated. No regulation probe reading");
+        }
+        return;
+    }
+    if (probeFailureAlert) {
+        probeFailureAlert = false;
+        Serial.printf("Probe failure alarm deactivated. Temp: %.1f\n", temperature);
+    }
+
     float highAlarmThreshold, lowAlarmThreshold;
 
     if (settings.ALC == "rel") {
@@ -307,6 +322,13 @@ void checkAlerts(float temperature) {
     }
 }
 
+void fillCurrentTemperatureJSON(JsonDocument &doc) {
+    doc["main"] = currentTemperature;
+    if (settings.P2P == "y") {
+        doc["evaporator"] = evaporatorTemperature;
+    }
+}
+
 void enterEnergySavingMode() {
     if (!energySavingMode) {
         energySavingMode = true;
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <Arduino.h>
+#include <ArduinoJson.h>
+#include "config.h"
 
 extern unsigned long drainingStartTime;
 extern bool isDraining;
@@ -8,17 +10,36 @@ extern bool isDefrosting;
 extern bool isCompressorOn;
 extern bool isFanOn;
 extern bool isDefrostOn;
+extern unsigned long compressorSwitchTime;  // millis() of the last compressor relay change
+
+// Outputs of the zone being controlled, zone 0 unless the zone scheduler
+// has switched to another one
+extern const ZonePins *zonePins;
+
+// Set by the zone scheduler before a zone is controlled. A compressor or
+// defrost start that is not allowed is held back to a later loop, and
+// startDeferred is set.
+extern bool compressorStartAllowed;
+extern bool defrostStartAllowed;
+extern bool startDeferred;
+
+// Overrides of the active schedule profile, set by updateSchedule()
+extern float scheduleSetpointOffset;  // K added to SEt
+extern float scheduleHysteresis;      // Replaces Hy unless NAN
+extern String scheduleFanMode;        // Replaces FnC unless empty
+extern bool scheduleDefrostAllowed;   // Defrost starts wait while false
+extern bool energySavingScheduled;    // Energy saving follows the schedule, not the door input
 
 
 void setupHardware();
 void setupWiFi();
 float readTemperature(bool isEvaporatorSensor);
-void calibrateSensor(float temp1, float temp2, float temp3);
 void controlCompressor();
 void handleDefrost();
 void controlFan();
 void checkErrors();
 void checkAlerts(float temperature);
+void fillCurrentTemperatureJSON(JsonDocument &doc);
 bool canActivateOutputs();
 void enterEnergySavingMode();
 void exitEnergySavingMode();
@@ -0,0 +1,424 @@
+#include "LogArchive.h"
+#include <SPIFFS.h>
+#include <ESPAsyncWebServer.h>
+#include <ArduinoJson.h>
+#include <memory>
+
+const int MAX_SEGMENTED_LOGS = 4;
+const size_t SEGMENT_HEADER_SIZE = 12;
+const uint8_t SEGMENT_FORMAT_VERSION = 1;
+
+SegmentedLog *segmentedLogs[MAX_SEGMENTED_LOGS];
+int segmentedLogCount = 0;
+
+// Guards segment numbering, renames and removals against the compression task
+SemaphoreHandle_t archiveMutex = nullptr;
+TaskHandle_t archiveTask = nullptr;
+
+// Compression statistics
+unsigned long segmentsCompressed = 0;
+uint64_t archiveBytesIn = 0;
+uint64_t archiveBytesOut = 0;
+unsigned long lastCompressionMillis = 0;
+unsigned long maxCompressionMillis = 0;
+
+static String segmentPath(const SegmentedLog &log, int segment, const char *extension) {
+  return String(log.stem) + "." + segment + extension;
+}
+
+static void putUint32(uint8_t *buffer, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    buffer[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static uint32_t getUint32(const uint8_t *buffer) {
+  return (uint32_t)buffer[0] | ((uint32_t)buffer[1] << 8) | ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+static bool readSegmentHeader(File &file, uint32_t &crc, uint32_t &length) {
+  uint8_t header[SEGMENT_HEADER_SIZE];
+  if (file.read(header, sizeof(header)) != sizeof(header) ||
+      header[0] != 'X' || header[1] != 'Z' || header[2] != SEGMENT_FORMAT_VERSION) {
+    return false;
+  }
+  crc = getUint32(header + 4);
+  length = getUint32(header + 8);
+  return true;
+}
+
+static void scanSegments(SegmentedLog &log) {
+  // SPIFFS reports names with or without the leading slash depending on the core version
+  String prefix = String(log.stem + 1) + ".";
+  bool found = false;
+
+  File root = SPIFFS.open("/");
+  for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+    String name = file.name();
+    if (name.startsWith("/")) {
+      name = name.substring(1);
+    }
+    if (!name.startsWith(prefix)) {
+      continue;
+    }
+    String rest = name.substring(prefix.length());
+    int dot = rest.indexOf('.');
+    if (dot <= 0) {
+      continue;  // The active file
+    }
+    String extension = rest.substring(dot);
+    int segment = rest.substring(0, dot).toInt();
+    if (extension == ".z.tmp") {
+      SPIFFS.remove("/" + name);  // Interrupted compression, the raw segment is still there
+      continue;
+    }
+    if (extension != ".z" && extension != log.rawExtension) {
+      continue;
+    }
+    if (!found || segment < log.firstSegment) log.firstSegment = segment;
+    if (!found || segment >= log.nextSegment) log.nextSegment = segment + 1;
+    found = true;
+  }
+}
+
+static void writeToFile(void *context, const uint8_t *data, size_t length) {
+  ((File *)context)->write(data, length);
+}
+
+static bool compressSegment(SegmentedLog &log, int segment) {
+  String rawPath = segmentPath(log, segment, log.rawExtension);
+  String compressedPath = segmentPath(log, segment, ".z");
+  String temporaryPath = compressedPath + ".tmp";
+  uint8_t buffer[256];
+  size_t bytes;
+
+  File input = SPIFFS.open(rawPath, FILE_READ);
+  if (!input) {
+    return false;
+  }
+
+  // First pass for the header, so the output never needs to be rewritten
+  uint32_t crc = 0;
+  uint32_t length = 0;
+  while ((bytes = input.read(buffer, sizeof(buffer))) > 0) {
+    crc = crc32Update(crc, buffer, bytes);
+    length += bytes;
+  }
+  input.seek(0);
+
+  File output = SPIFFS.open(temporaryPath, FILE_WRITE);
+  if (!output) {
+    input.close();
+    return false;
+  }
+  uint8_t header[SEGMENT_HEADER_SIZE] = {'X', 'Z', SEGMENT_FORMAT_VERSION, 0};
+  putUint32(header + 4, crc);
+  putUint32(header + 8, length);
+  output.write(header, sizeof(header));
+
+  unsigned long start = millis();
+  DeflateEncoder encoder;
+  if (!encoder.begin(writeToFile, &output)) {
+    Serial.println("Error: Not enough memory to compress log segment");
+    output.close();
+    input.close();
+    SPIFFS.remove(temporaryPath);
+    return false;
+  }
+  while ((bytes = input.read(buffer, sizeof(buffer))) > 0) {
+    encoder.write(buffer, bytes);
+    vTaskDelay(0);  // Yield between chunks, this task runs at idle-adjacent priority
+  }
+  encoder.finish();
+  encoder.end();
+  unsigned long elapsed = millis() - start;
+
+  size_t compressedSize = output.size();
+  output.close();
+  input.close();
+
+  xSemaphoreTake(archiveMutex, portMAX_DELAY);
+  if (segment >= log.firstSegment) {
+    SPIFFS.rename(temporaryPath, compressedPath);
+    SPIFFS.remove(rawPath);
+  } else {
+    SPIFFS.remove(temporaryPath);  // Dropped by retention while compressing
+  }
+  xSemaphoreGive(archiveMutex);
+
+  segmentsCompressed++;
+  archiveBytesIn += length;
+  archiveBytesOut += compressedSize;
+  lastCompressionMillis = elapsed;
+  maxCompressionMillis = max(maxCompressionMillis, elapsed);
+  Serial.printf("Compressed %s: %u -> %u bytes in %lu ms\n",
+                rawPath.c_str(), (unsigned)length, (unsigned)compressedSize, elapsed);
+  return true;
+}
+
+static void archiveTaskMain(void *) {
+  for (;;) {
+    for (int i = 0; i < segmentedLogCount; i++) {
+      SegmentedLog &log = *segmentedLogs[i];
+      for (int segment = log.firstSegment; segment < log.nextSegment; segment++) {
+        if (SPIFFS.exists(segmentPath(log, segment, log.rawExtension)) &&
+            !SPIFFS.exists(segmentPath(log, segment, ".z"))) {
+          compressSegment(log, segment);
+        }
+      }
+    }
+    // Woken by sealLogSegment, the timeout retries segments that failed
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(600000));
+  }
+}
+
+void setupLogArchive() {
+  archiveMutex = xSemaphoreCreateMutex();
+  xTaskCreatePinnedToCore(archiveTaskMain, "logArchive", 6144, nullptr, 1, &archiveTask, 0);
+}
+
+void registerSegmentedLog(SegmentedLog &log) {
+  if (segmentedLogCount >= MAX_SEGMENTED_LOGS) {
+    Serial.println("Error: Too many segmented logs");
+    return;
+  }
+  xSemaphoreTake(archiveMutex, portMAX_DELAY);
+  log.firstSegment = 0;
+  log.nextSegment = 0;
+  scanSegments(log);
+  segmentedLogs[segmentedLogCount++] = &log;
+  xSemaphoreGive(archiveMutex);
+
+  if (archiveTask) {
+    xTaskNotifyGive(archiveTask);  // Segments left uncompressed before the reboot
+  }
+}
+
+void sealLogSegment(SegmentedLog &log) {
+  xSemaphoreTake(archiveMutex, portMAX_DELAY);
+  SPIFFS.rename(log.activePath, segmentPath(log, log.nextSegment++, log.rawExtension));
+  while (log.nextSegment - log.firstSegment > log.maxSegments) {
+    SPIFFS.remove(segmentPath(log, log.firstSegment, log.rawExtension));
+    SPIFFS.remove(segmentPath(log, log.firstSegment, ".z"));
+    log.firstSegment++;
+  }
+  xSemaphoreGive(archiveMutex);
+
+  if (archiveTask) {
+    xTaskNotifyGive(archiveTask);
+  }
+}
+
+struct FileSource {
+  File *file;
+};
+
+static size_t readFromFile(void *context, uint8_t *data, size_t length) {
+  return ((FileSource *)context)->file->read(data, length);
+}
+
+bool readLogSegment(const SegmentedLog &log, int segment, CompressorSink sink, void *context) {
+  // Only opening the file is done under the lock: inflating a segment takes
+  // long enough to hold up sealLogSegment() in the control loop
+  xSemaphoreTake(archiveMutex, portMAX_DELAY);
+  String compressedPath = segmentPath(log, segment, ".z");
+  bool compressed = segment < log.nextSegment && SPIFFS.exists(compressedPath);
+  String path = compressed ? compressedPath
+              : segment < log.nextSegment ? segmentPath(log, segment, log.rawExtension) : String(log.activePath);
+  File file = SPIFFS.open(path, FILE_READ);
+  xSemaphoreGive(archiveMutex);
+
+  if (!file) {
+    return false;
+  }
+
+  bool ok = false;
+  if (compressed) {
+    uint32_t crc, length;
+    if (readSegmentHeader(file, crc, length)) {
+      FileSource source = {&file};
+      ok = inflateLogSegment(readFromFile, &source, sink, context);
+    }
+  } else {
+    uint8_t buffer[256];
+    size_t bytes;
+    while ((bytes = file.read(buffer, sizeof(buffer))) > 0) {
+      sink(context, buffer, bytes);
+    }
+    ok = true;
+  }
+  file.close();
+  return ok;
+}
+
+// State of one /download_log response: gzip header, prefix and uncompressed
+// files as stored blocks, compressed segments verbatim, then the trailer
+struct ArchiveStream {
+  enum Phase { HEADER, PREFIX, OPEN_SEGMENT, COMPRESSED, STORED, TRAILER, DONE };
+
+  SegmentedLog *log;
+  String prefix;
+  size_t prefixSent = 0;
+  Phase phase = HEADER;
+  int segment;
+  int lastSegment;  // The active file when the download started
+  File file;
+  size_t storedRemaining = 0;
+  uint32_t crc = 0;
+  uint32_t total = 0;
+
+  size_t storedBlock(uint8_t *buffer, size_t maxLen, const uint8_t *memory, size_t available) {
+    size_t length = min(min(maxLen - 5, available), (size_t)0xFFFF);
+    if (memory) {
+      memcpy(buffer + 5, memory, length);
+    } else {
+      length = file.read(buffer + 5, length);
+    }
+    buffer[0] = 0x00;  // BFINAL = 0, BTYPE = 00, we are byte aligned
+    buffer[1] = length & 0xFF;
+    buffer[2] = length >> 8;
+    buffer[3] = ~length & 0xFF;
+    buffer[4] = (~length >> 8) & 0xFF;
+    crc = crc32Update(crc, buffer + 5, length);
+    total += length;
+    return length;
+  }
+
+  size_t fill(uint8_t *buffer, size_t maxLen) {
+    while (phase != DONE) {
+      switch (phase) {
+        case HEADER: {
+          static const uint8_t gzipHeader[10] = {0x1F, 0x8B, 0x08, 0x00, 0, 0, 0, 0, 0x00, 0xFF};
+          memcpy(buffer, gzipHeader, sizeof(gzipHeader));
+          phase = PREFIX;
+          return sizeof(gzipHeader);
+        }
+
+        case PREFIX:
+          if (prefixSent < prefix.length()) {
+            size_t length = storedBlock(buffer, maxLen, (const uint8_t *)prefix.c_str() + prefixSent,
+                                        prefix.length() - prefixSent);
+            prefixSent += length;
+            return length + 5;
+          }
+          phase = OPEN_SEGMENT;
+          break;
+
+        case OPEN_SEGMENT: {
+          if (segment > lastSegment) {
+            phase = TRAILER;
+            break;
+          }
+          // Looked up again for every segment: the active file may have been
+          // sealed, and a sealed segment compressed, since the download started
+          xSemaphoreTake(archiveMutex, portMAX_DELAY);
+          bool sealed = segment < log->nextSegment;
+          String compressedPath = segmentPath(*log, segment, ".z");
+          bool compressed = sealed && SPIFFS.exists(compressedPath);
+          String path = compressed ? compressedPath
+                      : sealed ? segmentPath(*log, segment, log->rawExtension) : String(log->activePath);
+          file = SPIFFS.open(path, FILE_READ);
+          xSemaphoreGive(archiveMutex);
+
+          if (file && compressed) {
+            uint32_t segmentCrc, segmentLength;
+            if (readSegmentHeader(file, segmentCrc, segmentLength)) {
+              crc = crc32Combine(crc, segmentCrc, segmentLength);
+              total += segmentLength;
+              phase = COMPRESSED;
+              break;
+            }
+          } else if (file) {
+            storedRemaining = file.size();  // Rows appended while downloading are left out
+            phase = STORED;
+            break;
+          }
+          file.close();
+          segment++;  // Dropped by retention since the download started
+          break;
+        }
+
+        case COMPRESSED: {
+          size_t length = file.read(buffer, maxLen);
+          if (length > 0) {
+            return length;
+          }
+          file.close();
+          segment++;
+          phase = OPEN_SEGMENT;
+          break;
+        }
+
+        case STORED: {
+          if (storedRemaining > 0) {
+            size_t length = storedBlock(buffer, maxLen, nullptr, storedRemaining);
+            if (length > 0) {
+              storedRemaining -= length;
+              return length + 5;
+            }
+          }
+          file.close();
+          segment++;
+          phase = OPEN_SEGMENT;
+          break;
+        }
+
+        case TRAILER: {
+          static const uint8_t finalBlock[5] = {0x01, 0x00, 0x00, 0xFF, 0xFF};
+          memcpy(buffer, finalBlock, sizeof(finalBlock));
+          putUint32(buffer + 5, crc);
+          putUint32(buffer + 9, total);
+          phase = DONE;
+          return 13;
+        }
+
+        case DONE:
+          break;
+      }
+    }
+    return 0;
+  }
+};
+
+void sendLogArchive(AsyncWebServerRequest *request, SegmentedLog &log,
+                    const char *contentType, const char *fileName, const char *prefix) {
+  std::shared_ptr<ArchiveStream> stream = std::make_shared<ArchiveStream>();
+  stream->log = &log;
+  stream->prefix = prefix ? prefix : "";
+  stream->segment = log.firstSegment;
+  stream->lastSegment = log.nextSegment;
+
+  AsyncWebServerResponse *response = request->beginChunkedResponse(contentType,
+    [stream](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      if (maxLen < 32) {
+        return RESPONSE_TRY_AGAIN;
+      }
+      return stream->fill(buffer, maxLen);
+    });
+  response->addHeader("Content-Encoding", "gzip");
+  response->addHeader("Content-Disposition", String("attachment; filename=\"") + fileName + "\"");
+  request->send(response);
+}
+
+String getArchiveStatsJSON() {
+  JsonDocument doc;
+  doc["segmentsCompressed"] = segmentsCompressed;
+  doc["bytesIn"] = archiveBytesIn;
+  doc["bytesOut"] = archiveBytesOut;
+  doc["ratio"] = archiveBytesOut > 0 ? (double)archiveBytesIn / archiveBytesOut : 0.0;
+  doc["lastCompressMs"] = lastCompressionMillis;
+  doc["maxCompressMs"] = maxCompressionMillis;
+  doc["encoderRam"] = DeflateEncoder::memoryFootprint();
+
+  JsonArray logs = doc["logs"].to<JsonArray>();
+  for (int i = 0; i < segmentedLogCount; i++) {
+    JsonObject entry = logs.add<JsonObject>();
+    entry["path"] = segmentedLogs[i]->activePath;
+    entry["firstSegment"] = segmentedLogs[i]->firstSegment;
+    entry["nextSegment"] = segmentedLogs[i]->nextSegment;
+  }
+
+  String response;
+  serializeJson(doc, response);
+  return response;
+}
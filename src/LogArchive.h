@@ -0,0 +1,36 @@
+#pragma once
+
+#include <Arduino.h>
+#include "LogCompressor.h"
+
+class AsyncWebServerRequest;
+
+// A log file that is sealed into numbered segments once it reaches
+// segmentSize. Sealed segments (<stem>.<n><rawExtension>) are compressed in
+// the background into <stem>.<n>.z:
+//   "XZ", version, reserved, uint32 CRC-32 and uint32 length of the raw data,
+//   followed by the raw DEFLATE stream produced by DeflateEncoder.
+struct SegmentedLog {
+  const char *activePath;
+  const char *stem;
+  const char *rawExtension;
+  size_t segmentSize;
+  int maxSegments;
+  int firstSegment;  // Sealed segments are numbered [firstSegment, nextSegment)
+  int nextSegment;
+};
+
+void setupLogArchive();
+void registerSegmentedLog(SegmentedLog &log);
+void sealLogSegment(SegmentedLog &log);
+
+// Streams the uncompressed contents of a sealed segment, or of the active
+// file when segment == log.nextSegment, to sink
+bool readLogSegment(const SegmentedLog &log, int segment, CompressorSink sink, void *context);
+
+// Sends prefix followed by every segment and the active file as one gzip
+// member; compressed segments are passed through without recompression
+void sendLogArchive(AsyncWebServerRequest *request, SegmentedLog &log,
+                    const char *contentType, const char *fileName, const char *prefix);
+
+String getArchiveStatsJSON();
@@ -0,0 +1,521 @@
+#include "LogCompressor.h"
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+static const size_t MIN_MATCH = 3;
+static const size_t MAX_MATCH = 258;
+static const int MAX_CHAIN = 16;
+
+static const uint16_t LENGTH_BASE[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t LENGTH_EXTRA[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t DISTANCE_BASE[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t DISTANCE_EXTRA[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static uint16_t reverseBits(uint16_t code, int length) {
+  uint16_t reversed = 0;
+  for (int i = 0; i < length; i++) {
+    reversed = (reversed << 1) | (code & 1);
+    code >>= 1;
+  }
+  return reversed;
+}
+
+// ---------------------------------------------------------------------------
+// Encoder
+
+bool DeflateEncoder::begin(CompressorSink sink, void *context) {
+  this->sink = sink;
+  this->context = context;
+  window = (uint8_t *)malloc(2 * LOG_COMPRESSOR_WINDOW);
+  head = (uint32_t *)calloc(LOG_COMPRESSOR_HASH_SIZE, sizeof(uint32_t));
+  chain = (uint16_t *)calloc(LOG_COMPRESSOR_WINDOW, sizeof(uint16_t));
+  if (!window || !head || !chain) {
+    end();
+    return false;
+  }
+  windowStart = 0;
+  windowEnd = 0;
+  position = 0;
+  blockOpen = false;
+  bitBuffer = 0;
+  bitCount = 0;
+  outputLength = 0;
+  return true;
+}
+
+void DeflateEncoder::end() {
+  free(window);
+  free(head);
+  free(chain);
+  window = nullptr;
+  head = nullptr;
+  chain = nullptr;
+}
+
+size_t DeflateEncoder::memoryFootprint() {
+  return sizeof(DeflateEncoder) + 2 * LOG_COMPRESSOR_WINDOW +
+         LOG_COMPRESSOR_HASH_SIZE * sizeof(uint32_t) + LOG_COMPRESSOR_WINDOW * sizeof(uint16_t);
+}
+
+void DeflateEncoder::write(const uint8_t *data, size_t length) {
+  while (length > 0) {
+    if (windowEnd == 2 * LOG_COMPRESSOR_WINDOW) {
+      compress(false);
+      // Keep one window of history, make room for the next lookahead
+      memmove(window, window + LOG_COMPRESSOR_WINDOW, LOG_COMPRESSOR_WINDOW);
+      windowStart += LOG_COMPRESSOR_WINDOW;
+      windowEnd -= LOG_COMPRESSOR_WINDOW;
+      position -= LOG_COMPRESSOR_WINDOW;
+    }
+    size_t chunk = 2 * LOG_COMPRESSOR_WINDOW - windowEnd;
+    if (chunk > length) {
+      chunk = length;
+    }
+    memcpy(window + windowEnd, data, chunk);
+    windowEnd += chunk;
+    data += chunk;
+    length -= chunk;
+  }
+}
+
+void DeflateEncoder::finish() {
+  compress(true);
+  if (blockOpen) {
+    putHuffman(reverseBits(0, 7), 7);  // End of block (256)
+    blockOpen = false;
+  }
+  // Empty non-final stored block: byte-aligns the stream
+  putBits(0, 3);
+  flushBits();
+  static const uint8_t syncMarker[4] = {0x00, 0x00, 0xFF, 0xFF};
+  for (uint8_t byte : syncMarker) {
+    output[outputLength++] = byte;
+    if (outputLength == sizeof(output)) {
+      flushOutput();
+    }
+  }
+  flushOutput();
+}
+
+uint32_t DeflateEncoder::hashAt(size_t index) const {
+  uint32_t value = ((uint32_t)window[index] << 16) | ((uint32_t)window[index + 1] << 8) | window[index + 2];
+  return (value * 2654435761u) >> 21;  // 11 bits = LOG_COMPRESSOR_HASH_SIZE
+}
+
+void DeflateEncoder::compress(bool flush) {
+  // Only bytes already in window[position, position + length) are readable, and
+  // at least one full window of history must remain in front of every slide
+  size_t limit = flush ? windowEnd : (windowEnd > MAX_MATCH ? windowEnd - MAX_MATCH : 0);
+  if (!flush && limit > 2 * LOG_COMPRESSOR_WINDOW - MAX_MATCH) {
+    limit = 2 * LOG_COMPRESSOR_WINDOW - MAX_MATCH;
+  }
+
+  auto insert = [&](size_t index) {
+    uint32_t hash = hashAt(index);
+    size_t absolute = windowStart + index;
+    size_t previous = head[hash];
+    size_t distance = previous ? absolute - (previous - 1) : 0;
+    chain[absolute & (LOG_COMPRESSOR_WINDOW - 1)] = distance <= LOG_COMPRESSOR_WINDOW ? (uint16_t)distance : 0;
+    head[hash] = (uint32_t)(absolute + 1);
+  };
+
+  while (position < limit) {
+    size_t available = windowEnd - position;
+    if (available > MAX_MATCH) {
+      available = MAX_MATCH;
+    }
+    size_t bestLength = 0;
+    size_t bestDistance = 0;
+
+    if (available >= MIN_MATCH) {
+      size_t absolute = windowStart + position;
+      size_t candidate = head[hashAt(position)];
+      for (int probes = MAX_CHAIN; candidate && probes > 0; probes--) {
+        size_t match = candidate - 1;
+        size_t distance = absolute - match;
+        if (match < windowStart || distance > LOG_COMPRESSOR_WINDOW || distance == 0) {
+          break;
+        }
+        const uint8_t *a = window + position;
+        const uint8_t *b = window + (match - windowStart);
+        size_t length = 0;
+        while (length < available && a[length] == b[length]) {
+          length++;
+        }
+        if (length > bestLength) {
+          bestLength = length;
+          bestDistance = distance;
+          if (length == available) {
+            break;
+          }
+        }
+        uint16_t step = chain[match & (LOG_COMPRESSOR_WINDOW - 1)];
+        candidate = step ? candidate - step : 0;
+      }
+      insert(position);
+    }
+
+    if (bestLength >= MIN_MATCH) {
+      putMatch(bestLength, bestDistance);
+      for (size_t i = 1; i < bestLength; i++) {
+        if (windowEnd - (position + i) >= MIN_MATCH) {
+          insert(position + i);
+        }
+      }
+      position += bestLength;
+    } else {
+      putLiteral(window[position]);
+      position++;
+    }
+  }
+}
+
+void DeflateEncoder::putBits(uint32_t bits, int count) {
+  bitBuffer |= bits << bitCount;
+  bitCount += count;
+  while (bitCount >= 8) {
+    output[outputLength++] = (uint8_t)bitBuffer;
+    if (outputLength == sizeof(output)) {
+      flushOutput();
+    }
+    bitBuffer >>= 8;
+    bitCount -= 8;
+  }
+}
+
+void DeflateEncoder::putHuffman(uint16_t code, int length) {
+  if (!blockOpen) {
+    putBits(0x2, 3);  // BFINAL = 0, BTYPE = 01 (fixed Huffman)
+    blockOpen = true;
+  }
+  putBits(code, length);
+}
+
+static void fixedLiteralCode(uint16_t symbol, uint16_t &code, int &length) {
+  if (symbol < 144) {
+    code = 0x30 + symbol;
+    length = 8;
+  } else if (symbol < 256) {
+    code = 0x190 + (symbol - 144);
+    length = 9;
+  } else if (symbol < 280) {
+    code = symbol - 256;
+    length = 7;
+  } else {
+    code = 0xC0 + (symbol - 280);
+    length = 8;
+  }
+}
+
+void DeflateEncoder::putLiteral(uint8_t literal) {
+  uint16_t code;
+  int length;
+  fixedLiteralCode(literal, code, length);
+  putHuffman(reverseBits(code, length), length);
+}
+
+void DeflateEncoder::putMatch(size_t length, size_t distance) {
+  int lengthCode = 28;
+  while (LENGTH_BASE[lengthCode] > length) {
+    lengthCode--;
+  }
+  uint16_t code;
+  int codeLength;
+  fixedLiteralCode(257 + lengthCode, code, codeLength);
+  putHuffman(reverseBits(code, codeLength), codeLength);
+  putBits(length - LENGTH_BASE[lengthCode], LENGTH_EXTRA[lengthCode]);
+
+  int distanceCode = 29;
+  while (DISTANCE_BASE[distanceCode] > distance) {
+    distanceCode--;
+  }
+  putBits(reverseBits(distanceCode, 5), 5);
+  putBits(distance - DISTANCE_BASE[distanceCode], DISTANCE_EXTRA[distanceCode]);
+}
+
+void DeflateEncoder::flushBits() {
+  if (bitCount > 0) {
+    putBits(0, 8 - bitCount);
+  }
+}
+
+void DeflateEncoder::flushOutput() {
+  if (outputLength > 0) {
+    sink(context, output, outputLength);
+    outputLength = 0;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Decoder
+
+namespace {
+
+struct Inflater {
+  CompressorSource source;
+  void *sourceContext;
+  CompressorSink sink;
+  void *sinkContext;
+
+  uint8_t input[256];
+  size_t inputLength = 0;
+  size_t inputPosition = 0;
+  uint32_t bitBuffer = 0;
+  int bitCount = 0;
+
+  uint8_t window[LOG_COMPRESSOR_WINDOW];
+  size_t outputPosition = 0;
+  size_t flushedPosition = 0;
+
+  int nextByte() {
+    if (inputPosition == inputLength) {
+      inputLength = source(sourceContext, input, sizeof(input));
+      inputPosition = 0;
+      if (inputLength == 0) {
+        return -1;
+      }
+    }
+    return input[inputPosition++];
+  }
+
+  // Returns -1 when the input ends before count bits are available
+  int32_t bits(int count) {
+    while (bitCount < count) {
+      int byte = nextByte();
+      if (byte < 0) {
+        return -1;
+      }
+      bitBuffer |= (uint32_t)byte << bitCount;
+      bitCount += 8;
+    }
+    int32_t value = bitBuffer & ((1u << count) - 1);
+    bitBuffer >>= count;
+    bitCount -= count;
+    return value;
+  }
+
+  // Reads a Huffman code of count bits, most significant bit first
+  int32_t huffmanBits(int32_t code, int count) {
+    for (int i = 0; i < count; i++) {
+      int32_t bit = bits(1);
+      if (bit < 0) {
+        return -1;
+      }
+      code = (code << 1) | bit;
+    }
+    return code;
+  }
+
+  void flush() {
+    size_t start = flushedPosition & (LOG_COMPRESSOR_WINDOW - 1);
+    size_t length = outputPosition - flushedPosition;
+    if (length > 0) {
+      sink(sinkContext, window + start, length);
+      flushedPosition = outputPosition;
+    }
+  }
+
+  void emit(uint8_t byte) {
+    window[outputPosition & (LOG_COMPRESSOR_WINDOW - 1)] = byte;
+    outputPosition++;
+    if ((outputPosition & (LOG_COMPRESSOR_WINDOW - 1)) == 0) {
+      flush();
+    }
+  }
+
+  int32_t literalSymbol() {
+    int32_t code = huffmanBits(0, 7);
+    if (code < 0) return -1;
+    if (code <= 0x17) return 256 + code;
+    code = huffmanBits(code, 1);
+    if (code < 0) return -1;
+    if (code >= 0x30 && code <= 0xBF) return code - 0x30;
+    if (code >= 0xC0 && code <= 0xC7) return 280 + (code - 0xC0);
+    code = huffmanBits(code, 1);
+    if (code < 0) return -1;
+    if (code >= 0x190 && code <= 0x1FF) return 144 + (code - 0x190);
+    return -1;
+  }
+
+  bool storedBlock() {
+    bitBuffer = 0;  // Skip to the byte boundary
+    bitCount = 0;
+    int32_t length = bits(16);
+    int32_t complement = bits(16);
+    if (length < 0 || complement < 0 || (length ^ 0xFFFF) != complement) {
+      return false;
+    }
+    for (int32_t i = 0; i < length; i++) {
+      int byte = nextByte();
+      if (byte < 0) {
+        return false;
+      }
+      emit((uint8_t)byte);
+    }
+    return true;
+  }
+
+  bool fixedBlock() {
+    for (;;) {
+      int32_t symbol = literalSymbol();
+      if (symbol < 0) {
+        return false;
+      }
+      if (symbol < 256) {
+        emit((uint8_t)symbol);
+        continue;
+      }
+      if (symbol == 256) {
+        return true;
+      }
+      symbol -= 257;
+      if (symbol >= 29) {
+        return false;
+      }
+      int32_t extra = bits(LENGTH_EXTRA[symbol]);
+      int32_t distanceCode = huffmanBits(0, 5);
+      if (extra < 0 || distanceCode < 0 || distanceCode >= 30) {
+        return false;
+      }
+      int32_t distanceExtra = bits(DISTANCE_EXTRA[distanceCode]);
+      if (distanceExtra < 0) {
+        return false;
+      }
+      size_t length = LENGTH_BASE[symbol] + extra;
+      size_t distance = DISTANCE_BASE[distanceCode] + distanceExtra;
+      if (distance > LOG_COMPRESSOR_WINDOW || distance > outputPosition) {
+        return false;
+      }
+      for (size_t i = 0; i < length; i++) {
+        emit(window[(outputPosition - distance) & (LOG_COMPRESSOR_WINDOW - 1)]);
+      }
+    }
+  }
+
+  bool run() {
+    for (;;) {
+      int32_t header = bits(3);
+      if (header < 0) {
+        // Segments end after a byte-aligning stored block, not a final block
+        flush();
+        return true;
+      }
+      bool ok;
+      switch (header >> 1) {
+        case 0: ok = storedBlock(); break;
+        case 1: ok = fixedBlock(); break;
+        default: ok = false; break;  // Dynamic Huffman is never produced by the encoder
+      }
+      if (!ok) {
+        return false;
+      }
+      if (header & 1) {
+        flush();
+        return true;
+      }
+    }
+  }
+};
+
+}  // namespace
+
+bool inflateLogSegment(CompressorSource source, void *sourceContext,
+                       CompressorSink sink, void *sinkContext) {
+  Inflater *inflater = new (std::nothrow) Inflater();
+  if (!inflater) {
+    return false;
+  }
+  inflater->source = source;
+  inflater->sourceContext = sourceContext;
+  inflater->sink = sink;
+  inflater->sinkContext = sinkContext;
+  bool ok = inflater->run();
+  delete inflater;
+  return ok;
+}
+
+// ---------------------------------------------------------------------------
+// CRC-32 (IEEE 802.3, as used by gzip)
+
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length) {
+  static const uint32_t NIBBLE_TABLE[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+  };
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    crc = (crc >> 4) ^ NIBBLE_TABLE[crc & 0x0F];
+    crc = (crc >> 4) ^ NIBBLE_TABLE[crc & 0x0F];
+  }
+  return ~crc;
+}
+
+static uint32_t gf2MatrixTimes(const uint32_t *matrix, uint32_t vector) {
+  uint32_t sum = 0;
+  while (vector) {
+    if (vector & 1) {
+      sum ^= *matrix;
+    }
+    vector >>= 1;
+    matrix++;
+  }
+  return sum;
+}
+
+static void gf2MatrixSquare(uint32_t *square, const uint32_t *matrix) {
+  for (int n = 0; n < 32; n++) {
+    square[n] = gf2MatrixTimes(matrix, matrix[n]);
+  }
+}
+
+uint32_t crc32Combine(uint32_t crcA, uint32_t crcB, size_t lengthB) {
+  if (lengthB == 0) {
+    return crcA;
+  }
+
+  uint32_t even[32];  // Even-power-of-two zeros operator
+  uint32_t odd[32];   // Odd-power-of-two zeros operator
+
+  // Operator for one zero bit
+  odd[0] = 0xEDB88320;
+  uint32_t row = 1;
+  for (int n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  gf2MatrixSquare(even, odd);  // Two zero bits
+  gf2MatrixSquare(odd, even);  // Four zero bits
+
+  // Apply lengthB zero bytes to crcA
+  do {
+    gf2MatrixSquare(even, odd);
+    if (lengthB & 1) {
+      crcA = gf2MatrixTimes(even, crcA);
+    }
+    lengthB >>= 1;
+    if (lengthB == 0) {
+      break;
+    }
+    gf2MatrixSquare(odd, even);
+    if (lengthB & 1) {
+      crcA = gf2MatrixTimes(odd, crcA);
+    }
+    lengthB >>= 1;
+  } while (lengthB != 0);
+
+  return crcA ^ crcB;
+}
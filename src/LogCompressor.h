@@ -0,0 +1,64 @@
+#pragma once
+
+// Small-footprint streaming DEFLATE (RFC 1951) codec for sealed log segments.
+// Kept free of Arduino dependencies so it can be built for the host as well.
+//
+// The encoder uses LZ77 over a 4 KB window with short hash chains and emits
+// fixed-Huffman blocks; finish() ends the stream with an empty stored block,
+// so every compressed segment is byte aligned and independently decodable,
+// and segments can be concatenated into one gzip member (see crc32Combine).
+// The decoder understands stored and fixed-Huffman blocks with distances up
+// to the encoder window, i.e. everything the encoder produces.
+
+#include <stddef.h>
+#include <stdint.h>
+
+constexpr size_t LOG_COMPRESSOR_WINDOW = 4096;
+constexpr size_t LOG_COMPRESSOR_HASH_SIZE = 2048;
+
+typedef void (*CompressorSink)(void *context, const uint8_t *data, size_t length);
+typedef size_t (*CompressorSource)(void *context, uint8_t *data, size_t length);
+
+class DeflateEncoder {
+public:
+  // Buffers are allocated here; returns false when out of memory
+  bool begin(CompressorSink sink, void *context);
+  void write(const uint8_t *data, size_t length);
+  // Flushes pending input and byte-aligns the output, without marking the last block
+  void finish();
+  void end();
+
+  static size_t memoryFootprint();
+
+private:
+  void compress(bool flush);
+  void putBits(uint32_t bits, int count);
+  void putHuffman(uint16_t code, int length);
+  void putLiteral(uint8_t literal);
+  void putMatch(size_t length, size_t distance);
+  void flushBits();
+  void flushOutput();
+  uint32_t hashAt(size_t position) const;
+
+  CompressorSink sink = nullptr;
+  void *context = nullptr;
+  uint8_t *window = nullptr;     // 2 x LOG_COMPRESSOR_WINDOW: history + lookahead
+  uint32_t *head = nullptr;      // Absolute position + 1 of the newest string per hash
+  uint16_t *chain = nullptr;     // Distance to the previous string with the same hash
+  size_t windowStart = 0;        // Absolute position of window[0]
+  size_t windowEnd = 0;          // Bytes buffered in window
+  size_t position = 0;           // Next window index to encode
+  bool blockOpen = false;
+  uint32_t bitBuffer = 0;
+  int bitCount = 0;
+  uint8_t output[256];
+  size_t outputLength = 0;
+};
+
+// Decodes one stream produced by DeflateEncoder; returns false on corrupt input
+bool inflateLogSegment(CompressorSource source, void *sourceContext,
+                       CompressorSink sink, void *sinkContext);
+
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length);
+// CRC of A followed by B, given crc(A), crc(B) and the length of B
+uint32_t crc32Combine(uint32_t crcA, uint32_t crcB, size_t lengthB);
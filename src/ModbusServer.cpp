@@ -0,0 +1,401 @@
+#include "ModbusServer.h"
+#include "config.h"
+#include "Settings.h"
+#include "Hardware.h"
+#include "Probes.h"
+#include "FaultDetector.h"
+#include <AsyncTCP.h>
+
+static const char *const MODBUS_NO_YES[] = {"n", "y"};
+static const char *const MODBUS_UNITS[] = {"C", "F"};
+static const char *const MODBUS_RESOLUTIONS[] = {"dE", "in"};
+static const char *const MODBUS_PROBES[] = {"P1", "P2", "P3", "P4", "P5", "P6", "P7", "P8"};
+static const char *const MODBUS_DEFROST_TYPES[] = {"EL", "in"};
+static const char *const MODBUS_OPTIONAL_PROBES[] = {"nP", "P1", "P2", "P3", "P4", "P5", "P6", "P7", "P8"};
+static const char *const MODBUS_FAN_MODES[] = {"C_n", "O_n", "C_Y", "O_Y"};
+static const char *const MODBUS_ALARM_MODES[] = {"rE", "Ab"};
+
+template <size_t N>
+constexpr int16_t optionCount(const char *const (&)[N]) { return N; }
+
+struct HoldingRegister {
+  int16_t minimum;
+  int16_t maximum;
+};
+
+#define MODBUS_NUMERIC_RANGE(field, scale, minimum, maximum) {minimum, maximum},
+#define MODBUS_CHOICE_RANGE(field, options) {0, (int16_t)(optionCount(options) - 1)},
+static const HoldingRegister HOLDING_REGISTERS[] = {
+  MODBUS_HOLDING_REGISTERS(MODBUS_NUMERIC_RANGE, MODBUS_CHOICE_RANGE)
+};
+constexpr uint16_t HOLDING_REGISTER_COUNT = sizeof(HOLDING_REGISTERS) / sizeof(HOLDING_REGISTERS[0]);
+static_assert(IR_PROBE_TEMPERATURE + MAX_PROBES <= IR_FAULTS, "probe registers overlap IR_FAULTS");
+constexpr uint16_t INPUT_REGISTER_COUNT = IR_FAULTS + 1;
+
+constexpr uint8_t MODBUS_READ_HOLDING = 0x03;
+constexpr uint8_t MODBUS_READ_INPUT = 0x04;
+constexpr uint8_t MODBUS_WRITE_SINGLE = 0x06;
+constexpr uint8_t MODBUS_WRITE_MULTIPLE = 0x10;
+
+constexpr uint8_t MODBUS_ILLEGAL_FUNCTION = 0x01;
+constexpr uint8_t MODBUS_ILLEGAL_ADDRESS = 0x02;
+constexpr uint8_t MODBUS_ILLEGAL_VALUE = 0x03;
+constexpr uint8_t MODBUS_DEVICE_BUSY = 0x06;
+
+constexpr size_t MODBUS_HEADER_SIZE = 7;   // MBAP: transaction, protocol, length, unit
+constexpr size_t MODBUS_MAX_FRAME = 260;
+constexpr int MODBUS_WRITE_QUEUE = 64;  // Fits a write of every holding register
+
+struct ModbusWrite {
+  uint16_t address;
+  uint16_t value;
+};
+
+// Per-connection reassembly buffer, a frame can span TCP segments and a
+// segment can carry several frames
+struct ModbusConnection {
+  AsyncClient *client;
+  uint8_t buffer[MODBUS_MAX_FRAME];
+  size_t length;
+};
+
+AsyncServer *modbusServer = nullptr;
+int modbusConnections = 0;
+
+// Shared with the network task, guarded by modbusMux
+portMUX_TYPE modbusMux = portMUX_INITIALIZER_UNLOCKED;
+uint16_t inputRegisters[INPUT_REGISTER_COUNT];
+uint16_t holdingRegisters[HOLDING_REGISTER_COUNT];
+ModbusWrite writeQueue[MODBUS_WRITE_QUEUE];
+int writeQueueHead = 0;
+int writeQueueLength = 0;
+
+// Counters since boot, only touched by the loop
+uint32_t modbusCompressorStarts = 0;
+uint32_t modbusCompressorRunMillis = 0;
+uint32_t modbusDefrosts = 0;
+bool modbusLastCompressorOn = false;
+bool modbusLastDefrostOn = false;
+unsigned long modbusLastUpdate = 0;
+
+static uint16_t encodeTemperature(float temperature) {
+  if (isnan(temperature) || temperature < -3276.0f || temperature > 3276.0f) {
+    return 0x8000;
+  }
+  return (uint16_t)(int16_t)lroundf(temperature * 10.0f);
+}
+
+static uint16_t encodeSetting(float value, int scale) {
+  return (uint16_t)(int16_t)lroundf(value * scale);
+}
+
+static uint16_t encodeSetting(int value, int scale) {
+  return (uint16_t)(int16_t)(value * scale);
+}
+
+static void decodeSetting(float &field, uint16_t value, int scale) {
+  field = (int16_t)value / (float)scale;
+}
+
+static void decodeSetting(int &field, uint16_t value, int scale) {
+  field = (int16_t)value / scale;
+}
+
+template <size_t N>
+static uint16_t encodeChoice(const String &value, const char *const (&options)[N]) {
+  for (size_t i = 0; i < N; i++) {
+    if (value == options[i]) {
+      return i;
+    }
+  }
+  return 0xFFFF;  // Stored value is not one of the options
+}
+
+static void readSettingRegisters(uint16_t *registers) {
+  int address = 0;
+#define MODBUS_READ_NUMERIC(field, scale, minimum, maximum) registers[address++] = encodeSetting(settings.field, scale);
+#define MODBUS_READ_CHOICE(field, options) registers[address++] = encodeChoice(settings.field, options);
+  MODBUS_HOLDING_REGISTERS(MODBUS_READ_NUMERIC, MODBUS_READ_CHOICE)
+}
+
+static void applySettingRegister(uint16_t address, uint16_t value) {
+  uint16_t index = 0;
+#define MODBUS_WRITE_NUMERIC(field, scale, minimum, maximum) \
+  if (address == index++) { decodeSetting(settings.field, value, scale); return; }
+#define MODBUS_WRITE_CHOICE(field, options) \
+  if (address == index++) { settings.field = options[value]; return; }
+  MODBUS_HOLDING_REGISTERS(MODBUS_WRITE_NUMERIC, MODBUS_WRITE_CHOICE)
+}
+
+static void writeWord(uint8_t *out, uint16_t value) {
+  out[0] = value >> 8;
+  out[1] = value & 0xFF;
+}
+
+static uint16_t readWord(const uint8_t *in) {
+  return (in[0] << 8) | in[1];
+}
+
+static uint8_t readRegisters(const uint8_t *request, size_t length, uint8_t *response, size_t &responseLength) {
+  if (length != 5) {
+    return MODBUS_ILLEGAL_VALUE;
+  }
+  bool input = request[0] == MODBUS_READ_INPUT;
+  uint16_t start = readWord(request + 1);
+  uint16_t quantity = readWord(request + 3);
+  const uint16_t *registers = input ? inputRegisters : holdingRegisters;
+  uint16_t count = input ? INPUT_REGISTER_COUNT : HOLDING_REGISTER_COUNT;
+  if (quantity < 1 || quantity > 125) {
+    return MODBUS_ILLEGAL_VALUE;
+  }
+  if (start + quantity > count) {
+    return MODBUS_ILLEGAL_ADDRESS;
+  }
+
+  response[1] = quantity * 2;
+  portENTER_CRITICAL(&modbusMux);
+  for (uint16_t i = 0; i < quantity; i++) {
+    writeWord(response + 2 + i * 2, registers[start + i]);
+  }
+  portEXIT_CRITICAL(&modbusMux);
+  responseLength = 2 + quantity * 2;
+  return 0;
+}
+
+static uint8_t writeRegisters(const uint8_t *request, size_t length, uint8_t *response, size_t &responseLength) {
+  uint16_t start = 0;
+  uint16_t quantity = 1;
+  const uint8_t *values = request + 3;
+  if (request[0] == MODBUS_WRITE_SINGLE) {
+    if (length != 5) {
+      return MODBUS_ILLEGAL_VALUE;
+    }
+  } else {
+    if (length < 6) {
+      return MODBUS_ILLEGAL_VALUE;
+    }
+    quantity = readWord(request + 3);
+    values = request + 6;
+    if (quantity < 1 || quantity > 123 || request[5] != quantity * 2 || length != 6 + quantity * 2u) {
+      return MODBUS_ILLEGAL_VALUE;
+    }
+  }
+  start = readWord(request + 1);
+  if (start + quantity > HOLDING_REGISTER_COUNT) {
+    return MODBUS_ILLEGAL_ADDRESS;
+  }
+  for (uint16_t i = 0; i < quantity; i++) {
+    int16_t value = readWord(values + i * 2);
+    if (value < HOLDING_REGISTERS[start + i].minimum || value > HOLDING_REGISTERS[start + i].maximum) {
+      return MODBUS_ILLEGAL_VALUE;
+    }
+  }
+
+  uint8_t exception = 0;
+  portENTER_CRITICAL(&modbusMux);
+  if (writeQueueLength + quantity > MODBUS_WRITE_QUEUE) {
+    exception = MODBUS_DEVICE_BUSY;
+  } else {
+    for (uint16_t i = 0; i < quantity; i++) {
+      uint16_t value = readWord(values + i * 2);
+      writeQueue[(writeQueueHead + writeQueueLength++) % MODBUS_WRITE_QUEUE] = {(uint16_t)(start + i), value};
+      holdingRegisters[start + i] = value;
+    }
+  }
+  portEXIT_CRITICAL(&modbusMux);
+  if (exception) {
+    return exception;
+  }
+
+  // Single writes echo the request, multiple writes echo start and quantity
+  memcpy(response + 1, request + 1, 4);
+  responseLength = 5;
+  return 0;
+}
+
+// Builds the response PDU for a request PDU, returns its length
+static size_t handlePDU(const uint8_t *request, size_t length, uint8_t *response) {
+  uint8_t function = request[0];
+  size_t responseLength = 0;
+  uint8_t exception;
+
+  switch (function) {
+    case MODBUS_READ_HOLDING:
+    case MODBUS_READ_INPUT:
+      exception = readRegisters(request, length, response, responseLength);
+      break;
+    case MODBUS_WRITE_SINGLE:
+    case MODBUS_WRITE_MULTIPLE:
+      exception = writeRegisters(request, length, response, responseLength);
+      break;
+    default:
+      exception = MODBUS_ILLEGAL_FUNCTION;
+      break;
+  }
+
+  if (exception) {
+    response[0] = function | 0x80;
+    response[1] = exception;
+    return 2;
+  }
+  response[0] = function;
+  return responseLength;
+}
+
+static void handleModbusData(void *arg, AsyncClient *client, void *data, size_t length) {
+  ModbusConnection *connection = (ModbusConnection *)arg;
+  const uint8_t *in = (const uint8_t *)data;
+
+  while (length > 0) {
+    size_t chunk = min(length, sizeof(connection->buffer) - connection->length);
+    memcpy(connection->buffer + connection->length, in, chunk);
+    connection->length += chunk;
+    in += chunk;
+    length -= chunk;
+
+    while (connection->length >= MODBUS_HEADER_SIZE) {
+      uint8_t *frame = connection->buffer;
+      uint16_t protocol = readWord(frame + 2);
+      uint16_t frameLength = readWord(frame + 4);  // Unit id + PDU
+      if (protocol != 0 || frameLength < 2 || frameLength > MODBUS_MAX_FRAME - 6) {
+        client->close();  // Not Modbus, resynchronising is not possible
+        return;
+      }
+      size_t total = 6 + frameLength;
+      if (connection->length < total) {
+        break;
+      }
+
+      uint8_t response[MODBUS_MAX_FRAME];
+      memcpy(response, frame, 4);       // Transaction and protocol id
+      response[6] = frame[6];           // Unit id
+      size_t pduLength = handlePDU(frame + MODBUS_HEADER_SIZE, frameLength - 1, response + MODBUS_HEADER_SIZE);
+      writeWord(response + 4, pduLength + 1);
+      size_t responseLength = MODBUS_HEADER_SIZE + pduLength;
+      if (client->space() < responseLength) {
+        client->close();  // Master is not reading its responses
+        return;
+      }
+      client->add((const char *)response, responseLength, ASYNC_WRITE_FLAG_COPY);
+      client->send();
+
+      memmove(connection->buffer, connection->buffer + total, connection->length - total);
+      connection->length -= total;
+    }
+  }
+}
+
+static void handleModbusClient(void *arg, AsyncClient *client) {
+  if (modbusConnections >= MODBUS_MAX_CLIENTS) {
+    Serial.println("Modbus: connection limit reached, rejecting master");
+    client->close(true);
+    delete client;
+    return;
+  }
+
+  ModbusConnection *connection = new ModbusConnection();
+  connection->client = client;
+  connection->length = 0;
+  modbusConnections++;
+
+  client->setNoDelay(true);
+  client->setRxTimeout(MODBUS_IDLE_TIMEOUT);
+  client->onData(handleModbusData, connection);
+  client->onTimeout([](void *arg, AsyncClient *client, uint32_t time) {
+    client->close();
+  }, connection);
+  client->onDisconnect([](void *arg, AsyncClient *client) {
+    delete (ModbusConnection *)arg;
+    modbusConnections--;
+    delete client;
+  }, connection);
+}
+
+void setupModbus() {
+  readSettingRegisters(holdingRegisters);
+  modbusLastUpdate = millis();
+  modbusLastCompressorOn = isCompressorOn;
+  modbusLastDefrostOn = isDefrostOn;
+
+  modbusServer = new AsyncServer(MODBUS_PORT);
+  modbusServer->setNoDelay(true);
+  modbusServer->onClient(handleModbusClient, nullptr);
+  modbusServer->begin();
+  Serial.printf("Modbus TCP server listening on port %d\n", MODBUS_PORT);
+}
+
+// Applies queued writes and refreshes the snapshot, called from the loop
+void updateModbus() {
+  ModbusWrite writes[MODBUS_WRITE_QUEUE];
+  int writeCount = 0;
+  portENTER_CRITICAL(&modbusMux);
+  while (writeQueueLength > 0) {
+    writes[writeCount++] = writeQueue[writeQueueHead];
+    writeQueueHead = (writeQueueHead + 1) % MODBUS_WRITE_QUEUE;
+    writeQueueLength--;
+  }
+  portEXIT_CRITICAL(&modbusMux);
+
+  if (writeCount > 0) {
+    for (int i = 0; i < writeCount; i++) {
+      applySettingRegister(writes[i].address, writes[i].value);
+    }
+    saveSettings();
+    refreshProbeRoles();
+    Serial.printf("Modbus: applied %d register writes\n", writeCount);
+  }
+
+  unsigned long now = millis();
+  if (modbusLastCompressorOn) {
+    modbusCompressorRunMillis += now - modbusLastUpdate;
+  }
+  if (isCompressorOn && !modbusLastCompressorOn) {
+    modbusCompressorStarts++;
+  }
+  if (isDefrostOn && !modbusLastDefrostOn) {
+    modbusDefrosts++;
+  }
+  modbusLastCompressorOn = isCompressorOn;
+  modbusLastDefrostOn = isDefrostOn;
+  modbusLastUpdate = now;
+
+  uint16_t status = 0;
+  if (isCompressorOn) status |= MODBUS_STATUS_COMPRESSOR;
+  if (isDefrostOn) status |= MODBUS_STATUS_DEFROST;
+  if (isDraining) status |= MODBUS_STATUS_DRAINING;
+  if (isFanOn) status |= MODBUS_STATUS_FAN;
+  if (highTempAlert) status |= MODBUS_STATUS_HIGH_ALARM;
+  if (lowTempAlert) status |= MODBUS_STATUS_LOW_ALARM;
+  if (energySavingMode) status |= MODBUS_STATUS_ENERGY_SAVING;
+  if (digitalRead(DOOR_SENSOR_PIN) == LOW) status |= MODBUS_STATUS_DOOR_OPEN;
+  if (canActivateOutputs()) status |= MODBUS_STATUS_OUTPUTS_ENABLED;
+  if (useSimulatedTemperature) status |= MODBUS_STATUS_SIMULATED;
+  if (faultFlags) status |= MODBUS_STATUS_FAULT;
+
+  uint16_t inputs[INPUT_REGISTER_COUNT];
+  inputs[IR_CABINET_TEMPERATURE] = encodeTemperature(currentTemperature);
+  inputs[IR_EVAPORATOR_TEMPERATURE] = encodeTemperature(settings.P2P == "y" ? evaporatorTemperature : NAN);
+  inputs[IR_DISPLAY_TEMPERATURE] = encodeTemperature(roleTemperature(ROLE_DISPLAY));
+  inputs[IR_STATUS] = status;
+  uint32_t counters[] = {modbusCompressorStarts, modbusCompressorRunMillis / 1000, modbusDefrosts, (uint32_t)(now / 1000)};
+  for (int i = 0; i < 4; i++) {
+    inputs[IR_COMPRESSOR_STARTS + i * 2] = counters[i] >> 16;
+    inputs[IR_COMPRESSOR_STARTS + i * 2 + 1] = counters[i] & 0xFFFF;
+  }
+  inputs[IR_PROBE_COUNT] = getProbeCount();
+  for (int i = 0; i < MAX_PROBES; i++) {
+    inputs[IR_PROBE_TEMPERATURE + i] = encodeTemperature(probeTemperature(i));
+  }
+  inputs[IR_FAULTS] = faultFlags;
+
+  uint16_t holdings[HOLDING_REGISTER_COUNT];
+  readSettingRegisters(holdings);
+
+  portENTER_CRITICAL(&modbusMux);
+  memcpy(inputRegisters, inputs, sizeof(inputRegisters));
+  if (writeQueueLength == 0) {
+    // Otherwise keep showing the queued values until they are applied
+    memcpy(holdingRegisters, holdings, sizeof(holdingRegisters));
+  }
+  portEXIT_CRITICAL(&modbusMux);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Modbus TCP server (port MODBUS_PORT, any unit id) for building-management
+// polling. Supported functions: 03 read holding registers, 04 read input
+// registers, 06 write single register, 16 write multiple registers.
+//
+// Reads are answered from a snapshot that updateModbus() refreshes from the
+// loop, so the network task never touches control state. Writes are range
+// checked against the table below, queued, and applied (and saved) by the
+// next updateModbus(); the snapshot shows the written value immediately.
+//
+// Temperatures are signed 0.1 degC, 0x8000 when the probe is faulty or not
+// assigned. 32-bit counters span two registers, high word first.
+
+// Input registers (function 04)
+enum ModbusInputRegister : uint16_t {
+  IR_CABINET_TEMPERATURE = 0,    // Regulation probe
+  IR_EVAPORATOR_TEMPERATURE = 1, // Defrost termination probe
+  IR_DISPLAY_TEMPERATURE = 2,    // Lod probe
+  IR_STATUS = 3,                 // MODBUS_STATUS_* bits
+  IR_COMPRESSOR_STARTS = 4,      // 2 registers, since boot
+  IR_COMPRESSOR_RUN_TIME = 6,    // 2 registers, seconds since boot
+  IR_DEFROSTS = 8,               // 2 registers, since boot
+  IR_UPTIME = 10,                // 2 registers, seconds
+  IR_PROBE_COUNT = 12,
+  IR_PROBE_TEMPERATURE = 13,     // P1..P8, one register each
+  IR_FAULTS = 21                 // FaultFlag bits of the fault detector
+};
+
+enum ModbusStatusBit : uint16_t {
+  MODBUS_STATUS_COMPRESSOR = 1 << 0,
+  MODBUS_STATUS_DEFROST = 1 << 1,
+  MODBUS_STATUS_DRAINING = 1 << 2,
+  MODBUS_STATUS_FAN = 1 << 3,
+  MODBUS_STATUS_HIGH_ALARM = 1 << 4,
+  MODBUS_STATUS_LOW_ALARM = 1 << 5,
+  MODBUS_STATUS_ENERGY_SAVING = 1 << 6,
+  MODBUS_STATUS_DOOR_OPEN = 1 << 7,
+  MODBUS_STATUS_OUTPUTS_ENABLED = 1 << 8,  // Start-up delay (OdS) has passed
+  MODBUS_STATUS_SIMULATED = 1 << 9,
+  MODBUS_STATUS_FAULT = 1 << 10           // Any fault detector finding, details in IR_FAULTS
+};
+
+// Holding registers (functions 03/06/16), one per setting, numbered from 0
+// in this order:
+//   N(field, scale, minimum, maximum)  register = setting * scale, raw range
+//   C(field, options)                  register = index into options
+#define MODBUS_HOLDING_REGISTERS(N, C) \
+  N(SEt, 10, -500, 1100)   /*  0 */ \
+  N(Hy, 10, 1, 255)        /*  1 */ \
+  N(LS, 10, -500, 1100)    /*  2 */ \
+  N(US, 10, -500, 1100)    /*  3 */ \
+  C(P2P, MODBUS_NO_YES)    /*  4 */ \
+  N(OdS, 1, 0, 255)        /*  5 */ \
+  N(AC, 1, 0, 50)          /*  6 */ \
+  N(CCt, 10, 0, 240)       /*  7 */ \
+  N(CCS, 10, -500, 1500)   /*  8 */ \
+  N(COn, 1, 0, 255)        /*  9 */ \
+  N(COF, 1, 0, 255)        /* 10 */ \
+  C(CF, MODBUS_UNITS)      /* 11 */ \
+  C(rES, MODBUS_RESOLUTIONS) /* 12 */ \
+  C(rEP, MODBUS_PROBES)    /* 13 */ \
+  C(tdF, MODBUS_DEFROST_TYPES) /* 14 */ \
+  C(dFP, MODBUS_OPTIONAL_PROBES) /* 15 */ \
+  N(dtE, 10, -500, 500)    /* 16 */ \
+  N(IdF, 1, 1, 120)        /* 17 */ \
+  N(MdF, 1, 0, 255)        /* 18 */ \
+  N(dSd, 1, 0, 99)         /* 19 */ \
+  N(dAd, 1, 0, 255)        /* 20 */ \
+  N(Fdt, 1, 0, 120)        /* 21 */ \
+  C(dPo, MODBUS_NO_YES)    /* 22 */ \
+  N(dAF, 10, 0, 240)       /* 23 */ \
+  C(FnC, MODBUS_FAN_MODES) /* 24 */ \
+  N(Fnd, 1, 0, 255)        /* 25 */ \
+  N(Fct, 10, 0, 500)       /* 26 */ \
+  N(FSt, 10, -500, 500)    /* 27 */ \
+  C(FAP, MODBUS_OPTIONAL_PROBES) /* 28 */ \
+  C(ALC, MODBUS_ALARM_MODES) /* 29 */ \
+  N(ALU, 10, -500, 1100)   /* 30 */ \
+  N(ALL, 10, -500, 1100)   /* 31 */ \
+  N(AFH, 10, 1, 255)       /* 32 */ \
+  N(ALd, 1, 0, 255)        /* 33 */ \
+  N(dAO, 10, 0, 235)       /* 34 */ \
+  N(HES, 10, -300, 300)    /* 35 */ \
+  N(LdB, 10, 1, 100)       /* 36 */ \
+  N(LMi, 1, 1, 1440)       /* 37 */ \
+  C(dEM, MODBUS_NO_YES)    /* 38 */ \
+  N(IdM, 1, 1, 120)        /* 39 */ \
+  N(dFL, 1, 10, 100)       /* 40 */
+
+void setupModbus();
+void updateModbus();
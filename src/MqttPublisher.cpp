@@ -0,0 +1,624 @@
+#include "MqttPublisher.h"
+#include "config.h"
+#include "Hardware.h"
+#include "EventJournal.h"
+#include <AsyncMqttClient.h>
+#include <SPIFFS.h>
+#include <WiFi.h>
+#include <stdarg.h>
+
+// A record on its way to the broker. lost counts the records of the same
+// topic that were dropped from the stream right before it, so the batch that
+// carries it can report the gap.
+struct __attribute__((packed)) MqttRecord {
+  JournalRecord record;
+  uint32_t lost;
+};
+
+// Flash queue: a header followed by a ring of MQTT_QUEUE_CAPACITY records,
+// preallocated so appends never grow the file
+struct __attribute__((packed)) QueueHeader {
+  char magic[2];       // "XQ"
+  uint8_t version;
+  uint8_t reserved;
+  uint32_t capacity;   // Records
+  uint32_t head;       // Slot of the oldest record
+  uint32_t count;
+  uint32_t lost[2];    // Dropped records no record carries yet, by topic (events, samples)
+};
+
+// A published batch waiting for its PUBACK
+struct InflightBatch {
+  uint16_t packetId;   // 0 = free
+  bool acked;
+  bool fromQueue;      // Records are still in the flash queue until acked
+  uint32_t order;      // Publish order, counted separately for live and queue batches
+  uint8_t count;
+  MqttRecord records[MQTT_BATCH_SIZE];
+};
+
+static const char MQTT_OFFLINE[] = "{\"online\":false}";
+
+AsyncMqttClient mqttClient;
+char mqttClientId[24];
+char mqttStatusTopic[64];
+char mqttAlarmTopic[64];
+char mqttSamplesTopic[64];
+char mqttEventsTopic[64];
+char mqttPayload[MQTT_PAYLOAD_SIZE];
+
+MqttRecord sampleBatch[MQTT_BATCH_SIZE];
+int sampleBatchCount = 0;
+unsigned long sampleBatchStarted = 0;
+MqttRecord eventBatch[MQTT_BATCH_SIZE];
+int eventBatchCount = 0;
+unsigned long lastMqttSample = 0;
+
+InflightBatch inflightBatches[MQTT_MAX_INFLIGHT];
+uint32_t queueInflightRecords = 0;  // Oldest queue records that are published but not acked
+uint32_t nextQueueOrder = 0;
+uint32_t nextQueuePop = 0;
+uint32_t nextLiveOrder = 0;
+
+QueueHeader queueHeader;
+bool queueReady = false;
+
+// Handed over from the client callbacks (network task), guarded by mqttMux
+portMUX_TYPE mqttMux = portMUX_INITIALIZER_UNLOCKED;
+bool mqttConnectedEvent = false;
+bool mqttDisconnectedEvent = false;
+uint16_t mqttAcks[MQTT_MAX_INFLIGHT * 2];
+int mqttAckCount = 0;
+
+bool mqttOnline = false;
+unsigned long lastConnectAttempt = 0;
+unsigned long lastDrainUpdate = 0;
+float drainTokens = 0;
+unsigned long reconnectedAt = 0;
+bool lastHighAlarm = false;
+bool lastLowAlarm = false;
+bool lastProbeAlarm = false;
+
+uint32_t mqttPublishedBatches = 0;
+uint32_t mqttPublishedRecords = 0;
+uint32_t mqttPublishedSamples = 0;
+uint32_t mqttSampleBytes = 0;
+uint32_t mqttQueuedRecords = 0;
+uint32_t mqttDroppedRecords = 0;
+long mqttRecoveryMillis = -1;
+
+// ---------------------------------------------------------------------------
+// Flash queue
+
+static int topicOf(const JournalRecord &record) {
+  return record.type == EVT_SNAPSHOT ? 1 : 0;
+}
+
+static bool writeQueueHeader(File &file) {
+  file.seek(0);
+  return file.write((const uint8_t *)&queueHeader, sizeof(queueHeader)) == sizeof(queueHeader);
+}
+
+// offset counts records from the head
+static uint32_t queueSlot(uint32_t offset) {
+  return (queueHeader.head + offset) % queueHeader.capacity;
+}
+
+static void readQueueRecord(File &file, uint32_t slot, MqttRecord &record) {
+  file.seek(sizeof(QueueHeader) + slot * sizeof(MqttRecord));
+  file.read((uint8_t *)&record, sizeof(MqttRecord));
+}
+
+static void writeQueueRecord(File &file, uint32_t slot, const MqttRecord &record) {
+  file.seek(sizeof(QueueHeader) + slot * sizeof(MqttRecord));
+  file.write((const uint8_t *)&record, sizeof(MqttRecord));
+}
+
+static void setupQueue() {
+  size_t fileSize = sizeof(QueueHeader) + MQTT_QUEUE_CAPACITY * sizeof(MqttRecord);
+  File file = SPIFFS.open(MQTT_QUEUE_FILE, FILE_READ);
+  if (file) {
+    bool valid = file.read((uint8_t *)&queueHeader, sizeof(queueHeader)) == sizeof(queueHeader) &&
+                 memcmp(queueHeader.magic, "XQ", 2) == 0 && queueHeader.version == 2 &&
+                 queueHeader.capacity == MQTT_QUEUE_CAPACITY && file.size() == fileSize &&
+                 queueHeader.head < queueHeader.capacity && queueHeader.count <= queueHeader.capacity;
+    file.close();
+    if (valid) {
+      queueReady = true;
+      Serial.printf("MQTT queue holds %u records\n", (unsigned)queueHeader.count);
+      return;
+    }
+  }
+
+  queueHeader = {{'X', 'Q'}, 2, 0, MQTT_QUEUE_CAPACITY, 0, 0, {0, 0}};
+  file = SPIFFS.open(MQTT_QUEUE_FILE, FILE_WRITE);
+  if (!file) {
+    Serial.println("Error: Failed to create MQTT queue");
+    return;
+  }
+  file.write((const uint8_t *)&queueHeader, sizeof(queueHeader));
+  uint8_t zeros[256] = {0};
+  for (size_t left = fileSize - sizeof(queueHeader); left > 0;) {
+    size_t chunk = min(left, sizeof(zeros));
+    file.write(zeros, chunk);
+    left -= chunk;
+  }
+  file.close();
+  queueReady = true;
+}
+
+// Hands a dropped record's count on to the next record of its topic in the
+// stream: the queue from offset on, then the records still to be queued, then
+// the batch in RAM. Without one the count waits in the header for the next
+// record of the topic.
+static void carryLost(File &file, int topic, uint32_t lost, uint32_t offset, MqttRecord *next, int nextCount) {
+  MqttRecord record;
+  for (uint32_t i = offset; file && i < queueHeader.count; i++) {
+    readQueueRecord(file, queueSlot(i), record);
+    if (topicOf(record.record) == topic) {
+      record.lost += lost;
+      writeQueueRecord(file, queueSlot(i), record);
+      return;
+    }
+  }
+  for (int i = 0; i < nextCount; i++) {
+    if (topicOf(next[i].record) == topic) {
+      next[i].lost += lost;
+      return;
+    }
+  }
+  MqttRecord *batch = topic ? sampleBatch : eventBatch;
+  if ((topic ? sampleBatchCount : eventBatchCount) > 0) {
+    batch[0].lost += lost;
+    return;
+  }
+  queueHeader.lost[topic] += lost;
+}
+
+static void dropRecord(File &file, const MqttRecord &record, uint32_t offset, MqttRecord *next, int nextCount) {
+  mqttDroppedRecords++;
+  carryLost(file, topicOf(record.record), record.lost + 1, offset, next, nextCount);
+}
+
+// When the ring is full the oldest record is overwritten, unless it is
+// in flight, then the new one is dropped
+static void appendQueue(MqttRecord *records, int count) {
+  File file = queueReady ? SPIFFS.open(MQTT_QUEUE_FILE, "r+") : File();
+  for (int i = 0; i < count; i++) {
+    if (!file) {
+      dropRecord(file, records[i], 0, records + i + 1, count - i - 1);
+      continue;
+    }
+    if (queueHeader.count == queueHeader.capacity) {
+      if (queueInflightRecords > 0) {
+        dropRecord(file, records[i], queueHeader.count, records + i + 1, count - i - 1);
+        continue;
+      }
+      MqttRecord oldest;
+      readQueueRecord(file, queueHeader.head, oldest);
+      queueHeader.head = queueSlot(1);
+      queueHeader.count--;
+      dropRecord(file, oldest, 0, records + i, count - i);
+    }
+    writeQueueRecord(file, queueSlot(queueHeader.count), records[i]);
+    queueHeader.count++;
+    mqttQueuedRecords++;
+  }
+  if (file) {
+    writeQueueHeader(file);
+    file.close();
+  }
+}
+
+// Puts records back in front of the queue, for batches that are older than
+// everything queued. When the ring is full they are the oldest, so they are
+// dropped.
+static void prependQueue(MqttRecord *records, int count) {
+  File file = queueReady ? SPIFFS.open(MQTT_QUEUE_FILE, "r+") : File();
+  for (int i = count - 1; i >= 0; i--) {
+    if (!file || queueHeader.count == queueHeader.capacity) {
+      dropRecord(file, records[i], 0, nullptr, 0);
+      continue;
+    }
+    queueHeader.head = (queueHeader.head + queueHeader.capacity - 1) % queueHeader.capacity;
+    queueHeader.count++;
+    writeQueueRecord(file, queueHeader.head, records[i]);
+    mqttQueuedRecords++;
+  }
+  if (file) {
+    writeQueueHeader(file);
+    file.close();
+  }
+}
+
+// Reads up to max records starting offset records after the head
+static int peekQueue(uint32_t offset, MqttRecord *records, int max) {
+  if (offset >= queueHeader.count) {
+    return 0;
+  }
+  int count = min((uint32_t)max, queueHeader.count - offset);
+  File file = SPIFFS.open(MQTT_QUEUE_FILE, FILE_READ);
+  if (!file) {
+    return 0;
+  }
+  for (int i = 0; i < count; i++) {
+    uint32_t slot = queueSlot(offset + i);
+    if (i == 0 || slot == 0) {
+      file.seek(sizeof(QueueHeader) + slot * sizeof(MqttRecord));
+    }
+    file.read((uint8_t *)&records[i], sizeof(MqttRecord));
+  }
+  file.close();
+  return count;
+}
+
+static void popQueue(uint32_t count) {
+  count = min(count, queueHeader.count);
+  queueHeader.head = queueSlot(count);
+  queueHeader.count -= count;
+  File file = SPIFFS.open(MQTT_QUEUE_FILE, "r+");
+  if (file) {
+    writeQueueHeader(file);
+    file.close();
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Publishing
+
+static size_t appendPayload(size_t length, const char *format, ...) {
+  if (length >= sizeof(mqttPayload)) {
+    return length;
+  }
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(mqttPayload + length, sizeof(mqttPayload) - length, format, args);
+  va_end(args);
+  return written < 0 ? sizeof(mqttPayload) : length + written;
+}
+
+static size_t appendTemperature(size_t length, int16_t temperature) {
+  if (temperature == INT16_MIN) {
+    return appendPayload(length, "null");
+  }
+  int magnitude = abs(temperature);
+  return appendPayload(length, "%s%d.%d", temperature < 0 ? "-" : "", magnitude / 10, magnitude % 10);
+}
+
+// {"lost":N, only when records of the topic were dropped before or between
+// the ones in this batch
+static size_t beginPayload(const MqttRecord *records, int count) {
+  uint32_t lost = 0;
+  for (int i = 0; i < count; i++) {
+    lost += records[i].lost;
+  }
+  return lost ? appendPayload(0, "{\"lost\":%lu,", (unsigned long)lost) : appendPayload(0, "{");
+}
+
+// Samples are sent as columns: {"t":[...],"temp":[...],"evap":[...],"state":[...]}
+static size_t buildSamplesPayload(const MqttRecord *records, int count) {
+  size_t length = appendPayload(beginPayload(records, count), "\"t\":[");
+  for (int i = 0; i < count; i++) {
+    length = appendPayload(length, i ? ",%lu" : "%lu", (unsigned long)records[i].record.time);
+  }
+  length = appendPayload(length, "],\"temp\":[");
+  for (int i = 0; i < count; i++) {
+    length = appendTemperature(i ? appendPayload(length, ",") : length, records[i].record.temperature);
+  }
+  length = appendPayload(length, "],\"evap\":[");
+  for (int i = 0; i < count; i++) {
+    length = appendTemperature(i ? appendPayload(length, ",") : length, records[i].record.evaporator);
+  }
+  length = appendPayload(length, "],\"state\":[");
+  for (int i = 0; i < count; i++) {
+    length = appendPayload(length, i ? ",%u" : "%u", records[i].record.value);
+  }
+  return appendPayload(length, "]}");
+}
+
+static size_t buildEventsPayload(const MqttRecord *records, int count) {
+  size_t length = appendPayload(beginPayload(records, count), "\"events\":[");
+  for (int i = 0; i < count; i++) {
+    const JournalRecord &record = records[i].record;
+    length = appendPayload(length, "%s{\"t\":%lu,\"ms\":%u,\"type\":\"%s\",\"value\":%u,\"temp\":",
+                           i ? "," : "", (unsigned long)record.time, record.millis,
+                           journalEventName(record.type), record.value);
+    length = appendTemperature(length, record.temperature);
+    length = appendPayload(length, "}");
+  }
+  return appendPayload(length, "]}");
+}
+
+static bool publishBatch(const MqttRecord *records, int count, bool fromQueue) {
+  int slot = -1;
+  for (int i = 0; i < MQTT_MAX_INFLIGHT && slot < 0; i++) {
+    if (inflightBatches[i].packetId == 0) {
+      slot = i;
+    }
+  }
+  if (slot < 0) {
+    return false;
+  }
+
+  bool samples = topicOf(records[0].record) == 1;
+  size_t length = samples ? buildSamplesPayload(records, count) : buildEventsPayload(records, count);
+  if (length >= sizeof(mqttPayload)) {
+    Serial.println("Error: MQTT batch does not fit the payload buffer");
+    return false;
+  }
+  uint16_t packetId = mqttClient.publish(samples ? mqttSamplesTopic : mqttEventsTopic, 1, false,
+                                         mqttPayload, length);
+  if (packetId == 0) {
+    return false;  // Client buffer full or disconnected
+  }
+
+  InflightBatch &batch = inflightBatches[slot];
+  batch.packetId = packetId;
+  batch.acked = false;
+  batch.fromQueue = fromQueue;
+  batch.order = fromQueue ? nextQueueOrder++ : nextLiveOrder++;
+  batch.count = count;
+  memcpy(batch.records, records, count * sizeof(MqttRecord));
+
+  mqttPublishedBatches++;
+  mqttPublishedRecords += count;
+  if (samples) {
+    mqttPublishedSamples += count;
+    mqttSampleBytes += length;
+  }
+  return true;
+}
+
+// Keeps the order of the stream: live batches only bypass the queue while it is empty
+static void flushBatch(MqttRecord *batch, int &count) {
+  int flushed = count;
+  count = 0;  // Emptied first so dropped records are not carried into it
+  if (flushed == 0) {
+    return;
+  }
+  if (!mqttOnline || queueHeader.count > 0 || !publishBatch(batch, flushed, false)) {
+    appendQueue(batch, flushed);
+  }
+}
+
+static void addRecord(const JournalRecord &journalRecord) {
+  int topic = topicOf(journalRecord);
+  MqttRecord record = {journalRecord, queueHeader.lost[topic]};
+  queueHeader.lost[topic] = 0;
+  if (topic == 1) {
+    if (sampleBatchCount == 0) {
+      sampleBatchStarted = millis();
+    }
+    sampleBatch[sampleBatchCount++] = record;
+    if (sampleBatchCount == MQTT_BATCH_SIZE) {
+      flushBatch(sampleBatch, sampleBatchCount);
+    }
+  } else {
+    eventBatch[eventBatchCount++] = record;
+    if (eventBatchCount == MQTT_BATCH_SIZE) {
+      flushBatch(eventBatch, eventBatchCount);
+    }
+  }
+}
+
+static void queueJournalRecords(const JournalRecord *records, int count) {
+  for (int i = 0; i < count; i++) {
+    addRecord(records[i]);
+  }
+}
+
+static void publishStatus() {
+  char payload[128];
+  int length = snprintf(payload, sizeof(payload), "{\"online\":true,\"ip\":\"%s\",\"uptime\":%lu}",
+                        WiFi.localIP().toString().c_str(), millis() / 1000);
+  mqttClient.publish(mqttStatusTopic, 1, true, payload, length);
+}
+
+static void publishAlarm() {
+  char payload[112];
+  int length = snprintf(payload, sizeof(payload), "{\"high\":%s,\"low\":%s,\"probe\":%s,\"t\":%lu}",
+                        highTempAlert ? "true" : "false", lowTempAlert ? "true" : "false",
+                        probeFailureAlert ? "true" : "false", (unsigned long)time(nullptr));
+  if (mqttClient.publish(mqttAlarmTopic, 1, true, payload, length) != 0) {
+    lastHighAlarm = highTempAlert;
+    lastLowAlarm = lowTempAlert;
+    lastProbeAlarm = probeFailureAlert;
+  }
+}
+
+// Publishes queued batches while the token bucket allows, oldest first
+static void drainQueue(unsigned long now) {
+  drainTokens = min((float)MQTT_MAX_INFLIGHT, drainTokens + (now - lastDrainUpdate) / (float)MQTT_DRAIN_INTERVAL);
+  lastDrainUpdate = now;
+
+  MqttRecord records[MQTT_BATCH_SIZE];
+  while (drainTokens >= 1.0f) {
+    int count = peekQueue(queueInflightRecords, records, MQTT_BATCH_SIZE);
+    if (count == 0) {
+      break;
+    }
+    // A batch goes to one topic, so cut it where samples and events alternate,
+    // and before a gap so the batch reporting it starts there
+    int topic = topicOf(records[0].record);
+    int run = 1;
+    while (run < count && topicOf(records[run].record) == topic && records[run].lost == 0) {
+      run++;
+    }
+    if (!publishBatch(records, run, true)) {
+      break;
+    }
+    queueInflightRecords += run;
+    drainTokens -= 1.0f;
+  }
+}
+
+// Pops acknowledged queue batches from the flash queue in publish order
+static void releaseAckedQueueBatches() {
+  bool popped = true;
+  while (popped) {
+    popped = false;
+    for (int i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+      InflightBatch &batch = inflightBatches[i];
+      if (batch.packetId != 0 && batch.fromQueue && batch.acked && batch.order == nextQueuePop) {
+        popQueue(batch.count);
+        queueInflightRecords -= batch.count;
+        nextQueuePop++;
+        batch.packetId = 0;
+        popped = true;
+      }
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+void setupMqtt() {
+  if (MQTT_HOST[0] == 0) {
+    Serial.println("MQTT disabled, no broker configured");
+    return;
+  }
+
+  uint64_t mac = ESP.getEfuseMac();
+  snprintf(mqttClientId, sizeof(mqttClientId), "xr60-%04x%08x", (uint16_t)(mac >> 32), (uint32_t)mac);
+  const char *deviceId = mqttClientId + 5;
+  snprintf(mqttStatusTopic, sizeof(mqttStatusTopic), "%s/%s/status", MQTT_TOPIC_PREFIX, deviceId);
+  snprintf(mqttAlarmTopic, sizeof(mqttAlarmTopic), "%s/%s/alarm", MQTT_TOPIC_PREFIX, deviceId);
+  snprintf(mqttSamplesTopic, sizeof(mqttSamplesTopic), "%s/%s/samples", MQTT_TOPIC_PREFIX, deviceId);
+  snprintf(mqttEventsTopic, sizeof(mqttEventsTopic), "%s/%s/events", MQTT_TOPIC_PREFIX, deviceId);
+
+  setupQueue();
+
+  mqttClient.setServer(MQTT_HOST, MQTT_PORT);
+  if (MQTT_USER[0] != 0) {
+    mqttClient.setCredentials(MQTT_USER, MQTT_PASSWORD);
+  }
+  mqttClient.setClientId(mqttClientId);
+  mqttClient.setKeepAlive(30);
+  mqttClient.setWill(mqttStatusTopic, 1, true, MQTT_OFFLINE);
+
+  mqttClient.onConnect([](bool sessionPresent) {
+    portENTER_CRITICAL(&mqttMux);
+    mqttConnectedEvent = true;
+    portEXIT_CRITICAL(&mqttMux);
+  });
+  mqttClient.onDisconnect([](AsyncMqttClientDisconnectReason reason) {
+    portENTER_CRITICAL(&mqttMux);
+    mqttDisconnectedEvent = true;
+    portEXIT_CRITICAL(&mqttMux);
+  });
+  mqttClient.onPublish([](uint16_t packetId) {
+    portENTER_CRITICAL(&mqttMux);
+    if (mqttAckCount < (int)(sizeof(mqttAcks) / sizeof(mqttAcks[0]))) {
+      mqttAcks[mqttAckCount++] = packetId;
+    }
+    portEXIT_CRITICAL(&mqttMux);
+  });
+
+  setJournalListener(queueJournalRecords);
+  lastConnectAttempt = millis() - MQTT_RECONNECT_INTERVAL;
+}
+
+void updateMqtt() {
+  if (MQTT_HOST[0] == 0) {
+    return;
+  }
+  unsigned long now = millis();
+
+  uint16_t acks[sizeof(mqttAcks) / sizeof(mqttAcks[0])];
+  portENTER_CRITICAL(&mqttMux);
+  bool connected = mqttConnectedEvent;
+  bool disconnected = mqttDisconnectedEvent;
+  int ackCount = mqttAckCount;
+  memcpy(acks, mqttAcks, ackCount * sizeof(uint16_t));
+  mqttConnectedEvent = mqttDisconnectedEvent = false;
+  mqttAckCount = 0;
+  portEXIT_CRITICAL(&mqttMux);
+
+  for (int a = 0; a < ackCount; a++) {
+    for (int i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+      if (inflightBatches[i].packetId == acks[a]) {
+        inflightBatches[i].acked = true;
+        if (!inflightBatches[i].fromQueue) {
+          inflightBatches[i].packetId = 0;
+        }
+      }
+    }
+  }
+  releaseAckedQueueBatches();
+
+  if (disconnected) {
+    mqttOnline = false;
+    reconnectedAt = 0;
+    queueInflightRecords = 0;
+    // Unacknowledged live batches are resent from the queue; queue batches never
+    // left it. Live batches were published while the queue was empty, so they go
+    // in front of it, newest first to keep their order.
+    while (true) {
+      InflightBatch *newest = nullptr;
+      for (int i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+        InflightBatch &batch = inflightBatches[i];
+        if (batch.packetId != 0 && !batch.fromQueue && (!newest || batch.order > newest->order)) {
+          newest = &batch;
+        }
+      }
+      if (!newest) {
+        break;
+      }
+      prependQueue(newest->records, newest->count);
+      newest->packetId = 0;
+    }
+    for (int i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+      inflightBatches[i].packetId = 0;
+    }
+    nextQueueOrder = nextQueuePop = nextLiveOrder = 0;
+    Serial.println("MQTT disconnected");
+  }
+  if (connected) {
+    mqttOnline = true;
+    reconnectedAt = now;
+    lastDrainUpdate = now;
+    drainTokens = 0;
+    publishStatus();
+    publishAlarm();
+    Serial.println("MQTT connected");
+  }
+
+  if (!mqttOnline && !mqttClient.connected() && WiFi.status() == WL_CONNECTED &&
+      now - lastConnectAttempt >= MQTT_RECONNECT_INTERVAL) {
+    lastConnectAttempt = now;
+    mqttClient.connect();
+  }
+
+  if (time(nullptr) >= JOURNAL_MIN_VALID_TIME && now - lastMqttSample >= MQTT_SAMPLE_INTERVAL) {
+    lastMqttSample = now;
+    addRecord(sampleJournalSnapshot());
+  }
+  if (sampleBatchCount > 0 && now - sampleBatchStarted >= MQTT_BATCH_INTERVAL) {
+    flushBatch(sampleBatch, sampleBatchCount);
+  }
+  flushBatch(eventBatch, eventBatchCount);  // Events go out with the loop that produced them
+
+  if (mqttOnline) {
+    if (highTempAlert != lastHighAlarm || lowTempAlert != lastLowAlarm || probeFailureAlert != lastProbeAlarm) {
+      publishAlarm();
+    }
+    drainQueue(now);
+    if (reconnectedAt != 0 && queueHeader.count == 0) {
+      mqttRecoveryMillis = now - reconnectedAt;
+      reconnectedAt = 0;
+    }
+  }
+}
+
+void fillMqttStatsJSON(JsonDocument &doc) {
+  doc["enabled"] = MQTT_HOST[0] != 0;
+  doc["connected"] = mqttOnline;
+  doc["queued"] = queueHeader.count;
+  doc["queueCapacity"] = MQTT_QUEUE_CAPACITY;
+  doc["queuedTotal"] = mqttQueuedRecords;
+  doc["dropped"] = mqttDroppedRecords;
+  doc["publishedBatches"] = mqttPublishedBatches;
+  doc["publishedRecords"] = mqttPublishedRecords;
+  doc["bytesPerSample"] = mqttPublishedSamples ? (float)mqttSampleBytes / mqttPublishedSamples : 0.0f;
+  doc["lastRecoveryTime"] = mqttRecoveryMillis;  // ms from reconnect until the queue was empty, -1 = none yet
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// MQTT telemetry under <MQTT_TOPIC_PREFIX>/<device id>/:
+//   status   retained, {"online":true,...}; the broker publishes
+//            {"online":false} as last will
+//   alarm    retained, high/low alarm state, republished on every change
+//   samples  QoS 1, batches of periodic state samples as column arrays
+//   events   QoS 1, batches of event journal records
+//
+// Samples and events are batched in RAM while connected. While offline, and
+// for batches that were not acknowledged before a disconnect, they go to a
+// bounded ring file in flash that is drained at MQTT_DRAIN_INTERVAL per batch
+// after reconnecting. When the ring is full the oldest records are dropped;
+// the next batch of the same topic then starts with "lost":N, the number of
+// records missing before it. All work happens in updateMqtt(); the client
+// callbacks only hand events over to it.
+
+void setupMqtt();
+void updateMqtt();
+void fillMqttStatsJSON(JsonDocument &doc);
@@ -0,0 +1,404 @@
+#include "Probes.h"
+#include "config.h"
+#include "Settings.h"
+#include <Preferences.h>
+#include <Adafruit_BME280.h>
+#include <OneWire.h>
+#include <DallasTemperature.h>
+
+Adafruit_BME280 bme;
+OneWire oneWire(ONE_WIRE_PIN);
+DallasTemperature oneWireBus(&oneWire);
+Preferences probePreferences;
+
+// Steinhart-Hart coefficients
+float A = 0.001129148;
+float B = 0.000234125;
+float C = 0.0000000876741;
+
+ProbeConfig probeConfigs[MAX_PROBES];
+float probeValues[MAX_PROBES];
+int probeCount = 0;
+int8_t probeRoles[ROLE_COUNT];
+
+bool bmeFound = false;
+unsigned long lastBmeAttempt = 0;
+
+// DS18B20s convert in parallel after one broadcast Convert T; the readings
+// are collected on the first update after the conversion time has passed
+bool conversionPending = false;
+unsigned long conversionStartedAt = 0;
+unsigned long conversionMillis = 750;
+
+// Bus work the web handlers ask for is done by updateProbes() on the loop
+// task, which owns the 1-Wire bus, between two conversions
+bool probeScanRequested = false;
+bool resolutionPending = false;
+int lastScanAdded = -1;  // -1 until the first requested scan has run
+
+static const char *const PROBE_TYPE_NAMES[] = {"ntc", "bme280", "ds18b20"};
+static const char *const PROBE_ROLE_NAMES[ROLE_COUNT] = {"regulation", "defrost", "fan", "display"};
+
+static bool hasProbeType(ProbeType type) {
+  for (int i = 0; i < probeCount; i++) {
+    if (probeConfigs[i].type == type) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static float readNTC(int pin) {
+  int adcValue = analogRead(pin);
+  if (adcValue <= 0 || adcValue >= ADC_MAX) {
+    return NAN;  // Open or shorted probe
+  }
+  float resistance = SERIES_RESISTOR / ((ADC_MAX / (float)adcValue) - 1);
+  float logR = log(resistance);
+  float temperature = 1.0 / (A + B * logR + C * logR * logR * logR);
+  return temperature - 273.15;  // Convert Kelvin to Celsius
+}
+
+static float readBME280() {
+  if (!bmeFound && millis() - lastBmeAttempt > 60000) {
+    lastBmeAttempt = millis();
+    bmeFound = bme.begin(0x76);
+  }
+  return bmeFound ? bme.readTemperature() : NAN;
+}
+
+static void startConversion() {
+  oneWireBus.requestTemperatures();  // Returns immediately, see setWaitForConversion
+  conversionStartedAt = millis();
+  conversionPending = true;
+}
+
+static void collectConversion() {
+  for (int i = 0; i < probeCount; i++) {
+    if (probeConfigs[i].type != PROBE_DS18B20) {
+      continue;
+    }
+    float temperature = oneWireBus.getTempC(probeConfigs[i].address);
+    probeValues[i] = temperature == DEVICE_DISCONNECTED_C ? NAN : temperature + probeConfigs[i].offset;
+  }
+  conversionPending = false;
+}
+
+static bool loadProbes() {
+  probePreferences.begin("probes", true);
+  int count = probePreferences.getUChar("count", 0);
+  bool loaded = count > 0 && count <= MAX_PROBES &&
+                probePreferences.getBytesLength("cfg") == count * sizeof(ProbeConfig);
+  if (loaded) {
+    probePreferences.getBytes("cfg", probeConfigs, count * sizeof(ProbeConfig));
+    probeCount = count;
+  }
+  probePreferences.end();
+  return loaded;
+}
+
+// First boot with the registry: P1 and P2 take over the thermostat and
+// evaporator probes together with their Ot/OE calibration
+static void migrateLegacyProbes() {
+  Preferences legacy;
+  legacy.begin("refrigCtrl", true);
+  probeConfigs[0] = {(uint8_t)(legacy.getBool("useBME280", false) ? PROBE_BME280 : PROBE_NTC),
+                     (uint8_t)NTC_PIN, {0}, legacy.getFloat("Ot", 0.0)};
+  probeConfigs[1] = {PROBE_NTC, (uint8_t)EVAP_SENSOR_PIN, {0}, legacy.getFloat("OE", 0.0)};
+  legacy.end();
+  probeCount = 2;
+
+  scanProbes();
+  saveProbes();
+  Serial.printf("Migrated to probe registry with %d probes\n", probeCount);
+}
+
+void setupProbes() {
+  oneWireBus.begin();
+  if (!loadProbes()) {
+    migrateLegacyProbes();
+  }
+
+  oneWireBus.setResolution(DS18B20_RESOLUTION);
+  oneWireBus.setWaitForConversion(false);
+  conversionMillis = oneWireBus.millisToWaitForConversion(DS18B20_RESOLUTION);
+
+  if (hasProbeType(PROBE_BME280)) {
+    bmeFound = bme.begin(0x76);
+    if (!bmeFound) {
+      Serial.println("Could not find a valid BME280 sensor, check wiring!");
+    }
+  }
+
+  for (int i = 0; i < MAX_PROBES; i++) {
+    probeValues[i] = NAN;
+  }
+  refreshProbeRoles();
+  if (hasProbeType(PROBE_DS18B20)) {
+    startConversion();
+  }
+}
+
+void updateProbes() {
+  if (conversionPending && millis() - conversionStartedAt >= conversionMillis) {
+    collectConversion();
+  }
+  if (!conversionPending && probeScanRequested) {
+    probeScanRequested = false;
+    lastScanAdded = scanProbes();
+    if (lastScanAdded > 0) {
+      saveProbes();
+    }
+    Serial.printf("Probe scan added %d probes\n", lastScanAdded);
+  }
+  if (!conversionPending && resolutionPending) {
+    resolutionPending = false;
+    oneWireBus.setResolution(DS18B20_RESOLUTION);
+  }
+  // Start the next conversion right away so it runs while the loop sleeps
+  if (!conversionPending && hasProbeType(PROBE_DS18B20)) {
+    startConversion();
+  }
+
+  for (int i = 0; i < probeCount; i++) {
+    const ProbeConfig &config = probeConfigs[i];
+    if (config.type == PROBE_NTC) {
+      probeValues[i] = readNTC(config.pin) + config.offset;
+    } else if (config.type == PROBE_BME280) {
+      probeValues[i] = readBME280() + config.offset;
+    }
+  }
+}
+
+// "P1".."Pn" selects a probe, anything else ("nP", "SET", ...) none
+static int8_t parseProbeSelection(const String &selection) {
+  if (selection.length() < 2 || selection[0] != 'P') {
+    return -1;
+  }
+  int index = selection.substring(1).toInt() - 1;
+  return index >= 0 && index < probeCount ? index : -1;
+}
+
+void refreshProbeRoles() {
+  probeRoles[ROLE_REGULATION] = parseProbeSelection(settings.rEP);
+  probeRoles[ROLE_DEFROST] = parseProbeSelection(settings.dFP);
+  probeRoles[ROLE_FAN] = parseProbeSelection(settings.FAP);
+  probeRoles[ROLE_DISPLAY] = parseProbeSelection(settings.Lod);
+}
+
+void saveProbes() {
+  probePreferences.begin("probes", false);
+  probePreferences.putBytes("cfg", probeConfigs, probeCount * sizeof(ProbeConfig));
+  probePreferences.putUChar("count", probeCount);
+  probePreferences.end();
+}
+
+void requestProbeScan() {
+  probeScanRequested = true;
+}
+
+// Appends DS18B20s found on the bus that are not registered yet
+int scanProbes() {
+  int added = 0;
+  DeviceAddress address;
+  int devices = oneWireBus.getDeviceCount();
+  for (int d = 0; d < devices && probeCount < MAX_PROBES; d++) {
+    if (!oneWireBus.getAddress(address, d)) {
+      continue;
+    }
+    bool known = false;
+    for (int i = 0; i < probeCount && !known; i++) {
+      known = probeConfigs[i].type == PROBE_DS18B20 && memcmp(probeConfigs[i].address, address, 8) == 0;
+    }
+    if (!known) {
+      ProbeConfig &config = probeConfigs[probeCount++];
+      config = {PROBE_DS18B20, 0, {0}, 0.0};
+      memcpy(config.address, address, 8);
+      added++;
+    }
+  }
+  if (added > 0) {
+    oneWireBus.setResolution(DS18B20_RESOLUTION);
+    refreshProbeRoles();
+  }
+  return added;
+}
+
+int getProbeCount() {
+  return probeCount;
+}
+
+float probeTemperature(int index) {
+  return index >= 0 && index < probeCount ? probeValues[index] : NAN;
+}
+
+float roleTemperature(ProbeRole role) {
+  if (useSimulatedTemperature) {
+    return simulatedTemperature;
+  }
+  return probeTemperature(probeRoles[role]);
+}
+
+bool hasRoleProbe(ProbeRole role) {
+  return probeRoles[role] >= 0;
+}
+
+ProbeType getProbeType(int index) {
+  return index >= 0 && index < probeCount ? (ProbeType)probeConfigs[index].type : PROBE_NTC;
+}
+
+void setProbeType(int index, ProbeType type) {
+  if (index < 0 || index >= probeCount || type == PROBE_DS18B20 || probeConfigs[index].type == PROBE_DS18B20) {
+    return;  // DS18B20s are only added by scanProbes or /update_probes
+  }
+  probeConfigs[index].type = type;
+  if (type == PROBE_NTC && probeConfigs[index].pin == 0) {
+    probeConfigs[index].pin = NTC_PIN;
+  }
+  if (type == PROBE_BME280 && !bmeFound) {
+    bmeFound = bme.begin(0x76);
+  }
+}
+
+float getProbeOffset(int index) {
+  return index >= 0 && index < probeCount ? probeConfigs[index].offset : 0.0;
+}
+
+void setProbeOffset(int index, float offset) {
+  if (index >= 0 && index < probeCount) {
+    probeConfigs[index].offset = offset;
+  }
+}
+
+void calibrateSensor(float temp1, float temp2, float temp3) {
+  int regulationProbe = probeRoles[ROLE_REGULATION];
+  int pin = regulationProbe >= 0 && probeConfigs[regulationProbe].type == PROBE_NTC
+              ? probeConfigs[regulationProbe].pin : NTC_PIN;
+
+  int adc1 = analogRead(pin);
+  delay(1000);
+  int adc2 = analogRead(pin);
+  delay(1000);
+  int adc3 = analogRead(pin);
+
+  float r1 = SERIES_RESISTOR / ((ADC_MAX / (float)adc1) - 1);
+  float r2 = SERIES_RESISTOR / ((ADC_MAX / (float)adc2) - 1);
+  float r3 = SERIES_RESISTOR / ((ADC_MAX / (float)adc3) - 1);
+
+  float t1 = temp1 + 273.15;
+  float t2 = temp2 + 273.15;
+  float t3 = temp3 + 273.15;
+
+  float L1 = log(r1);
+  float L2 = log(r2);
+  float L3 = log(r3);
+
+  float Y1 = 1.0 / t1;
+  float Y2 = 1.0 / t2;
+  float Y3 = 1.0 / t3;
+
+  float U2 = (Y2 - Y1) / (L2 - L1);
+  float U3 = (Y3 - Y1) / (L3 - L1);
+
+  C = (U3 - U2) / (L3 - L2) / (L1 + L2 + L3);
+  B = U2 - C * (L1 * L1 + L1 * L2 + L2 * L2);
+  A = Y1 - (B + L1 * L1 * C) * L1;
+}
+
+static String formatAddress(const uint8_t *address) {
+  char hex[17];
+  for (int i = 0; i < 8; i++) {
+    sprintf(hex + i * 2, "%02X", address[i]);
+  }
+  return String(hex);
+}
+
+static bool parseAddress(const char *hex, uint8_t *address) {
+  if (!hex || strlen(hex) != 16) {
+    return false;
+  }
+  for (int i = 0; i < 8; i++) {
+    char byte[3] = {hex[i * 2], hex[i * 2 + 1], 0};
+    char *end;
+    address[i] = strtoul(byte, &end, 16);
+    if (*end != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void fillProbesJSON(JsonDocument &doc) {
+  doc["conversionTime"] = conversionMillis;
+  doc["scanPending"] = probeScanRequested;
+  if (lastScanAdded >= 0) {
+    doc["lastScanAdded"] = lastScanAdded;
+  }
+  JsonArray list = doc["probes"].to<JsonArray>();
+  for (int i = 0; i < probeCount; i++) {
+    const ProbeConfig &config = probeConfigs[i];
+    JsonObject probe = list.add<JsonObject>();
+    probe["name"] = String("P") + (i + 1);
+    probe["type"] = PROBE_TYPE_NAMES[config.type];
+    if (config.type == PROBE_NTC) {
+      probe["pin"] = config.pin;
+    } else if (config.type == PROBE_DS18B20) {
+      probe["address"] = formatAddress(config.address);
+    }
+    probe["offset"] = config.offset;
+    if (!isnan(probeValues[i])) {
+      probe["temperature"] = probeValues[i];
+    }
+    JsonArray roles = probe["roles"].to<JsonArray>();
+    for (int r = 0; r < ROLE_COUNT; r++) {
+      if (probeRoles[r] == i) {
+        roles.add(PROBE_ROLE_NAMES[r]);
+      }
+    }
+  }
+}
+
+// Replaces the registry with {"probes": [{"type", "pin" | "address", "offset"}, ...]},
+// keeping the current configuration when any entry is invalid
+bool updateProbesFromJSON(JsonDocument &doc) {
+  JsonArray list = doc["probes"];
+  if (list.isNull() || list.size() == 0 || list.size() > MAX_PROBES) {
+    return false;
+  }
+
+  ProbeConfig configs[MAX_PROBES];
+  int count = 0;
+  for (JsonObject probe : list) {
+    ProbeConfig &config = configs[count++];
+    config = {PROBE_NTC, 0, {0}, probe["offset"] | 0.0f};
+    String type = probe["type"] | "";
+    if (type == "ntc") {
+      config.pin = probe["pin"] | 0;
+      if (config.pin == 0) {
+        return false;
+      }
+    } else if (type == "bme280") {
+      config.type = PROBE_BME280;
+    } else if (type == "ds18b20") {
+      config.type = PROBE_DS18B20;
+      if (!parseAddress(probe["address"], config.address)) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+
+  memcpy(probeConfigs, configs, count * sizeof(ProbeConfig));
+  probeCount = count;
+  for (int i = 0; i < MAX_PROBES; i++) {
+    probeValues[i] = NAN;
+  }
+  if (hasProbeType(PROBE_BME280) && !bmeFound) {
+    bmeFound = bme.begin(0x76);
+  }
+  resolutionPending = true;  // New DS18B20s get it before their first conversion
+  saveProbes();
+  refreshProbeRoles();
+  return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+enum ProbeType : uint8_t {
+  PROBE_NTC,
+  PROBE_BME280,
+  PROBE_DS18B20
+};
+
+// What a probe is used for; each role is assigned a probe ("P1".."Pn") by
+// the rEP, dFP, FAP and Lod settings
+enum ProbeRole : uint8_t {
+  ROLE_REGULATION,
+  ROLE_DEFROST,
+  ROLE_FAN,
+  ROLE_DISPLAY,
+  ROLE_COUNT
+};
+
+// Persistent part of a probe, stored as a blob in the "probes" namespace
+struct ProbeConfig {
+  uint8_t type;
+  uint8_t pin;         // ADC pin of an NTC
+  uint8_t address[8];  // ROM code of a DS18B20
+  float offset;        // Calibration, added to every reading
+};
+
+void setupProbes();
+void updateProbes();
+void refreshProbeRoles();
+void saveProbes();
+void requestProbeScan();  // Runs scanProbes() from the next updateProbes(), with the zones locked
+int scanProbes();          // Loop task only, it drives the 1-Wire bus
+
+int getProbeCount();
+float probeTemperature(int index);  // Including the offset, NAN while faulty
+float roleTemperature(ProbeRole role);  // NAN when no probe is assigned
+bool hasRoleProbe(ProbeRole role);      // The role's setting names a registered probe
+ProbeType getProbeType(int index);
+void setProbeType(int index, ProbeType type);
+float getProbeOffset(int index);
+void setProbeOffset(int index, float offset);
+
+void calibrateSensor(float temp1, float temp2, float temp3);
+
+void fillProbesJSON(JsonDocument &doc);
+bool updateProbesFromJSON(JsonDocument &doc);
@@ -0,0 +1,239 @@
+#include "ResponsePool.h"
+#include "config.h"
+#include <ESPAsyncWebServer.h>
+
+const char RESPONSE_SUCCESS[] PROGMEM = "{\"status\":\"success\"}";
+
+static const char *const ENDPOINT_NAMES[EP_COUNT] = {
+  "/temperature", "/alert_status", "/get_settings", "/data", "/data_since", "/stats", "/heap_stats", "/probes", "/mqtt_stats",
+  "/defrost_status", "/faults", "/zones", "/schedule"
+};
+
+struct ResponseSlot {
+  bool inUse;
+  ArenaAllocator allocator;
+  alignas(8) uint8_t arena[RESPONSE_ARENA_SIZE];
+  char output[RESPONSE_BUFFER_SIZE];
+};
+
+struct EndpointStats {
+  uint32_t requests;
+  uint32_t pooled;           // Served entirely from a pool slot
+  uint32_t fallbacks;        // Pool exhausted or skipped, arena overflowed or payload too large
+  uint32_t heapAllocations;  // Heap allocations made while building fallback documents
+  uint32_t bytes;
+  uint32_t lastLargestFreeBlock;
+  uint32_t minLargestFreeBlock;
+};
+
+ResponseSlot responseSlots[RESPONSE_POOL_SLOTS];
+EndpointStats endpointStats[EP_COUNT];
+portMUX_TYPE responsePoolMux = portMUX_INITIALIZER_UNLOCKED;
+
+static ResponseSlot *acquireSlot() {
+  ResponseSlot *slot = nullptr;
+  portENTER_CRITICAL(&responsePoolMux);
+  for (int i = 0; i < RESPONSE_POOL_SLOTS; i++) {
+    if (!responseSlots[i].inUse) {
+      slot = &responseSlots[i];
+      slot->inUse = true;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&responsePoolMux);
+  if (slot) {
+    slot->allocator.reset(slot->arena, sizeof(slot->arena));
+  }
+  return slot;
+}
+
+static void releaseSlot(ResponseSlot *slot) {
+  portENTER_CRITICAL(&responsePoolMux);
+  slot->inUse = false;
+  portEXIT_CRITICAL(&responsePoolMux);
+}
+
+// ---------------------------------------------------------------------------
+// Allocators
+
+// Every block is prefixed with its size so reallocate can copy
+static const size_t ARENA_HEADER_SIZE = 4;
+
+void ArenaAllocator::reset(uint8_t *arena, size_t capacity) {
+  this->arena = arena;
+  this->capacity = capacity;
+  used = 0;
+  last = nullptr;
+}
+
+void *ArenaAllocator::allocate(size_t size) {
+  size_t total = (size + ARENA_HEADER_SIZE + 3) & ~(size_t)3;
+  if (used + total > capacity) {
+    return nullptr;
+  }
+  uint8_t *block = arena + used;
+  *(uint32_t *)block = size;
+  used += total;
+  last = block;
+  return block + ARENA_HEADER_SIZE;
+}
+
+void ArenaAllocator::deallocate(void *pointer) {
+  // Only the newest block can be given back, the rest is reclaimed by reset()
+  if (pointer && (uint8_t *)pointer - ARENA_HEADER_SIZE == last) {
+    used = last - arena;
+    last = nullptr;
+  }
+}
+
+void *ArenaAllocator::reallocate(void *pointer, size_t newSize) {
+  if (!pointer) {
+    return allocate(newSize);
+  }
+  uint8_t *block = (uint8_t *)pointer - ARENA_HEADER_SIZE;
+  size_t oldSize = *(uint32_t *)block;
+
+  if (block == last) {
+    size_t total = (newSize + ARENA_HEADER_SIZE + 3) & ~(size_t)3;
+    if ((size_t)(block - arena) + total > capacity) {
+      return nullptr;
+    }
+    *(uint32_t *)block = newSize;
+    used = (block - arena) + total;
+    return pointer;
+  }
+  if (newSize <= oldSize) {
+    *(uint32_t *)block = newSize;
+    return pointer;
+  }
+  void *moved = allocate(newSize);
+  if (moved) {
+    memcpy(moved, pointer, oldSize);
+  }
+  return moved;
+}
+
+void *CountingHeapAllocator::allocate(size_t size) {
+  endpointStats[endpoint].heapAllocations++;
+  return malloc(size);
+}
+
+void CountingHeapAllocator::deallocate(void *pointer) {
+  free(pointer);
+}
+
+void *CountingHeapAllocator::reallocate(void *pointer, size_t newSize) {
+  endpointStats[endpoint].heapAllocations++;
+  return realloc(pointer, newSize);
+}
+
+// ---------------------------------------------------------------------------
+// Responses
+
+// Streams the serialized document out of its slot and returns the slot to
+// the pool once the server has sent it
+class PooledResponse : public AsyncAbstractResponse {
+public:
+  PooledResponse(ResponseSlot *slot, int code, size_t length) : slot(slot) {
+    _code = code;
+    _contentType = "application/json";
+    _contentLength = length;
+  }
+
+  ~PooledResponse() {
+    releaseSlot(slot);
+  }
+
+  bool _sourceValid() const override {
+    return true;
+  }
+
+  size_t _fillBuffer(uint8_t *data, size_t maxLen) override {
+    size_t length = min(maxLen, _contentLength - offset);
+    memcpy(data, slot->output + offset, length);
+    offset += length;
+    return length;
+  }
+
+private:
+  ResponseSlot *slot;
+  size_t offset = 0;
+};
+
+PooledDocument::PooledDocument(ResponseEndpoint endpoint, bool usePool)
+  : endpoint(endpoint),
+    slot(usePool ? acquireSlot() : nullptr),
+    heapAllocator(endpoint),
+    document(slot ? (ArduinoJson::Allocator *)&slot->allocator : &heapAllocator) {
+  EndpointStats &stats = endpointStats[endpoint];
+  stats.requests++;
+  stats.lastLargestFreeBlock = ESP.getMaxAllocHeap();
+  if (stats.minLargestFreeBlock == 0 || stats.lastLargestFreeBlock < stats.minLargestFreeBlock) {
+    stats.minLargestFreeBlock = stats.lastLargestFreeBlock;
+  }
+}
+
+PooledDocument::~PooledDocument() {
+  document.clear();  // Give the arena back before the slot
+  if (slot) {
+    releaseSlot(slot);
+  }
+}
+
+bool PooledDocument::send(AsyncWebServerRequest *request, int code) {
+  if (!slot || document.overflowed()) {
+    return false;
+  }
+  size_t length = serializeJson(document, slot->output, sizeof(slot->output));
+  if (length >= sizeof(slot->output)) {
+    return false;  // Truncated
+  }
+  document.clear();
+
+  EndpointStats &stats = endpointStats[endpoint];
+  stats.pooled++;
+  stats.bytes += length;
+  request->send(new PooledResponse(slot, code, length));
+  slot = nullptr;  // Owned by the response now
+  return true;
+}
+
+void sendHeapJsonResponse(AsyncWebServerRequest *request, ResponseEndpoint endpoint,
+                          JsonDocument &doc, int code) {
+  EndpointStats &stats = endpointStats[endpoint];
+  stats.fallbacks++;
+  String response;
+  serializeJson(doc, response);
+  stats.bytes += response.length();
+  request->send(code, "application/json", response);
+}
+
+void sendStaticJson(AsyncWebServerRequest *request, int code, const char *json) {
+  request->send_P(code, "application/json", json);
+}
+
+void fillHeapStatsJSON(JsonDocument &doc) {
+  doc["freeHeap"] = ESP.getFreeHeap();
+  doc["largestFreeBlock"] = ESP.getMaxAllocHeap();
+  doc["minFreeHeap"] = ESP.getMinFreeHeap();
+
+  int slotsInUse = 0;
+  for (int i = 0; i < RESPONSE_POOL_SLOTS; i++) {
+    slotsInUse += responseSlots[i].inUse ? 1 : 0;
+  }
+  doc["poolSlots"] = RESPONSE_POOL_SLOTS;
+  doc["poolSlotsInUse"] = slotsInUse;
+
+  JsonObject endpoints = doc["endpoints"].to<JsonObject>();
+  for (int i = 0; i < EP_COUNT; i++) {
+    const EndpointStats &stats = endpointStats[i];
+    JsonObject entry = endpoints[ENDPOINT_NAMES[i]].to<JsonObject>();
+    entry["requests"] = stats.requests;
+    entry["pooled"] = stats.pooled;
+    entry["fallbacks"] = stats.fallbacks;
+    entry["heapAllocations"] = stats.heapAllocations;
+    entry["bytes"] = stats.bytes;
+    entry["largestFreeBlock"] = stats.lastLargestFreeBlock;
+    entry["minLargestFreeBlock"] = stats.minLargestFreeBlock;
+  }
+}
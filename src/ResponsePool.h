@@ -0,0 +1,111 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+class AsyncWebServerRequest;
+
+// Endpoints with their own allocation counters in /heap_stats
+enum ResponseEndpoint : uint8_t {
+  EP_TEMPERATURE,
+  EP_ALERT_STATUS,
+  EP_GET_SETTINGS,
+  EP_DATA,
+  EP_DATA_SINCE,
+  EP_STATS,
+  EP_HEAP_STATS,
+  EP_PROBES,
+  EP_MQTT_STATS,
+  EP_DEFROST,
+  EP_FAULTS,
+  EP_ZONES,
+  EP_SCHEDULE,
+  EP_COUNT
+};
+
+// Constant payloads, sent straight from flash without a copy
+extern const char RESPONSE_SUCCESS[];
+
+struct ResponseSlot;
+
+// Bump allocator over a slot's arena, so building a JsonDocument never
+// touches the heap; allocations fail (and the document overflows) when full
+class ArenaAllocator : public ArduinoJson::Allocator {
+public:
+  void reset(uint8_t *arena, size_t capacity);
+  void *allocate(size_t size) override;
+  void deallocate(void *pointer) override;
+  void *reallocate(void *pointer, size_t newSize) override;
+
+private:
+  uint8_t *arena = nullptr;
+  size_t capacity = 0;
+  size_t used = 0;
+  uint8_t *last = nullptr;
+};
+
+// Heap allocator that counts allocations against an endpoint, used when a
+// response does not fit in a pool slot
+class CountingHeapAllocator : public ArduinoJson::Allocator {
+public:
+  explicit CountingHeapAllocator(ResponseEndpoint endpoint) : endpoint(endpoint) {}
+  void *allocate(size_t size) override;
+  void deallocate(void *pointer) override;
+  void *reallocate(void *pointer, size_t newSize) override;
+
+private:
+  ResponseEndpoint endpoint;
+};
+
+// A JsonDocument living in a pooled slot's arena. send() serializes it into
+// the slot's output buffer and hands the slot to a response that streams from
+// it; it returns false when no slot was free (or usePool is false), the arena
+// overflowed or the payload is larger than the output buffer.
+class PooledDocument {
+public:
+  explicit PooledDocument(ResponseEndpoint endpoint, bool usePool = true);
+  ~PooledDocument();
+
+  bool valid() const { return slot != nullptr; }
+  JsonDocument &doc() { return document; }
+  bool send(AsyncWebServerRequest *request, int code);
+
+private:
+  ResponseEndpoint endpoint;
+  ResponseSlot *slot;
+  CountingHeapAllocator heapAllocator;  // Only backs the document when no slot was free
+  JsonDocument document;
+};
+
+void sendHeapJsonResponse(AsyncWebServerRequest *request, ResponseEndpoint endpoint,
+                          JsonDocument &doc, int code);
+
+// Builds a JSON response with fill(JsonDocument &) in a pooled slot, and
+// builds it again on the heap if it does not fit:
+//
+//   sendJsonResponse(request, EP_TEMPERATURE, [](JsonDocument &doc) {
+//     doc["main"] = currentTemperature;
+//   });
+//
+// usePool = false goes to the heap directly, for responses known to be too
+// large for a slot.
+template <typename Fill>
+void sendJsonResponse(AsyncWebServerRequest *request, ResponseEndpoint endpoint, Fill fill, int code = 200,
+                      bool usePool = true) {
+  {
+    PooledDocument pooled(endpoint, usePool);
+    if (pooled.valid()) {
+      fill(pooled.doc());
+      if (pooled.send(request, code)) {
+        return;
+      }
+    }
+  }
+  CountingHeapAllocator allocator(endpoint);
+  JsonDocument doc(&allocator);
+  fill(doc);
+  sendHeapJsonResponse(request, endpoint, doc, code);
+}
+
+void sendStaticJson(AsyncWebServerRequest *request, int code, const char *json);
+void fillHeapStatsJSON(JsonDocument &doc);
@@ -0,0 +1,348 @@
+#include "Schedule.h"
+#include "Hardware.h"
+#include "EventJournal.h"
+#include <Preferences.h>
+#include <algorithm>
+
+const uint32_t SCHEDULE_WEEK_SECONDS = 7 * 86400UL;
+const uint16_t SCHEDULE_WEEK_MINUTES = 7 * 1440;
+
+static const char *const SCHEDULE_CLOCK_NAMES[] = {"none", "ntp", "monotonic"};
+static const char *const SCHEDULE_FAN_MODES[] = {"C_n", "O_n", "C_Y", "O_Y"};
+
+ScheduleProfile scheduleProfiles[SCHEDULE_MAX_PROFILES];
+ScheduleTransition scheduleTransitions[SCHEDULE_MAX_TRANSITIONS];  // Sorted by minute
+int scheduleProfileCount = 0;
+int scheduleTransitionCount = 0;
+bool scheduleEnabled = false;
+Preferences schedulePreferences;
+
+// The active profile and the interval it covers, until the next transition
+int activeProfile = -1;          // -1 = none, the settings apply unchanged
+time_t activeFrom = 0;
+time_t activeUntil = 0;
+ScheduleClock scheduleClock = SCHEDULE_CLOCK_NONE;
+
+// Wall clock while NTP has not synced: the last saved time advanced by millis()
+time_t fallbackTime = 0;         // 0 = never saved
+unsigned long fallbackMillis = 0;
+unsigned long lastClockSave = 0;
+bool clockSaved = false;
+
+static void saveSchedule() {
+  schedulePreferences.begin("schedule", false);
+  schedulePreferences.putBool("enabled", scheduleEnabled);
+  if (scheduleProfileCount > 0) {
+    schedulePreferences.putBytes("profiles", scheduleProfiles, scheduleProfileCount * sizeof(ScheduleProfile));
+  }
+  if (scheduleTransitionCount > 0) {
+    schedulePreferences.putBytes("transitions", scheduleTransitions, scheduleTransitionCount * sizeof(ScheduleTransition));
+  }
+  schedulePreferences.putUChar("nProfiles", scheduleProfileCount);
+  schedulePreferences.putUChar("nTransitions", scheduleTransitionCount);
+  schedulePreferences.end();
+}
+
+static void loadSchedule() {
+  schedulePreferences.begin("schedule", true);
+  scheduleEnabled = schedulePreferences.getBool("enabled", false);
+  scheduleProfileCount = min((int)schedulePreferences.getUChar("nProfiles", 0), SCHEDULE_MAX_PROFILES);
+  scheduleTransitionCount = min((int)schedulePreferences.getUChar("nTransitions", 0), SCHEDULE_MAX_TRANSITIONS);
+  size_t profileBytes = scheduleProfileCount * sizeof(ScheduleProfile);
+  size_t transitionBytes = scheduleTransitionCount * sizeof(ScheduleTransition);
+  if ((profileBytes && schedulePreferences.getBytes("profiles", scheduleProfiles, profileBytes) != profileBytes) ||
+      (transitionBytes && schedulePreferences.getBytes("transitions", scheduleTransitions, transitionBytes) != transitionBytes)) {
+    scheduleProfileCount = scheduleTransitionCount = 0;
+  }
+  fallbackTime = schedulePreferences.getUInt("clock", 0);
+  schedulePreferences.end();
+
+  for (int i = 0; i < scheduleTransitionCount; i++) {
+    if (scheduleTransitions[i].profile >= scheduleProfileCount || scheduleTransitions[i].minute >= SCHEDULE_WEEK_MINUTES) {
+      Serial.println("Error: Invalid schedule in NVS, schedule cleared");
+      scheduleProfileCount = scheduleTransitionCount = 0;
+      break;
+    }
+  }
+}
+
+static ScheduleClock readClock(time_t &now) {
+  unsigned long ms = millis();
+  unsigned long elapsed = ms - fallbackMillis;
+  fallbackMillis += elapsed / 1000 * 1000;
+  if (fallbackTime) {
+    fallbackTime += elapsed / 1000;
+  }
+
+  time_t wall = time(nullptr);
+  if (wall >= JOURNAL_MIN_VALID_TIME) {
+    fallbackTime = wall;
+    if (!clockSaved || ms - lastClockSave >= SCHEDULE_CLOCK_SAVE_INTERVAL) {
+      schedulePreferences.begin("schedule", false);
+      schedulePreferences.putUInt("clock", (uint32_t)wall);
+      schedulePreferences.end();
+      lastClockSave = ms;
+      clockSaved = true;
+    }
+    now = wall;
+    return SCHEDULE_CLOCK_NTP;
+  }
+  now = fallbackTime;
+  return fallbackTime ? SCHEDULE_CLOCK_MONOTONIC : SCHEDULE_CLOCK_NONE;
+}
+
+// The time readClock() would return, without advancing the fallback clock
+// or saving it; 0 without a clock
+static time_t peekClock() {
+  time_t wall = time(nullptr);
+  if (wall >= JOURNAL_MIN_VALID_TIME) {
+    return wall;
+  }
+  return fallbackTime ? fallbackTime + (time_t)((millis() - fallbackMillis) / 1000) : 0;
+}
+
+static void applyProfile(int profile) {
+  if (profile == activeProfile) {
+    return;
+  }
+  activeProfile = profile;
+  const ScheduleProfile *active = profile >= 0 ? &scheduleProfiles[profile] : nullptr;
+  scheduleSetpointOffset = active ? active->setpointOffset : 0;
+  scheduleHysteresis = active ? active->hysteresis : NAN;
+  scheduleFanMode = active ? active->fanMode : "";
+  scheduleDefrostAllowed = active ? active->defrostAllowed : true;
+  if (energySavingScheduled) {
+    if (active && active->energySaving) {
+      enterEnergySavingMode();
+    } else {
+      exitEnergySavingMode();
+    }
+  }
+  if (scheduleEnabled) {
+    Serial.printf("Schedule profile: %s\n", active ? active->name : "none");
+  }
+}
+
+// Monday 00:00 local time is 0
+static uint32_t secondOfWeek(time_t now) {
+  struct tm local;
+  localtime_r(&now, &local);
+  return ((local.tm_wday + 6) % 7) * 86400UL + local.tm_hour * 3600UL + local.tm_min * 60UL + local.tm_sec;
+}
+
+// Finds the transition in force at `now` and when the next one is due; runs
+// once per transition, and after the clock jumps
+static void locateTransition(time_t now) {
+  uint32_t second = secondOfWeek(now);
+  int index = scheduleTransitionCount - 1;  // Before the first transition of the week, the last one of the previous
+  for (int i = 0; i < scheduleTransitionCount && scheduleTransitions[i].minute * 60UL <= second; i++) {
+    index = i;
+  }
+  uint32_t next = scheduleTransitions[(index + 1) % scheduleTransitionCount].minute * 60UL;
+  uint32_t remaining = (next + SCHEDULE_WEEK_SECONDS - second) % SCHEDULE_WEEK_SECONDS;
+  activeFrom = now;
+  activeUntil = now + (remaining ? remaining : SCHEDULE_WEEK_SECONDS);
+  applyProfile(scheduleTransitions[index].profile);
+}
+
+void updateSchedule() {
+  if (!scheduleEnabled || scheduleTransitionCount == 0) {
+    return;
+  }
+  time_t now;
+  scheduleClock = readClock(now);
+  if (scheduleClock == SCHEDULE_CLOCK_NONE) {
+    applyProfile(-1);
+    return;
+  }
+  if (now < activeFrom || now >= activeUntil) {
+    locateTransition(now);
+  }
+}
+
+// Applies a changed schedule from scratch on the next update
+static void restartSchedule() {
+  if (energySavingScheduled && !scheduleEnabled) {
+    exitEnergySavingMode();
+  }
+  energySavingScheduled = scheduleEnabled;
+  activeProfile = -2;  // Forces the profile to be applied again
+  activeFrom = activeUntil = 0;
+  updateSchedule();
+  if (activeProfile == -2) {
+    applyProfile(-1);
+  }
+}
+
+void setupSchedule() {
+  fallbackMillis = millis();
+  loadSchedule();
+  restartSchedule();
+}
+
+static int findProfile(const ScheduleProfile *profiles, int count, const char *name) {
+  for (int i = 0; i < count; i++) {
+    if (strcmp(profiles[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static bool parseProfile(JsonObject item, ScheduleProfile &profile) {
+  memset(&profile, 0, sizeof(profile));
+  const char *name = item["name"] | "";
+  const char *fanMode = item["FnC"] | "";
+  if (!*name || strlen(name) >= SCHEDULE_NAME_SIZE) {
+    return false;
+  }
+  if (*fanMode && std::none_of(std::begin(SCHEDULE_FAN_MODES), std::end(SCHEDULE_FAN_MODES),
+                               [fanMode](const char *mode) { return strcmp(mode, fanMode) == 0; })) {
+    return false;
+  }
+  strcpy(profile.name, name);
+  strcpy(profile.fanMode, fanMode);
+  profile.setpointOffset = item["offset"] | 0.0f;
+  profile.hysteresis = item["Hy"] | NAN;
+  profile.defrostAllowed = item["defrost"] | true;
+  profile.energySaving = item["energySaving"] | false;
+  return true;
+}
+
+// "HH:MM"
+static bool parseMinuteOfDay(const char *text, uint16_t &minute) {
+  int hours, minutes;
+  char extra;
+  if (!text || sscanf(text, "%d:%d%c", &hours, &minutes, &extra) != 2 ||
+      hours < 0 || hours > 23 || minutes < 0 || minutes > 59) {
+    return false;
+  }
+  minute = hours * 60 + minutes;
+  return true;
+}
+
+// A day (0 = Monday), a list of days, or every day when left out
+static bool parseDays(JsonVariant value, uint8_t &days) {
+  if (value.isNull()) {
+    days = 0x7F;
+    return true;
+  }
+  days = 0;
+  if (value.is<JsonArray>()) {
+    for (JsonVariant day : value.as<JsonArray>()) {
+      if (!day.is<int>() || day.as<int>() < 0 || day.as<int>() > 6) {
+        return false;
+      }
+      days |= 1 << day.as<int>();
+    }
+  } else if (value.is<int>() && value.as<int>() >= 0 && value.as<int>() <= 6) {
+    days = 1 << value.as<int>();
+  }
+  return days != 0;
+}
+
+// {"enabled": true,
+//  "profiles": [{"name": "night", "offset": 2, "Hy": 3, "FnC": "C_n", "defrost": true, "energySaving": true}, ...],
+//  "transitions": [{"day": [0, 1, 2, 3, 4], "time": "22:00", "profile": "night"}, ...]}
+// Days count from 0 = Monday, a transition without a day repeats daily.
+// Profile fields left out keep the setting. Either key list may be left out
+// to keep it, but new profiles need their transitions.
+bool updateScheduleFromJSON(JsonDocument &doc) {
+  ScheduleProfile profiles[SCHEDULE_MAX_PROFILES];
+  ScheduleTransition transitions[SCHEDULE_MAX_TRANSITIONS];
+  int profileCount = scheduleProfileCount;
+  int transitionCount = scheduleTransitionCount;
+  memcpy(profiles, scheduleProfiles, sizeof(profiles));
+  memcpy(transitions, scheduleTransitions, sizeof(transitions));
+
+  JsonArray profileList = doc["profiles"];
+  JsonArray transitionList = doc["transitions"];
+  if (!profileList.isNull()) {
+    if (transitionList.isNull() || profileList.size() > SCHEDULE_MAX_PROFILES) {
+      return false;
+    }
+    profileCount = 0;
+    for (JsonObject item : profileList) {
+      if (!parseProfile(item, profiles[profileCount]) || findProfile(profiles, profileCount, profiles[profileCount].name) >= 0) {
+        return false;
+      }
+      profileCount++;
+    }
+  }
+
+  if (!transitionList.isNull()) {
+    transitionCount = 0;
+    for (JsonObject item : transitionList) {
+      int profile = findProfile(profiles, profileCount, item["profile"] | "");
+      uint8_t days;
+      uint16_t minute;
+      if (profile < 0 || !parseDays(item["day"], days) || !parseMinuteOfDay(item["time"].as<const char *>(), minute)) {
+        return false;
+      }
+      for (int day = 0; day < 7; day++) {
+        if (!(days & (1 << day))) {
+          continue;
+        }
+        if (transitionCount == SCHEDULE_MAX_TRANSITIONS) {
+          return false;
+        }
+        transitions[transitionCount++] = {(uint16_t)(day * 1440 + minute), (uint8_t)profile};
+      }
+    }
+    std::sort(transitions, transitions + transitionCount,
+              [](const ScheduleTransition &a, const ScheduleTransition &b) { return a.minute < b.minute; });
+    for (int i = 1; i < transitionCount; i++) {
+      if (transitions[i].minute == transitions[i - 1].minute) {
+        return false;
+      }
+    }
+  }
+
+  memcpy(scheduleProfiles, profiles, sizeof(profiles));
+  memcpy(scheduleTransitions, transitions, sizeof(transitions));
+  scheduleProfileCount = profileCount;
+  scheduleTransitionCount = transitionCount;
+  scheduleEnabled = doc["enabled"] | scheduleEnabled;
+  saveSchedule();
+  restartSchedule();
+  return true;
+}
+
+void fillScheduleJSON(JsonDocument &doc) {
+  doc["enabled"] = scheduleEnabled;
+  doc["clock"] = SCHEDULE_CLOCK_NAMES[scheduleClock];
+  if (activeProfile >= 0) {
+    doc["active"] = scheduleProfiles[activeProfile].name;
+    time_t now = peekClock();
+    if (now != 0 && now >= activeFrom && now < activeUntil) {
+      doc["nextChange"] = (uint32_t)(activeUntil - now);
+    }
+  }
+
+  JsonArray profiles = doc["profiles"].to<JsonArray>();
+  for (int i = 0; i < scheduleProfileCount; i++) {
+    const ScheduleProfile &profile = scheduleProfiles[i];
+    JsonObject item = profiles.add<JsonObject>();
+    item["name"] = profile.name;
+    item["offset"] = profile.setpointOffset;
+    if (!isnan(profile.hysteresis)) {
+      item["Hy"] = profile.hysteresis;
+    }
+    if (profile.fanMode[0]) {
+      item["FnC"] = profile.fanMode;
+    }
+    item["defrost"] = profile.defrostAllowed;
+    item["energySaving"] = profile.energySaving;
+  }
+
+  JsonArray transitions = doc["transitions"].to<JsonArray>();
+  for (int i = 0; i < scheduleTransitionCount; i++) {
+    const ScheduleTransition &transition = scheduleTransitions[i];
+    char timeText[6];
+    snprintf(timeText, sizeof(timeText), "%02d:%02d", transition.minute % 1440 / 60, transition.minute % 60);
+    JsonObject item = transitions.add<JsonObject>();
+    item["day"] = transition.minute / 1440;
+    item["time"] = timeText;
+    item["profile"] = scheduleProfiles[transition.profile].name;
+  }
+}
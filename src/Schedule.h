@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "config.h"
+
+// Weekly schedule of named settings profiles: a night set-back, a pre-cool
+// before deliveries, hours without defrost starts. A profile adjusts the
+// settings of every zone while it is active; transitions switch profiles at
+// a minute of the week in local time.
+//
+// The transitions are kept sorted, and the time the active profile ends is
+// precomputed when it starts, so updateSchedule() costs one comparison
+// until the next transition. Time comes from NTP; until NTP syncs after a
+// reboot, the last saved wall clock runs on with millis(). Without either
+// the schedule waits and the settings apply unchanged.
+//
+// While the schedule is enabled, energy saving follows the energySaving
+// flag of the active profile and the door input no longer toggles it.
+
+struct ScheduleProfile {
+  char name[SCHEDULE_NAME_SIZE];
+  float setpointOffset;   // K added to SEt
+  float hysteresis;       // Replaces Hy unless NAN
+  char fanMode[4];        // Replaces FnC unless empty
+  bool defrostAllowed;    // False holds defrost starts back, a running defrost finishes
+  bool energySaving;      // Energy saving mode (HES) while active
+};
+
+struct ScheduleTransition {
+  uint16_t minute;        // Minute of the week, 0 = Monday 00:00
+  uint8_t profile;
+};
+
+enum ScheduleClock : uint8_t {
+  SCHEDULE_CLOCK_NONE,
+  SCHEDULE_CLOCK_NTP,
+  SCHEDULE_CLOCK_MONOTONIC  // Saved wall clock advanced by millis()
+};
+
+void setupSchedule();
+void updateSchedule();   // Every loop, before the outputs are set
+void fillScheduleJSON(JsonDocument &doc);
+bool updateScheduleFromJSON(JsonDocument &doc);  // Validated, saved and applied
@@ -1,19 +1,19 @@
 #include "Settings.h"
+#include "Probes.h"
 #include <Preferences.h>
 
 Settings settings;
 Preferences preferences;
+const char *settingsNamespace = "refrigCtrl";
 
 void loadSettings() {
-  preferences.begin("refrigCtrl", true);
+  preferences.begin(settingsNamespace, true);
 
   settings.SEt = preferences.getFloat("SEt", -5.0);
   settings.Hy = preferences.getFloat("Hy", 2.0);
   settings.LS = preferences.getFloat("LS", -50.0);
   settings.US = preferences.getFloat("US", 110.0);
-  settings.Ot = preferences.getFloat("Ot", 0.0);
   settings.P2P = preferences.getString("P2P", "y");
-  settings.OE = preferences.getFloat("OE", 0.0);
   settings.OdS = preferences.getInt("OdS", 0);
   settings.AC = preferences.getInt("AC", 1);
   settings.CCt = preferences.getFloat("CCt", 0.0);
@@ -22,6 +22,7 @@ void loadSettings() {
   settings.COF = preferences.getInt("COF", 30);
   settings.CF = preferences.getString("CF", "C");
   settings.rES = preferences.getString("rES", "dE");
+  settings.rEP = preferences.getString("rEP", "P1");
   settings.Lod = preferences.getString("Lod", "P1");
   settings.tdF = preferences.getString("tdF", "EL");
   settings.dFP = preferences.getString("dFP", "P2");
@@ -46,21 +47,23 @@ void loadSettings() {
   settings.ALd = preferences.getInt("ALd", 15);
   settings.dAO = preferences.getFloat("dAO", 1.3);
   settings.HES = preferences.getFloat("HES", 0.0);
-  settings.useBME280 = preferences.getBool("useBME280", false);
+  settings.LdB = preferences.getFloat("LdB", 0.5);
+  settings.LMi = preferences.getInt("LMi", 15);
+  settings.dEM = preferences.getString("dEM", "n");
+  settings.IdM = preferences.getInt("IdM", 2);
+  settings.dFL = preferences.getFloat("dFL", 60.0);
 
   preferences.end();
 }
 
 void saveSettings() {
-  preferences.begin("refrigCtrl", false);
+  preferences.begin(settingsNamespace, false);
 
   preferences.putFloat("SEt", settings.SEt);
   preferences.putFloat("Hy", settings.Hy);
   preferences.putFloat("LS", settings.LS);
   preferences.putFloat("US", settings.US);
-  preferences.putFloat("Ot", settings.Ot);
   preferences.putString("P2P", settings.P2P);
-  preferences.putFloat("OE", settings.OE);
   preferences.putInt("OdS", settings.OdS);
   preferences.putInt("AC", settings.AC);
   preferences.putFloat("CCt", settings.CCt);
@@ -69,6 +72,7 @@ void saveSettings() {
   preferences.putInt("COF", settings.COF);
   preferences.putString("CF", settings.CF);
   preferences.putString("rES", settings.rES);
+  preferences.putString("rEP", settings.rEP);
   preferences.putString("Lod", settings.Lod);
   preferences.putString("tdF", settings.tdF);
   preferences.putString("dFP", settings.dFP);
@@ -93,7 +97,72 @@ void saveSettings() {
   preferences.putInt("ALd", settings.ALd);
   preferences.putFloat("dAO", settings.dAO);
   preferences.putFloat("HES", settings.HES);
-  preferences.putBool("useBME280", settings.useBME280);
+  preferences.putFloat("LdB", settings.LdB);
+  preferences.putInt("LMi", settings.LMi);
+  preferences.putString("dEM", settings.dEM);
+  preferences.putInt("IdM", settings.IdM);
+  preferences.putFloat("dFL", settings.dFL);
 
   preferences.end();
-}
\ No newline at end of file
+}
+
+bool validateSettings(const Settings &candidate, String &error) {
+  // A zero deadband records every sample, a zero interval every loop
+  if (!(candidate.LdB > 0)) {
+    error = "LdB must be greater than 0";
+    return false;
+  }
+  if (candidate.LMi < 1) {
+    error = "LMi must be at least 1 minute";
+    return false;
+  }
+  return true;
+}
+
+void fillSettingsJSON(JsonDocument &doc, bool includeProbes) {
+  doc["SEt"] = settings.SEt;
+  doc["Hy"] = settings.Hy;
+  doc["LS"] = settings.LS;
+  doc["US"] = settings.US;
+  if (includeProbes) doc["Ot"] = getProbeOffset(0);
+  doc["P2P"] = settings.P2P;
+  if (includeProbes) doc["OE"] = getProbeOffset(1);
+  doc["OdS"] = settings.OdS;
+  doc["AC"] = settings.AC;
+  doc["CCt"] = settings.CCt;
+  doc["CCS"] = settings.CCS;
+  doc["COn"] = settings.COn;
+  doc["COF"] = settings.COF;
+  doc["CF"] = settings.CF;
+  doc["rES"] = settings.rES;
+  doc["rEP"] = settings.rEP;
+  doc["Lod"] = settings.Lod;
+  doc["tdF"] = settings.tdF;
+  doc["dFP"] = settings.dFP;
+  doc["dtE"] = settings.dtE;
+  doc["IdF"] = settings.IdF;
+  doc["MdF"] = settings.MdF;
+  doc["dSd"] = settings.dSd;
+  doc["dFd"] = settings.dFd;
+  doc["dAd"] = settings.dAd;
+  doc["Fdt"] = settings.Fdt;
+  doc["dPo"] = settings.dPo;
+  doc["dAF"] = settings.dAF;
+  doc["FnC"] = settings.FnC;
+  doc["Fnd"] = settings.Fnd;
+  doc["Fct"] = settings.Fct;
+  doc["FSt"] = settings.FSt;
+  doc["FAP"] = settings.FAP;
+  doc["ALC"] = settings.ALC;
+  doc["ALU"] = settings.ALU;
+  doc["ALL"] = settings.ALL;
+  doc["AFH"] = settings.AFH;
+  doc["ALd"] = settings.ALd;
+  doc["dAO"] = settings.dAO;
+  if (includeProbes) doc["useBME280"] = getProbeType(0) == PROBE_BME280;
+  doc["LdB"] = settings.LdB;
+  doc["LMi"] = settings.LMi;
+  doc["dEM"] = settings.dEM;
+  doc["IdM"] = settings.IdM;
+  doc["dFL"] = settings.dFL;
+}
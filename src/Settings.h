@@ -1,15 +1,14 @@
 #pragma once
 
 #include <Arduino.h>
+#include <ArduinoJson.h>
 
 struct Settings {
   float SEt;  // Set Point
   float Hy;   // Differential
   float LS;   // Minimum Set Point
   float US;   // Maximum Set Point
-  float Ot;   // Thermostat Probe Calibration
   String P2P; // Evaporator Probe Presence
-  float OE;   // Evaporator Probe Calibration
   int OdS;    // Outputs Activation Delay at Start Up
   int AC;     // Anti-short Cycle Delay
   float CCt;  // Continuous Cycle Duration
@@ -18,6 +17,7 @@ struct Settings {
   int COF;    // Compressor OFF Time with Faulty Probe
   String CF;  // Temperature Measurement Unit
   String rES; // Resolution
+  String rEP; // Probe Selection for Regulation
   String Lod; // Probe Displayed
   String tdF; // Defrost Type
   String dFP; // Probe Selection for Defrost Termination
@@ -41,11 +41,22 @@ struct Settings {
   float AFH;  // Differential for Temperature Alarm Recovery
   int ALd;    // Temperature Alarm Delay
   float dAO;  // Delay of Temperature Alarm at Start Up
-  bool useBME280; // Use BME280 sensor instead of NTC
   float HES; // Temperature Increase during Energy Saving cycle
+  float LdB;  // Temperature Deadband for Event Journal
+  int LMi;    // Maximum Interval Between Journal Temperature Records
+  String dEM; // Demand Defrost (IdF becomes the maximum interval)
+  int IdM;    // Minimum Interval Between Demand Defrosts
+  float dFL;  // Frost Level Starting a Demand Defrost
 };
 
 extern Settings settings;
+// NVS namespace loadSettings() and saveSettings() use, one per zone
+extern const char *settingsNamespace;
 
 void loadSettings();
-void saveSettings();
\ No newline at end of file
+void saveSettings();
+// Checks settings before they are applied, error says what is wrong
+bool validateSettings(const Settings &candidate, String &error);
+// includeProbes adds Ot, OE and useBME280, which configure probes P1/P2 and
+// only belong to zone 0
+void fillSettingsJSON(JsonDocument &doc, bool includeProbes);
\ No newline at end of file
@@ -0,0 +1,200 @@
+#include "Statistics.h"
+#include "config.h"
+#include "Settings.h"
+#include "Hardware.h"
+
+// Each window is a ring of STATS_BUCKETS fixed-width buckets. A sample only
+// touches the current bucket of every window, a query folds the buckets that
+// are still inside the window.
+struct StatsBucket {
+  unsigned long id;          // Bucket number (millis() / bucket width), identifies stale slots
+  float cabinetMin;
+  float cabinetMax;
+  double cabinetSum;
+  float evaporatorMin;
+  float evaporatorMax;
+  double evaporatorSum;
+  uint32_t samples;
+  uint16_t cabinetInvalid;   // Samples without a reading (probe fault), left out of min/max/mean
+  uint32_t evaporatorSamples;  // Samples taken with an evaporator probe (P2P = y)
+  uint16_t evaporatorInvalid;
+  uint32_t observedMillis;
+  uint32_t compressorOnMillis;
+  uint32_t alarmMillis;
+  uint16_t compressorStarts;
+  uint16_t onCycles;         // Completed ON periods
+  uint32_t onCycleMillis;
+  uint16_t offCycles;        // Completed OFF periods
+  uint32_t offCycleMillis;
+  uint16_t defrosts;         // Completed defrosts
+  uint32_t defrostMillis;
+};
+
+StatsBucket statsBuckets[STATS_WINDOW_COUNT][STATS_BUCKETS];
+unsigned long statsBucketWidth[STATS_WINDOW_COUNT];
+
+unsigned long lastStatsUpdate = 0;
+bool lastStatsCompressorOn = false;
+bool lastStatsDefrostOn = false;
+unsigned long compressorStateSince = 0;
+bool compressorStateKnown = false;    // The first period after boot has no known start
+unsigned long defrostStartedAt = 0;
+
+static void resetBucket(StatsBucket &bucket, unsigned long id) {
+  memset(&bucket, 0, sizeof(bucket));
+  bucket.id = id;
+  bucket.cabinetMin = bucket.evaporatorMin = INFINITY;
+  bucket.cabinetMax = bucket.evaporatorMax = -INFINITY;
+}
+
+void setupStatistics() {
+  for (int w = 0; w < STATS_WINDOW_COUNT; w++) {
+    statsBucketWidth[w] = STATS_WINDOW_MINUTES[w] * 60000UL / STATS_BUCKETS;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      resetBucket(statsBuckets[w][b], ULONG_MAX);
+    }
+  }
+  lastStatsUpdate = millis();
+}
+
+void updateStatistics() {
+  unsigned long now = millis();
+  uint32_t elapsed = now - lastStatsUpdate;
+  lastStatsUpdate = now;
+
+  bool compressorStarted = isCompressorOn && !lastStatsCompressorOn;
+  bool compressorStopped = !isCompressorOn && lastStatsCompressorOn;
+  bool defrostEnded = !isDefrostOn && lastStatsDefrostOn;
+  uint32_t periodMillis = now - compressorStateSince;
+  bool hasEvaporator = settings.P2P == "y";
+
+  for (int w = 0; w < STATS_WINDOW_COUNT; w++) {
+    unsigned long id = now / statsBucketWidth[w];
+    StatsBucket &bucket = statsBuckets[w][id % STATS_BUCKETS];
+    if (bucket.id != id) {
+      resetBucket(bucket, id);
+    }
+
+    bucket.samples++;
+    if (isnan(currentTemperature)) {
+      bucket.cabinetInvalid++;
+    } else {
+      bucket.cabinetSum += currentTemperature;
+      bucket.cabinetMin = min(bucket.cabinetMin, currentTemperature);
+      bucket.cabinetMax = max(bucket.cabinetMax, currentTemperature);
+    }
+    if (hasEvaporator) {
+      bucket.evaporatorSamples++;
+      if (isnan(evaporatorTemperature)) {
+        bucket.evaporatorInvalid++;
+      } else {
+        bucket.evaporatorSum += evaporatorTemperature;
+        bucket.evaporatorMin = min(bucket.evaporatorMin, evaporatorTemperature);
+        bucket.evaporatorMax = max(bucket.evaporatorMax, evaporatorTemperature);
+      }
+    }
+
+    // The interval since the last update is attributed to the previous state
+    bucket.observedMillis += elapsed;
+    if (lastStatsCompressorOn) bucket.compressorOnMillis += elapsed;
+    if (highTempAlert || lowTempAlert) bucket.alarmMillis += elapsed;
+
+    if (compressorStarted) {
+      bucket.compressorStarts++;
+      if (compressorStateKnown) {
+        bucket.offCycles++;
+        bucket.offCycleMillis += periodMillis;
+      }
+    } else if (compressorStopped && compressorStateKnown) {
+      bucket.onCycles++;
+      bucket.onCycleMillis += periodMillis;
+    }
+    if (defrostEnded) {
+      bucket.defrosts++;
+      bucket.defrostMillis += now - defrostStartedAt;
+    }
+  }
+
+  if (compressorStarted || compressorStopped) {
+    compressorStateKnown = true;
+    compressorStateSince = now;
+  }
+  if (isDefrostOn && !lastStatsDefrostOn) {
+    defrostStartedAt = now;
+  }
+  lastStatsCompressorOn = isCompressorOn;
+  lastStatsDefrostOn = isDefrostOn;
+}
+
+static void fillTemperatureJSON(JsonObject object, float minimum, float maximum, double sum,
+                                uint32_t samples, uint32_t invalid) {
+  if (invalid > 0) {
+    object["invalidSamples"] = invalid;
+  }
+  if (samples <= invalid) {
+    return;
+  }
+  object["min"] = minimum;
+  object["max"] = maximum;
+  object["mean"] = sum / (samples - invalid);
+}
+
+void fillStatisticsJSON(JsonDocument &doc) {
+  JsonArray windows = doc["windows"].to<JsonArray>();
+  unsigned long now = millis();
+  bool hasEvaporator = settings.P2P == "y";
+
+  for (int w = 0; w < STATS_WINDOW_COUNT; w++) {
+    unsigned long currentId = now / statsBucketWidth[w];
+    StatsBucket total;
+    resetBucket(total, currentId);
+    uint32_t cabinetInvalid = 0;  // The bucket's 16-bit counters could overflow in a sum
+    uint32_t evaporatorInvalid = 0;
+
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      const StatsBucket &bucket = statsBuckets[w][b];
+      if (bucket.id > currentId || currentId - bucket.id >= (unsigned long)STATS_BUCKETS) {
+        continue;  // Never used or fell out of the window
+      }
+      total.cabinetMin = min(total.cabinetMin, bucket.cabinetMin);
+      total.cabinetMax = max(total.cabinetMax, bucket.cabinetMax);
+      total.cabinetSum += bucket.cabinetSum;
+      total.evaporatorMin = min(total.evaporatorMin, bucket.evaporatorMin);
+      total.evaporatorMax = max(total.evaporatorMax, bucket.evaporatorMax);
+      total.evaporatorSum += bucket.evaporatorSum;
+      total.samples += bucket.samples;
+      total.evaporatorSamples += bucket.evaporatorSamples;
+      cabinetInvalid += bucket.cabinetInvalid;
+      evaporatorInvalid += bucket.evaporatorInvalid;
+      total.observedMillis += bucket.observedMillis;
+      total.compressorOnMillis += bucket.compressorOnMillis;
+      total.alarmMillis += bucket.alarmMillis;
+      total.compressorStarts += bucket.compressorStarts;
+      total.onCycles += bucket.onCycles;
+      total.onCycleMillis += bucket.onCycleMillis;
+      total.offCycles += bucket.offCycles;
+      total.offCycleMillis += bucket.offCycleMillis;
+      total.defrosts += bucket.defrosts;
+      total.defrostMillis += bucket.defrostMillis;
+    }
+
+    JsonObject window = windows.add<JsonObject>();
+    window["minutes"] = STATS_WINDOW_MINUTES[w];
+    window["coverage"] = total.observedMillis / 1000;
+    fillTemperatureJSON(window["cabinet"].to<JsonObject>(), total.cabinetMin, total.cabinetMax,
+                        total.cabinetSum, total.samples, cabinetInvalid);
+    if (hasEvaporator) {
+      fillTemperatureJSON(window["evaporator"].to<JsonObject>(), total.evaporatorMin, total.evaporatorMax,
+                          total.evaporatorSum, total.evaporatorSamples, evaporatorInvalid);
+    }
+
+    double observedHours = total.observedMillis / 3600000.0;
+    window["compressorDuty"] = total.observedMillis ? (double)total.compressorOnMillis / total.observedMillis : 0.0;
+    window["compressorStartsPerHour"] = observedHours > 0 ? total.compressorStarts / observedHours : 0.0;
+    window["meanOnTime"] = total.onCycles ? total.onCycleMillis / 1000.0 / total.onCycles : 0.0;
+    window["meanOffTime"] = total.offCycles ? total.offCycleMillis / 1000.0 / total.offCycles : 0.0;
+    window["defrosts"] = total.defrosts;
+    window["meanDefrostDuration"] = total.defrosts ? total.defrostMillis / 1000.0 / total.defrosts : 0.0;
+    window["alarmTime"] = total.alarmMillis / 1000;
+  }
+}
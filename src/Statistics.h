@@ -0,0 +1,8 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+void setupStatistics();
+void updateStatistics();
+void fillStatisticsJSON(JsonDocument &doc);
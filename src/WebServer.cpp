@@ -4,11 +4,38 @@
 #include <SPIFFS.h>
 #include "Settings.h"
 #include "Hardware.h"
+#include "Probes.h"
 #include "DataLogger.h"
+#include "EventJournal.h"
+#include "LogArchive.h"
+#include "Statistics.h"
+#include "ResponsePool.h"
+#include "MqttPublisher.h"
+#include "Defrost.h"
+#include "FaultDetector.h"
+#include "Zones.h"
+#include "Schedule.h"
 #include "config.h"
 
 AsyncWebServer server(80);
 
+// Runs handler(zone) with the zone of the "zone" parameter (0 without one)
+// swapped into the globals and the control loop held off
+template <typename Handler>
+static void withZone(AsyncWebServerRequest *request, Handler handler) {
+  int zone = request->hasParam("zone") ? request->getParam("zone")->value().toInt() : 0;
+  if (zone < 0 || zone >= getZoneCount()) {
+    request->send(400, "text/plain", "Invalid zone");
+    return;
+  }
+  ZoneScope scope(zone);
+  if (!scope.locked()) {
+    request->send(503, "text/plain", "Controller busy");
+    return;
+  }
+  handler(zone);
+}
+
 void setupWebServer() {
   // Serve the main page
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
@@ -17,14 +44,9 @@ void setupWebServer() {
 
   // Get current temperature
   server.on("/temperature", HTTP_GET, [](AsyncWebServerRequest *request) {
-    JsonDocument doc;
-    doc["main"] = currentTemperature;
-    if (settings.P2P == "y") {
-      doc["evaporator"] = evaporatorTemperature;
-    }
-    String response;
-    serializeJson(doc, response);
-    request->send(200, "application/json", response);
+    withZone(request, [request](int) {
+      sendJsonResponse(request, EP_TEMPERATURE, fillCurrentTemperatureJSON);
+    });
   });
 
   // Serve the parameters page
@@ -47,6 +69,11 @@ void setupWebServer() {
       float temp2 = doc["temp2"];
       float temp3 = doc["temp3"];
       
+      ZoneScope scope(0);
+      if (!scope.locked()) {
+        request->send(503, "text/plain", "Controller busy");
+        return;
+      }
       calibrateSensor(temp1, temp2, temp3);
       
       request->send(200, "text/plain", "Calibration complete");
@@ -57,7 +84,7 @@ void setupWebServer() {
 
   // Get latest data
   server.on("/data", HTTP_GET, [](AsyncWebServerRequest *request) {
-    request->send(200, "application/json", getLatestDataJSON());
+    sendJsonResponse(request, EP_DATA, fillLatestDataJSON);
   });
 
   // Get data for a specific time range
@@ -71,19 +98,234 @@ void setupWebServer() {
     }
   });
 
+  // Get the samples logged after a sequence cursor
+  server.on("/data_since", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (!request->hasParam("seq")) {
+      request->send(400, "text/plain", "Missing seq parameter");
+      return;
+    }
+    uint32_t sequence = strtoul(request->getParam("seq")->value().c_str(), nullptr, 10);
+    int maxRecords = DATA_SINCE_MAX_RECORDS;
+    if (request->hasParam("max")) {
+      maxRecords = constrain(request->getParam("max")->value().toInt(), 1, DATA_SINCE_MAX_RECORDS);
+    }
+    sendDataSince(request, sequence, maxRecords);
+  });
+
+  // Get history in the compact binary format (see writeDataBinary), falls back
+  // to JSON when the client only accepts JSON
+  server.on("/data_bin", HTTP_GET, [](AsyncWebServerRequest *request) {
+    unsigned long startTime = request->hasParam("start") ? request->getParam("start")->value().toInt() : 0;
+    unsigned long endTime = request->hasParam("end") ? request->getParam("end")->value().toInt() : ULONG_MAX;
+    bool includeEvaporator;
+    if (request->hasParam("evap")) {
+      includeEvaporator = request->getParam("evap")->value() == "1";
+    } else {
+      ZoneScope scope(0);
+      if (!scope.locked()) {
+        request->send(503, "text/plain", "Controller busy");
+        return;
+      }
+      includeEvaporator = settings.P2P == "y";
+    }
+
+    String accept = request->hasHeader("Accept") ? request->getHeader("Accept")->value() : "*/*";
+    bool acceptsBinary = accept.indexOf("application/octet-stream") >= 0 || accept.indexOf("*/*") >= 0;
+
+    unsigned long encodeStart = micros();
+    if (!acceptsBinary && accept.indexOf("application/json") >= 0) {
+      AsyncWebServerResponse *response = request->beginResponse(200, "application/json", getDataJSON(startTime, endTime));
+      response->addHeader("X-Encode-Time-us", String(micros() - encodeStart));
+      response->addHeader("Vary", "Accept");
+      request->send(response);
+      return;
+    }
+
+    AsyncResponseStream *response = request->beginResponseStream("application/octet-stream");
+    writeDataBinary(*response, startTime, endTime, includeEvaporator);
+    response->addHeader("X-Encode-Time-us", String(micros() - encodeStart));
+    response->addHeader("Vary", "Accept");
+    request->send(response);
+  });
+
+  // Get the journaled state transitions and run-time statistics for a time range
+  server.on("/events", HTTP_GET, [](AsyncWebServerRequest *request) {
+    unsigned long startTime = request->hasParam("start") ? request->getParam("start")->value().toInt() : 0;
+    unsigned long endTime = request->hasParam("end") ? request->getParam("end")->value().toInt() : ULONG_MAX;
+    sendEvents(request, startTime, endTime);
+  });
+
+  // Get the sliding-window statistics, answered from precomputed accumulators
+  server.on("/stats", HTTP_GET, [](AsyncWebServerRequest *request) {
+    ZoneScope scope(0);
+    if (!scope.locked()) {
+      request->send(503, "text/plain", "Controller busy");
+      return;
+    }
+    sendJsonResponse(request, EP_STATS, fillStatisticsJSON);
+  });
+
+  // Get heap fragmentation and per-endpoint response allocation counters
+  server.on("/heap_stats", HTTP_GET, [](AsyncWebServerRequest *request) {
+    sendJsonResponse(request, EP_HEAP_STATS, fillHeapStatsJSON);
+  });
+
+  // Get the probe registry with the latest readings and the role assignments of a zone
+  server.on("/probes", HTTP_GET, [](AsyncWebServerRequest *request) {
+    withZone(request, [request](int) {
+      sendJsonResponse(request, EP_PROBES, fillProbesJSON);
+    });
+  });
+
+  // Replace the probe registry
+  server.on("/update_probes", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
+    [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+      JsonDocument doc;
+      DeserializationError error = deserializeJson(doc, data, len);
+
+      if (error) {
+        request->send(400, "text/plain", "Invalid JSON");
+        return;
+      }
+
+      ZoneScope scope(0);
+      if (!scope.locked()) {
+        request->send(503, "text/plain", "Controller busy");
+      } else if (updateProbesFromJSON(doc)) {
+        sendStaticJson(request, 200, RESPONSE_SUCCESS);
+      } else {
+        request->send(400, "application/json", "{\"status\":\"error\",\"message\":\"Invalid probe configuration\"}");
+      }
+    }
+  );
+
+  // Register DS18B20s found on the 1-Wire bus. The control loop runs the
+  // scan, /probes shows scanPending and then lastScanAdded
+  server.on("/scan_probes", HTTP_POST, [](AsyncWebServerRequest *request) {
+    ZoneScope scope(0);
+    if (!scope.locked()) {
+      request->send(503, "text/plain", "Controller busy");
+      return;
+    }
+    requestProbeScan();
+    request->send(202, "text/plain", "Probe scan requested");
+  });
+
+  // Get MQTT connection, queue and throughput counters
+  server.on("/mqtt_stats", HTTP_GET, [](AsyncWebServerRequest *request) {
+    sendJsonResponse(request, EP_MQTT_STATS, fillMqttStatsJSON);
+  });
+
+  // Get the defrost schedule and frost estimate
+  server.on("/defrost_status", HTTP_GET, [](AsyncWebServerRequest *request) {
+    withZone(request, [request](int) {
+      sendJsonResponse(request, EP_DEFROST, fillDefrostJSON);
+    });
+  });
+
   // Get alert status
   server.on("/alert_status", HTTP_GET, [](AsyncWebServerRequest *request) {
-    JsonDocument doc;
-    doc["highTemp"] = highTempAlert;
-    doc["lowTemp"] = lowTempAlert;
-    String response;
-    serializeJson(doc, response);
-    request->send(200, "application/json", response);
+    withZone(request, [request](int) {
+      sendJsonResponse(request, EP_ALERT_STATUS, fillAlertStatusJSON);
+    });
+  });
+
+  // Get the fault detector findings and the trends behind them
+  server.on("/faults", HTTP_GET, [](AsyncWebServerRequest *request) {
+    withZone(request, [request](int) {
+      sendJsonResponse(request, EP_FAULTS, fillFaultsJSON);
+    });
+  });
+
+  // Get the state, start staggering and control time of every zone
+  server.on("/zones", HTTP_GET, [](AsyncWebServerRequest *request) {
+    ZoneScope scope(0);
+    if (!scope.locked()) {
+      request->send(503, "text/plain", "Controller busy");
+      return;
+    }
+    sendJsonResponse(request, EP_ZONES, fillZonesJSON);
+  });
+
+  // Set the number of zones
+  server.on("/update_zones", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
+    [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+      JsonDocument doc;
+      DeserializationError error = deserializeJson(doc, data, len);
+
+      if (error || !doc["count"].is<int>()) {
+        request->send(400, "text/plain", "Invalid JSON");
+        return;
+      }
+
+      ZoneScope scope(0);
+      String message;
+      if (!scope.locked()) {
+        request->send(503, "text/plain", "Controller busy");
+      } else if (setZoneCount(doc["count"], message)) {
+        sendStaticJson(request, 200, RESPONSE_SUCCESS);
+      } else {
+        JsonDocument response;
+        response["status"] = "error";
+        response["message"] = message;
+        String body;
+        serializeJson(response, body);
+        request->send(400, "application/json", body);
+      }
+    }
+  );
+
+  // Get the history of a zone, one sample every ZONE_HISTORY_INTERVAL
+  server.on("/zone_history", HTTP_GET, [](AsyncWebServerRequest *request) {
+    unsigned long startTime = request->hasParam("start") ? request->getParam("start")->value().toInt() : 0;
+    unsigned long endTime = request->hasParam("end") ? request->getParam("end")->value().toInt() : ULONG_MAX;
+    withZone(request, [request, startTime, endTime](int zone) {
+      AsyncResponseStream *response = request->beginResponseStream("application/json");
+      writeZoneHistoryJSON(*response, zone, startTime, endTime);
+      request->send(response);
+    });
   });
 
-  // Download log file
+  // Get the weekly schedule, its profiles and the active one
+  server.on("/schedule", HTTP_GET, [](AsyncWebServerRequest *request) {
+    ZoneScope scope(0);
+    if (!scope.locked()) {
+      request->send(503, "text/plain", "Controller busy");
+      return;
+    }
+    sendJsonResponse(request, EP_SCHEDULE, fillScheduleJSON);
+  });
+
+  // Replace the schedule profiles and transitions, or enable/disable the schedule
+  server.on("/update_schedule", HTTP_POST, [](AsyncWebServerRequest *request) {}, NULL,
+    [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+      JsonDocument doc;
+      DeserializationError error = deserializeJson(doc, data, len);
+
+      if (error) {
+        request->send(400, "text/plain", "Invalid JSON");
+        return;
+      }
+
+      ZoneScope scope(0);
+      if (!scope.locked()) {
+        request->send(503, "text/plain", "Controller busy");
+      } else if (updateScheduleFromJSON(doc)) {
+        sendStaticJson(request, 200, RESPONSE_SUCCESS);
+      } else {
+        request->send(400, "application/json", "{\"status\":\"error\",\"message\":\"Invalid schedule\"}");
+      }
+    }
+  );
+
+  // Download log file, served gzip-encoded from the compressed segments
   server.on("/download_log", HTTP_GET, [](AsyncWebServerRequest *request) {
-    request->send(SPIFFS, DATA_FILE, "text/csv", true);
+    sendLogDownload(request);
+  });
+
+  // Get log compression statistics
+  server.on("/archive_stats", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(200, "application/json", getArchiveStatsJSON());
   });
 
   // Simulate temperature
@@ -97,10 +339,13 @@ void setupWebServer() {
         return;
       }
       
-      if (doc.containsKey("temperature")) {
+      ZoneScope scope(0);
+      if (!scope.locked()) {
+        request->send(503, "text/plain", "Controller busy");
+      } else if (doc.containsKey("temperature")) {
         simulatedTemperature = doc["temperature"];
         useSimulatedTemperature = true;
-        request->send(200, "application/json", "{\"status\":\"success\"}");
+        sendStaticJson(request, 200, RESPONSE_SUCCESS);
       } else {
         request->send(400, "application/json", "{\"status\":\"error\",\"message\":\"Missing temperature value\"}");
       }
@@ -118,104 +363,97 @@ void setupWebServer() {
         return;
       }
       
-      if (doc.containsKey("SEt")) settings.SEt = doc["SEt"];
-      if (doc.containsKey("Hy")) settings.Hy = doc["Hy"];
-      if (doc.containsKey("LS")) settings.LS = doc["LS"];
-      if (doc.containsKey("US")) settings.US = doc["US"];
-      if (doc.containsKey("Ot")) settings.Ot = doc["Ot"];
-      if (doc.containsKey("P2P")) settings.P2P = doc["P2P"].as<String>();
-      if (doc.containsKey("OE")) settings.OE = doc["OE"];
-      if (doc.containsKey("OdS")) settings.OdS = doc["OdS"];
-      if (doc.containsKey("AC")) settings.AC = doc["AC"];
-      if (doc.containsKey("CCt")) settings.CCt = doc["CCt"];
-      if (doc.containsKey("CCS")) settings.CCS = doc["CCS"];
-      if (doc.containsKey("COn")) settings.COn = doc["COn"];
-      if (doc.containsKey("COF")) settings.COF = doc["COF"];
-      if (doc.containsKey("CF")) settings.CF = doc["CF"].as<String>();
-      if (doc.containsKey("rES")) settings.rES = doc["rES"].as<String>();
-      if (doc.containsKey("Lod")) settings.Lod = doc["Lod"].as<String>();
-      if (doc.containsKey("tdF")) settings.tdF = doc["tdF"].as<String>();
-      if (doc.containsKey("dFP")) settings.dFP = doc["dFP"].as<String>();
-      if (doc.containsKey("dtE")) settings.dtE = doc["dtE"];
-      if (doc.containsKey("IdF")) settings.IdF = doc["IdF"];
-      if (doc.containsKey("MdF")) settings.MdF = doc["MdF"];
-      if (doc.containsKey("dSd")) settings.dSd = doc["dSd"];
-      if (doc.containsKey("dFd")) settings.dFd = doc["dFd"].as<String>();
-      if (doc.containsKey("dAd")) settings.dAd = doc["dAd"];
-      if (doc.containsKey("Fdt")) settings.Fdt = doc["Fdt"];
-      if (doc.containsKey("dPo")) settings.dPo = doc["dPo"].as<String>();
-      if (doc.containsKey("dAF")) settings.dAF = doc["dAF"];
-      if (doc.containsKey("FnC")) settings.FnC = doc["FnC"].as<String>();
-      if (doc.containsKey("Fnd")) settings.Fnd = doc["Fnd"];
-      if (doc.containsKey("Fct")) settings.Fct = doc["Fct"];
-      if (doc.containsKey("FSt")) settings.FSt = doc["FSt"];
-      if (doc.containsKey("FAP")) settings.FAP = doc["FAP"].as<String>();
-      if (doc.containsKey("ALC")) settings.ALC = doc["ALC"].as<String>();
-      if (doc.containsKey("ALU")) settings.ALU = doc["ALU"];
-      if (doc.containsKey("ALL")) settings.ALL = doc["ALL"];
-      if (doc.containsKey("AFH")) settings.AFH = doc["AFH"];
-      if (doc.containsKey("ALd")) settings.ALd = doc["ALd"];
-      if (doc.containsKey("dAO")) settings.dAO = doc["dAO"];
-      if (doc.containsKey("useBME280")) settings.useBME280 = doc["useBME280"];
-
-      saveSettings();
-      request->send(200, "application/json", "{\"status\":\"success\"}");
+      withZone(request, [request, &doc](int zone) {
+        // Applied to a copy first, so a rejected update changes nothing
+        Settings updated = settings;
+        if (doc.containsKey("SEt")) updated.SEt = doc["SEt"];
+        if (doc.containsKey("Hy")) updated.Hy = doc["Hy"];
+        if (doc.containsKey("LS")) updated.LS = doc["LS"];
+        if (doc.containsKey("US")) updated.US = doc["US"];
+        if (doc.containsKey("P2P")) updated.P2P = doc["P2P"].as<String>();
+        if (doc.containsKey("OdS")) updated.OdS = doc["OdS"];
+        if (doc.containsKey("AC")) updated.AC = doc["AC"];
+        if (doc.containsKey("CCt")) updated.CCt = doc["CCt"];
+        if (doc.containsKey("CCS")) updated.CCS = doc["CCS"];
+        if (doc.containsKey("COn")) updated.COn = doc["COn"];
+        if (doc.containsKey("COF")) updated.COF = doc["COF"];
+        if (doc.containsKey("CF")) updated.CF = doc["CF"].as<String>();
+        if (doc.containsKey("rES")) updated.rES = doc["rES"].as<String>();
+        if (doc.containsKey("rEP")) updated.rEP = doc["rEP"].as<String>();
+        if (doc.containsKey("Lod")) updated.Lod = doc["Lod"].as<String>();
+        if (doc.containsKey("tdF")) updated.tdF = doc["tdF"].as<String>();
+        if (doc.containsKey("dFP")) updated.dFP = doc["dFP"].as<String>();
+        if (doc.containsKey("dtE")) updated.dtE = doc["dtE"];
+        if (doc.containsKey("IdF")) updated.IdF = doc["IdF"];
+        if (doc.containsKey("MdF")) updated.MdF = doc["MdF"];
+        if (doc.containsKey("dSd")) updated.dSd = doc["dSd"];
+        if (doc.containsKey("dFd")) updated.dFd = doc["dFd"].as<String>();
+        if (doc.containsKey("dAd")) updated.dAd = doc["dAd"];
+        if (doc.containsKey("Fdt")) updated.Fdt = doc["Fdt"];
+        if (doc.containsKey("dPo")) updated.dPo = doc["dPo"].as<String>();
+        if (doc.containsKey("dAF")) updated.dAF = doc["dAF"];
+        if (doc.containsKey("FnC")) updated.FnC = doc["FnC"].as<String>();
+        if (doc.containsKey("Fnd")) updated.Fnd = doc["Fnd"];
+        if (doc.containsKey("Fct")) updated.Fct = doc["Fct"];
+        if (doc.containsKey("FSt")) updated.FSt = doc["FSt"];
+        if (doc.containsKey("FAP")) updated.FAP = doc["FAP"].as<String>();
+        if (doc.containsKey("ALC")) updated.ALC = doc["ALC"].as<String>();
+        if (doc.containsKey("ALU")) updated.ALU = doc["ALU"];
+        if (doc.containsKey("ALL")) updated.ALL = doc["ALL"];
+        if (doc.containsKey("AFH")) updated.AFH = doc["AFH"];
+        if (doc.containsKey("ALd")) updated.ALd = doc["ALd"];
+        if (doc.containsKey("dAO")) updated.dAO = doc["dAO"];
+        if (doc.containsKey("LdB")) updated.LdB = doc["LdB"];
+        if (doc.containsKey("LMi")) updated.LMi = doc["LMi"];
+        if (doc.containsKey("dEM")) updated.dEM = doc["dEM"].as<String>();
+        if (doc.containsKey("IdM")) updated.IdM = doc["IdM"];
+        if (doc.containsKey("dFL")) updated.dFL = doc["dFL"];
+
+        String message;
+        if (!validateSettings(updated, message)) {
+          JsonDocument response;
+          response["status"] = "error";
+          response["message"] = message;
+          String body;
+          serializeJson(response, body);
+          request->send(400, "application/json", body);
+          return;
+        }
+        settings = updated;
+        if (zone == 0 && doc.containsKey("Ot")) setProbeOffset(0, doc["Ot"]);
+        if (zone == 0 && doc.containsKey("OE")) setProbeOffset(1, doc["OE"]);
+        if (zone == 0 && doc.containsKey("useBME280")) setProbeType(0, doc["useBME280"].as<bool>() ? PROBE_BME280 : PROBE_NTC);
+
+        saveSettings();
+        if (zone == 0) {
+          saveProbes();
+        }
+        refreshProbeRoles();
+        sendStaticJson(request, 200, RESPONSE_SUCCESS);
+      });
     }
   );
 
   // Get current settings
   server.on("/get_settings", HTTP_GET, [](AsyncWebServerRequest *request) {
-    JsonDocument doc;
-    doc["SEt"] = settings.SEt;
-    doc["Hy"] = settings.Hy;
-    doc["LS"] = settings.LS;
-    doc["US"] = settings.US;
-    doc["Ot"] = settings.Ot;
-    doc["P2P"] = settings.P2P;
-    doc["OE"] = settings.OE;
-    doc["OdS"] = settings.OdS;
-    doc["AC"] = settings.AC;
-    doc["CCt"] = settings.CCt;
-    doc["CCS"] = settings.CCS;
-    doc["COn"] = settings.COn;
-    doc["COF"] = settings.COF;
-    doc["CF"] = settings.CF;
-    doc["rES"] = settings.rES;
-    doc["Lod"] = settings.Lod;
-    doc["tdF"] = settings.tdF;
-    doc["dFP"] = settings.dFP;
-    doc["dtE"] = settings.dtE;
-    doc["IdF"] = settings.IdF;
-    doc["MdF"] = settings.MdF;
-    doc["dSd"] = settings.dSd;
-    doc["dFd"] = settings.dFd;
-    doc["dAd"] = settings.dAd;
-    doc["Fdt"] = settings.Fdt;
-    doc["dPo"] = settings.dPo;
-    doc["dAF"] = settings.dAF;
-    doc["FnC"] = settings.FnC;
-    doc["Fnd"] = settings.Fnd;
-    doc["Fct"] = settings.Fct;
-    doc["FSt"] = settings.FSt;
-    doc["FAP"] = settings.FAP;
-    doc["ALC"] = settings.ALC;
-    doc["ALU"] = settings.ALU;
-    doc["ALL"] = settings.ALL;
-    doc["AFH"] = settings.AFH;
-    doc["ALd"] = settings.ALd;
-    doc["dAO"] = settings.dAO;
-    doc["useBME280"] = settings.useBME280;
-
-    String response;
-    serializeJson(doc, response);
-    request->send(200, "application/json", response);
+    withZone(request, [request](int zone) {
+      sendJsonResponse(request, EP_GET_SETTINGS, [zone](JsonDocument &doc) {
+        fillSettingsJSON(doc, zone == 0);
+      });
+    });
   });
 
   // Toggle sensor type
   server.on("/toggle_sensor", HTTP_POST, [](AsyncWebServerRequest *request) {
-    settings.useBME280 = !settings.useBME280;
-    saveSettings();
-    String response = settings.useBME280 ? "Using BME280" : "Using NTC";
+    ZoneScope scope(0);
+    if (!scope.locked()) {
+      request->send(503, "text/plain", "Controller busy");
+      return;
+    }
+    bool useBME280 = getProbeType(0) != PROBE_BME280;
+    setProbeType(0, useBME280 ? PROBE_BME280 : PROBE_NTC);
+    saveProbes();
+    String response = getProbeType(0) == PROBE_BME280 ? "Using BME280" : "Using NTC";
     request->send(200, "text/plain", response);
   });
 
@@ -0,0 +1,377 @@
+#include "Zones.h"
+#include "config.h"
+#include "Settings.h"
+#include "Hardware.h"
+#include "Probes.h"
+#include "Defrost.h"
+#include "FaultDetector.h"
+#include "DataLogger.h"
+#include <Preferences.h>
+#include <utility>
+
+const unsigned long ZONE_LOCK_TIMEOUT_MS = 1000;  // Web requests give up after this
+const float ZONE_COST_ALPHA = 0.1;                // Moving average of the control time
+
+// Control state of a zone while another zone is in the globals
+struct ZoneContext {
+  Settings settings;
+  float currentTemperature = 0;
+  float evaporatorTemperature = 0;
+  bool isCompressorOn = false;
+  unsigned long compressorSwitchTime = 0;
+  bool isFanOn = false;
+  bool isDefrostOn = false;
+  bool isDefrosting = false;
+  bool isDraining = false;
+  unsigned long lastDefrostTime = 0;
+  unsigned long drainingStartTime = 0;
+  bool highTempAlert = false;
+  bool lowTempAlert = false;
+  bool probeFailureAlert = false;
+  uint8_t faultFlags = 0;
+  DefrostState defrost;
+  FaultDetectorState detector;
+};
+
+struct __attribute__((packed)) ZoneSample {
+  uint32_t time;        // Epoch seconds
+  int16_t temperature;  // 0.1 degC, INT16_MIN when invalid
+  int16_t evaporator;
+  uint8_t states;       // ZONE_STATE_* bits
+};
+
+// Kept per zone whichever zone is in the globals
+struct ZoneStats {
+  uint32_t compressorStarts;
+  uint32_t deferredLoops;      // Loops a compressor start or a defrost was held back
+  float controlMicros;         // Moving average of one control pass
+  uint32_t maxControlMicros;
+  unsigned long lastHistorySample;
+  int historyIndex;
+  int historyCount;
+  ZoneSample history[ZONE_HISTORY_SIZE];
+};
+
+ZoneContext zoneContexts[MAX_ZONES];
+ZoneStats zoneStats[MAX_ZONES];
+char zoneNamespaces[MAX_ZONES][12];
+int zoneCount = 1;
+int activeZone = 0;
+int lastStartZone = -1;         // Zone of the last compressor start, -1 = none yet
+unsigned long lastZoneStart = 0;
+float zonesControlMicros = 0;   // All zones of one loop
+SemaphoreHandle_t zoneMutex = nullptr;
+
+static void swapGlobals(ZoneContext &context) {
+  std::swap(settings, context.settings);
+  std::swap(currentTemperature, context.currentTemperature);
+  std::swap(evaporatorTemperature, context.evaporatorTemperature);
+  std::swap(isCompressorOn, context.isCompressorOn);
+  std::swap(compressorSwitchTime, context.compressorSwitchTime);
+  std::swap(isFanOn, context.isFanOn);
+  std::swap(isDefrostOn, context.isDefrostOn);
+  std::swap(isDefrosting, context.isDefrosting);
+  std::swap(isDraining, context.isDraining);
+  std::swap(lastDefrostTime, context.lastDefrostTime);
+  std::swap(drainingStartTime, context.drainingStartTime);
+  std::swap(highTempAlert, context.highTempAlert);
+  std::swap(lowTempAlert, context.lowTempAlert);
+  std::swap(probeFailureAlert, context.probeFailureAlert);
+  std::swap(faultFlags, context.faultFlags);
+  std::swap(defrost, context.defrost);
+  std::swap(detector, context.detector);
+}
+
+// The globals of the active zone go to its slot, the slot of `zone` (holding
+// whatever the previous swap left there) takes the place of the globals
+static void switchZone(int zone) {
+  if (zone == activeZone) {
+    return;
+  }
+  swapGlobals(zoneContexts[activeZone]);
+  swapGlobals(zoneContexts[zone]);
+  activeZone = zone;
+  zonePins = &ZONE_PINS[zone];
+  settingsNamespace = zoneNamespaces[zone];
+  refreshProbeRoles();
+}
+
+static bool hasSavedSettings(const char *name) {
+  Preferences saved;
+  bool found = saved.begin(name, true) && saved.isKey("SEt");
+  saved.end();
+  return found;
+}
+
+// Outputs off and control state as after boot. A zone without saved
+// settings regulates on P(2n+1) and terminates defrost on P(2n+2). Fails,
+// with the outputs left off, when those probes are not registered.
+static bool initZone(int zone, String &error) {
+  const ZonePins &pins = ZONE_PINS[zone];
+  pinMode(pins.compressor, OUTPUT);
+  pinMode(pins.defrost, OUTPUT);
+  pinMode(pins.fan, OUTPUT);
+  pinMode(pins.door, INPUT_PULLUP);
+  digitalWrite(pins.compressor, LOW);
+  digitalWrite(pins.defrost, LOW);
+  digitalWrite(pins.fan, LOW);
+
+  zoneContexts[zone] = ZoneContext();
+  memset(&zoneStats[zone], 0, sizeof(ZoneStats));
+
+  int previous = activeZone;
+  switchZone(zone);
+  loadSettings();
+  if (!hasSavedSettings(settingsNamespace)) {
+    settings.rEP = settings.Lod = String("P") + (2 * zone + 1);
+    settings.dFP = settings.FAP = String("P") + (2 * zone + 2);
+    saveSettings();
+  }
+  refreshProbeRoles();
+
+  bool probesFound = true;
+  if (!hasRoleProbe(ROLE_REGULATION)) {
+    error = String("Zone ") + zone + ": regulation probe rEP=" + settings.rEP + " is not registered";
+    probesFound = false;
+  } else if (settings.P2P == "y" && !hasRoleProbe(ROLE_DEFROST)) {
+    error = String("Zone ") + zone + ": defrost probe dFP=" + settings.dFP + " is not registered";
+    probesFound = false;
+  } else {
+    resetDefrost();
+    setupFaultDetector();
+  }
+  switchZone(previous);
+  return probesFound;
+}
+
+void setupZones() {
+  zoneMutex = xSemaphoreCreateMutex();
+  snprintf(zoneNamespaces[0], sizeof(zoneNamespaces[0]), "%s", settingsNamespace);
+  for (int zone = 1; zone < MAX_ZONES; zone++) {
+    snprintf(zoneNamespaces[zone], sizeof(zoneNamespaces[zone]), "zone%d", zone);
+  }
+
+  Preferences zonePreferences;
+  zonePreferences.begin("zones", true);
+  zoneCount = constrain((int)zonePreferences.getUChar("count", 1), 1, MAX_ZONES);
+  zonePreferences.end();
+
+  // Zones are numbered without gaps, the first one that fails ends the list
+  for (int zone = 1; zone < zoneCount; zone++) {
+    String error;
+    if (!initZone(zone, error)) {
+      Serial.printf("Error: %s, zone not controlled\n", error.c_str());
+      zoneCount = zone;
+    }
+  }
+  Serial.printf("Controlling %d zone(s)\n", zoneCount);
+}
+
+int getZoneCount() {
+  return zoneCount;
+}
+
+bool setZoneCount(int count, String &error) {
+  if (count < 1 || count > MAX_ZONES) {
+    error = "Invalid zone count";
+    return false;
+  }
+  for (int zone = zoneCount; zone < count; zone++) {
+    if (!initZone(zone, error)) {
+      return false;  // Nothing changed yet, the zones stay as they were
+    }
+  }
+  for (int zone = count; zone < zoneCount; zone++) {
+    digitalWrite(ZONE_PINS[zone].compressor, LOW);
+    digitalWrite(ZONE_PINS[zone].defrost, LOW);
+    digitalWrite(ZONE_PINS[zone].fan, LOW);
+  }
+  zoneCount = count;
+
+  Preferences zonePreferences;
+  zonePreferences.begin("zones", false);
+  zonePreferences.putUChar("count", zoneCount);
+  zonePreferences.end();
+  return true;
+}
+
+static bool otherZoneDefrosting(int zone) {
+  for (int other = 0; other < zoneCount; other++) {
+    if (other != zone && (zoneContexts[other].isDefrostOn || zoneContexts[other].isDraining)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void controlZone(int zone) {
+  currentTemperature = readTemperature(false);
+  if (zone > 0) {
+    Serial.printf("Zone %d: ", zone);
+  }
+  Serial.printf("Current temperature: %.2f\n", currentTemperature);
+
+  if (settings.P2P == "y") {
+    evaporatorTemperature = readTemperature(true);
+    Serial.printf("Evaporator temperature: %.2f\n", evaporatorTemperature);
+  }
+
+  checkAlerts(currentTemperature);
+  controlCompressor();
+  handleDefrost();
+  controlFan();
+  updateFaultDetector();
+}
+
+static void recordHistory(ZoneStats &stats, unsigned long now) {
+  if (stats.historyCount > 0 && now - stats.lastHistorySample < ZONE_HISTORY_INTERVAL) {
+    return;
+  }
+  stats.lastHistorySample = now;
+
+  uint8_t states = 0;
+  if (isCompressorOn) states |= ZONE_STATE_COMPRESSOR;
+  if (isDefrostOn) states |= ZONE_STATE_DEFROST;
+  if (isDraining) states |= ZONE_STATE_DRAINING;
+  if (isFanOn) states |= ZONE_STATE_FAN;
+  if (highTempAlert) states |= ZONE_STATE_HIGH_ALARM;
+  if (lowTempAlert) states |= ZONE_STATE_LOW_ALARM;
+  if (digitalRead(zonePins->door) == LOW) states |= ZONE_STATE_DOOR_OPEN;
+  if (faultFlags) states |= ZONE_STATE_FAULT;
+
+  ZoneSample sample = {(uint32_t)time(nullptr), packTemperature(currentTemperature),
+                       packTemperature(settings.P2P == "y" ? evaporatorTemperature : NAN), states};
+  stats.history[stats.historyIndex] = sample;
+  stats.historyIndex = (stats.historyIndex + 1) % ZONE_HISTORY_SIZE;
+  if (stats.historyCount < ZONE_HISTORY_SIZE) {
+    stats.historyCount++;
+  }
+}
+
+void controlZones() {
+  unsigned long loopStart = micros();
+
+  // Zone 0 last, so the globals hold it again afterwards
+  for (int i = 1; i <= zoneCount; i++) {
+    int zone = i % zoneCount;
+    ZoneStats &stats = zoneStats[zone];
+    switchZone(zone);
+
+    unsigned long now = millis();
+    compressorStartAllowed = lastStartZone < 0 || lastStartZone == zone || now - lastZoneStart >= ZONE_START_STAGGER;
+    defrostStartAllowed = !otherZoneDefrosting(zone);
+    startDeferred = false;
+    bool wasCompressorOn = isCompressorOn;
+
+    unsigned long start = micros();
+    controlZone(zone);
+    uint32_t elapsed = micros() - start;
+    stats.controlMicros = stats.controlMicros == 0 ? elapsed : stats.controlMicros + ZONE_COST_ALPHA * (elapsed - stats.controlMicros);
+    stats.maxControlMicros = max(stats.maxControlMicros, elapsed);
+
+    if (isCompressorOn && !wasCompressorOn) {
+      lastStartZone = zone;
+      lastZoneStart = now;
+      stats.compressorStarts++;
+    }
+    if (startDeferred) {
+      stats.deferredLoops++;
+    }
+    recordHistory(stats, now);
+  }
+  compressorStartAllowed = defrostStartAllowed = true;
+
+  uint32_t elapsed = micros() - loopStart;
+  zonesControlMicros = zonesControlMicros == 0 ? elapsed : zonesControlMicros + ZONE_COST_ALPHA * (elapsed - zonesControlMicros);
+}
+
+void lockZones() {
+  xSemaphoreTake(zoneMutex, portMAX_DELAY);
+}
+
+void unlockZones() {
+  xSemaphoreGive(zoneMutex);
+}
+
+ZoneScope::ZoneScope(int zone) : zone(zone) {
+  isLocked = xSemaphoreTake(zoneMutex, pdMS_TO_TICKS(ZONE_LOCK_TIMEOUT_MS)) == pdTRUE;
+  if (isLocked) {
+    switchZone(zone);
+  }
+}
+
+ZoneScope::~ZoneScope() {
+  if (isLocked) {
+    switchZone(0);
+    xSemaphoreGive(zoneMutex);
+  }
+}
+
+// Every zone is swapped in once; call with the zones locked
+void fillZonesJSON(JsonDocument &doc) {
+  int previous = activeZone;
+  doc["count"] = zoneCount;
+  doc["max"] = MAX_ZONES;
+  doc["staggerSeconds"] = ZONE_START_STAGGER / 1000;
+  if (lastStartZone >= 0) {
+    doc["lastStartZone"] = lastStartZone;
+    doc["sinceLastStart"] = (millis() - lastZoneStart) / 1000;
+  }
+  doc["controlMicros"] = lroundf(zonesControlMicros);
+
+  JsonArray zones = doc["zones"].to<JsonArray>();
+  for (int zone = 0; zone < zoneCount; zone++) {
+    switchZone(zone);
+    const ZoneStats &stats = zoneStats[zone];
+    JsonObject entry = zones.add<JsonObject>();
+    entry["zone"] = zone;
+    entry["temperature"] = currentTemperature;
+    if (settings.P2P == "y") {
+      entry["evaporator"] = evaporatorTemperature;
+    }
+    entry["setpoint"] = settings.SEt;
+    entry["compressor"] = isCompressorOn;
+    entry["defrost"] = isDefrostOn;
+    entry["draining"] = isDraining;
+    entry["fan"] = isFanOn;
+    entry["door"] = digitalRead(zonePins->door) == LOW;
+    entry["highTemp"] = highTempAlert;
+    entry["lowTemp"] = lowTempAlert;
+    entry["probeFailure"] = probeFailureAlert;
+    fillFaultNamesJSON(entry["faults"].to<JsonArray>(), faultFlags);
+    entry["frostLevel"] = round(getFrostLevel() * 10) / 10.0;
+    entry["compressorStarts"] = stats.compressorStarts;
+    entry["deferredLoops"] = stats.deferredLoops;
+    entry["controlMicros"] = lroundf(stats.controlMicros);
+    entry["maxControlMicros"] = stats.maxControlMicros;
+  }
+  switchZone(previous);
+}
+
+static void writeHistoryTemperature(Print &out, int16_t value) {
+  if (value == INT16_MIN) {
+    out.print("null");
+  } else {
+    out.printf("%.1f", value / 10.0);
+  }
+}
+
+// Oldest sample first, streamed so the 24 hours of a zone need no document
+void writeZoneHistoryJSON(Print &out, int zone, unsigned long startTime, unsigned long endTime) {
+  const ZoneStats &stats = zoneStats[zone];
+  bool first = true;
+  out.print("[");
+  for (int i = 0; i < stats.historyCount; i++) {
+    ZoneSample sample = stats.history[(stats.historyIndex - stats.historyCount + i + ZONE_HISTORY_SIZE) % ZONE_HISTORY_SIZE];
+    if (sample.time < startTime || sample.time > endTime) {
+      continue;
+    }
+    out.printf("%s{\"time\":%lu,\"temp\":", first ? "" : ",", (unsigned long)sample.time);
+    writeHistoryTemperature(out, sample.temperature);
+    out.print(",\"evaporator\":");
+    writeHistoryTemperature(out, sample.evaporator);
+    out.printf(",\"states\":%u}", sample.states);
+    first = false;
+  }
+  out.print("]");
+}
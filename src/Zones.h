@@ -0,0 +1,60 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Several independent cabinets on one controller. Each zone has its own
+// relays and door contact (ZONE_PINS), its own settings in the NVS namespace
+// of the zone, and its own alarms, defrost scheduler and fault detector.
+// Probes are shared: the rEP, dFP, FAP and Lod settings of a zone pick them
+// from the probe registry.
+//
+// The control modules work on the globals (settings, currentTemperature,
+// isCompressorOn, defrost, detector, ...). Zone 0 lives there; controlZones()
+// swaps every other zone in, runs the control sequence on it and swaps zone 0
+// back, so outside the zone lock the globals always hold zone 0.
+//
+// The zones share one supply: a compressor start waits until ZONE_START_STAGGER
+// has passed since the last start of any zone, and only one zone defrosts
+// (or drains) at a time. A held back start is retried every loop.
+
+// State bits of a zone history sample
+enum ZoneStateBit : uint8_t {
+  ZONE_STATE_COMPRESSOR = 1 << 0,
+  ZONE_STATE_DEFROST = 1 << 1,
+  ZONE_STATE_DRAINING = 1 << 2,
+  ZONE_STATE_FAN = 1 << 3,
+  ZONE_STATE_HIGH_ALARM = 1 << 4,
+  ZONE_STATE_LOW_ALARM = 1 << 5,
+  ZONE_STATE_DOOR_OPEN = 1 << 6,
+  ZONE_STATE_FAULT = 1 << 7
+};
+
+void setupZones();
+void controlZones();       // Every loop, with the zones locked
+int getZoneCount();
+// Saved; the outputs of removed zones are switched off. Fails with a message
+// in `error` when the count is out of range or an added zone's rEP (or dFP,
+// with P2P = y) probe is not in the probe registry.
+bool setZoneCount(int count, String &error);
+
+// The loop holds the lock while it controls the zones and while other
+// modules read the zone 0 globals
+void lockZones();
+void unlockZones();
+
+// Locks the zones for a web request and swaps the requested zone into the
+// globals until it goes out of scope; check locked() before touching them
+class ZoneScope {
+public:
+  explicit ZoneScope(int zone);
+  ~ZoneScope();
+  bool locked() const { return isLocked; }
+
+private:
+  int zone;
+  bool isLocked;
+};
+
+void fillZonesJSON(JsonDocument &doc);
+void writeZoneHistoryJSON(Print &out, int zone, unsigned long startTime, unsigned long endTime);
@@ -17,6 +17,19 @@ const int COMPRESSOR_RELAY_PIN = 16;
 const int DEFROST_RELAY_PIN = 17;
 const int FAN_RELAY_PIN = 18;
 const int DOOR_SENSOR_PIN = 19;
+const int ONE_WIRE_PIN = 4;  // DS18B20 bus, 4.7k pull-up to 3.3V
+
+// Zone relays and door contacts; the probes of zones 1 and 2 default to P3/P4
+// and P5/P6, e.g. NTCs on GPIO 32/33 and 36/39. GPIO 21/22 stay free for the
+// BME280's I2C bus. Zone 2 uses the strapping pins 2 and 15, which are fine
+// for a relay driver and a door contact to GND at boot.
+const ZonePins ZONE_PINS[MAX_ZONES] = {
+  {COMPRESSOR_RELAY_PIN, DEFROST_RELAY_PIN, FAN_RELAY_PIN, DOOR_SENSOR_PIN},
+  {25, 26, 27, 14},
+  {23, 13, 2, 15}
+};
+const unsigned long ZONE_START_STAGGER = 30000;     // 30 seconds
+const unsigned long ZONE_HISTORY_INTERVAL = 120000;  // 24 hours of history at 2 minutes
 
 // NTC parameters
 const float SERIES_RESISTOR = 10000;
@@ -26,10 +39,44 @@ const int ADC_MAX = 4095;
 const float TEMP_HIGH_ALERT = 10.0;
 const float TEMP_LOW_ALERT = -5.0;
 
+// Modbus TCP server
+const uint16_t MODBUS_PORT = 502;
+const int MODBUS_MAX_CLIENTS = 8;           // Concurrent masters
+const uint32_t MODBUS_IDLE_TIMEOUT = 60;    // Seconds without a request before a master is dropped
+
+// MQTT telemetry
+const char *MQTT_HOST = "";                       // Broker host name or IP, empty disables MQTT
+const uint16_t MQTT_PORT = 1883;
+const char *MQTT_USER = "";
+const char *MQTT_PASSWORD = "";
+const char *MQTT_TOPIC_PREFIX = "xr60";            // Topics are <prefix>/<device id>/<topic>
+const unsigned long MQTT_SAMPLE_INTERVAL = 10000;  // State sample every 10 seconds
+const unsigned long MQTT_BATCH_INTERVAL = 60000;   // Samples are published at least once a minute
+const unsigned long MQTT_DRAIN_INTERVAL = 200;     // At most 5 queued batches per second after reconnecting
+const unsigned long MQTT_RECONNECT_INTERVAL = 10000;
+const char *MQTT_QUEUE_FILE = "/mqtt_queue.bin";
+
 // Data logging parameters
 const char *DATA_FILE = "/temperature_log.csv";
 const unsigned long LOG_INTERVAL = 5000;
 
+// Weekly schedule: the wall clock is saved this often and, after a reboot,
+// runs on from there until NTP syncs
+const unsigned long SCHEDULE_CLOCK_SAVE_INTERVAL = 3600000;  // 1 hour
+
+// Statistics windows (minutes)
+const unsigned long STATS_WINDOW_MINUTES[STATS_WINDOW_COUNT] = {15, 60, 1440};
+
+// Log segment parameters
+const size_t LOG_SEGMENT_SIZE = 65536;  // CSV log is sealed and compressed at this size
+const int LOG_MAX_SEGMENTS = 16;
+
+// Event journal parameters
+const char *JOURNAL_FILE = "/events.bin";
+const size_t JOURNAL_SEGMENT_SIZE = 32768;  // Active segment is sealed at this size
+const int JOURNAL_MAX_SEGMENTS = 8;         // Sealed segments kept before the oldest is dropped
+const int JOURNAL_MAX_EVENTS_JSON = 500;
+
 // Global variables
 float currentTemperature = 0.0;
 float evaporatorTemperature = 0.0;
@@ -37,14 +84,12 @@ bool isDefrosting = false;
 unsigned long lastDefrostTime = 0;
 bool highTempAlert = false;
 bool lowTempAlert = false;
+bool probeFailureAlert = false;
 bool useSimulatedTemperature = false;
 float simulatedTemperature = 20.0;
-<<<<<<< HEAD
 unsigned long startupTime = 0;
 bool energySavingMode = false;
 
 // Add these definitions
 unsigned long drainingStartTime = 0;
 bool isDraining = false;
-=======
->>>>>>> daadbed8af6a5b4ef83ad228df3e0f594acefaa5
@@ -18,6 +18,21 @@ extern const int COMPRESSOR_RELAY_PIN;
 extern const int DEFROST_RELAY_PIN;
 extern const int FAN_RELAY_PIN;
 extern const int DOOR_SENSOR_PIN;
+extern const int ONE_WIRE_PIN;
+
+// Zones: independent cabinets on one board, each with its own relays and
+// door contact; zone 0 uses the pins above. Probes come from the registry.
+struct ZonePins {
+  uint8_t compressor;
+  uint8_t defrost;
+  uint8_t fan;
+  uint8_t door;
+};
+constexpr int MAX_ZONES = 3;
+extern const ZonePins ZONE_PINS[MAX_ZONES];
+extern const unsigned long ZONE_START_STAGGER;  // Between compressor starts of different zones
+constexpr int ZONE_HISTORY_SIZE = 720;          // Samples kept per zone
+extern const unsigned long ZONE_HISTORY_INTERVAL;
 
 // NTC parameters
 extern const float SERIES_RESISTOR;
@@ -27,13 +42,71 @@ extern const int ADC_MAX;
 extern const float TEMP_HIGH_ALERT;
 extern const float TEMP_LOW_ALERT;
 
+// Modbus TCP server
+extern const uint16_t MODBUS_PORT;
+extern const int MODBUS_MAX_CLIENTS;
+extern const uint32_t MODBUS_IDLE_TIMEOUT;
+
+// MQTT telemetry, disabled when MQTT_HOST is empty
+extern const char *MQTT_HOST;
+extern const uint16_t MQTT_PORT;
+extern const char *MQTT_USER;
+extern const char *MQTT_PASSWORD;
+extern const char *MQTT_TOPIC_PREFIX;
+extern const unsigned long MQTT_SAMPLE_INTERVAL;
+extern const unsigned long MQTT_BATCH_INTERVAL;
+extern const unsigned long MQTT_DRAIN_INTERVAL;
+extern const unsigned long MQTT_RECONNECT_INTERVAL;
+extern const char *MQTT_QUEUE_FILE;
+constexpr uint32_t MQTT_QUEUE_CAPACITY = 4096;  // Records of 16 bytes kept in flash while offline
+constexpr int MQTT_BATCH_SIZE = 20;             // Records per published message
+constexpr int MQTT_MAX_INFLIGHT = 4;            // Published batches waiting for PUBACK
+constexpr size_t MQTT_PAYLOAD_SIZE = 2048;
+
 // Data logging parameters
 extern const char *DATA_FILE;
 extern const unsigned long LOG_INTERVAL;
 
+// Log segment parameters
+extern const size_t LOG_SEGMENT_SIZE;
+extern const int LOG_MAX_SEGMENTS;
+
+// Event journal parameters
+extern const char *JOURNAL_FILE;
+extern const size_t JOURNAL_SEGMENT_SIZE;
+extern const int JOURNAL_MAX_SEGMENTS;
+extern const int JOURNAL_MAX_EVENTS_JSON;
+constexpr int JOURNAL_STREAM_BATCH = 64;  // Records /events reads back from the journal at a time
+
+// Weekly schedule of settings profiles
+constexpr int SCHEDULE_MAX_PROFILES = 6;
+constexpr int SCHEDULE_MAX_TRANSITIONS = 42;     // Six a day
+constexpr size_t SCHEDULE_NAME_SIZE = 12;
+extern const unsigned long SCHEDULE_CLOCK_SAVE_INTERVAL;
+
+// Probe registry: NTCs, a BME280 and DS18B20s on the 1-Wire bus
+constexpr int MAX_PROBES = 8;
+constexpr uint8_t DS18B20_RESOLUTION = 12;  // Bits, 750 ms per conversion
+
 // Data history size
 constexpr  int DATA_HISTORY_SIZE = 1440;
 
+// Sliding statistics windows served by /stats, each split into STATS_BUCKETS buckets
+constexpr int STATS_WINDOW_COUNT = 3;
+constexpr int STATS_BUCKETS = 60;
+extern const unsigned long STATS_WINDOW_MINUTES[STATS_WINDOW_COUNT];
+
+// Upper bound of records returned by one /data_since request
+constexpr int DATA_SINCE_MAX_RECORDS = 240;
+// Larger pages skip the response pool, they never fit a slot's output buffer
+constexpr int DATA_SINCE_POOLED_RECORDS = 10;
+
+// Preallocated JSON response slots: documents are built in the arena and
+// serialized into the output buffer; larger responses fall back to the heap
+constexpr int RESPONSE_POOL_SLOTS = 3;
+constexpr size_t RESPONSE_ARENA_SIZE = 4096;
+constexpr size_t RESPONSE_BUFFER_SIZE = 2048;
+
 // Global variables
 extern float currentTemperature;
 extern float evaporatorTemperature;
@@ -41,6 +114,7 @@ extern bool isDefrosting;
 extern unsigned long lastDefrostTime;
 extern bool highTempAlert;
 extern bool lowTempAlert;
+extern bool probeFailureAlert;  // The regulation probe has no reading
 extern bool useSimulatedTemperature;
 extern float simulatedTemperature;
 
@@ -2,8 +2,17 @@
 #include "config.h"
 #include "Settings.h"
 #include "Hardware.h"
+#include "Probes.h"
 #include "WebServer.h"
 #include "DataLogger.h"
+#include "EventJournal.h"
+#include "LogArchive.h"
+#include "Statistics.h"
+#include "ModbusServer.h"
+#include "MqttPublisher.h"
+#include "FaultDetector.h"
+#include "Zones.h"
+#include "Schedule.h"
 #include <SPIFFS.h>
 #include <Time.h>
 
@@ -21,9 +30,18 @@ void setup()
 
   loadSettings();
   setupHardware();
+  setupProbes();
+  setupFaultDetector();
+  setupZones();
+  setupSchedule();
   setupWiFi(); //including NTP
+  setupLogArchive();  // Before anything that registers, seals or serves a segmented log
   setupWebServer();
   setupDataLogging();
+  setupEventJournal();
+  setupStatistics();
+  setupModbus();
+  setupMqtt();
 
   startupTime = millis();
 
@@ -32,27 +50,30 @@ void setup()
 
 void loop()
 {
-  currentTemperature = readTemperature(false);
-  Serial.printf("Current temperature: %.2f\n", currentTemperature);
-
-  if (settings.P2P == "y")
-  {
-    evaporatorTemperature = readTemperature(true);
-    Serial.printf("Evaporator temperature: %.2f\n", evaporatorTemperature);
-  }
+  lockZones();
+  updateProbes();
+  updateSchedule();
+  controlZones();
 
   checkErrors();
-  checkAlerts(currentTemperature);
 
   if(!canActivateOutputs())
     Serial.println("Startup-Delay active!");
 
-  controlCompressor();
-  handleDefrost();
-  controlFan();
+  updateStatistics();
+  updateModbus();
 
   logDataIfNeeded();
 
+  // The CSV log gets a row whenever the journal records a transition or a
+  // temperature change, instead of one every 5 seconds
+  if (updateEventJournal())
+  {
+    appendLogRow();
+  }
+
+  updateMqtt();
+  unlockZones();
+
   delay(3000); // Adjust as needed
 }
-
@@ -0,0 +1,392 @@
+// Host microbenchmarks of the firmware's hot paths with regression gates.
+//
+//   pio run -e bench
+//   .pio/build/bench/program                          run and print
+//   .pio/build/bench/program --save baseline.json     store a baseline
+//   .pio/build/bench/program --compare baseline.json  fail on regressions
+//
+// Each benchmark reports the median ns/op of --repeats runs plus heap
+// allocations and allocated bytes per op. Allocation counts are exact and
+// portable between hosts, so --compare gates on them; ns/op is only
+// comparable on the same machine and too noisy to gate on by default.
+// --gate-time opts in, comparing the fastest of the runs with its own
+// (wider) threshold.
+
+#include "Bench.h"
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include <string>
+#include <vector>
+
+volatile uint64_t benchSink = 0;
+const char *benchLogPath = nullptr;
+static int failedChecks = 0;
+
+constexpr int BENCH_DEFAULT_REPEATS = 5;
+
+// Heap accounting. With glibc every allocation, including ArduinoJson's
+// malloc-based default allocator and operator new, passes through malloc;
+// elsewhere only operator new is seen. Live bytes (allocated minus freed)
+// are tracked for the whole run, by the usable size of each block.
+static bool countingAllocations = false;
+static uint64_t allocationCount = 0;
+static uint64_t allocatedBytes = 0;
+static int64_t liveBytes = 0;
+
+static inline void countAllocation(size_t size) {
+  if (countingAllocations) {
+    allocationCount++;
+    allocatedBytes += size;
+  }
+}
+
+const char *benchCheck(bool ok) {
+  if (!ok) {
+    failedChecks++;
+  }
+  return ok ? "ok" : "FAILED";
+}
+
+int64_t benchLiveBytes() {
+  return liveBytes;
+}
+
+#if defined(__GLIBC__)
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *pointer);
+size_t malloc_usable_size(void *pointer);
+
+static inline void *trackLive(void *pointer) {
+  if (pointer) {
+    liveBytes += malloc_usable_size(pointer);
+  }
+  return pointer;
+}
+
+void *malloc(size_t size) noexcept {
+  countAllocation(size);
+  return trackLive(__libc_malloc(size));
+}
+
+void *calloc(size_t count, size_t size) noexcept {
+  countAllocation(count * size);
+  return trackLive(__libc_calloc(count, size));
+}
+
+void *realloc(void *pointer, size_t size) noexcept {
+  countAllocation(size);
+  size_t previous = pointer ? malloc_usable_size(pointer) : 0;
+  void *resized = __libc_realloc(pointer, size);
+  if (resized || size == 0) {
+    liveBytes -= previous;  // Freed, or moved into the new block
+  }
+  return trackLive(resized);
+}
+
+// Aligned blocks are freed through free() as well, so they are tracked too
+void *memalign(size_t alignment, size_t size) noexcept {
+  countAllocation(size);
+  return trackLive(__libc_memalign(alignment, size));
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void **result, size_t alignment, size_t size) noexcept {
+  void *pointer = memalign(alignment, size);
+  if (!pointer) return ENOMEM;
+  *result = pointer;
+  return 0;
+}
+
+void free(void *pointer) noexcept {
+  if (pointer) {
+    liveBytes -= malloc_usable_size(pointer);
+  }
+  __libc_free(pointer);
+}
+}
+#else
+// The size is kept in front of the block for operator delete
+constexpr size_t BLOCK_HEADER = alignof(std::max_align_t);
+
+void *operator new(size_t size) {
+  countAllocation(size);
+  uint8_t *block = (uint8_t *)malloc(size + BLOCK_HEADER);
+  if (!block) throw std::bad_alloc();
+  memcpy(block, &size, sizeof(size));
+  liveBytes += size;
+  return block + BLOCK_HEADER;
+}
+
+void operator delete(void *pointer) noexcept {
+  if (!pointer) return;
+  uint8_t *block = (uint8_t *)pointer - BLOCK_HEADER;
+  size_t size;
+  memcpy(&size, block, sizeof(size));
+  liveBytes -= size;
+  free(block);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+  operator delete(pointer);
+}
+#endif
+
+struct BenchResult {
+  std::string name;
+  uint64_t iterations;
+  double nsPerOp;     // Median of the runs
+  double minNsPerOp;  // Fastest run, the least noisy estimate for gating
+  double allocationsPerOp;
+  double bytesPerOp;
+};
+
+static std::string benchmarkName(const Benchmark &benchmark) {
+  std::string name = benchmark.name;
+  if (benchmark.argument >= 0) {
+    name += "/" + std::to_string(benchmark.argument);
+  }
+  return name;
+}
+
+static double runNanoseconds(const Benchmark &benchmark, uint64_t iterations) {
+  auto start = std::chrono::steady_clock::now();
+  benchmark.run(benchmark.argument, iterations);
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+static BenchResult measure(const Benchmark &benchmark, double minSeconds, int repeats) {
+  BenchResult result = {benchmarkName(benchmark), 1, 0, 0, 0, 0};
+  std::vector<double> samples;
+  samples.reserve(repeats);  // Nothing here allocates between runs, see benchLiveBytes()
+  benchmark.setup(benchmark.argument);
+  benchmark.run(benchmark.argument, 1);  // Warm-up, first-time allocations
+
+  // Grow the batch until one run takes a tenth of the target, then size it
+  // for the full target
+  double elapsed = runNanoseconds(benchmark, result.iterations);
+  while (elapsed < minSeconds * 1e8 && result.iterations < (1ULL << 40)) {
+    result.iterations *= 10;
+    elapsed = runNanoseconds(benchmark, result.iterations);
+  }
+  result.iterations = max<uint64_t>(1, (uint64_t)(result.iterations * minSeconds * 1e9 / max(elapsed, 1.0)));
+
+  for (int repeat = 0; repeat < repeats; repeat++) {
+    allocationCount = 0;
+    allocatedBytes = 0;
+    countingAllocations = true;
+    double nanoseconds = runNanoseconds(benchmark, result.iterations);
+    countingAllocations = false;
+    samples.push_back(nanoseconds / result.iterations);
+    if (repeat == 0) {
+      result.allocationsPerOp = (double)allocationCount / result.iterations;
+      result.bytesPerOp = (double)allocatedBytes / result.iterations;
+    }
+  }
+  std::sort(samples.begin(), samples.end());
+  result.nsPerOp = samples[repeats / 2];
+  result.minNsPerOp = samples[0];
+  return result;
+}
+
+class FilePrint : public Print {
+public:
+  explicit FilePrint(FILE *file) : file(file) {}
+  size_t write(uint8_t c) override { return fputc(c, file) == EOF ? 0 : 1; }
+  size_t write(const uint8_t *buffer, size_t size) override { return fwrite(buffer, 1, size, file); }
+  using Print::write;
+
+private:
+  FILE *file;
+};
+
+static bool saveBaseline(const char *path, const std::vector<BenchResult> &results, int repeats) {
+  JsonDocument doc;
+  doc["version"] = 1;
+  doc["repeats"] = repeats;
+  JsonArray list = doc["benchmarks"].to<JsonArray>();
+  for (const BenchResult &result : results) {
+    JsonObject entry = list.add<JsonObject>();
+    entry["name"] = result.name.c_str();
+    entry["iterations"] = (unsigned long)result.iterations;
+    entry["nsPerOp"] = result.nsPerOp;
+    entry["minNsPerOp"] = result.minNsPerOp;
+    entry["allocsPerOp"] = result.allocationsPerOp;
+    entry["bytesPerOp"] = result.bytesPerOp;
+  }
+
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "bench: cannot write %s\n", path);
+    return false;
+  }
+  FilePrint out(file);
+  serializeJsonPretty(doc, out);
+  out.println();
+  fclose(file);
+  return true;
+}
+
+static bool loadBaseline(const char *path, JsonDocument &doc) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "bench: cannot read %s\n", path);
+    return false;
+  }
+  std::string content;
+  char buffer[4096];
+  for (size_t length; (length = fread(buffer, 1, sizeof(buffer), file)) > 0;) {
+    content.append(buffer, length);
+  }
+  fclose(file);
+
+  DeserializationError error = deserializeJson(doc, content.c_str(), content.size());
+  if (error) {
+    fprintf(stderr, "bench: %s: %s\n", path, error.c_str());
+    return false;
+  }
+  return true;
+}
+
+// A metric regresses when it grows by more than the threshold and by more
+// than its noise floor (one allocation, one byte, one nanosecond)
+static bool regressed(double current, double baseline, double threshold, double floor) {
+  return current > baseline * (1 + threshold) && current - baseline >= floor;
+}
+
+// Allocations always gate; time only when timeThreshold > 0, otherwise a
+// slowdown beyond threshold is flagged without failing
+static bool compareBaseline(JsonDocument &baseline, const std::vector<BenchResult> &results,
+                            double threshold, double timeThreshold) {
+  bool failed = false;
+  printf("\n%-28s %12s %12s %8s %10s %10s\n", "compared to baseline", "base ns/op", "ns/op", "change", "base alloc", "alloc");
+  for (const BenchResult &result : results) {
+    JsonObject entry;
+    for (JsonObject candidate : baseline["benchmarks"].as<JsonArray>()) {
+      const char *name = candidate["name"];
+      if (name && result.name == name) {
+        entry = candidate;
+      }
+    }
+    if (entry.isNull()) {
+      printf("%-28s %12s %12.1f %8s %10s %10.2f  new\n", result.name.c_str(), "-", result.nsPerOp, "-", "-",
+             result.allocationsPerOp);
+      continue;
+    }
+
+    double baseNs = entry["nsPerOp"] | 0.0;
+    double baseMinNs = entry["minNsPerOp"] | baseNs;  // Baselines saved before minNsPerOp
+    double baseAllocations = entry["allocsPerOp"] | 0.0;
+    double baseBytes = entry["bytesPerOp"] | 0.0;
+    bool allocates = regressed(result.allocationsPerOp, baseAllocations, threshold, 1.0) ||
+                     regressed(result.bytesPerOp, baseBytes, threshold, 1.0);
+    bool slower = timeThreshold > 0 ? regressed(result.minNsPerOp, baseMinNs, timeThreshold, 1.0)
+                                    : regressed(result.nsPerOp, baseNs, threshold, 1.0);
+    bool failing = allocates || (timeThreshold > 0 && slower);
+    printf("%-28s %12.1f %12.1f %+7.1f%% %10.2f %10.2f  %s\n", result.name.c_str(), baseNs, result.nsPerOp,
+           baseNs > 0 ? 100.0 * (result.nsPerOp - baseNs) / baseNs : 0.0, baseAllocations, result.allocationsPerOp,
+           failing ? "REGRESSION" : slower ? "slower" : "ok");
+    failed |= failing;
+  }
+  return !failed;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: bench [options]\n"
+          "  --filter TEXT     only run benchmarks whose name contains TEXT\n"
+          "  --log FILE        compress this CSV log export instead of a generated segment\n"
+          "  --min-time S      target seconds per measured run (default 0.2)\n"
+          "  --repeats N       measured runs per benchmark (default 5)\n"
+          "  --save FILE       store the results as a JSON baseline\n"
+          "  --compare FILE    compare against a baseline, exit 1 on regressions\n"
+          "  --threshold PCT   allowed growth of allocs/op and bytes/op (default 10);\n"
+          "                    a larger ns/op growth is shown as \"slower\" without failing\n"
+          "  --gate-time PCT   also fail when the fastest run's ns/op grows by more than\n"
+          "                    PCT, e.g. --gate-time 25 --repeats 15 on a quiet machine\n");
+}
+
+int main(int argc, char **argv) {
+  const char *filter = nullptr;
+  const char *savePath = nullptr;
+  const char *comparePath = nullptr;
+  double minSeconds = 0.2;
+  double threshold = 0.10;
+  double timeThreshold = 0;
+  int repeats = BENCH_DEFAULT_REPEATS;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (strcmp(arg, "--filter") == 0 && hasValue) {
+      filter = argv[++i];
+    } else if (strcmp(arg, "--log") == 0 && hasValue) {
+      benchLogPath = argv[++i];
+    } else if (strcmp(arg, "--min-time") == 0 && hasValue) {
+      minSeconds = atof(argv[++i]);
+    } else if (strcmp(arg, "--save") == 0 && hasValue) {
+      savePath = argv[++i];
+    } else if (strcmp(arg, "--compare") == 0 && hasValue) {
+      comparePath = argv[++i];
+    } else if (strcmp(arg, "--threshold") == 0 && hasValue) {
+      threshold = atof(argv[++i]) / 100;
+    } else if (strcmp(arg, "--gate-time") == 0 && hasValue) {
+      timeThreshold = atof(argv[++i]) / 100;
+    } else if (strcmp(arg, "--repeats") == 0 && hasValue) {
+      repeats = atoi(argv[++i]);
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  if (minSeconds <= 0 || repeats < 1 || timeThreshold < 0) {
+    usage();
+    return 2;
+  }
+
+  // Load first so a bad path fails before minutes of measuring
+  JsonDocument baseline;
+  if (comparePath && !loadBaseline(comparePath, baseline)) {
+    return 2;
+  }
+
+  std::vector<BenchResult> results;
+  printf("%-28s %12s %12s %10s %10s\n", "benchmark", "iterations", "ns/op", "allocs/op", "bytes/op");
+  for (int i = 0; i < BENCHMARK_COUNT; i++) {
+    const Benchmark &benchmark = BENCHMARKS[i];
+    if (filter && benchmarkName(benchmark).find(filter) == std::string::npos) {
+      continue;
+    }
+    BenchResult result = measure(benchmark, minSeconds, repeats);
+    printf("%-28s %12llu %12.1f %10.2f %10.1f\n", result.name.c_str(), (unsigned long long)result.iterations,
+           result.nsPerOp, result.allocationsPerOp, result.bytesPerOp);
+    if (benchmark.report) {
+      benchmark.report(benchmark.argument);
+    }
+    fflush(stdout);
+    results.push_back(result);
+  }
+
+  if (savePath && !saveBaseline(savePath, results, repeats)) {
+    return 2;
+  }
+  if (comparePath && !compareBaseline(baseline, results, threshold, timeThreshold)) {
+    return 1;
+  }
+  if (failedChecks > 0) {
+    printf("\n%d checks FAILED\n", failedChecks);
+    return 1;
+  }
+  return 0;
+}
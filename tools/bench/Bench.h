@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+// A benchmark runs its operation `iterations` times per call; setup() runs
+// once before it is measured. argument parameterizes the input size and is
+// part of the reported name ("getDataJSON/60"), -1 for none.
+struct Benchmark {
+  const char *name;
+  int argument;
+  void (*setup)(int argument);
+  void (*run)(int argument, uint64_t iterations);
+  void (*report)(int argument);  // Optional, prints extra results below the row
+};
+
+extern const Benchmark BENCHMARKS[];
+extern const int BENCHMARK_COUNT;
+
+// --log: a CSV log export the compression benchmarks use instead of the
+// generated segment, nullptr for none
+extern const char *benchLogPath;
+
+// Heap bytes allocated and not freed yet, tracked for the whole run
+int64_t benchLiveBytes();
+
+// Counts the outcome of a check printed by a report; the run exits with 1
+// when any failed. Returns "ok" or "FAILED" for the printout.
+const char *benchCheck(bool ok);
+
+// Results are accumulated here so the compiler cannot drop the measured work
+extern volatile uint64_t benchSink;
@@ -0,0 +1,31 @@
+// LogArchive.h for the benchmarks: sealing a segment drops the active file,
+// so appendLogRow() keeps working on a bounded file without background
+// compression
+
+#include "LogArchive.h"
+#include <SPIFFS.h>
+
+void setupLogArchive() {}
+
+void registerSegmentedLog(SegmentedLog &log) {
+  (void)log;
+}
+
+void sealLogSegment(SegmentedLog &log) {
+  SPIFFS.remove(log.activePath);
+  log.nextSegment++;
+}
+
+bool readLogSegment(const SegmentedLog &log, int segment, CompressorSink sink, void *context) {
+  (void)log; (void)segment; (void)sink; (void)context;
+  return false;
+}
+
+void sendLogArchive(AsyncWebServerRequest *request, SegmentedLog &log,
+                    const char *contentType, const char *fileName, const char *prefix) {
+  (void)request; (void)log; (void)contentType; (void)fileName; (void)prefix;
+}
+
+String getArchiveStatsJSON() {
+  return "{}";
+}
@@ -0,0 +1,509 @@
+#include "Bench.h"
+#include "config.h"
+#include "Hardware.h"
+#include "Settings.h"
+#include "Probes.h"
+#include "DataLogger.h"
+#include "FaultDetector.h"
+#include "Zones.h"
+#include "EventJournal.h"
+#include "LogCompressor.h"
+#include "ResponsePool.h"
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <ESPAsyncWebServer.h>
+#include <SPIFFS.h>
+#include <limits.h>
+#include <vector>
+
+// Firmware state the benchmarks share, prepared once
+static void prepareFirmware() {
+  static bool prepared = false;
+  if (prepared) return;
+  prepared = true;
+
+  hostEpoch = 1704067200;  // 2024-01-01, NTP-synced
+  loadSettings();
+  setupProbes();  // Migrates to two NTC probes on the empty host NVS
+  setupDataLogging();
+  currentTemperature = 4.2;
+  evaporatorTemperature = -12.5;
+}
+
+// Thermistor conversion of both NTC probes and the regulation probe read
+// that controlCompressor() uses; the ADC values sweep about -30..+40 degC
+static void setupNtc(int) {
+  prepareFirmware();
+}
+
+static void runNtc(int, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    hostAnalog[NTC_PIN] = 1200 + (int)(i & 1023);
+    hostAnalog[EVAP_SENSOR_PIN] = 2200 + (int)(i & 1023);
+    updateProbes();
+    benchSink += (uint64_t)(readTemperature(false) * 1000);
+  }
+}
+
+static void setupLogging(int) {
+  prepareFirmware();
+}
+
+static void runLogDataIfNeeded(int, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    hostMillis += LOG_INTERVAL;
+    logDataIfNeeded();
+  }
+}
+
+static void setupAppendLogRow(int) {
+  prepareFirmware();
+  SPIFFS.remove(DATA_FILE);
+}
+
+static void runAppendLogRow(int, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    appendLogRow();
+  }
+}
+
+// /temperature: the document as the pooled response builds and serializes it
+static void runLatestDataJSON(int, uint64_t iterations) {
+  char buffer[RESPONSE_BUFFER_SIZE];
+  for (uint64_t i = 0; i < iterations; i++) {
+    JsonDocument doc;
+    fillLatestDataJSON(doc);
+    benchSink += serializeJson(doc, buffer, sizeof(buffer));
+  }
+}
+
+// The history ring is filled with `points` new samples 5 s apart; only those
+// fall into the requested range
+static unsigned long historyStart = 0;
+
+static void setupHistory(int points) {
+  prepareFirmware();
+  for (int i = 0; i < points; i++) {
+    hostMillis += LOG_INTERVAL;
+    currentTemperature = 4.0 + (i % 20) * 0.1;
+    logDataIfNeeded();
+    if (i == 0) {
+      historyStart = time(nullptr);
+    }
+  }
+}
+
+static void runDataJSON(int, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    String response = getDataJSON(historyStart, ULONG_MAX);
+    benchSink += response.length();
+  }
+}
+
+// /data_bin over the same range: the compact encoding the UI loads instead
+// of the JSON, written into a sink that only counts the bytes
+class CountingPrint : public Print {
+public:
+  size_t write(uint8_t) override { bytes++; return 1; }
+  size_t write(const uint8_t *, size_t size) override { bytes += size; return size; }
+  using Print::write;
+  size_t bytes = 0;
+};
+
+static void runDataBinary(int, uint64_t iterations) {
+  bool includeEvaporator = settings.P2P == "y";
+  for (uint64_t i = 0; i < iterations; i++) {
+    CountingPrint out;
+    writeDataBinary(out, historyStart, ULONG_MAX, includeEvaporator);
+    benchSink += out.bytes;
+  }
+}
+
+static void reportDataBinary(int points) {
+  size_t json = getDataJSON(historyStart, ULONG_MAX).length();
+  CountingPrint binary;
+  writeDataBinary(binary, historyStart, ULONG_MAX, settings.P2P == "y");
+  printf("  %d points: getDataJSON %zu bytes (%.1f/point), writeDataBinary %zu bytes (%.1f/point), %.1fx smaller\n",
+         points, json, (double)json / points, binary.bytes, (double)binary.bytes / points,
+         binary.bytes ? (double)json / binary.bytes : 0.0);
+}
+
+static void setupSettings(int) {
+  prepareFirmware();
+  saveSettings();  // Every key present, as on a configured unit
+}
+
+static void runLoadSettings(int, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    loadSettings();
+    benchSink += settings.IdF;
+  }
+}
+
+static void runSaveSettings(int, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    saveSettings();
+  }
+}
+
+// One loop of the zone control with `zones` zones. Six NTCs give every zone
+// its own regulation and evaporator probe; the registry change makes this
+// the last group in the table.
+static void setupZoneControl(int zones) {
+  static bool registered = false;
+  prepareFirmware();
+  if (!registered) {
+    registered = true;
+    const int pins[] = {NTC_PIN, EVAP_SENSOR_PIN, 32, 33, 36, 39};
+    JsonDocument doc;
+    JsonArray probes = doc["probes"].to<JsonArray>();
+    for (int pin : pins) {
+      JsonObject probe = probes.add<JsonObject>();
+      probe["type"] = "ntc";
+      probe["pin"] = pin;
+      hostAnalog[pin] = 2000;
+    }
+    updateProbesFromJSON(doc);
+    updateProbes();
+    setupFaultDetector();
+    setupZones();
+  }
+  String error;
+  if (!setZoneCount(zones, error)) {
+    printf("setZoneCount(%d): %s\n", zones, error.c_str());
+  }
+}
+
+static void runControlZones(int, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    hostMillis += 3000;
+    controlZones();
+    benchSink += isCompressorOn;
+  }
+}
+
+// Sealed log segments as the firmware writes them: a day-long fridge cycle
+// with door openings and defrosts, driven through updateEventJournal() and
+// appendLogRow() until both active files are one write short of sealing.
+// --log replaces the CSV segment with a real export.
+static std::vector<uint8_t> csvSegment;
+static std::vector<uint8_t> journalSegment;
+
+static std::vector<uint8_t> readHostFile(const char *path) {
+  std::vector<uint8_t> content;
+  File file = SPIFFS.open(path, FILE_READ);
+  content.resize(file ? file.size() : 0);
+  if (!content.empty()) {
+    content.resize(file.read(content.data(), content.size()));
+  }
+  file.close();
+  return content;
+}
+
+static void generateSegments() {
+  if (!csvSegment.empty()) return;
+  prepareFirmware();
+  SPIFFS.remove(DATA_FILE);
+  SPIFFS.remove(JOURNAL_FILE);
+  hostMillis = (hostMillis / 86400000 + 1) * 86400000;  // Start at midnight
+
+  uint32_t random = 1;
+  float temperature = settings.SEt;
+  unsigned long defrostStart = 0;
+  bool csvFull = false;
+  bool journalFull = false;
+  while (!csvFull || !journalFull) {
+    hostMillis += 3000;
+    random = random * 1103515245 + 12345;
+    unsigned long minute = hostMillis / 60000;
+    bool doorOpen = minute % 17 == 0 && (random >> 16) % 4 != 0;
+    hostPins[DOOR_SENSOR_PIN] = doorOpen ? LOW : HIGH;
+
+    isDefrostOn = minute % 480 < 20;
+    isDraining = !isDefrostOn && minute % 480 < 20 + (unsigned long)settings.Fdt;
+    isDefrosting = isDefrostOn;
+    if (isDefrostOn && defrostStart == 0) defrostStart = lastDefrostTime = hostMillis;
+    if (!isDefrostOn && defrostStart != 0) drainingStartTime = hostMillis;
+    if (!isDefrostOn) defrostStart = 0;
+    if (isDefrostOn || isDraining) {
+      isCompressorOn = false;
+    } else if (temperature > settings.SEt + settings.Hy) {
+      isCompressorOn = true;
+    } else if (temperature < settings.SEt) {
+      isCompressorOn = false;
+    }
+    isFanOn = isCompressorOn;
+    hostPins[COMPRESSOR_RELAY_PIN] = isCompressorOn;
+    hostPins[DEFROST_RELAY_PIN] = isDefrostOn;
+    hostPins[FAN_RELAY_PIN] = isFanOn;
+    temperature += (isCompressorOn ? -0.02f : 0.006f) + (doorOpen ? 0.03f : 0) +
+                   (isDefrostOn ? 0.004f : 0) + ((int)((random >> 8) % 21) - 10) * 0.001f;
+    currentTemperature = temperature;
+    evaporatorTemperature = isDefrostOn ? -10 + (hostMillis - defrostStart) / 60000.0f : (isCompressorOn ? -18 : -8);
+
+    if (updateEventJournal()) {
+      if (!csvFull) appendLogRow();
+    }
+    File csv = SPIFFS.open(DATA_FILE, FILE_READ);
+    csvFull = csv && csv.size() + 64 >= LOG_SEGMENT_SIZE;
+    csv.close();
+    File journal = SPIFFS.open(JOURNAL_FILE, FILE_READ);
+    journalFull = journal && journal.size() + (EVT_FAULT + 2) * sizeof(JournalRecord) >= JOURNAL_SEGMENT_SIZE;
+    journal.close();
+    if (journalFull) hostPins[DOOR_SENSOR_PIN] = HIGH;
+  }
+  csvSegment = readHostFile(DATA_FILE);
+  journalSegment = readHostFile(JOURNAL_FILE);
+
+  if (benchLogPath) {
+    FILE *file = fopen(benchLogPath, "rb");
+    if (!file) {
+      fprintf(stderr, "bench: cannot read %s, using the generated segment\n", benchLogPath);
+      return;
+    }
+    std::vector<uint8_t> content(LOG_SEGMENT_SIZE);
+    content.resize(fread(content.data(), 1, content.size(), file));
+    fclose(file);
+    csvSegment = content;
+  }
+}
+
+static const std::vector<uint8_t> &segmentFor(int journal) {
+  return journal ? journalSegment : csvSegment;
+}
+
+static void countBytes(void *context, const uint8_t *, size_t length) {
+  *(size_t *)context += length;
+}
+
+static void appendBytes(void *context, const uint8_t *data, size_t length) {
+  std::vector<uint8_t> *output = (std::vector<uint8_t> *)context;
+  output->insert(output->end(), data, data + length);
+}
+
+// Compresses a segment the way the archive task does, in 256-byte reads
+static size_t compressSegment(const std::vector<uint8_t> &segment, CompressorSink sink, void *context) {
+  DeflateEncoder encoder;
+  if (!encoder.begin(sink, context)) return 0;
+  for (size_t offset = 0; offset < segment.size(); offset += 256) {
+    encoder.write(segment.data() + offset, min((size_t)256, segment.size() - offset));
+  }
+  encoder.finish();
+  encoder.end();
+  return segment.size();
+}
+
+static void setupCompression(int) {
+  generateSegments();
+}
+
+template <int journal>
+static void runCompressSegment(int, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    size_t compressed = 0;
+    compressSegment(segmentFor(journal), countBytes, &compressed);
+    benchSink += compressed;
+  }
+}
+
+template <int journal>
+static void reportCompression(int) {
+  const std::vector<uint8_t> &segment = segmentFor(journal);
+  size_t compressed = 0;
+  compressSegment(segment, countBytes, &compressed);
+  printf("  %s segment: %zu -> %zu bytes, ratio %.2f, encoder RAM %zu bytes\n",
+         journal ? "journal" : (benchLogPath ? "csv (--log)" : "csv"), segment.size(), compressed,
+         compressed ? (double)segment.size() / compressed : 0.0, DeflateEncoder::memoryFootprint());
+}
+
+struct MemorySource {
+  const std::vector<uint8_t> *data;
+  size_t offset;
+};
+
+static size_t readMemory(void *context, uint8_t *data, size_t length) {
+  MemorySource *source = (MemorySource *)context;
+  length = min(length, source->data->size() - source->offset);
+  memcpy(data, source->data->data() + source->offset, length);
+  source->offset += length;
+  return length;
+}
+
+static std::vector<uint8_t> compressedSegments[2];
+
+template <int journal>
+static void setupInflate(int) {
+  generateSegments();
+  compressedSegments[journal].clear();
+  compressSegment(segmentFor(journal), appendBytes, &compressedSegments[journal]);
+}
+
+// Reading a compressed segment back, as /events does for journal segments
+template <int journal>
+static void runInflateSegment(int, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    MemorySource source = {&compressedSegments[journal], 0};
+    size_t inflated = 0;
+    inflateLogSegment(readMemory, &source, countBytes, &inflated);
+    benchSink += inflated;
+  }
+}
+
+template <int journal>
+static void reportInflate(int) {
+  MemorySource source = {&compressedSegments[journal], 0};
+  std::vector<uint8_t> inflated;
+  bool ok = inflateLogSegment(readMemory, &source, appendBytes, &inflated) && inflated == segmentFor(journal);
+  printf("  round trip %s\n", benchCheck(ok));
+}
+
+// JSON responses through the pool, sent and streamed out by the mock server.
+// The history holds DATA_HISTORY_SIZE samples; /data_since pages ask for the
+// newest `records` of them.
+static void setupResponses(int) {
+  static bool filled = false;
+  prepareFirmware();
+  if (!filled) {
+    filled = true;
+    for (int i = 0; i < DATA_HISTORY_SIZE; i++) {
+      hostMillis += LOG_INTERVAL;
+      logDataIfNeeded();
+    }
+  }
+}
+
+static uint32_t newestSequence() {
+  JsonDocument doc;
+  fillDataSinceJSON(doc, 0, 1);
+  return doc["last"].as<uint32_t>();
+}
+
+static void runTemperatureResponse(int, uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    AsyncWebServerRequest request;
+    sendJsonResponse(&request, EP_TEMPERATURE, fillLatestDataJSON);
+    benchSink += hostCompleteRequest(request);
+  }
+}
+
+static void runDataSinceResponse(int records, uint64_t iterations) {
+  uint32_t cursor = newestSequence() - records;
+  for (uint64_t i = 0; i < iterations; i++) {
+    AsyncWebServerRequest request;
+    sendDataSince(&request, cursor, DATA_SINCE_MAX_RECORDS);
+    benchSink += hostCompleteRequest(request);
+  }
+}
+
+static uint32_t dataSinceCounter(const char *name) {
+  JsonDocument stats;
+  fillHeapStatsJSON(stats);
+  return stats["endpoints"]["/data_since"][name].as<uint32_t>();
+}
+
+// Pages up to DATA_SINCE_POOLED_RECORDS have to fit a slot's output buffer,
+// larger ones have to go to the heap without building the document twice
+static void reportDataSinceResponse(int records) {
+  uint32_t pooled = dataSinceCounter("pooled");
+  uint32_t fallbacks = dataSinceCounter("fallbacks");
+  AsyncWebServerRequest request;
+  sendDataSince(&request, newestSequence() - records, DATA_SINCE_MAX_RECORDS);
+  hostCompleteRequest(request);
+  bool wasPooled = dataSinceCounter("pooled") > pooled;
+  bool expectPooled = records <= DATA_SINCE_POOLED_RECORDS;
+  printf("  %u byte page (slot buffer %u), %s: %s\n", (unsigned)request.body.length(),
+         (unsigned)RESPONSE_BUFFER_SIZE, wasPooled ? "pooled" : "heap",
+         benchCheck(wasPooled == expectPooled && dataSinceCounter("fallbacks") == fallbacks + !wasPooled));
+}
+
+// Soak: more requests in flight than the pool has slots, across endpoints,
+// completed in a rotating order. Every slot has to come back to the pool,
+// every body has to be complete JSON and the live heap bytes may not grow
+// past what they were after the first (warm-up) round.
+constexpr int SOAK_IN_FLIGHT = RESPONSE_POOL_SLOTS + 2;
+static uint64_t soakRounds = 0;
+static uint64_t soakBadBodies = 0;
+static bool soakBaselineTaken = false;
+static int64_t soakBaselineBytes = 0;
+static int64_t soakMaxGrowth = 0;
+
+static void sendSoakRequest(AsyncWebServerRequest &request, int kind, uint32_t newest) {
+  switch (kind % 4) {
+    case 0: sendJsonResponse(&request, EP_TEMPERATURE, fillLatestDataJSON); break;
+    case 1: sendDataSince(&request, newest - 3, DATA_SINCE_MAX_RECORDS); break;
+    case 2: sendDataSince(&request, newest - DATA_SINCE_MAX_RECORDS, DATA_SINCE_MAX_RECORDS); break;
+    default: sendJsonResponse(&request, EP_HEAP_STATS, fillHeapStatsJSON); break;
+  }
+}
+
+static void runResponseSoak(int, uint64_t iterations) {
+  uint32_t newest = newestSequence();
+  for (uint64_t i = 0; i < iterations; i++) {
+    AsyncWebServerRequest requests[SOAK_IN_FLIGHT];
+    for (int r = 0; r < SOAK_IN_FLIGHT; r++) {
+      sendSoakRequest(requests[r], (int)(i + r), newest);
+    }
+    for (int r = 0; r < SOAK_IN_FLIGHT; r++) {
+      AsyncWebServerRequest &request = requests[(i + r) % SOAK_IN_FLIGHT];
+      if (hostCompleteRequest(request) != 200 || request.body.length() == 0 ||
+          request.body[request.body.length() - 1] != '}') {
+        soakBadBodies++;
+      }
+    }
+    soakRounds++;
+  }
+  // Requests, bodies and documents are gone once the last round returns
+  int64_t live = benchLiveBytes();
+  if (!soakBaselineTaken) {
+    soakBaselineTaken = true;  // After the warm-up round
+    soakBaselineBytes = live;
+  } else {
+    soakMaxGrowth = max(soakMaxGrowth, live - soakBaselineBytes);
+  }
+}
+
+static void reportResponseSoak(int) {
+  JsonDocument stats;
+  fillHeapStatsJSON(stats);
+  int slotsInUse = stats["poolSlotsInUse"] | -1;
+  printf("  %llu rounds of %d requests: %d of %d slots still in use, %llu bad bodies: %s\n",
+         (unsigned long long)soakRounds, SOAK_IN_FLIGHT, slotsInUse, RESPONSE_POOL_SLOTS,
+         (unsigned long long)soakBadBodies, benchCheck(slotsInUse == 0 && soakBadBodies == 0));
+  printf("  live heap %+lld bytes at most after the warm-up round: %s\n", (long long)soakMaxGrowth,
+         benchCheck(soakMaxGrowth <= 0));
+  const char *endpoints[] = {"/temperature", "/data_since", "/heap_stats"};
+  for (const char *endpoint : endpoints) {
+    JsonObject entry = stats["endpoints"][endpoint];
+    printf("  %-14s requests %lu, pooled %lu, fallbacks %lu\n", endpoint, (unsigned long)entry["requests"].as<uint32_t>(),
+           (unsigned long)entry["pooled"].as<uint32_t>(), (unsigned long)entry["fallbacks"].as<uint32_t>());
+  }
+}
+
+const Benchmark BENCHMARKS[] = {
+  {"readTemperature/ntc", -1, setupNtc, runNtc},
+  {"logDataIfNeeded", -1, setupLogging, runLogDataIfNeeded},
+  {"appendLogRow", -1, setupAppendLogRow, runAppendLogRow},
+  {"fillLatestDataJSON", -1, setupLogging, runLatestDataJSON},
+  {"getDataJSON", 1, setupHistory, runDataJSON},
+  {"writeDataBinary", 1, setupHistory, runDataBinary, reportDataBinary},
+  {"getDataJSON", 60, setupHistory, runDataJSON},
+  {"writeDataBinary", 60, setupHistory, runDataBinary, reportDataBinary},
+  {"getDataJSON", 1440, setupHistory, runDataJSON},
+  {"writeDataBinary", 1440, setupHistory, runDataBinary, reportDataBinary},
+  {"loadSettings", -1, setupSettings, runLoadSettings},
+  {"saveSettings", -1, setupSettings, runSaveSettings},
+  {"controlZones", 1, setupZoneControl, runControlZones},
+  {"controlZones", 2, setupZoneControl, runControlZones},
+  {"controlZones", 3, setupZoneControl, runControlZones},
+  {"compressSegment/csv", -1, setupCompression, runCompressSegment<0>, reportCompression<0>},
+  {"compressSegment/journal", -1, setupCompression, runCompressSegment<1>, reportCompression<1>},
+  {"inflateSegment/csv", -1, setupInflate<0>, runInflateSegment<0>, reportInflate<0>},
+  {"inflateSegment/journal", -1, setupInflate<1>, runInflateSegment<1>, reportInflate<1>},
+  {"sendJsonResponse/temperature", -1, setupResponses, runTemperatureResponse},
+  {"sendDataSince", 1, setupResponses, runDataSinceResponse, reportDataSinceResponse},
+  {"sendDataSince", DATA_SINCE_POOLED_RECORDS, setupResponses, runDataSinceResponse, reportDataSinceResponse},
+  {"sendDataSince", DATA_SINCE_MAX_RECORDS, setupResponses, runDataSinceResponse, reportDataSinceResponse},
+  {"responsePool/soak", -1, setupResponses, runResponseSoak, reportResponseSoak}
+};
+
+const int BENCHMARK_COUNT = sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]);
@@ -0,0 +1,170 @@
+#include <Arduino.h>
+#include <Preferences.h>
+#include <WiFi.h>
+#include <stdarg.h>
+
+unsigned long hostMillis = 0;
+time_t hostEpoch = 0;
+int hostPins[HOST_PIN_COUNT];
+int hostAnalog[HOST_PIN_COUNT];
+bool hostSerialEcho = false;
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+String::String(double number, unsigned int decimals) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.*f", (int)decimals, number);
+  value = buffer;
+}
+
+int String::indexOf(char c, unsigned int from) const {
+  size_t position = value.find(c, from);
+  return position == std::string::npos ? -1 : (int)position;
+}
+
+int String::indexOf(const String &text, unsigned int from) const {
+  size_t position = value.find(text.value, from);
+  return position == std::string::npos ? -1 : (int)position;
+}
+
+bool String::endsWith(const String &suffix) const {
+  return value.size() >= suffix.value.size() &&
+         value.compare(value.size() - suffix.value.size(), suffix.value.size(), suffix.value) == 0;
+}
+
+String String::substring(unsigned int from) const {
+  return from < value.size() ? String(value.substr(from)) : String();
+}
+
+String String::substring(unsigned int from, unsigned int to) const {
+  if (from > to) std::swap(from, to);
+  return from < value.size() ? String(value.substr(from, to - from)) : String();
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    write(buffer[i]);
+  }
+  return size;
+}
+
+static size_t vprintTo(Print &out, const char *format, va_list args) {
+  char buffer[256];
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  if (length < 0) return 0;
+  return out.write((const uint8_t *)buffer, min((size_t)length, sizeof(buffer) - 1));
+}
+
+size_t Print::printf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  size_t written = vprintTo(*this, format, args);
+  va_end(args);
+  return written;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  if (hostSerialEcho) fputc(c, stderr);
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+  if (hostSerialEcho) fwrite(buffer, 1, size, stderr);
+  return size;
+}
+
+size_t HardwareSerial::printf(const char *format, ...) {
+  if (!hostSerialEcho) return 0;
+  va_list args;
+  va_start(args, format);
+  size_t written = vprintTo(*this, format, args);
+  va_end(args);
+  return written;
+}
+
+uint32_t esp_random() { return (uint32_t)rand(); }
+
+unsigned long millis() { return hostMillis; }
+unsigned long micros() { return hostMillis * 1000; }
+void delay(unsigned long ms) { hostMillis += ms; }
+void yield() {}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin < HOST_PIN_COUNT && mode == INPUT_PULLUP) hostPins[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin < HOST_PIN_COUNT) hostPins[pin] = value;
+}
+
+int digitalRead(uint8_t pin) { return pin < HOST_PIN_COUNT ? hostPins[pin] : LOW; }
+uint16_t analogRead(uint8_t pin) { return pin < HOST_PIN_COUNT ? hostAnalog[pin] : 0; }
+int digitalPinToInterrupt(uint8_t pin) { return pin; }
+void attachInterrupt(uint8_t interrupt, void (*handler)(), int mode) { (void)interrupt; (void)handler; (void)mode; }
+
+void configTime(long gmtOffset, int daylightOffset, const char *server) {
+  (void)gmtOffset; (void)daylightOffset; (void)server;
+}
+
+time_t hostTime(time_t *result) {
+  time_t now = hostEpoch + hostMillis / 1000;
+  if (result) *result = now;
+  return now;
+}
+
+int hostGettimeofday(struct timeval *tv, void *tz) {
+  (void)tz;
+  tv->tv_sec = hostEpoch + hostMillis / 1000;
+  tv->tv_usec = (hostMillis % 1000) * 1000;
+  return 0;
+}
+
+static std::map<std::string, std::map<std::string, std::string>> nvs;
+
+bool Preferences::begin(const char *name, bool readOnly) {
+  space = &nvs[name];
+  this->readOnly = readOnly;
+  return true;
+}
+
+bool Preferences::clear() {
+  if (!space || readOnly) return false;
+  space->clear();
+  return true;
+}
+
+bool Preferences::remove(const char *key) {
+  return space && !readOnly && space->erase(key) > 0;
+}
+
+bool Preferences::isKey(const char *key) {
+  return space && space->count(key) > 0;
+}
+
+size_t Preferences::put(const char *key, const void *value, size_t length) {
+  if (!space || readOnly) return 0;
+  (*space)[key].assign((const char *)value, length);
+  return length;
+}
+
+String Preferences::getString(const char *key, const String &defaultValue) {
+  if (!space) return defaultValue;
+  Namespace::const_iterator entry = space->find(key);
+  return entry == space->end() ? defaultValue : String(entry->second);
+}
+
+size_t Preferences::getBytesLength(const char *key) {
+  if (!space) return 0;
+  Namespace::const_iterator entry = space->find(key);
+  return entry == space->end() ? 0 : entry->second.size();
+}
+
+size_t Preferences::getBytes(const char *key, void *buffer, size_t length) {
+  if (!space) return 0;
+  Namespace::const_iterator entry = space->find(key);
+  if (entry == space->end() || entry->second.size() > length) return 0;
+  memcpy(buffer, entry->second.data(), entry->second.size());
+  return entry->second.size();
+}
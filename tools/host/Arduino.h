@@ -0,0 +1,173 @@
+#pragma once
+
+// Minimal Arduino core for building firmware modules natively (tools/replay,
+// tools/bench). Time is virtual: millis() returns hostMillis, which the tool
+// advances, and time() and gettimeofday() return hostEpoch plus the elapsed
+// hostMillis. Pin writes land in hostPins, analog reads come from hostAnalog,
+// and Serial output is dropped unless hostSerialEcho is set.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <string>
+
+using std::min;
+using std::max;
+
+#define IRAM_ATTR
+#define PROGMEM
+#define F(string) string
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define CHANGE 0x03
+
+typedef uint8_t byte;
+
+constexpr int HOST_PIN_COUNT = 40;
+
+extern unsigned long hostMillis;
+extern time_t hostEpoch;  // Wall clock at hostMillis == 0, 0 = not NTP-synced
+extern int hostPins[HOST_PIN_COUNT];
+extern int hostAnalog[HOST_PIN_COUNT];
+extern bool hostSerialEcho;
+
+template <class T, class L, class H>
+T constrain(T value, L low, H high) { return value < low ? low : (value > high ? high : value); }
+
+class String {
+public:
+  String() {}
+  String(const char *text) : value(text ? text : "") {}
+  String(const std::string &text) : value(text) {}
+  String(char c) : value(1, c) {}
+  String(int number) : value(std::to_string(number)) {}
+  String(unsigned int number) : value(std::to_string(number)) {}
+  String(long number) : value(std::to_string(number)) {}
+  String(unsigned long number) : value(std::to_string(number)) {}
+  String(float number, unsigned int decimals = 2) : String((double)number, decimals) {}
+  String(double number, unsigned int decimals = 2);
+
+  const char *c_str() const { return value.c_str(); }
+  unsigned int length() const { return value.size(); }
+  bool isEmpty() const { return value.empty(); }
+  bool reserve(unsigned int size) { value.reserve(size); return true; }
+  bool concat(const char *text, unsigned int length) { value.append(text, length); return true; }
+  bool concat(const String &text) { value += text.value; return true; }
+  bool concat(char c) { value += c; return true; }
+
+  bool operator==(const String &other) const { return value == other.value; }
+  bool operator!=(const String &other) const { return value != other.value; }
+  bool operator==(const char *other) const { return value == other; }
+  bool operator!=(const char *other) const { return value != other; }
+  bool equals(const String &other) const { return value == other.value; }
+  char operator[](unsigned int index) const { return value[index]; }
+  char charAt(unsigned int index) const { return value[index]; }
+
+  String &operator+=(const String &other) { value += other.value; return *this; }
+  String &operator+=(const char *other) { value += other; return *this; }
+  String &operator+=(char c) { value += c; return *this; }
+  template <class T>
+  String &operator+=(T number) { return *this += String(number); }
+  template <class T>
+  friend String operator+(String left, const T &right) { left += right; return left; }
+  friend String operator+(const char *left, const String &right) { return String(left) += right; }
+
+  int indexOf(char c, unsigned int from = 0) const;
+  int indexOf(const String &text, unsigned int from = 0) const;
+  bool startsWith(const String &prefix) const { return value.compare(0, prefix.value.size(), prefix.value) == 0; }
+  bool endsWith(const String &suffix) const;
+  String substring(unsigned int from) const;
+  String substring(unsigned int from, unsigned int to) const;
+  long toInt() const { return atol(value.c_str()); }
+  float toFloat() const { return atof(value.c_str()); }
+
+private:
+  std::string value;
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write(const char *text) { return write((const uint8_t *)text, strlen(text)); }
+
+  size_t print(const char *text) { return write(text); }
+  size_t print(const String &text) { return write(text.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  template <class T>
+  size_t print(T number) { return print(String(number)); }
+  size_t println() { return write("\n"); }
+  template <class T>
+  size_t println(const T &value) { return print(value) + println(); }
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class HardwareSerial : public Print {
+public:
+  void begin(unsigned long baud) { (void)baud; }
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+  // Skips the formatting while output is dropped; the control loop prints
+  // on every iteration
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+  uint32_t getFreeHeap() { return 0; }
+  uint32_t getMaxAllocHeap() { return 0; }
+  uint32_t getMinFreeHeap() { return 0; }
+  uint64_t getEfuseMac() { return 0; }
+  void restart() { exit(0); }
+};
+
+extern EspClass ESP;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+uint32_t esp_random();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+uint16_t analogRead(uint8_t pin);
+int digitalPinToInterrupt(uint8_t pin);
+void attachInterrupt(uint8_t interrupt, void (*handler)(), int mode);
+
+void configTime(long gmtOffset, int daylightOffset, const char *server);
+
+// FreeRTOS mutexes; the host tools run on one thread, so taking one always succeeds
+typedef void *SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+#define pdTRUE 1
+#define portMAX_DELAY 0xFFFFFFFF
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+inline SemaphoreHandle_t xSemaphoreCreateMutex() { static int mutex; return &mutex; }
+inline int xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+inline int xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+
+time_t hostTime(time_t *result);
+#define time(result) hostTime(result)
+int hostGettimeofday(struct timeval *tv, void *tz);
+#define gettimeofday(tv, tz) hostGettimeofday(tv, tz)
@@ -0,0 +1,180 @@
+#include "AsyncMqttClient.h"
+#include <algorithm>
+#include <string.h>
+
+bool hostMqttBrokerUp = true;
+bool hostMqttStalled = false;
+bool hostMqttHoldAcks = false;
+std::vector<HostMqttMessage> hostMqttMessages;
+int hostMqttConnects = 0;
+
+// One client, as in the firmware; a plain pointer is set before any
+// constructor runs, so the firmware's global client can register itself
+static AsyncMqttClient *hostMqttClient = nullptr;
+
+// MQTT 3.1.1 remaining length: 7 bits per byte
+static size_t remainingLengthBytes(size_t length) {
+  size_t bytes = 1;
+  while (length >= 128) {
+    length /= 128;
+    bytes++;
+  }
+  return bytes;
+}
+
+AsyncMqttClient::AsyncMqttClient() {
+  hostMqttClient = this;
+}
+
+AsyncMqttClient::~AsyncMqttClient() {
+  if (hostMqttClient == this) {
+    hostMqttClient = nullptr;
+  }
+}
+
+AsyncMqttClient &AsyncMqttClient::setServer(const char *host, uint16_t port) {
+  (void)host; (void)port;
+  return *this;
+}
+
+AsyncMqttClient &AsyncMqttClient::setCredentials(const char *username, const char *password) {
+  (void)username; (void)password;
+  return *this;
+}
+
+AsyncMqttClient &AsyncMqttClient::setClientId(const char *clientId) {
+  (void)clientId;
+  return *this;
+}
+
+AsyncMqttClient &AsyncMqttClient::setKeepAlive(uint16_t keepAlive) {
+  (void)keepAlive;
+  return *this;
+}
+
+AsyncMqttClient &AsyncMqttClient::setWill(const char *topic, uint8_t qos, bool retain, const char *payload,
+                                          size_t length) {
+  (void)topic; (void)qos; (void)retain; (void)payload; (void)length;
+  return *this;
+}
+
+AsyncMqttClient &AsyncMqttClient::onConnect(std::function<void(bool)> callback) {
+  connectCallback = callback;
+  return *this;
+}
+
+AsyncMqttClient &AsyncMqttClient::onDisconnect(std::function<void(AsyncMqttClientDisconnectReason)> callback) {
+  disconnectCallback = callback;
+  return *this;
+}
+
+AsyncMqttClient &AsyncMqttClient::onPublish(std::function<void(uint16_t)> callback) {
+  publishCallback = callback;
+  return *this;
+}
+
+void AsyncMqttClient::connect() {
+  if (state == DISCONNECTED) {
+    state = CONNECTING;
+  }
+}
+
+void AsyncMqttClient::disconnect(bool force) {
+  (void)force;
+  if (state != DISCONNECTED) {
+    state = DISCONNECTING;
+  }
+}
+
+uint16_t AsyncMqttClient::publish(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length,
+                                  bool dup, uint16_t messageId) {
+  (void)dup;
+  if (state != CONNECTED) {
+    return 0;
+  }
+  uint16_t packetId = 1;
+  if (qos > 0) {
+    packetId = messageId ? messageId : nextPacketId;
+    nextPacketId = nextPacketId == 0xFFFF ? 1 : nextPacketId + 1;
+  }
+  if (payload && length == 0) {
+    length = strlen(payload);
+  }
+  size_t remaining = 2 + strlen(topic) + (qos > 0 ? 2 : 0) + length;
+  outgoing.push_back({topic, std::string(payload ? payload : "", length), qos, retain, packetId,
+                      1 + remainingLengthBytes(remaining) + remaining});
+  return packetId;
+}
+
+// The session is gone: whatever was not delivered or acknowledged is lost
+void AsyncMqttClient::drop() {
+  state = DISCONNECTED;
+  outgoing.clear();
+  heldAcks.clear();
+  acks.clear();
+  if (disconnectCallback) {
+    disconnectCallback(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+  }
+}
+
+void AsyncMqttClient::poll() {
+  if (state == CONNECTING) {
+    if (!hostMqttBrokerUp) {
+      drop();
+      return;
+    }
+    state = CONNECTED;
+    hostMqttConnects++;
+    if (connectCallback) {
+      connectCallback(false);
+    }
+    return;
+  }
+  if (state == DISCONNECTING || (state == CONNECTED && !hostMqttBrokerUp)) {
+    drop();
+    return;
+  }
+  if (state != CONNECTED) {
+    return;
+  }
+
+  if (!hostMqttStalled) {
+    for (const HostMqttMessage &message : outgoing) {
+      hostMqttMessages.push_back(message);
+      if (message.qos > 0) {
+        (hostMqttHoldAcks ? heldAcks : acks).push_back(message.packetId);
+      }
+    }
+    outgoing.clear();
+  }
+
+  std::vector<uint16_t> ready;
+  ready.swap(acks);
+  for (uint16_t packetId : ready) {
+    if (publishCallback) {
+      publishCallback(packetId);
+    }
+  }
+}
+
+void hostPollMqtt() {
+  if (hostMqttClient) {
+    hostMqttClient->poll();
+  }
+}
+
+void hostMqttReleaseAcks(size_t count, bool newestFirst) {
+  if (!hostMqttClient) {
+    return;
+  }
+  std::vector<uint16_t> &held = hostMqttClient->heldAcks;
+  std::vector<uint16_t> &acks = hostMqttClient->acks;
+  size_t released = std::min(count, held.size());
+  if (newestFirst) {
+    acks.insert(acks.end(), held.rbegin(), held.rbegin() + released);
+    held.erase(held.end() - released, held.end());
+  } else {
+    acks.insert(acks.end(), held.begin(), held.begin() + released);
+    held.erase(held.begin(), held.begin() + released);
+  }
+}
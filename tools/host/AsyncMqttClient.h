@@ -0,0 +1,87 @@
+#pragma once
+
+// AsyncMqttClient against an in-memory broker (tools/mqtt). There is no
+// network task: hostPollMqtt() hands what the client published to the broker
+// and runs the connect, disconnect and publish (PUBACK) callbacks on the
+// caller's thread. The tool breaks the link with:
+//   hostMqttBrokerUp   false drops the session at the next poll and makes
+//                      connect() fail, as a broker or Wi-Fi outage does
+//   hostMqttStalled    published packets stay in the client's send buffer
+//                      and are lost with the session, a dead link the
+//                      keep-alive has not noticed yet
+//   hostMqttHoldAcks   the broker takes messages but keeps their PUBACKs
+//                      until hostMqttReleaseAcks(); a dropped session loses
+//                      them, so the client publishes those messages again
+// Everything the broker took is in hostMqttMessages, in arrival order.
+
+#include <Arduino.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+enum class AsyncMqttClientDisconnectReason : uint8_t {
+  TCP_DISCONNECTED = 0
+};
+
+struct HostMqttMessage {
+  std::string topic;
+  std::string payload;
+  uint8_t qos;
+  bool retain;
+  uint16_t packetId;
+  size_t wireBytes;  // The PUBLISH packet: fixed header, topic, packet id and payload
+};
+
+extern bool hostMqttBrokerUp;
+extern bool hostMqttStalled;
+extern bool hostMqttHoldAcks;
+extern std::vector<HostMqttMessage> hostMqttMessages;
+extern int hostMqttConnects;  // Sessions the broker accepted
+
+class AsyncMqttClient {
+public:
+  AsyncMqttClient();
+  ~AsyncMqttClient();
+  AsyncMqttClient(const AsyncMqttClient &) = delete;
+  AsyncMqttClient &operator=(const AsyncMqttClient &) = delete;
+
+  AsyncMqttClient &setServer(const char *host, uint16_t port);
+  AsyncMqttClient &setCredentials(const char *username, const char *password = nullptr);
+  AsyncMqttClient &setClientId(const char *clientId);
+  AsyncMqttClient &setKeepAlive(uint16_t keepAlive);
+  AsyncMqttClient &setWill(const char *topic, uint8_t qos, bool retain, const char *payload = nullptr,
+                           size_t length = 0);
+  AsyncMqttClient &onConnect(std::function<void(bool sessionPresent)> callback);
+  AsyncMqttClient &onDisconnect(std::function<void(AsyncMqttClientDisconnectReason reason)> callback);
+  AsyncMqttClient &onPublish(std::function<void(uint16_t packetId)> callback);
+
+  void connect();
+  void disconnect(bool force = false);
+  bool connected() const { return state == CONNECTED; }
+  // 0 when not connected, else the packet id (1 for QoS 0)
+  uint16_t publish(const char *topic, uint8_t qos, bool retain, const char *payload = nullptr, size_t length = 0,
+                   bool dup = false, uint16_t messageId = 0);
+
+private:
+  friend void hostPollMqtt();
+  friend void hostMqttReleaseAcks(size_t count, bool newestFirst);
+  void poll();
+  void drop();
+
+  enum State { DISCONNECTED, CONNECTING, CONNECTED, DISCONNECTING };
+  State state = DISCONNECTED;
+  uint16_t nextPacketId = 1;
+  std::vector<HostMqttMessage> outgoing;  // Published, not at the broker yet
+  std::vector<uint16_t> heldAcks;         // At the broker, PUBACK held back
+  std::vector<uint16_t> acks;             // PUBACKs for the next poll
+  std::function<void(bool)> connectCallback;
+  std::function<void(AsyncMqttClientDisconnectReason)> disconnectCallback;
+  std::function<void(uint16_t)> publishCallback;
+};
+
+// Runs the callbacks of everything that happened since the last poll
+void hostPollMqtt();
+
+// Sends count of the held PUBACKs on the next poll, the oldest or the newest
+// first; the broker keeps holding the others
+void hostMqttReleaseAcks(size_t count, bool newestFirst);
@@ -0,0 +1,250 @@
+#include "AsyncTCP.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+int hostTcpPortOffset = 0;
+
+// AsyncTCP offers the free space of lwIP's send buffer, TCP_SND_BUF on the ESP32
+static const size_t HOST_TCP_SEND_BUFFER = 5744;
+
+static std::vector<AsyncServer *> hostServers;
+static std::vector<AsyncClient *> hostClients;
+
+// Real time, rx timeouts are not part of the virtual clock
+static unsigned long wallMillis() {
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void setNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+AsyncClient::AsyncClient(int fd) : fd(fd), lastReceive(wallMillis()) {
+  setNonBlocking(fd);
+  hostClients.push_back(this);
+}
+
+AsyncClient::~AsyncClient() {
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  for (size_t i = 0; i < hostClients.size(); i++) {
+    if (hostClients[i] == this) {
+      hostClients.erase(hostClients.begin() + i);
+      break;
+    }
+  }
+}
+
+void AsyncClient::onData(AcDataHandler handler, void *arg) {
+  dataHandler = handler;
+  dataArg = arg;
+}
+
+void AsyncClient::onDisconnect(AcConnectHandler handler, void *arg) {
+  disconnectHandler = handler;
+  disconnectArg = arg;
+}
+
+void AsyncClient::onTimeout(AcTimeoutHandler handler, void *arg) {
+  timeoutHandler = handler;
+  timeoutArg = arg;
+}
+
+void AsyncClient::setNoDelay(bool noDelay) {
+  int flag = noDelay;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+}
+
+void AsyncClient::setRxTimeout(uint32_t timeout) {
+  rxTimeout = timeout;
+}
+
+size_t AsyncClient::space() const {
+  return connected() && pending.size() < HOST_TCP_SEND_BUFFER ? HOST_TCP_SEND_BUFFER - pending.size() : 0;
+}
+
+size_t AsyncClient::add(const char *data, size_t size, uint8_t flags) {
+  (void)flags;  // Always copied
+  size = min(size, space());
+  pending.append(data, size);
+  return size;
+}
+
+bool AsyncClient::send() {
+  flush();
+  return connected();
+}
+
+void AsyncClient::flush() {
+  while (connected() && !pending.empty()) {
+    ssize_t sent = ::send(fd, pending.data(), pending.size(), MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        close(true);
+      }
+      return;  // The rest goes out from hostPollTCP()
+    }
+    pending.erase(0, sent);
+  }
+}
+
+void AsyncClient::close(bool now) {
+  if (!connected()) {
+    return;
+  }
+  if (!now) {
+    // Like tcp_close(): what was added still goes out, best effort
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    flush();
+  }
+  ::close(fd);
+  fd = -1;
+  pending.clear();
+  disconnectPending = true;
+}
+
+void AsyncClient::receive() {
+  uint8_t buffer[1460];  // One segment at a time, as lwIP hands them over
+  ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+  if (length > 0) {
+    lastReceive = wallMillis();
+    if (dataHandler) {
+      dataHandler(dataArg, this, buffer, length);
+    }
+  } else if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+    close(true);
+  }
+}
+
+AsyncServer::AsyncServer(uint16_t port) : port(port) {}
+
+AsyncServer::~AsyncServer() {
+  end();
+}
+
+void AsyncServer::onClient(AcConnectHandler handler, void *arg) {
+  clientHandler = handler;
+  clientArg = arg;
+}
+
+void AsyncServer::begin() {
+  if (fd >= 0) {
+    return;
+  }
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port + hostTcpPortOffset);
+  if (bind(fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 16) != 0) {
+    fprintf(stderr, "AsyncServer: cannot listen on port %d: %s\n", port + hostTcpPortOffset, strerror(errno));
+    ::close(fd);
+    fd = -1;
+    return;
+  }
+  setNonBlocking(fd);
+  hostServers.push_back(this);
+}
+
+void AsyncServer::end() {
+  if (fd < 0) {
+    return;
+  }
+  ::close(fd);
+  fd = -1;
+  for (size_t i = 0; i < hostServers.size(); i++) {
+    if (hostServers[i] == this) {
+      hostServers.erase(hostServers.begin() + i);
+      break;
+    }
+  }
+}
+
+void AsyncServer::accept() {
+  int client = ::accept(fd, nullptr, nullptr);
+  if (client < 0) {
+    return;
+  }
+  AsyncClient *connection = new AsyncClient(client);
+  connection->setNoDelay(noDelay);
+  if (clientHandler) {
+    clientHandler(clientArg, connection);
+  } else {
+    delete connection;
+  }
+}
+
+void hostPollTCP(int timeoutMs) {
+  // Callbacks may delete clients, so every step works on a snapshot and
+  // checks the client is still registered
+  auto registered = [](AsyncClient *client) {
+    for (AsyncClient *other : hostClients) {
+      if (other == client) return true;
+    }
+    return false;
+  };
+
+  std::vector<pollfd> fds;
+  std::vector<AsyncServer *> servers = hostServers;
+  std::vector<AsyncClient *> clients = hostClients;
+  for (AsyncServer *server : servers) {
+    fds.push_back({server->fd, POLLIN, 0});
+  }
+  for (AsyncClient *client : clients) {
+    if (client->disconnectPending) {
+      timeoutMs = 0;  // Nothing to wait for, the callback is due now
+    }
+    short events = client->pending.empty() ? POLLIN : POLLIN | POLLOUT;
+    fds.push_back({client->fd, events, 0});  // fd -1 is ignored by poll()
+  }
+  poll(fds.data(), fds.size(), timeoutMs);
+
+  for (size_t i = 0; i < servers.size(); i++) {
+    if (fds[i].revents & POLLIN) {
+      servers[i]->accept();
+    }
+  }
+  for (size_t i = 0; i < clients.size(); i++) {
+    AsyncClient *client = clients[i];
+    short revents = fds[servers.size() + i].revents;
+    if (!registered(client)) {
+      continue;
+    }
+    if (client->connected() && (revents & POLLOUT)) {
+      client->flush();
+    }
+    if (client->connected() && (revents & (POLLIN | POLLHUP | POLLERR))) {
+      client->receive();
+    }
+    if (!registered(client)) {
+      continue;
+    }
+    unsigned long idle = wallMillis() - client->lastReceive;  // After receive(), which moves lastReceive
+    if (client->connected() && client->rxTimeout && idle >= client->rxTimeout * 1000UL) {
+      if (client->timeoutHandler) {
+        client->timeoutHandler(client->timeoutArg, client, idle);
+      } else {
+        client->close(true);
+      }
+    }
+    if (registered(client) && client->disconnectPending) {
+      client->disconnectPending = false;
+      if (client->disconnectHandler) {
+        client->disconnectHandler(client->disconnectArg, client);
+      }
+    }
+  }
+}
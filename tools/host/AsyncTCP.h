@@ -0,0 +1,86 @@
+#pragma once
+
+// AsyncTCP on top of non-blocking loopback sockets (tools/modbus). There is
+// no network task: hostPollTCP() waits for socket events and runs the
+// accept, data, timeout and disconnect callbacks on the caller's thread, so
+// the firmware code needs no locking against it. Servers listen on
+// 127.0.0.1, port + hostTcpPortOffset, which keeps 80 and 502 unprivileged.
+//
+// As in AsyncTCP, close() ends up in the onDisconnect callback, which may
+// delete the client; here it runs from the next hostPollTCP().
+
+#include <Arduino.h>
+#include <functional>
+#include <string>
+
+constexpr uint8_t ASYNC_WRITE_FLAG_COPY = 0x01;
+
+extern int hostTcpPortOffset;
+
+class AsyncClient;
+
+typedef std::function<void(void *, AsyncClient *)> AcConnectHandler;
+typedef std::function<void(void *, AsyncClient *, void *data, size_t len)> AcDataHandler;
+typedef std::function<void(void *, AsyncClient *, uint32_t time)> AcTimeoutHandler;
+
+class AsyncClient {
+public:
+  explicit AsyncClient(int fd);
+  ~AsyncClient();
+  AsyncClient(const AsyncClient &) = delete;
+  AsyncClient &operator=(const AsyncClient &) = delete;
+
+  void onData(AcDataHandler handler, void *arg = nullptr);
+  void onDisconnect(AcConnectHandler handler, void *arg = nullptr);
+  void onTimeout(AcTimeoutHandler handler, void *arg = nullptr);
+  void setNoDelay(bool noDelay);
+  void setRxTimeout(uint32_t timeout);  // Seconds, 0 = none
+
+  bool connected() const { return fd >= 0; }
+  size_t space() const;
+  size_t add(const char *data, size_t size, uint8_t flags = ASYNC_WRITE_FLAG_COPY);
+  bool send();
+  void close(bool now = false);
+
+private:
+  friend void hostPollTCP(int timeoutMs);
+  void receive();
+  void flush();
+
+  int fd;
+  std::string pending;  // Added, not yet accepted by the socket
+  uint32_t rxTimeout = 0;
+  unsigned long lastReceive;
+  bool disconnectPending = false;
+  AcDataHandler dataHandler;
+  void *dataArg = nullptr;
+  AcConnectHandler disconnectHandler;
+  void *disconnectArg = nullptr;
+  AcTimeoutHandler timeoutHandler;
+  void *timeoutArg = nullptr;
+};
+
+class AsyncServer {
+public:
+  explicit AsyncServer(uint16_t port);
+  ~AsyncServer();
+
+  void onClient(AcConnectHandler handler, void *arg);
+  void setNoDelay(bool noDelay) { this->noDelay = noDelay; }
+  void begin();
+  void end();
+
+private:
+  friend void hostPollTCP(int timeoutMs);
+  void accept();
+
+  uint16_t port;
+  int fd = -1;
+  bool noDelay = false;
+  AcConnectHandler clientHandler;
+  void *clientArg = nullptr;
+};
+
+// Runs the callbacks of everything that happened on the host sockets,
+// waiting up to timeoutMs for the first event
+void hostPollTCP(int timeoutMs);
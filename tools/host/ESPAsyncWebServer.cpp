@@ -0,0 +1,90 @@
+#include "ESPAsyncWebServer.h"
+
+// Response with its content in memory, for send(code, type, content)
+class HostBasicResponse : public AsyncWebServerResponse {
+public:
+  HostBasicResponse(int code, const String &contentType, const String &content) : content(content) {
+    _code = code;
+    _contentType = contentType;
+    _contentLength = content.length();
+  }
+
+  bool _sourceValid() const override { return true; }
+
+  size_t _fillBuffer(uint8_t *data, size_t maxLen) override {
+    size_t length = min(maxLen, _contentLength - offset);
+    memcpy(data, content.c_str() + offset, length);
+    offset += length;
+    return length;
+  }
+
+private:
+  String content;
+  size_t offset = 0;
+};
+
+// Response produced by a callback while it is being sent
+class HostChunkedResponse : public AsyncWebServerResponse {
+public:
+  HostChunkedResponse(const String &contentType, AwsResponseFiller callback) : callback(callback) {
+    _code = 200;
+    _contentType = contentType;
+    _chunked = true;
+  }
+
+  bool _sourceValid() const override { return true; }
+
+  size_t _fillBuffer(uint8_t *data, size_t maxLen) override {
+    size_t length = callback(data, maxLen, offset);
+    if (length != RESPONSE_TRY_AGAIN) {
+      offset += length;
+    }
+    return length;
+  }
+
+private:
+  AwsResponseFiller callback;
+  size_t offset = 0;
+};
+
+void AsyncWebServerRequest::send(AsyncWebServerResponse *response) {
+  delete this->response;  // The server ignores a second response, and frees it
+  this->response = response;
+}
+
+void AsyncWebServerRequest::send(int code, const String &contentType, const String &content) {
+  send(new HostBasicResponse(code, contentType, content));
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginChunkedResponse(const String &contentType,
+                                                                    AwsResponseFiller callback) {
+  return new HostChunkedResponse(contentType, callback);
+}
+
+int hostCompleteRequest(AsyncWebServerRequest &request) {
+  AsyncWebServerResponse *response = request.response;
+  if (!response) {
+    return 0;
+  }
+  request.response = nullptr;
+  request.body = String();
+  request.contentType = response->_contentType;
+
+  uint8_t chunk[1460];
+  size_t sent = 0;
+  while (response->_sourceValid() && (response->_chunked || sent < response->_contentLength)) {
+    size_t maxLen = response->_chunked ? sizeof(chunk) : min(sizeof(chunk), response->_contentLength - sent);
+    size_t length = response->_fillBuffer(chunk, maxLen);
+    if (length == RESPONSE_TRY_AGAIN) {
+      continue;  // Only asked for with a short buffer, which this never passes
+    }
+    if (length == 0) {
+      break;
+    }
+    request.body.concat((const char *)chunk, length);
+    sent += length;
+  }
+  int code = response->_code;
+  delete response;
+  return code;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+// Just enough of ESPAsyncWebServer for the response code paths (tools/bench,
+// tools/modbus).
+// A request keeps the response it was sent until hostCompleteRequest()
+// streams it out in TCP-sized chunks and deletes it, as the server does once
+// the last byte is acknowledged.
+
+#include <Arduino.h>
+#include <functional>
+
+#define RESPONSE_TRY_AGAIN 0xFFFFFFFF
+
+// Fills buffer with up to maxLen bytes of the body from offset index; 0 ends it
+typedef std::function<size_t(uint8_t *buffer, size_t maxLen, size_t index)> AwsResponseFiller;
+
+class AsyncWebServerResponse {
+public:
+  virtual ~AsyncWebServerResponse() {}
+  virtual bool _sourceValid() const { return false; }
+  virtual size_t _fillBuffer(uint8_t *data, size_t maxLen) { (void)data; (void)maxLen; return 0; }
+  void addHeader(const String &name, const String &value) { (void)name; (void)value; }
+
+  int _code = 0;
+  String _contentType;
+  size_t _contentLength = 0;
+  bool _chunked = false;  // Length unknown, the body ends with the first empty fill
+};
+
+class AsyncAbstractResponse : public AsyncWebServerResponse {};
+
+class AsyncWebServerRequest {
+public:
+  AsyncWebServerRequest() {}
+  AsyncWebServerRequest(const AsyncWebServerRequest &) = delete;
+  AsyncWebServerRequest &operator=(const AsyncWebServerRequest &) = delete;
+  ~AsyncWebServerRequest() { delete response; }
+
+  void send(AsyncWebServerResponse *response);
+  void send(int code, const String &contentType = String(), const String &content = String());
+  void send_P(int code, const String &contentType, const char *content) { send(code, contentType, String(content)); }
+  AsyncWebServerResponse *beginChunkedResponse(const String &contentType, AwsResponseFiller callback);
+
+  AsyncWebServerResponse *response = nullptr;  // Sent, not yet completed
+  String body;                                 // Filled by hostCompleteRequest()
+  String contentType;
+};
+
+// Streams out and frees the pending response; returns its status code, 0 when
+// nothing was sent
+int hostCompleteRequest(AsyncWebServerRequest &request);
@@ -0,0 +1,114 @@
+#include <FS.h>
+#include <SPIFFS.h>
+#include <map>
+#include <string>
+
+struct HostFile {
+  std::vector<uint8_t> data;
+};
+
+SPIFFSFS SPIFFS;
+
+static std::map<std::string, std::shared_ptr<HostFile>> files;
+
+size_t File::write(const uint8_t *buffer, size_t size) {
+  if (!file || !writable) return 0;
+  if (offset + size > file->data.size()) file->data.resize(offset + size);
+  memcpy(file->data.data() + offset, buffer, size);
+  offset += size;
+  return size;
+}
+
+int File::available() {
+  return file && offset < file->data.size() ? (int)(file->data.size() - offset) : 0;
+}
+
+int File::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+size_t File::read(uint8_t *buffer, size_t size) {
+  size_t count = min(size, (size_t)available());
+  if (count > 0) memcpy(buffer, file->data.data() + offset, count);
+  offset += count;
+  return count;
+}
+
+bool File::seek(uint32_t position, SeekMode mode) {
+  if (!file) return false;
+  size_t base = mode == SeekSet ? 0 : mode == SeekCur ? offset : file->data.size();
+  if (base + position > file->data.size()) return false;
+  offset = base + position;
+  return true;
+}
+
+size_t File::size() const {
+  return file ? file->data.size() : 0;
+}
+
+void File::close() {
+  file.reset();
+  names.reset();
+}
+
+File File::openNextFile() {
+  if (!names || nextName >= names->size()) return File();
+  return SPIFFS.open((*names)[nextName++]);
+}
+
+File fs::FS::open(const char *path, const char *mode) {
+  if (strcmp(path, "/") == 0) {
+    auto names = std::make_shared<std::vector<String>>();
+    for (const auto &entry : files) {
+      names->push_back(entry.first.c_str());
+    }
+    return File(names, path);
+  }
+
+  auto entry = files.find(path);
+  if (mode[0] == 'r') {
+    return entry == files.end() ? File() : File(entry->second, path, mode[1] == '+', 0);
+  }
+  if (entry == files.end()) {
+    entry = files.emplace(path, std::make_shared<HostFile>()).first;
+  }
+  if (mode[0] == 'w') {
+    entry->second->data.clear();
+  }
+  return File(entry->second, path, true, mode[0] == 'a' ? entry->second->data.size() : 0);
+}
+
+bool fs::FS::exists(const char *path) {
+  return files.count(path) > 0;
+}
+
+bool fs::FS::remove(const char *path) {
+  return files.erase(path) > 0;
+}
+
+bool fs::FS::rename(const char *from, const char *to) {
+  auto entry = files.find(from);
+  if (entry == files.end()) return false;
+  if (strcmp(from, to) == 0) return true;
+  files[to] = entry->second;
+  files.erase(from);
+  return true;
+}
+
+size_t SPIFFSFS::totalBytes() {
+  return 1 << 20;
+}
+
+size_t SPIFFSFS::usedBytes() {
+  size_t used = 0;
+  for (const auto &entry : files) {
+    used += entry.second->data.size();
+  }
+  return used;
+}
+
+bool SPIFFSFS::format() {
+  files.clear();
+  return true;
+}
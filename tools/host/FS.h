@@ -0,0 +1,67 @@
+#pragma once
+
+#include <Arduino.h>
+#include <memory>
+#include <vector>
+
+// In-memory file system: files live as long as the process, directories are
+// implied by the paths
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+enum SeekMode { SeekSet, SeekCur, SeekEnd };
+
+struct HostFile;
+
+class File : public Print {
+public:
+  File() {}
+  File(std::shared_ptr<HostFile> file, const String &path, bool writable, size_t position)
+    : file(file), writable(writable), offset(position), path(path) {}
+  // Directory listing, see openNextFile()
+  File(std::shared_ptr<std::vector<String>> names, const String &path) : names(names), path(path) {}
+
+  explicit operator bool() const { return file || names; }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+  int available();
+  int read();
+  size_t read(uint8_t *buffer, size_t size);
+  bool seek(uint32_t position, SeekMode mode = SeekSet);
+  size_t position() const { return offset; }
+  size_t size() const;
+  void flush() {}
+  void close();
+  const char *name() const { return path.c_str(); }
+  bool isDirectory() const { return (bool)names; }
+  File openNextFile();
+
+private:
+  std::shared_ptr<HostFile> file;
+  bool writable = false;
+  size_t offset = 0;
+  std::shared_ptr<std::vector<String>> names;
+  size_t nextName = 0;
+  String path;
+};
+
+namespace fs {
+
+class FS {
+public:
+  File open(const char *path, const char *mode = FILE_READ);
+  File open(const String &path, const char *mode = FILE_READ) { return open(path.c_str(), mode); }
+  bool exists(const char *path);
+  bool exists(const String &path) { return exists(path.c_str()); }
+  bool remove(const char *path);
+  bool remove(const String &path) { return remove(path.c_str()); }
+  bool rename(const char *from, const char *to);
+  bool rename(const String &from, const String &to) { return rename(from.c_str(), to.c_str()); }
+};
+
+}  // namespace fs
+
+using fs::FS;
@@ -0,0 +1,19 @@
+#include "HostSettings.h"
+#include "ModbusServer.h"
+#include "Settings.h"
+
+bool applySettingOverride(const char *assignment) {
+  const char *separator = strchr(assignment, '=');
+  if (!separator) return false;
+  String name = String(assignment).substring(0, separator - assignment);
+  const char *value = separator + 1;
+
+#define SET_NUMBER(field, scale, minimum, maximum) \
+  if (name == #field) { settings.field = atof(value); return true; }
+#define SET_CHOICE(field, options) \
+  if (name == #field) { settings.field = value; return true; }
+  MODBUS_HOLDING_REGISTERS(SET_NUMBER, SET_CHOICE)
+#undef SET_NUMBER
+#undef SET_CHOICE
+  return false;
+}
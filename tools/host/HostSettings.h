@@ -0,0 +1,5 @@
+#pragma once
+
+// Applies a "name=value" command-line override to the firmware settings.
+// Accepts every setting of the Modbus holding register table.
+bool applySettingOverride(const char *assignment);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+#include <string>
+
+// NVS replacement backed by a process-wide map, so settings survive
+// Preferences objects but not the process
+
+class Preferences {
+public:
+  bool begin(const char *name, bool readOnly = false);
+  void end() { space = nullptr; }
+  bool clear();
+  bool remove(const char *key);
+  bool isKey(const char *key);
+
+  size_t putBool(const char *key, bool value) { return put(key, &value, sizeof(value)); }
+  size_t putUChar(const char *key, uint8_t value) { return put(key, &value, sizeof(value)); }
+  size_t putInt(const char *key, int32_t value) { return put(key, &value, sizeof(value)); }
+  size_t putUInt(const char *key, uint32_t value) { return put(key, &value, sizeof(value)); }
+  size_t putFloat(const char *key, float value) { return put(key, &value, sizeof(value)); }
+  size_t putString(const char *key, const String &value) { return put(key, value.c_str(), value.length()); }
+  size_t putBytes(const char *key, const void *value, size_t length) { return put(key, value, length); }
+
+  bool getBool(const char *key, bool defaultValue = false) { return get(key, defaultValue); }
+  uint8_t getUChar(const char *key, uint8_t defaultValue = 0) { return get(key, defaultValue); }
+  int32_t getInt(const char *key, int32_t defaultValue = 0) { return get(key, defaultValue); }
+  uint32_t getUInt(const char *key, uint32_t defaultValue = 0) { return get(key, defaultValue); }
+  float getFloat(const char *key, float defaultValue = NAN) { return get(key, defaultValue); }
+  String getString(const char *key, const String &defaultValue = String());
+  size_t getBytesLength(const char *key);
+  size_t getBytes(const char *key, void *buffer, size_t length);
+
+private:
+  typedef std::map<std::string, std::string> Namespace;
+
+  size_t put(const char *key, const void *value, size_t length);
+  template <class T>
+  T get(const char *key, T defaultValue) {
+    T value;
+    return getBytes(key, &value, sizeof(value)) == sizeof(value) ? value : defaultValue;
+  }
+
+  Namespace *space = nullptr;
+  bool readOnly = false;
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <FS.h>
+
+class SPIFFSFS : public fs::FS {
+public:
+  bool begin(bool formatOnFail = false) { (void)formatOnFail; return true; }
+  size_t totalBytes();
+  size_t usedBytes();
+  bool format();
+};
+
+extern SPIFFSFS SPIFFS;
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <Arduino.h>
+
+// The host is always "connected" so setupWiFi() returns immediately
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_CONNECTED = 3,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+class IPAddress {
+public:
+  String toString() const { return "127.0.0.1"; }
+  operator String() const { return toString(); }
+};
+
+class WiFiClass {
+public:
+  void begin(const char *ssid, const char *password) { (void)ssid; (void)password; }
+  wl_status_t status() { return WL_CONNECTED; }
+  IPAddress localIP() { return IPAddress(); }
+};
+
+extern WiFiClass WiFi;
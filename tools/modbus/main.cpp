@@ -0,0 +1,455 @@
+// Loopback test of the Modbus TCP server, and a polling comparison with the
+// HTTP/JSON endpoints it replaces for building-management systems.
+//
+//   pio run -e modbus
+//   .pio/build/modbus/program [options]
+//
+// The firmware's ModbusServer runs on the host AsyncTCP (tools/host), whose
+// callbacks hostPollTCP() runs on this thread; the master is a plain socket
+// client. The checks cover the register map, writes and their validation,
+// exception responses, frames split across segments, pipelined frames, the
+// connection limit and dropping a peer that does not speak Modbus.
+//
+// The comparison then polls the same state both ways:
+//   modbus  one persistent connection, one read of the input registers and
+//           one of the holding registers (the settings)
+//   http    GET /temperature, /alert_status and /get_settings, a connection
+//           each as the web server closes after every response, built by the
+//           firmware's fill functions and response pool and parsed with
+//           ArduinoJson
+// Loopback leaves out the Wi-Fi round trips, which make every extra request
+// and connection cost more on the device than here; requests, connections
+// and bytes per poll are reported next to the latency for that reason.
+
+#include "ModbusServer.h"
+#include "ResponsePool.h"
+#include "Settings.h"
+#include "Hardware.h"
+#include "Probes.h"
+#include "FaultDetector.h"
+#include "config.h"
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <AsyncTCP.h>
+#include <ESPAsyncWebServer.h>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+const uint16_t HTTP_PORT = 80;
+const int IO_TIMEOUT_MS = 2000;
+
+#define MODBUS_COUNT_NUMERIC(field, scale, minimum, maximum) +1
+#define MODBUS_COUNT_CHOICE(field, options) +1
+constexpr uint16_t HOLDING_COUNT = 0 MODBUS_HOLDING_REGISTERS(MODBUS_COUNT_NUMERIC, MODBUS_COUNT_CHOICE);
+constexpr uint16_t INPUT_COUNT = IR_FAULTS + 1;
+
+static int failures = 0;
+
+static void check(const char *name, bool passed) {
+  printf("  %-52s %s\n", name, passed ? "ok" : "FAILED");
+  if (!passed) failures++;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: modbus [options]\n"
+          "  --polls N        polls per protocol in the comparison (default 1000)\n"
+          "  --port-offset N  added to the Modbus and HTTP ports (default 20000)\n"
+          "  -v               echo the firmware's serial output to stderr\n");
+}
+
+// ---- Master side: blocking writes, reads that keep the firmware served ----
+
+static int connectTo(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int flag = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port + hostTcpPortOffset);
+  if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  hostPollTCP(0);  // Accept it
+  return fd;
+}
+
+static void sendAll(int fd, const void *data, size_t length) {
+  const char *bytes = (const char *)data;
+  while (length > 0) {
+    ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+    if (sent <= 0) return;
+    bytes += sent;
+    length -= sent;
+  }
+}
+
+// Appends what fd has to `data` while serving the firmware until complete()
+// holds, the peer closed (returns false) or IO_TIMEOUT_MS passed
+template <typename Complete>
+static bool receiveUntil(int fd, std::string &data, Complete complete) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(IO_TIMEOUT_MS);
+  while (!complete(data)) {
+    char buffer[2048];
+    ssize_t length = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (length > 0) {
+      data.append(buffer, length);
+      continue;
+    }
+    if (length == 0 || std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    hostPollTCP(1);
+  }
+  return true;
+}
+
+static void putWord(std::string &out, uint16_t value) {
+  out += (char)(value >> 8);
+  out += (char)(value & 0xFF);
+}
+
+static uint16_t getWord(const std::string &in, size_t offset) {
+  return ((uint8_t)in[offset] << 8) | (uint8_t)in[offset + 1];
+}
+
+static std::string modbusFrame(uint16_t transaction, const std::string &pdu) {
+  std::string frame;
+  putWord(frame, transaction);
+  putWord(frame, 0);
+  putWord(frame, pdu.size() + 1);
+  frame += (char)1;  // Unit id, any is answered
+  return frame + pdu;
+}
+
+static std::string readRequest(uint8_t function, uint16_t start, uint16_t quantity) {
+  std::string pdu(1, (char)function);
+  putWord(pdu, start);
+  putWord(pdu, quantity);
+  return pdu;
+}
+
+static std::string writeRequest(uint16_t start, const std::vector<int16_t> &values) {
+  std::string pdu(1, (char)(values.size() == 1 ? 0x06 : 0x10));
+  putWord(pdu, start);
+  if (values.size() > 1) {
+    putWord(pdu, values.size());
+    pdu += (char)(values.size() * 2);
+  }
+  for (int16_t value : values) putWord(pdu, value);
+  return pdu;
+}
+
+static bool frameComplete(const std::string &data, size_t offset = 0) {
+  return data.size() >= offset + 6 && data.size() >= offset + 6 + getWord(data, offset + 4);
+}
+
+// Sends a request frame and returns the PDU of the response, empty when none came
+static std::string transact(int fd, uint16_t transaction, const std::string &pdu) {
+  std::string frame = modbusFrame(transaction, pdu);
+  sendAll(fd, frame.data(), frame.size());
+  std::string response;
+  if (!receiveUntil(fd, response, [](const std::string &data) { return frameComplete(data); }) ||
+      getWord(response, 0) != transaction) {
+    return std::string();
+  }
+  return response.substr(7, getWord(response, 4) - 1);
+}
+
+static bool isException(const std::string &pdu, uint8_t function, uint8_t code) {
+  return pdu.size() == 2 && (uint8_t)pdu[0] == (function | 0x80) && (uint8_t)pdu[1] == code;
+}
+
+static bool peerClosed(int fd) {
+  std::string data;
+  return !receiveUntil(fd, data, [](const std::string &) { return false; }) && data.empty();
+}
+
+// ---- Firmware side: the HTTP endpoints a BMS would otherwise scrape ----
+
+struct HttpEndpoint {
+  const char *path;
+  ResponseEndpoint endpoint;
+  void (*fill)(JsonDocument &doc);
+};
+
+static void fillZoneSettingsJSON(JsonDocument &doc) {
+  fillSettingsJSON(doc, true);
+}
+
+static const HttpEndpoint HTTP_ENDPOINTS[] = {
+  {"/temperature", EP_TEMPERATURE, fillCurrentTemperatureJSON},
+  {"/alert_status", EP_ALERT_STATUS, fillAlertStatusJSON},
+  {"/get_settings", EP_GET_SETTINGS, fillZoneSettingsJSON}
+};
+
+// Answers one GET per connection and closes it, as ESPAsyncWebServer does
+// without keep-alive
+static void handleHttpData(void *arg, AsyncClient *client, void *data, size_t length) {
+  std::string &request = *(std::string *)arg;
+  request.append((const char *)data, length);
+  if (request.find("\r\n\r\n") == std::string::npos) {
+    return;
+  }
+  size_t pathStart = request.find(' ') + 1;
+  std::string path = request.substr(pathStart, request.find_first_of(" ?", pathStart) - pathStart);
+
+  AsyncWebServerRequest response;
+  for (const HttpEndpoint &endpoint : HTTP_ENDPOINTS) {
+    if (path == endpoint.path) {
+      sendJsonResponse(&response, endpoint.endpoint, endpoint.fill);
+    }
+  }
+  if (!response.response) {
+    response.send(404, "text/plain", "Not found");
+  }
+  int code = hostCompleteRequest(response);
+
+  char header[160];
+  int headerLength = snprintf(header, sizeof(header),
+                              "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+                              code, code == 200 ? "OK" : "Not Found", response.contentType.c_str(),
+                              response.body.length());
+  client->add(header, headerLength);
+  client->add(response.body.c_str(), response.body.length());
+  client->send();
+  client->close();
+}
+
+static void handleHttpClient(void *, AsyncClient *client) {
+  std::string *request = new std::string();
+  client->onData(handleHttpData, request);
+  client->onDisconnect([](void *arg, AsyncClient *client) {
+    delete (std::string *)arg;
+    delete client;
+  }, request);
+}
+
+// Fetches path on a new connection and parses the body; returns the bytes
+// sent and received, 0 on failure
+static size_t httpGet(const char *path, JsonDocument &doc) {
+  int fd = connectTo(HTTP_PORT);
+  if (fd < 0) return 0;
+  std::string request = std::string("GET ") + path + " HTTP/1.1\r\nHost: fridge\r\nConnection: close\r\n\r\n";
+  sendAll(fd, request.data(), request.size());
+  std::string response;
+  receiveUntil(fd, response, [](const std::string &) { return false; });  // To the server's close
+  close(fd);
+  size_t body = response.find("\r\n\r\n");
+  if (body == std::string::npos || deserializeJson(doc, response.substr(body + 4))) {
+    return 0;
+  }
+  return request.size() + response.size();
+}
+
+// ---- Checks ----
+
+static void runChecks() {
+  printf("register map and protocol\n");
+  int master = connectTo(MODBUS_PORT);
+  check("master connects", master >= 0);
+  if (master < 0) return;
+
+  std::string inputs = transact(master, 1, readRequest(0x04, 0, INPUT_COUNT));
+  check("input registers: read all", inputs.size() == 2 + INPUT_COUNT * 2u && (uint8_t)inputs[1] == INPUT_COUNT * 2);
+  if (inputs.size() == 2 + INPUT_COUNT * 2u) {
+    auto input = [&](int address) { return getWord(inputs, 2 + address * 2); };
+    check("input registers: cabinet temperature in 0.1 degC",
+          (int16_t)input(IR_CABINET_TEMPERATURE) == lroundf(currentTemperature * 10));
+    check("input registers: evaporator 0x8000 without P2P",
+          settings.P2P == "y" || input(IR_EVAPORATOR_TEMPERATURE) == 0x8000);
+    check("input registers: probe count", input(IR_PROBE_COUNT) == getProbeCount());
+    check("input registers: uptime, high word first",
+          ((uint32_t)input(IR_UPTIME) << 16 | input(IR_UPTIME + 1)) == millis() / 1000);
+  }
+
+  std::string holdings = transact(master, 2, readRequest(0x03, 0, HOLDING_COUNT));
+  check("holding registers: read all", holdings.size() == 2 + HOLDING_COUNT * 2u);
+  if (holdings.size() == 2 + HOLDING_COUNT * 2u) {
+    check("holding registers: SEt scaled by 10", (int16_t)getWord(holdings, 2) == lroundf(settings.SEt * 10));
+  }
+
+  float previousSetpoint = settings.SEt;
+  std::string pdu = writeRequest(0, {-50});
+  check("write single: echoed", transact(master, 3, pdu) == pdu);
+  std::string readBack = transact(master, 4, readRequest(0x03, 0, 1));
+  check("write single: visible before it is applied",
+        readBack.size() == 4 && (int16_t)getWord(readBack, 2) == -50 && settings.SEt == previousSetpoint);
+  updateModbus();
+  check("write single: applied by updateModbus()", settings.SEt == -5.0f);
+
+  std::string echo = transact(master, 5, writeRequest(1, {20, -300, 500}));
+  check("write multiple: start and quantity echoed",
+        echo.size() == 5 && getWord(echo, 1) == 1 && getWord(echo, 3) == 3);
+  updateModbus();
+  check("write multiple: applied", settings.Hy == 2.0f && settings.LS == -30.0f && settings.US == 50.0f);
+
+  check("write out of range: exception 03", isException(transact(master, 6, writeRequest(0, {2000})), 0x06, 0x03));
+  check("read past the map: exception 02",
+        isException(transact(master, 7, readRequest(0x04, INPUT_COUNT - 1, 2)), 0x04, 0x02));
+  check("read of 0 registers: exception 03", isException(transact(master, 8, readRequest(0x03, 0, 0)), 0x03, 0x03));
+  check("unsupported function: exception 01", isException(transact(master, 9, std::string(1, (char)0x2B)), 0x2B, 0x01));
+
+  // One frame in three segments, served in between
+  std::string frame = modbusFrame(10, readRequest(0x04, IR_CABINET_TEMPERATURE, 1));
+  std::string response;
+  for (size_t offset = 0; offset < frame.size(); offset += 5) {
+    sendAll(master, frame.data() + offset, std::min((size_t)5, frame.size() - offset));
+    hostPollTCP(1);
+  }
+  check("frame split across segments",
+        receiveUntil(master, response, [](const std::string &data) { return frameComplete(data); }) &&
+            getWord(response, 0) == 10 && response.size() == 7 + 4);
+
+  // Two frames in one segment
+  std::string pipelined = modbusFrame(11, readRequest(0x04, 0, 1)) + modbusFrame(12, readRequest(0x03, 0, 1));
+  sendAll(master, pipelined.data(), pipelined.size());
+  response.clear();
+  bool both = receiveUntil(master, response, [](const std::string &data) {
+    return frameComplete(data) && frameComplete(data, 6 + getWord(data, 4));
+  });
+  check("pipelined frames answered in order",
+        both && getWord(response, 0) == 11 && getWord(response, 6 + getWord(response, 4)) == 12);
+
+  // The master holds one connection, the limit allows MODBUS_MAX_CLIENTS
+  std::vector<int> others;
+  for (int i = 1; i < MODBUS_MAX_CLIENTS; i++) {
+    others.push_back(connectTo(MODBUS_PORT));
+  }
+  check("masters up to the limit are served", transact(others.back(), 13, readRequest(0x04, 0, 1)).size() == 4);
+  int rejected = connectTo(MODBUS_PORT);
+  check("a master over the limit is dropped", rejected >= 0 && peerClosed(rejected));
+  close(rejected);
+  for (int fd : others) close(fd);
+  for (int i = 0; i < 10; i++) hostPollTCP(1);  // Let the server see the closes
+  int again = connectTo(MODBUS_PORT);
+  check("closed connections free their places", transact(again, 14, readRequest(0x04, 0, 1)).size() == 4);
+  close(again);
+
+  int stranger = connectTo(MODBUS_PORT);
+  const char *notModbus = "GET / HTTP/1.1\r\n\r\n";
+  sendAll(stranger, notModbus, strlen(notModbus));
+  check("a peer that does not speak Modbus is dropped", peerClosed(stranger));
+  close(stranger);
+
+  JsonDocument temperature;
+  check("HTTP /temperature agrees with the registers",
+        httpGet("/temperature", temperature) > 0 &&
+            lroundf(temperature["main"].as<float>() * 10) == lroundf(currentTemperature * 10));
+
+  settings.SEt = previousSetpoint;
+  close(master);
+  for (int i = 0; i < 10; i++) hostPollTCP(1);
+}
+
+// ---- Comparison ----
+
+struct PollStats {
+  std::vector<double> micros;
+  size_t requests = 0;
+  size_t connections = 0;
+  size_t bytes = 0;
+  int errors = 0;
+};
+
+static void printStats(const char *name, PollStats &stats, int polls) {
+  std::sort(stats.micros.begin(), stats.micros.end());
+  double total = 0;
+  for (double micros : stats.micros) total += micros;
+  auto percentile = [&](double p) { return stats.micros[std::min(stats.micros.size() - 1, (size_t)(p * stats.micros.size()))]; };
+  printf("%-7s %9.1f %9.1f %9.1f %9.0f %9.1f %9.1f %9zu %6d\n", name, total / polls, percentile(0.5),
+         percentile(0.99), polls / (total / 1e6), (double)stats.requests / polls, (double)stats.connections / polls,
+         stats.bytes / polls, stats.errors);
+}
+
+static void runComparison(int polls) {
+  using clock = std::chrono::steady_clock;
+  PollStats modbus, http;
+
+  int master = connectTo(MODBUS_PORT);
+  modbus.connections = 1;
+  std::string inputRead = readRequest(0x04, 0, INPUT_COUNT);
+  std::string holdingRead = readRequest(0x03, 0, HOLDING_COUNT);
+  for (int i = 0; i < polls; i++) {
+    auto start = clock::now();
+    std::string inputs = transact(master, (uint16_t)(2 * i), inputRead);
+    std::string holdings = transact(master, (uint16_t)(2 * i + 1), holdingRead);
+    modbus.micros.push_back(std::chrono::duration<double, std::micro>(clock::now() - start).count());
+    modbus.requests += 2;
+    modbus.bytes += inputs.size() + holdings.size() + 4 * 7;  // PDUs plus the request and response headers
+    modbus.bytes += inputRead.size() + holdingRead.size();
+    if (inputs.size() != 2 + INPUT_COUNT * 2u || holdings.size() != 2 + HOLDING_COUNT * 2u) modbus.errors++;
+  }
+  close(master);
+
+  for (int i = 0; i < polls; i++) {
+    auto start = clock::now();
+    size_t bytes = 0;
+    bool complete = true;
+    for (const HttpEndpoint &endpoint : HTTP_ENDPOINTS) {
+      JsonDocument doc;
+      size_t received = httpGet(endpoint.path, doc);
+      complete = complete && received > 0;
+      bytes += received;
+    }
+    http.micros.push_back(std::chrono::duration<double, std::micro>(clock::now() - start).count());
+    http.requests += 3;
+    http.connections += 3;
+    http.bytes += bytes;
+    if (!complete) http.errors++;
+  }
+
+  printf("\n%d polls of the live state and the settings over loopback (us per poll)\n", polls);
+  printf("protocol     mean       p50       p99   polls/s  requests    conns     bytes errors\n");
+  printStats("modbus", modbus, polls);
+  printStats("http", http, polls);
+}
+
+int main(int argc, char **argv) {
+  int polls = 1000;
+  hostTcpPortOffset = 20000;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--polls") == 0 && i + 1 < argc) {
+      polls = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--port-offset") == 0 && i + 1 < argc) {
+      hostTcpPortOffset = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-v") == 0) {
+      hostSerialEcho = true;
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  if (polls < 1) {
+    usage();
+    return 2;
+  }
+
+  hostEpoch = 1704067200;  // 2024-01-01, NTP-synced
+  hostMillis = 3723000;
+  loadSettings();
+  setupProbes();  // Migrates to two NTC probes on the empty host NVS
+  setupFaultDetector();
+  currentTemperature = 4.2;
+  evaporatorTemperature = -12.5;
+  setupModbus();
+  updateModbus();
+
+  AsyncServer http(HTTP_PORT);
+  http.onClient(handleHttpClient, nullptr);
+  http.begin();
+
+  runChecks();
+  runComparison(polls);
+  printf("\n%s\n", failures ? "FAILED" : "all checks passed");
+  return failures ? 1 : 0;
+}
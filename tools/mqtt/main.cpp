@@ -0,0 +1,433 @@
+// Host test of the MQTT publisher: broker outages and reconnects, acks across
+// a reconnect, overflow of the flash queue, and the publishing figures.
+//
+//   pio run -e mqtt
+//   .pio/build/mqtt/program [-v]
+//
+// MqttPublisher runs on the virtual clock against the in-memory broker of the
+// AsyncMqttClient mock and the in-memory SPIFFS (tools/host). The event
+// journal is replaced by the stand-in below, which keeps every record it
+// hands to the publisher. The checks then hold what the broker received
+// against it: per topic every record in order, where a record delivered
+// again is counted as a duplicate, and nothing missing except the gaps that
+// the batch after them reports with "lost".
+//
+// Scenarios:
+//   steady    10 minutes online
+//   outage    the broker is down for 30 minutes
+//   ordering  live batches lost on a dead link, then acks held and released
+//             newest first, across a session drop each
+//   overflow  the broker is down for 13 hours, longer than the queue holds
+// The figures are in virtual time, where the drain is limited by
+// MQTT_DRAIN_INTERVAL; the host time per published message is the
+// publisher's own cost.
+
+#include "MqttPublisher.h"
+#include "EventJournal.h"
+#include "config.h"
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <AsyncMqttClient.h>
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+
+enum Topic { EVENTS = 0, SAMPLES = 1 };  // As the publisher indexes them
+
+static const char *const TOPIC_NAMES[] = {"events", "samples"};
+
+static int failures = 0;
+
+static void check(const char *name, bool passed) {
+  printf("  %-60s %s\n", name, passed ? "ok" : "FAILED");
+  if (!passed) failures++;
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: mqtt [options]\n"
+          "  -v  echo the firmware's serial output to stderr\n");
+}
+
+// ---- Event journal stand-in ----
+
+// Samples only carry seconds; they are MQTT_SAMPLE_INTERVAL apart
+static uint64_t recordKey(int topic, uint32_t time, uint16_t millis) {
+  return (uint64_t)time * 1000 + (topic == SAMPLES ? 0 : millis);
+}
+
+static std::vector<uint64_t> produced[2];  // Every record handed to the publisher, per topic
+static JournalListener journalListener = nullptr;
+static uint8_t journalStates = 0;
+
+static JournalRecord makeRecord(JournalEventType type, uint8_t value) {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  JournalRecord record = {(uint32_t)tv.tv_sec, (uint16_t)(tv.tv_usec / 1000), type, value, 42, -125};
+  int topic = type == EVT_SNAPSHOT ? SAMPLES : EVENTS;
+  produced[topic].push_back(recordKey(topic, record.time, record.millis));
+  return record;
+}
+
+void setJournalListener(JournalListener listener) {
+  journalListener = listener;
+}
+
+JournalRecord sampleJournalSnapshot() {
+  return makeRecord(EVT_SNAPSHOT, journalStates);
+}
+
+const char *journalEventName(uint8_t type) {
+  return type == EVT_COMPRESSOR ? "compressor" : "unknown";
+}
+
+// A compressor start or stop, handed over as updateEventJournal() does
+static void emitEvent() {
+  journalStates ^= JOURNAL_STATE_BIT(EVT_COMPRESSOR);
+  JournalRecord record = makeRecord(EVT_COMPRESSOR, journalStates & 1);
+  journalListener(&record, 1);
+}
+
+// ---- Subscriber ----
+
+struct Delivery {
+  uint64_t key;
+  uint32_t lost;  // Reported missing right before this record
+};
+
+struct TopicTraffic {
+  std::vector<Delivery> stream;  // First deliveries, in arrival order
+  std::set<uint64_t> seen;
+  size_t duplicates = 0;
+  size_t messages = 0;
+  size_t records = 0;
+  size_t payloadBytes = 0;
+  size_t wireBytes = 0;
+};
+
+static TopicTraffic traffic[2];
+static size_t receivedMessages = 0;  // Of hostMqttMessages
+static bool malformed = false;
+
+static bool endsWith(const std::string &text, const char *suffix) {
+  size_t length = strlen(suffix);
+  return text.size() >= length && text.compare(text.size() - length, length, suffix) == 0;
+}
+
+static void receive() {
+  for (; receivedMessages < hostMqttMessages.size(); receivedMessages++) {
+    const HostMqttMessage &message = hostMqttMessages[receivedMessages];
+    int topic = endsWith(message.topic, "/samples") ? SAMPLES : endsWith(message.topic, "/events") ? EVENTS : -1;
+    if (topic < 0) {
+      continue;  // status, alarm
+    }
+    JsonDocument doc;
+    if (deserializeJson(doc, message.payload) || message.qos != 1) {
+      malformed = true;
+      continue;
+    }
+    TopicTraffic &t = traffic[topic];
+    JsonArray records = topic == SAMPLES ? doc["t"].as<JsonArray>() : doc["events"].as<JsonArray>();
+    uint32_t lost = doc["lost"] | 0;
+    for (size_t i = 0; i < records.size(); i++) {
+      uint64_t key = topic == SAMPLES ? recordKey(topic, records[i].as<uint32_t>(), 0)
+                                      : recordKey(topic, records[i]["t"].as<uint32_t>(), records[i]["ms"].as<uint32_t>());
+      if (!t.seen.insert(key).second) {
+        t.duplicates++;
+        continue;
+      }
+      t.stream.push_back({key, i == 0 ? lost : 0});
+    }
+    t.messages++;
+    t.records += records.size();
+    t.payloadBytes += message.payload.size();
+    t.wireBytes += message.wireBytes;
+  }
+}
+
+struct StreamCheck {
+  bool inOrder = true;    // Every delivery is the next produced record after the reported gap
+  size_t undelivered = 0; // Produced after the last delivery
+  uint32_t lost = 0;
+  int gaps = 0;
+  size_t firstGap = 0;    // Index in produced of the first missing record
+};
+
+static StreamCheck checkStream(int topic) {
+  StreamCheck result;
+  size_t next = 0;
+  for (const Delivery &delivery : traffic[topic].stream) {
+    if (delivery.lost) {
+      if (result.gaps++ == 0) result.firstGap = next;
+      result.lost += delivery.lost;
+      next += delivery.lost;
+    }
+    if (next >= produced[topic].size() || produced[topic][next] != delivery.key) {
+      result.inOrder = false;
+      return result;
+    }
+    next++;
+  }
+  result.undelivered = produced[topic].size() - next;
+  return result;
+}
+
+// ---- Firmware loop ----
+
+const unsigned long LOOP_TICK = 100;  // ms per loop() on the device
+const size_t SAMPLES_PER_BATCH_INTERVAL = MQTT_BATCH_INTERVAL / MQTT_SAMPLE_INTERVAL;
+
+static uint64_t loopTicks = 0;
+static double publisherMicros = 0;  // Host time in updateMqtt()
+
+// One loop() per tick with an event every eventEvery ticks, 0 for none
+static void run(unsigned long ms, unsigned long tick, int eventEvery) {
+  using clock = std::chrono::steady_clock;
+  for (unsigned long elapsed = 0; elapsed < ms; elapsed += tick) {
+    hostMillis += tick;
+    if (eventEvery && ++loopTicks % eventEvery == 0) {
+      emitEvent();
+    }
+    auto start = clock::now();
+    updateMqtt();
+    publisherMicros += std::chrono::duration<double, std::micro>(clock::now() - start).count();
+    hostPollMqtt();
+    receive();
+  }
+}
+
+static JsonDocument mqttStats() {
+  JsonDocument doc;
+  fillMqttStatsJSON(doc);
+  return doc;
+}
+
+static uint32_t queuedRecords() {
+  return mqttStats()["queued"] | 0;
+}
+
+static bool runUntilConnected(unsigned long limit) {
+  for (unsigned long waited = 0; waited < limit; waited += LOOP_TICK) {
+    if (mqttStats()["connected"] | false) return true;
+    run(LOOP_TICK, LOOP_TICK, 0);
+  }
+  return false;
+}
+
+struct Drain {
+  size_t backlog = 0;   // Queued records when the session came back
+  unsigned long millis = 0;
+  size_t messages = 0;
+  size_t records = 0;
+  double publisherMicros = 0;
+  long reported = -1;   // lastRecoveryTime of /mqtt_stats
+  bool done = false;
+};
+
+// Brings the broker back and runs until the queue is empty
+static Drain recover(unsigned long limit) {
+  Drain drain;
+  hostMqttBrokerUp = true;
+  hostMqttStalled = false;
+  hostMqttHoldAcks = false;
+  if (!runUntilConnected(MQTT_RECONNECT_INTERVAL + 1000)) {
+    return drain;
+  }
+  drain.backlog = queuedRecords();
+  unsigned long start = hostMillis;
+  size_t messages = traffic[EVENTS].messages + traffic[SAMPLES].messages;
+  size_t records = traffic[EVENTS].records + traffic[SAMPLES].records;
+  double micros = publisherMicros;
+  while (queuedRecords() > 0 && hostMillis - start < limit) {
+    run(LOOP_TICK, LOOP_TICK, 0);
+  }
+  drain.done = queuedRecords() == 0;
+  drain.millis = hostMillis - start;
+  drain.messages = traffic[EVENTS].messages + traffic[SAMPLES].messages - messages;
+  drain.records = traffic[EVENTS].records + traffic[SAMPLES].records - records;
+  drain.publisherMicros = publisherMicros - micros;
+  drain.reported = mqttStats()["lastRecoveryTime"] | -1;
+  return drain;
+}
+
+// Lets the sample batch in RAM go out, so only the newest samples are pending
+static void settle() {
+  run(MQTT_BATCH_INTERVAL + 1000, LOOP_TICK, 0);
+}
+
+static void checkStreams(const char *scenario, bool gapsExpected) {
+  char name[96];
+  for (int topic = EVENTS; topic <= SAMPLES; topic++) {
+    StreamCheck stream = checkStream(topic);
+    snprintf(name, sizeof(name), "%s: %s in order, nothing missing unreported", scenario, TOPIC_NAMES[topic]);
+    check(name, stream.inOrder && (gapsExpected || stream.gaps == 0));
+    snprintf(name, sizeof(name), "%s: %s delivered up to the batch in RAM", scenario, TOPIC_NAMES[topic]);
+    check(name, stream.undelivered <= (topic == SAMPLES ? SAMPLES_PER_BATCH_INTERVAL : 0));
+  }
+}
+
+// ---- Scenarios ----
+
+static Drain outageDrain, overflowDrain;
+static size_t steadySamples = 0, steadySampleBytes = 0, steadySampleWireBytes = 0, steadySampleMessages = 0;
+
+static void runSteady() {
+  printf("steady\n");
+  check("steady: connects", runUntilConnected(2000));
+  size_t samples = traffic[SAMPLES].records;
+  size_t bytes = traffic[SAMPLES].payloadBytes;
+  size_t wireBytes = traffic[SAMPLES].wireBytes;
+  size_t messages = traffic[SAMPLES].messages;
+  run(10 * 60000, LOOP_TICK, 370);
+  settle();
+  steadySamples = traffic[SAMPLES].records - samples;
+  steadySampleBytes = traffic[SAMPLES].payloadBytes - bytes;
+  steadySampleWireBytes = traffic[SAMPLES].wireBytes - wireBytes;
+  steadySampleMessages = traffic[SAMPLES].messages - messages;
+  checkStreams("steady", false);
+  check("steady: nothing queued in flash", (mqttStats()["queuedTotal"] | 0) == 0);
+  check("steady: no duplicates", traffic[EVENTS].duplicates + traffic[SAMPLES].duplicates == 0);
+}
+
+static void runOutage() {
+  printf("outage\n");
+  size_t messages = hostMqttMessages.size();
+  hostMqttBrokerUp = false;
+  run(30 * 60000, LOOP_TICK, 370);
+  JsonDocument stats = mqttStats();
+  check("outage: offline while the broker is down", !(stats["connected"] | true));
+  check("outage: nothing reaches the broker", hostMqttMessages.size() == messages);
+  check("outage: records queue in flash", (stats["queued"] | 0) > 150);
+
+  outageDrain = recover(10 * 60000);
+  check("outage: reconnects and drains the queue", outageDrain.done);
+  check("outage: /mqtt_stats reports the recovery time",
+        outageDrain.reported >= 0 && labs(outageDrain.reported - (long)outageDrain.millis) <= (long)LOOP_TICK);
+  settle();
+  checkStreams("outage", false);
+  check("outage: no duplicates", traffic[EVENTS].duplicates + traffic[SAMPLES].duplicates == 0);
+}
+
+static void runOrdering() {
+  printf("ordering\n");
+  // Live batches published on a link that died: the broker never got them,
+  // and batches queued after them must not overtake them
+  hostMqttStalled = true;
+  run(2000, LOOP_TICK, 1);
+  check("ordering: batches queue behind the lost live ones", queuedRecords() > 0);
+  hostMqttBrokerUp = false;
+  run(1000, LOOP_TICK, 1);
+  check("ordering: drains after the dead link", recover(60000).done);
+  checkStreams("ordering after a dead link", false);
+
+  // Acks held, then released newest first: a queue batch acked before the
+  // ones published ahead of it stays in the queue until they are acked.
+  // The acks reach updateMqtt() on the loop after the poll that brings them.
+  size_t duplicates = traffic[EVENTS].duplicates;
+  hostMqttHoldAcks = true;
+  run(10000, LOOP_TICK, 1);  // The first batches go out live, the rest queue
+  uint32_t queued = queuedRecords();
+  hostMqttReleaseAcks(MQTT_MAX_INFLIGHT, true);
+  run(1000, LOOP_TICK, 0);  // The live batches are done, full queue batches go out
+  check("ordering: acked live batches leave the queue alone", queuedRecords() == queued);
+  hostMqttReleaseAcks(MQTT_MAX_INFLIGHT / 2, true);
+  run(2 * LOOP_TICK, LOOP_TICK, 0);
+  check("ordering: acks out of order pop nothing", queuedRecords() == queued);
+  hostMqttReleaseAcks(MQTT_MAX_INFLIGHT / 2 - 1, true);
+  run(2 * LOOP_TICK, LOOP_TICK, 0);
+  check("ordering: still nothing until the oldest batch is acked", queuedRecords() == queued);
+  hostMqttReleaseAcks(1, true);
+  run(2 * LOOP_TICK, LOOP_TICK, 0);
+  check("ordering: then all acked batches pop",
+        queuedRecords() == queued - (uint32_t)(MQTT_MAX_INFLIGHT * MQTT_BATCH_SIZE));
+
+  // The session drops with acks outstanding; those batches go out again
+  run(1000, LOOP_TICK, 0);
+  hostMqttBrokerUp = false;
+  run(1000, LOOP_TICK, 1);
+  check("ordering: drains after a drop with acks outstanding", recover(60000).done);
+  checkStreams("ordering after held acks", false);
+  printf("  %zu events delivered twice (QoS 1, acks lost with the session)\n",
+         traffic[EVENTS].duplicates - duplicates);
+}
+
+static void runOverflow() {
+  printf("overflow\n");
+  // The samples batched in RAM when the broker went away are older than the
+  // outage, so the first record not delivered yet is where the gap must start
+  size_t delivered[2] = {traffic[EVENTS].stream.size(), traffic[SAMPLES].stream.size()};
+  size_t outageStart[2] = {produced[EVENTS].size(), produced[SAMPLES].size()};
+  uint32_t dropped = mqttStats()["dropped"] | 0;
+  hostMqttBrokerUp = false;
+  run(13 * 3600000UL, 1000, 120);  // Ticks of 1 s, an event every 2 minutes
+  JsonDocument stats = mqttStats();
+  check("overflow: the queue is full", (stats["queued"] | 0) == MQTT_QUEUE_CAPACITY);
+  dropped = (stats["dropped"] | 0) - dropped;
+  check("overflow: records are dropped", dropped > 0);
+
+  overflowDrain = recover(30 * 60000);
+  check("overflow: reconnects and drains the queue", overflowDrain.done);
+  settle();
+  checkStreams("overflow", true);
+  uint32_t reported = 0;
+  bool oldestDropped = true;
+  for (int topic = EVENTS; topic <= SAMPLES; topic++) {
+    StreamCheck stream = checkStream(topic);
+    reported += stream.lost;
+    oldestDropped = oldestDropped && stream.gaps <= 1 && (stream.gaps == 0 || stream.firstGap == delivered[topic]);
+  }
+  check("overflow: the oldest records of the outage are the ones dropped", oldestDropped);
+  check("overflow: \"lost\" accounts for every dropped record", reported == dropped);
+  printf("  %u of %zu records dropped\n", dropped,
+         produced[EVENTS].size() + produced[SAMPLES].size() - outageStart[EVENTS] - outageStart[SAMPLES]);
+}
+
+static void printDrain(const char *name, const Drain &drain) {
+  double seconds = drain.millis / 1000.0;
+  printf("%-9s %8zu %9zu %9.1f %9.1f %10.1f %9.1f\n", name, drain.backlog, drain.messages, seconds,
+         seconds > 0 ? drain.messages / seconds : 0.0, seconds > 0 ? drain.records / seconds : 0.0,
+         drain.messages ? drain.publisherMicros / drain.messages : 0.0);
+}
+
+static void printFigures() {
+  printf("\nDraining the backlog after the broker came back (virtual time)\n");
+  printf("scenario   backlog  messages   drain s    msgs/s  records/s  host us/msg\n");
+  printDrain("outage", outageDrain);
+  printDrain("overflow", overflowDrain);
+
+  const TopicTraffic &samples = traffic[SAMPLES];
+  printf("\nBytes per sample    payload  on the wire  samples/message\n");
+  printf("steady             %8.1f %12.1f %16.1f\n", steadySamples ? (double)steadySampleBytes / steadySamples : 0.0,
+         steadySamples ? (double)steadySampleWireBytes / steadySamples : 0.0,
+         steadySampleMessages ? (double)steadySamples / steadySampleMessages : 0.0);
+  printf("all                %8.1f %12.1f %16.1f\n", samples.records ? (double)samples.payloadBytes / samples.records : 0.0,
+         samples.records ? (double)samples.wireBytes / samples.records : 0.0,
+         samples.messages ? (double)samples.records / samples.messages : 0.0);
+  printf("/mqtt_stats bytesPerSample %.1f\n", mqttStats()["bytesPerSample"] | 0.0f);
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-v") == 0) {
+      hostSerialEcho = true;
+    } else {
+      usage();
+      return 2;
+    }
+  }
+
+  hostEpoch = 1704067200;  // 2024-01-01, NTP-synced
+  hostMillis = 3723000;
+  MQTT_HOST = "127.0.0.1";
+  setupMqtt();
+
+  runSteady();
+  runOutage();
+  runOrdering();
+  runOverflow();
+  check("every message is QoS 1 JSON", !malformed);
+  printFigures();
+  printf("\n%s\n", failures ? "FAILED" : "all checks passed");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,181 @@
+#include "Replay.h"
+#include "config.h"
+#include "Hardware.h"
+#include "Defrost.h"
+#include "Settings.h"
+#include <Arduino.h>
+#include <chrono>
+
+static const char *SIGNAL_NAMES[SIGNAL_COUNT] = {"compressor", "defrost", "fan", "high alarm", "low alarm"};
+
+const char *signalName(uint8_t signal) {
+  return signal < SIGNAL_COUNT ? SIGNAL_NAMES[signal] : "?";
+}
+
+// Firmware state as after a reboot; settings are left as configured
+static void resetControlState(uint8_t outputs) {
+  hostMillis = 0;
+  startupTime = 0;
+  lastDefrostTime = 0;
+  drainingStartTime = 0;
+  isDraining = false;
+  energySavingMode = false;
+  isCompressorOn = outputs & SIGNAL_BIT(SIGNAL_COMPRESSOR);
+  isDefrostOn = outputs & SIGNAL_BIT(SIGNAL_DEFROST);
+  isDefrosting = isDefrostOn;
+  isFanOn = outputs & SIGNAL_BIT(SIGNAL_FAN);
+  highTempAlert = outputs & SIGNAL_BIT(SIGNAL_HIGH_ALARM);
+  lowTempAlert = outputs & SIGNAL_BIT(SIGNAL_LOW_ALARM);
+  resetDefrost();
+}
+
+static uint8_t replayOutputs() {
+  return (isCompressorOn ? SIGNAL_BIT(SIGNAL_COMPRESSOR) : 0) |
+         (isDefrostOn ? SIGNAL_BIT(SIGNAL_DEFROST) : 0) |
+         (isFanOn ? SIGNAL_BIT(SIGNAL_FAN) : 0) |
+         (highTempAlert ? SIGNAL_BIT(SIGNAL_HIGH_ALARM) : 0) |
+         (lowTempAlert ? SIGNAL_BIT(SIGNAL_LOW_ALARM) : 0);
+}
+
+static float interpolate(float from, float to, int64_t fromTime, int64_t toTime, int64_t time) {
+  if (isnan(to) || toTime <= fromTime) return from;
+  return from + (to - from) * (float)(time - fromTime) / (float)(toTime - fromTime);
+}
+
+class DivergenceTracker {
+public:
+  DivergenceTracker(ReplayReport &report, int64_t minDuration) : report(report), minDuration(minDuration) {
+    for (int64_t &start : openSince) start = -1;
+  }
+
+  void update(uint8_t signal, bool recorded, bool replayed, int64_t time) {
+    if (recorded != replayed) {
+      if (openSince[signal] < 0) {
+        openSince[signal] = time;
+        openRecorded[signal] = recorded;
+      }
+    } else {
+      close(signal, time);
+    }
+  }
+
+  void close(uint8_t signal, int64_t time) {
+    if (openSince[signal] < 0) return;
+    int64_t duration = time - openSince[signal];
+    if (duration >= minDuration) {
+      if (report.listedDivergences < REPLAY_MAX_DIVERGENCES) {
+        report.divergences[report.listedDivergences++] = {openSince[signal], duration, signal, openRecorded[signal]};
+      }
+      report.divergenceCount++;
+    }
+    openSince[signal] = -1;
+  }
+
+private:
+  ReplayReport &report;
+  int64_t minDuration;
+  int64_t openSince[SIGNAL_COUNT];
+  bool openRecorded[SIGNAL_COUNT];
+};
+
+void replayTrace(const char *path, const ReplayOptions &options, ReplayReport &report) {
+  auto wallStart = std::chrono::steady_clock::now();
+  memset(&report, 0, sizeof(report));
+
+  TraceReader reader;
+  if (!reader.open(path)) {
+    snprintf(report.error, sizeof(report.error), "%s", reader.error());
+    return;
+  }
+  report.format = reader.format();
+  report.recordedSignals = reader.recordedSignals();
+
+  TraceSample previous, next;
+  if (!reader.next(previous)) {
+    snprintf(report.error, sizeof(report.error), "no samples");
+    return;
+  }
+  bool hasNext = reader.next(next);
+  report.samples = hasNext ? 2 : 1;
+  report.firstTime = previous.time;
+  report.minTemperature = INFINITY;
+  report.maxTemperature = -INFINITY;
+
+  DivergenceTracker divergences(report, options.minDivergenceMillis);
+  uint8_t lastRecorded = 0, lastReplayed = 0;
+  int64_t bootTime = 0;
+  bool boot = true;
+
+  for (int64_t time = previous.time;; time += options.stepMillis) {
+    // The unit was off or not logging: continue at the next sample as after a reboot
+    if (hasNext && time > previous.time && next.time - previous.time > (int64_t)options.maxGapMillis) {
+      for (uint8_t signal = 0; signal < SIGNAL_COUNT; signal++) {
+        divergences.close(signal, time);
+      }
+      time = next.time;
+      report.gaps++;
+      boot = true;
+    }
+    while (hasNext && next.time <= time) {
+      previous = next;
+      hasNext = reader.next(next);
+      report.samples += hasNext;
+    }
+    if (!hasNext && time > previous.time) break;
+
+    if (boot) {
+      resetControlState(options.coldStart ? 0 : previous.outputs);
+      bootTime = time;
+      lastRecorded = previous.outputs;
+      lastReplayed = replayOutputs();
+      boot = false;
+    }
+
+    float temperature = hasNext ? interpolate(previous.temperature, next.temperature, previous.time, next.time, time)
+                                : previous.temperature;
+    float evaporator = hasNext ? interpolate(previous.evaporator, next.evaporator, previous.time, next.time, time)
+                               : previous.evaporator;
+    if (!isnan(temperature)) {
+      report.minTemperature = min(report.minTemperature, temperature);
+      report.maxTemperature = max(report.maxTemperature, temperature);
+    }
+
+    // Same order as loop(); checkErrors() only prints
+    hostMillis = time - bootTime;
+    currentTemperature = temperature;
+    evaporatorTemperature = evaporator;
+    setReplayTemperatures(temperature, evaporator);
+    energySavingMode = previous.energySaving;
+    checkAlerts(currentTemperature);
+    controlCompressor();
+    handleDefrost();
+    controlFan();
+    report.steps++;
+
+    uint8_t recorded = previous.outputs;
+    uint8_t replayed = replayOutputs();
+    for (uint8_t signal = 0; signal < SIGNAL_COUNT; signal++) {
+      uint8_t bit = SIGNAL_BIT((TraceSignal)signal);
+      SignalStats &stats = report.signals[signal];
+      bool isRecorded = recorded & bit, isReplayed = replayed & bit;
+      stats.recordedOnMillis += isRecorded ? options.stepMillis : 0;
+      stats.replayOnMillis += isReplayed ? options.stepMillis : 0;
+      stats.agreementMillis += isRecorded == isReplayed ? options.stepMillis : 0;
+      stats.recordedStarts += isRecorded && !(lastRecorded & bit);
+      stats.replayStarts += isReplayed && !(lastReplayed & bit);
+      if (report.recordedSignals & bit) {
+        divergences.update(signal, isRecorded, isReplayed, time);
+      }
+    }
+    lastRecorded = recorded;
+    lastReplayed = replayed;
+    report.lastTime = time;
+  }
+
+  for (uint8_t signal = 0; signal < SIGNAL_COUNT; signal++) {
+    divergences.close(signal, report.lastTime + options.stepMillis);
+  }
+  report.replayedMillis = report.steps * options.stepMillis;
+  report.skipped = reader.skipped();
+  report.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "Trace.h"
+
+// Drives the firmware control functions from a recorded trace on a virtual
+// clock that advances stepMillis per loop iteration, like the delay() at the
+// end of loop(). Temperatures are interpolated between samples; recorded
+// outputs hold until the next sample. The replayed relay and alarm states
+// are compared against the recording at every step.
+
+constexpr int REPLAY_MAX_DIVERGENCES = 32;  // Keeps a report below PIPE_BUF
+
+struct ReplayOptions {
+  unsigned long stepMillis = 3000;
+  unsigned long minDivergenceMillis = 60000;  // Shorter divergences are not reported
+  unsigned long maxGapMillis = 3600000;       // Longer gaps between samples are replayed as a reboot
+  bool coldStart = false;                     // Start with all outputs off instead of the recorded state
+};
+
+struct SignalStats {
+  uint64_t recordedOnMillis;
+  uint64_t replayOnMillis;
+  uint64_t agreementMillis;
+  uint32_t recordedStarts;
+  uint32_t replayStarts;
+};
+
+struct Divergence {
+  int64_t start;
+  int64_t duration;
+  uint8_t signal;
+  bool recorded;  // The replay had the opposite state
+};
+
+struct ReplayReport {
+  char error[64];
+  uint8_t format;
+  uint8_t recordedSignals;
+  uint64_t samples;
+  uint64_t skipped;
+  uint64_t steps;
+  uint64_t replayedMillis;
+  uint32_t gaps;
+  int64_t firstTime;
+  int64_t lastTime;
+  float minTemperature;
+  float maxTemperature;
+  SignalStats signals[SIGNAL_COUNT];
+  uint32_t divergenceCount;   // All divergences of at least minDivergenceMillis
+  uint32_t listedDivergences;
+  Divergence divergences[REPLAY_MAX_DIVERGENCES];
+  double wallSeconds;
+};
+
+// Readings returned by the Probes.h API (ReplayProbes.cpp): the regulation
+// and display roles get the recorded temperature, the defrost and fan roles
+// the evaporator temperature
+void setReplayTemperatures(float temperature, float evaporator);
+
+const char *signalName(uint8_t signal);
+void replayTrace(const char *path, const ReplayOptions &options, ReplayReport &report);
@@ -0,0 +1,30 @@
+#include "Replay.h"
+#include "Probes.h"
+#include <math.h>
+
+static float probeValues[2] = {NAN, NAN};
+
+void setReplayTemperatures(float temperature, float evaporator) {
+  probeValues[0] = temperature;
+  probeValues[1] = evaporator;
+}
+
+int getProbeCount() {
+  return 2;
+}
+
+float probeTemperature(int index) {
+  return index >= 0 && index < 2 ? probeValues[index] : NAN;
+}
+
+float roleTemperature(ProbeRole role) {
+  return role == ROLE_DEFROST || role == ROLE_FAN ? probeValues[1] : probeValues[0];
+}
+
+ProbeType getProbeType(int) {
+  return PROBE_NTC;
+}
+
+float getProbeOffset(int) {
+  return 0;
+}
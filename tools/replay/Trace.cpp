@@ -0,0 +1,260 @@
+#include "Trace.h"
+#include "EventJournal.h"
+#include "LogCompressor.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const size_t SEGMENT_HEADER_SIZE = 12;
+const uint8_t SEGMENT_FORMAT_VERSION = 1;
+
+TraceReader::~TraceReader() {
+  if (mapping) munmap((void *)mapping, mappingSize);
+}
+
+static bool hasSuffix(const char *path, const char *suffix) {
+  size_t length = strlen(path), suffixLength = strlen(suffix);
+  return length > suffixLength && strcmp(path + length - suffixLength, suffix) == 0;
+}
+
+bool TraceReader::open(const char *path) {
+  traceFormat = hasSuffix(path, ".bin") ? TRACE_JOURNAL : TRACE_CSV;
+
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    lastError = strerror(errno);
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    lastError = strerror(errno);
+    close(fd);
+    return false;
+  }
+  mappingSize = info.st_size;
+  if (mappingSize > 0) {
+    void *pages = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (pages == MAP_FAILED) {
+      lastError = strerror(errno);
+      close(fd);
+      return false;
+    }
+    madvise(pages, mappingSize, MADV_SEQUENTIAL);
+    mapping = (const char *)pages;
+  }
+  close(fd);
+
+  if (hasSuffix(path, ".z")) {
+    return inflateSegment();
+  }
+  data = cursor = mapping;
+  end = mapping + mappingSize;
+  return true;
+}
+
+static uint32_t getUint32(const uint8_t *buffer) {
+  return (uint32_t)buffer[0] | ((uint32_t)buffer[1] << 8) | ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+struct SegmentSource {
+  const uint8_t *cursor;
+  const uint8_t *end;
+};
+
+static size_t readSegment(void *context, uint8_t *data, size_t length) {
+  SegmentSource &source = *(SegmentSource *)context;
+  length = std::min(length, (size_t)(source.end - source.cursor));
+  memcpy(data, source.cursor, length);
+  source.cursor += length;
+  return length;
+}
+
+static void appendInflated(void *context, const uint8_t *data, size_t length) {
+  std::vector<char> &inflated = *(std::vector<char> *)context;
+  inflated.insert(inflated.end(), data, data + length);
+}
+
+bool TraceReader::inflateSegment() {
+  const uint8_t *header = (const uint8_t *)mapping;
+  if (mappingSize < SEGMENT_HEADER_SIZE || header[0] != 'X' || header[1] != 'Z' ||
+      header[2] != SEGMENT_FORMAT_VERSION) {
+    lastError = "not a compressed log segment";
+    return false;
+  }
+  uint32_t crc = getUint32(header + 4);
+  uint32_t length = getUint32(header + 8);
+
+  inflated.reserve(length);
+  SegmentSource source = {header + SEGMENT_HEADER_SIZE, header + mappingSize};
+  if (!inflateLogSegment(readSegment, &source, appendInflated, &inflated) ||
+      inflated.size() != length || crc32Update(0, (const uint8_t *)inflated.data(), length) != crc) {
+    lastError = "corrupt compressed log segment";
+    return false;
+  }
+
+  // A journal record's millis field is below 1000, where a CSV row has
+  // two text characters
+  JournalRecord first;
+  if (length >= sizeof(first)) {
+    memcpy(&first, inflated.data(), sizeof(first));
+  }
+  traceFormat = length >= sizeof(first) && first.millis < 1000 ? TRACE_JOURNAL : TRACE_CSV;
+
+  data = cursor = inflated.data();
+  end = data + length;
+  return true;
+}
+
+uint8_t TraceReader::recordedSignals() const {
+  uint8_t outputs = SIGNAL_BIT(SIGNAL_COMPRESSOR) | SIGNAL_BIT(SIGNAL_DEFROST) | SIGNAL_BIT(SIGNAL_FAN);
+  if (traceFormat == TRACE_JOURNAL) {
+    outputs |= SIGNAL_BIT(SIGNAL_HIGH_ALARM) | SIGNAL_BIT(SIGNAL_LOW_ALARM);
+  }
+  return outputs;
+}
+
+bool TraceReader::next(TraceSample &sample) {
+  while (traceFormat == TRACE_CSV ? nextCsv(sample) : nextJournal(sample)) {
+    if (sample.time >= lastTime) {
+      lastTime = sample.time;
+      return true;
+    }
+    skippedRecords++;
+  }
+  return false;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date
+static int64_t daysFromCivil(int year, int month, int day) {
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t yearOfEra = year - era * 400;
+  int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  return era * 146097 + dayOfEra - 719468;
+}
+
+// Field parsers for one CSV row; each consumes its trailing separator and
+// fails on anything unexpected instead of reading past the row
+static bool parseUnsigned(const char *&p, const char *end, char separator, int &value) {
+  if (p >= end || *p < '0' || *p > '9') return false;
+  value = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    value = value * 10 + (*p++ - '0');
+  }
+  if (separator) {
+    if (p >= end || *p != separator) return false;
+    p++;
+  }
+  return true;
+}
+
+static bool parseDecimal(const char *&p, const char *end, char separator, float &value) {
+  bool negative = p < end && *p == '-';
+  if (negative) p++;
+  if (p < end && (*p == 'n' || *p == 'N')) {  // "nan" from a faulty probe
+    value = NAN;
+    while (p < end && *p != separator && *p != '\n') p++;
+  } else {
+    int whole;
+    if (!parseUnsigned(p, end, 0, whole)) return false;
+    float fraction = 0, scale = 1;
+    if (p < end && *p == '.') {
+      for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+        fraction = fraction * 10 + (*p - '0');
+        scale *= 10;
+      }
+    }
+    value = whole + fraction / scale;
+    if (negative) value = -value;
+  }
+  if (p >= end || *p != separator) return false;
+  p++;
+  return true;
+}
+
+static bool parseCsvRow(const char *p, const char *end, TraceSample &sample) {
+  int year, month, day, hour, minute, second;
+  int compressor, defrost, fan;
+  if (!parseUnsigned(p, end, '-', year) || !parseUnsigned(p, end, '-', month) ||
+      !parseUnsigned(p, end, ',', day) || !parseUnsigned(p, end, ':', hour) ||
+      !parseUnsigned(p, end, ':', minute) || !parseUnsigned(p, end, ',', second) ||
+      !parseDecimal(p, end, ',', sample.temperature) ||
+      !parseUnsigned(p, end, ',', compressor) || !parseUnsigned(p, end, ',', defrost) ||
+      !parseUnsigned(p, end, 0, fan)) {
+    return false;
+  }
+
+  sample.time = ((daysFromCivil(year, month, day) * 24 + hour) * 60 + minute) * 60000LL + second * 1000LL;
+  sample.evaporator = NAN;
+  sample.outputs = (compressor ? SIGNAL_BIT(SIGNAL_COMPRESSOR) : 0) |
+                   (defrost ? SIGNAL_BIT(SIGNAL_DEFROST) : 0) |
+                   (fan ? SIGNAL_BIT(SIGNAL_FAN) : 0);
+  sample.energySaving = false;
+  return true;
+}
+
+bool TraceReader::nextCsv(TraceSample &sample) {
+  while (cursor < end) {
+    const char *row = cursor;
+    const char *rowEnd = (const char *)memchr(row, '\n', end - row);
+    if (!rowEnd) rowEnd = end;
+    cursor = rowEnd < end ? rowEnd + 1 : end;
+
+    if (row < rowEnd && *row >= '0' && *row <= '9') {
+      if (parseCsvRow(row, rowEnd, sample)) return true;
+      skippedRecords++;
+    }
+  }
+  return false;
+}
+
+static float unpackTemperature(int16_t value) {
+  return value == INT16_MIN ? NAN : value / 10.0f;
+}
+
+static const struct {
+  JournalEventType type;
+  TraceSignal signal;
+} JOURNAL_SIGNALS[] = {
+  {EVT_COMPRESSOR, SIGNAL_COMPRESSOR},
+  {EVT_DEFROST, SIGNAL_DEFROST},
+  {EVT_FAN, SIGNAL_FAN},
+  {EVT_HIGH_ALARM, SIGNAL_HIGH_ALARM},
+  {EVT_LOW_ALARM, SIGNAL_LOW_ALARM}
+};
+
+bool TraceReader::nextJournal(TraceSample &sample) {
+  if (end - cursor < (ptrdiff_t)sizeof(JournalRecord)) return false;
+
+  JournalRecord record;
+  memcpy(&record, cursor, sizeof(record));
+  cursor += sizeof(record);
+
+  state.time = record.time * 1000LL + record.millis;
+  state.temperature = unpackTemperature(record.temperature);
+  state.evaporator = unpackTemperature(record.evaporator);
+  if (record.type == EVT_SNAPSHOT) {
+    state.outputs = 0;
+    for (const auto &entry : JOURNAL_SIGNALS) {
+      if (record.value & JOURNAL_STATE_BIT(entry.type)) state.outputs |= SIGNAL_BIT(entry.signal);
+    }
+    state.energySaving = record.value & JOURNAL_STATE_BIT(EVT_ENERGY_SAVING);
+  } else if (record.type == EVT_ENERGY_SAVING) {
+    state.energySaving = record.value;
+  } else {
+    for (const auto &entry : JOURNAL_SIGNALS) {
+      if (record.type == entry.type) {
+        state.outputs = record.value ? state.outputs | SIGNAL_BIT(entry.signal)
+                                     : state.outputs & ~SIGNAL_BIT(entry.signal);
+      }
+    }
+  }
+  sample = state;
+  return true;
+}
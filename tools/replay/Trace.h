@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Recorded field logs, read straight from a read-only mapping of the file:
+//   TRACE_CSV      /temperature_log.csv rows
+//                  date,time,temperature,compressor,defrost,fan,remainingDefrost,remainingDrip
+//                  (header lines and malformed rows are skipped)
+//   TRACE_JOURNAL  /events.bin segments, packed JournalRecords
+//
+// Sealed segments of either log (<stem>.<n>.z) are not gzip but the archive
+// format of LogArchive.h: the 12-byte "XZ" header (magic, version, reserved,
+// CRC-32 and length of the raw data) followed by raw DEFLATE. They are
+// inflated into memory with inflateLogSegment() and checked against the
+// header; the raw extension is gone, so the format is told from the data.
+//
+// Samples are returned in time order; records that step back in time (clock
+// adjustments) are skipped.
+
+enum TraceFormat : uint8_t {
+  TRACE_CSV,
+  TRACE_JOURNAL
+};
+
+enum TraceSignal : uint8_t {
+  SIGNAL_COMPRESSOR,
+  SIGNAL_DEFROST,
+  SIGNAL_FAN,
+  SIGNAL_HIGH_ALARM,
+  SIGNAL_LOW_ALARM,
+  SIGNAL_COUNT
+};
+
+constexpr uint8_t SIGNAL_BIT(TraceSignal signal) { return (uint8_t)(1 << signal); }
+
+struct TraceSample {
+  int64_t time;          // Milliseconds; device local time for CSV, UTC for the journal
+  float temperature;     // Regulation probe
+  float evaporator;      // NAN when not recorded
+  uint8_t outputs;       // SIGNAL_BIT per recorded output or alarm that is on
+  bool energySaving;
+};
+
+class TraceReader {
+public:
+  ~TraceReader();
+
+  bool open(const char *path);
+  bool next(TraceSample &sample);
+
+  TraceFormat format() const { return traceFormat; }
+  uint8_t recordedSignals() const;  // SIGNAL_BITs the format records
+  const char *error() const { return lastError; }
+  uint64_t skipped() const { return skippedRecords; }
+
+private:
+  bool nextCsv(TraceSample &sample);
+  bool nextJournal(TraceSample &sample);
+  bool inflateSegment();
+
+  const char *mapping = nullptr;
+  size_t mappingSize = 0;
+  std::vector<char> inflated;  // Decoded contents of a .z segment
+  const char *data = nullptr;
+  const char *cursor = nullptr;
+  const char *end = nullptr;
+  TraceFormat traceFormat = TRACE_CSV;
+  TraceSample state = {};  // Journal state between records
+  int64_t lastTime = INT64_MIN;
+  uint64_t skippedRecords = 0;
+  const char *lastError = nullptr;
+};
@@ -0,0 +1,241 @@
+// Replays recorded field logs through the firmware control logic and
+// reports where the replayed relay and alarm decisions differ from the
+// recording.
+//
+//   pio run -e replay
+//   .pio/build/replay/program [options] log.csv|events.bin...
+//
+// Files are replayed in parallel, one process per file, and reported in the
+// order given.
+
+#include "Replay.h"
+#include "HostSettings.h"
+#include "Settings.h"
+#include <Arduino.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+static_assert(sizeof(ReplayReport) <= PIPE_BUF, "a report has to fit into one atomic pipe write");
+
+static void usage() {
+  fprintf(stderr,
+          "usage: replay [options] trace...\n"
+          "  -j N          replay N files in parallel (default: number of CPUs)\n"
+          "  --set K=V     override a setting, e.g. --set SEt=-18 --set FnC=C_n\n"
+          "  --step MS     virtual loop period in ms (default 3000)\n"
+          "  --min-div S   report divergences of at least S seconds (default 60)\n"
+          "  --max-gap S   replay longer gaps between samples as a reboot (default 3600)\n"
+          "  --cold-start  start with all outputs off instead of the recorded state\n"
+          "  --json        print the reports as a JSON array\n"
+          "  -v            echo the firmware's serial output to stderr\n"
+          "Traces ending in .bin are event journal segments, .z files sealed\n"
+          "segments of either log, anything else is read as /temperature_log.csv.\n");
+}
+
+static void formatTime(int64_t millis, char *buffer, size_t size) {
+  time_t seconds = millis / 1000;
+  struct tm parts;
+  gmtime_r(&seconds, &parts);
+  strftime(buffer, size, "%Y-%m-%d %H:%M:%S", &parts);
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+  return whole ? 100.0 * part / whole : 0;
+}
+
+static void printText(const char *path, const ReplayReport &report) {
+  printf("%s\n", path);
+  if (report.error[0]) {
+    printf("  error: %s\n\n", report.error);
+    return;
+  }
+
+  char first[20], last[20];
+  formatTime(report.firstTime, first, sizeof(first));
+  formatTime(report.lastTime, last, sizeof(last));
+  printf("  %s, %llu samples (%llu skipped), %s .. %s, %.1f days replayed, %u gaps\n",
+         report.format == TRACE_JOURNAL ? "journal" : "csv",
+         (unsigned long long)report.samples, (unsigned long long)report.skipped,
+         first, last, report.replayedMillis / 86400000.0, report.gaps);
+  printf("  temperature %.1f .. %.1f\n", report.minTemperature, report.maxTemperature);
+  printf("  %-10s %9s %9s %10s %10s %9s\n", "", "rec duty", "duty", "rec starts", "starts", "agreement");
+  for (uint8_t signal = 0; signal < SIGNAL_COUNT; signal++) {
+    const SignalStats &stats = report.signals[signal];
+    if (report.recordedSignals & SIGNAL_BIT((TraceSignal)signal)) {
+      printf("  %-10s %8.1f%% %8.1f%% %10u %10u %8.2f%%\n", signalName(signal),
+             percent(stats.recordedOnMillis, report.replayedMillis), percent(stats.replayOnMillis, report.replayedMillis),
+             stats.recordedStarts, stats.replayStarts, percent(stats.agreementMillis, report.replayedMillis));
+    } else {
+      printf("  %-10s %9s %8.1f%% %10s %10u %9s\n", signalName(signal), "-",
+             percent(stats.replayOnMillis, report.replayedMillis), "-", stats.replayStarts, "-");
+    }
+  }
+
+  printf("  %u divergences", report.divergenceCount);
+  if (report.listedDivergences < report.divergenceCount) printf(", first %u", report.listedDivergences);
+  printf("\n");
+  for (uint32_t i = 0; i < report.listedDivergences; i++) {
+    const Divergence &divergence = report.divergences[i];
+    char start[20];
+    formatTime(divergence.start, start, sizeof(start));
+    printf("    %s %7.1f min  %-10s recorded %s, replay %s\n", start, divergence.duration / 60000.0,
+           signalName(divergence.signal), divergence.recorded ? "ON" : "OFF", divergence.recorded ? "OFF" : "ON");
+  }
+  printf("  replayed in %.2f s (%.1f M steps/s)\n\n", report.wallSeconds,
+         report.wallSeconds > 0 ? report.steps / report.wallSeconds / 1e6 : 0);
+}
+
+static void printJson(const char *path, const ReplayReport &report, bool last) {
+  printf("  {\"file\":\"%s\"", path);
+  if (report.error[0]) {
+    printf(",\"error\":\"%s\"}%s\n", report.error, last ? "" : ",");
+    return;
+  }
+  printf(",\"format\":\"%s\",\"samples\":%llu,\"skipped\":%llu,\"first\":%lld,\"last\":%lld,"
+         "\"replayedSeconds\":%llu,\"gaps\":%u,\"minTemp\":%.1f,\"maxTemp\":%.1f,\"signals\":{",
+         report.format == TRACE_JOURNAL ? "journal" : "csv",
+         (unsigned long long)report.samples, (unsigned long long)report.skipped,
+         (long long)(report.firstTime / 1000), (long long)(report.lastTime / 1000),
+         (unsigned long long)(report.replayedMillis / 1000), report.gaps,
+         report.minTemperature, report.maxTemperature);
+  for (uint8_t signal = 0; signal < SIGNAL_COUNT; signal++) {
+    const SignalStats &stats = report.signals[signal];
+    printf("%s\"%s\":{\"duty\":%.4f,\"starts\":%u", signal ? "," : "", signalName(signal),
+           percent(stats.replayOnMillis, report.replayedMillis) / 100, stats.replayStarts);
+    if (report.recordedSignals & SIGNAL_BIT((TraceSignal)signal)) {
+      printf(",\"recordedDuty\":%.4f,\"recordedStarts\":%u,\"agreement\":%.4f",
+             percent(stats.recordedOnMillis, report.replayedMillis) / 100, stats.recordedStarts,
+             percent(stats.agreementMillis, report.replayedMillis) / 100);
+    }
+    printf("}");
+  }
+  printf("},\"divergenceCount\":%u,\"divergences\":[", report.divergenceCount);
+  for (uint32_t i = 0; i < report.listedDivergences; i++) {
+    const Divergence &divergence = report.divergences[i];
+    printf("%s{\"start\":%lld,\"seconds\":%lld,\"signal\":\"%s\",\"recorded\":%d}", i ? "," : "",
+           (long long)(divergence.start / 1000), (long long)(divergence.duration / 1000),
+           signalName(divergence.signal), divergence.recorded);
+  }
+  printf("],\"wallSeconds\":%.3f}%s\n", report.wallSeconds, last ? "" : ",");
+}
+
+// Forks a worker per file, at most `jobs` at a time; each sends its report
+// back through its own pipe
+static void replayAll(const std::vector<const char *> &paths, const ReplayOptions &options, long jobs,
+                      std::vector<ReplayReport> &reports) {
+  std::vector<pid_t> workers(paths.size(), -1);
+  std::vector<int> pipes(paths.size(), -1);
+  long running = 0;
+
+  auto collect = [&]() {
+    pid_t pid = wait(nullptr);
+    for (size_t i = 0; i < paths.size(); i++) {
+      if (workers[i] != pid) continue;
+      if (read(pipes[i], &reports[i], sizeof(ReplayReport)) != (ssize_t)sizeof(ReplayReport)) {
+        memset(&reports[i], 0, sizeof(ReplayReport));
+        snprintf(reports[i].error, sizeof(reports[i].error), "worker failed");
+      }
+      close(pipes[i]);
+      workers[i] = -1;
+      running--;
+    }
+  };
+
+  for (size_t i = 0; i < paths.size(); i++) {
+    while (running >= jobs) {
+      collect();
+    }
+    int fds[2];
+    if (pipe(fds) != 0) {
+      replayTrace(paths[i], options, reports[i]);  // No worker, replay in this process
+      continue;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      ReplayReport report;
+      replayTrace(paths[i], options, report);
+      ssize_t written = write(fds[1], &report, sizeof(report));
+      _exit(written == (ssize_t)sizeof(report) ? 0 : 1);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+      close(fds[0]);
+      replayTrace(paths[i], options, reports[i]);
+      continue;
+    }
+    workers[i] = pid;
+    pipes[i] = fds[0];
+    running++;
+  }
+  while (running > 0) {
+    collect();
+  }
+}
+
+int main(int argc, char **argv) {
+  loadSettings();
+
+  ReplayOptions options;
+  std::vector<const char *> paths;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  bool json = false;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (strcmp(arg, "-j") == 0 && hasValue) {
+      jobs = atol(argv[++i]);
+    } else if (strcmp(arg, "--set") == 0 && hasValue) {
+      if (!applySettingOverride(argv[++i])) {
+        fprintf(stderr, "replay: unknown setting %s\n", argv[i]);
+        return 2;
+      }
+    } else if (strcmp(arg, "--step") == 0 && hasValue) {
+      options.stepMillis = atol(argv[++i]);
+    } else if (strcmp(arg, "--min-div") == 0 && hasValue) {
+      options.minDivergenceMillis = atol(argv[++i]) * 1000;
+    } else if (strcmp(arg, "--max-gap") == 0 && hasValue) {
+      options.maxGapMillis = atol(argv[++i]) * 1000;
+    } else if (strcmp(arg, "--cold-start") == 0) {
+      options.coldStart = true;
+    } else if (strcmp(arg, "--json") == 0) {
+      json = true;
+    } else if (strcmp(arg, "-v") == 0) {
+      hostSerialEcho = true;
+    } else if (arg[0] == '-') {
+      usage();
+      return 2;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty() || options.stepMillis == 0) {
+    usage();
+    return 2;
+  }
+
+  std::vector<ReplayReport> reports(paths.size());
+  if (paths.size() == 1 || jobs <= 1) {
+    for (size_t i = 0; i < paths.size(); i++) {
+      replayTrace(paths[i], options, reports[i]);
+    }
+  } else {
+    replayAll(paths, options, jobs, reports);
+  }
+
+  bool failed = false;
+  if (json) printf("[\n");
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (json) {
+      printJson(paths[i], reports[i], i + 1 == paths.size());
+    } else {
+      printText(paths[i], reports[i]);
+    }
+    failed |= reports[i].error[0] != 0;
+  }
+  if (json) printf("]\n");
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,44 @@
+#include "Plant.h"
+#include <algorithm>
+
+static const float LATENT_HEAT = 334;  // J/g, melting ice
+
+Plant::Plant(const PlantParameters &parameters) : parameters(parameters) {
+  cabinet = coil = parameters.ambient;
+}
+
+void Plant::step(const PlantInputs &inputs, float seconds) {
+  const PlantParameters &p = parameters;
+
+  float conductance = p.coilConductance / (1 + frost / p.frostHalving);
+  if (!inputs.fan) conductance *= p.naturalConvection;
+  float coilToCabinet = conductance * (coil - cabinet);
+
+  float walls = (p.wallConductance + (inputs.doorOpen ? p.doorConductance : 0)) * (p.ambient - cabinet);
+  float heater = inputs.heater ? p.heaterPower : 0;
+  float cabinetHeat = walls + coilToCabinet + heater * p.heaterToCabinet + (inputs.fan ? p.fanPower : 0);
+
+  float coilHeat = -coilToCabinet + heater * (1 - p.heaterToCabinet) + (inputs.hotGas ? p.hotGasPower : 0);
+  if (inputs.compressor && !inputs.hotGas) {
+    coilHeat -= std::max(0.0f, p.refrigeration * (1 + p.refrigerationSlope * (coil + 10)));
+  }
+
+  cabinet += cabinetHeat * seconds / p.cabinetCapacity;
+
+  // Frost holds the coil at 0 degC: heat above that melts it first
+  float coilCapacity = p.coilCapacity + frost * p.frostHeatCapacity;
+  float warmed = coil + coilHeat * seconds / coilCapacity;
+  if (frost > 0 && warmed > 0) {
+    float melted = std::min(frost, warmed * coilCapacity / LATENT_HEAT);
+    frost -= melted;
+    warmed = frost > 0 ? 0 : warmed - melted * LATENT_HEAT / coilCapacity;
+  }
+  coil = warmed;
+
+  moisture += p.infiltration * seconds / 3600;
+  if (coil < 0) {
+    float deposited = moisture * std::min(1.0f, seconds / p.depositionTime);
+    moisture -= deposited;
+    frost += deposited;
+  }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+// Lumped thermal model of a small commercial cooler: the cabinet (air,
+// shelves and goods) and the evaporator coil as two heat capacities, and the
+// frost on the coil as a moisture store.
+//
+// The compressor extracts heat from the coil, more the warmer the coil is.
+// The coil exchanges heat with the cabinet through a conductance that the
+// fan raises and frost lowers, so a frosted coil runs colder and cools less.
+// Moisture from door openings and infiltration freezes onto the coil while
+// it is below 0 degC. A defrost heater warms the coil; at 0 degC its heat
+// melts frost before the coil warms further, so a clean coil reaches the
+// termination temperature sooner.
+
+struct PlantParameters {
+  float ambient = 25;               // degC
+  float cabinetCapacity = 80000;    // J/K
+  float wallConductance = 3.0;      // W/K, cabinet to ambient with the door shut
+  float doorConductance = 30;       // W/K, extra while the door is open
+  float coilCapacity = 4000;        // J/K
+  float coilConductance = 45;       // W/K, clean coil to cabinet with the fan on
+  float naturalConvection = 0.3;    // Share of the coil conductance with the fan off
+  float frostHalving = 500;         // g of frost that halve the coil conductance
+  float frostHeatCapacity = 2.1;    // J/(g K)
+  float refrigeration = 300;        // W extracted at -10 degC coil temperature
+  float refrigerationSlope = 0.03;  // Relative capacity change per K of coil temperature
+  float compressorPower = 200;      // W electric
+  float heaterPower = 400;          // W electric, electric defrost
+  float heaterToCabinet = 0.2;      // Share of the heater power warming the cabinet directly
+  float hotGasPower = 600;          // W into the coil, hot gas defrost
+  float fanPower = 15;              // W electric
+  float infiltration = 2;           // g/h of moisture with the door shut
+  float doorMoisture = 3;           // g per door opening
+  float depositionTime = 900;       // s, time constant of cabinet moisture freezing onto a cold coil
+};
+
+struct PlantInputs {
+  bool compressor;
+  bool heater;                      // Defrost relay with electric defrost
+  bool hotGas;                      // Defrost relay with hot gas defrost
+  bool fan;
+  bool doorOpen;
+};
+
+class Plant {
+public:
+  explicit Plant(const PlantParameters &parameters);
+
+  void step(const PlantInputs &inputs, float seconds);
+  void openDoor() { moisture += parameters.doorMoisture; }
+
+  float cabinet;                    // degC
+  float coil;                       // degC
+  float frost = 0;                  // g on the coil
+  float moisture = 0;               // g in the cabinet air, not yet frozen
+  PlantParameters parameters;       // May change during a run to inject a fault
+};
@@ -0,0 +1,217 @@
+#include "Simulation.h"
+#include "config.h"
+#include "Hardware.h"
+#include "Settings.h"
+#include "Probes.h"
+#include "FaultDetector.h"
+#include "Schedule.h"
+#include <Arduino.h>
+#include <chrono>
+#include <random>
+
+extern float A, B, C;  // Steinhart-Hart coefficients of the NTC probes, Probes.cpp
+
+const time_t SIM_START_TIME = 1704067200;  // Monday 2024-01-01 00:00 UTC
+
+static const char *LOAD_NAMES[] = {"weekly", "busy", "quiet"};
+
+static const char *FAULT_NAMES[SIM_FAULT_COUNT] = {"none", "capacity", "relay-open", "relay-closed", "gasket", "door-ajar"};
+
+const char *loadName(SimLoad load) {
+  return LOAD_NAMES[load];
+}
+
+const char *simFaultName(SimFault fault) {
+  return FAULT_NAMES[fault];
+}
+
+bool parseSimFault(const char *name, SimFault &fault) {
+  for (int i = 0; i < SIM_FAULT_COUNT; i++) {
+    if (strcmp(name, FAULT_NAMES[i]) == 0) {
+      fault = (SimFault)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint8_t expectedFaults(SimFault fault) {
+  switch (fault) {
+    case SIM_FAULT_CAPACITY: return FAULT_PULL_DOWN | FAULT_RUN_TIME;
+    case SIM_FAULT_RELAY_OPEN: return FAULT_NO_COOLING;
+    case SIM_FAULT_RELAY_CLOSED: return FAULT_STUCK_ON;
+    case SIM_FAULT_GASKET: return FAULT_HEAT_LOAD;
+    case SIM_FAULT_DOOR_AJAR: return FAULT_DOOR;
+    default: return 0;
+  }
+}
+
+static void injectFault(SimFault fault, Plant &plant) {
+  switch (fault) {
+    case SIM_FAULT_CAPACITY:
+      plant.parameters.refrigeration *= 0.5;
+      break;
+    case SIM_FAULT_GASKET:
+      plant.parameters.wallConductance += 3;
+      plant.parameters.infiltration *= 3;
+      break;
+    default:
+      break;  // Relay faults act on the inputs, the open door on the door process
+  }
+}
+
+// Inverse of the probe registry's NTC conversion: the ADC reading the
+// divider gives at `celsius`
+static int ntcReading(float celsius) {
+  double x = (A - 1 / (celsius + 273.15)) / C;
+  double y = sqrt(pow(B / (3 * C), 3) + x * x / 4);
+  double resistance = exp(cbrt(y - x / 2) - cbrt(y + x / 2));
+  return constrain(lround(ADC_MAX / (SERIES_RESISTOR / resistance + 1)), 1L, (long)ADC_MAX - 1);
+}
+
+// Days start on a Monday at midnight
+static float openingsPerHour(const SimOptions &options, uint64_t seconds) {
+  int day = seconds / 86400 % 7;
+  int hour = seconds / 3600 % 24;
+  if (hour < 7 || hour >= 19) {
+    return options.nightOpenings;
+  }
+  bool busy = options.load == LOAD_BUSY || (options.load == LOAD_WEEKLY && day < 5);
+  return busy ? options.busyOpenings : options.quietOpenings;
+}
+
+void runSimulation(const SimOptions &options, SimReport &report) {
+  auto wallStart = std::chrono::steady_clock::now();
+  memset(&report, 0, sizeof(report));
+
+  setupHardware();
+  setupProbes();  // Migrates to two NTC probes on the empty host NVS
+  setupFaultDetector();
+  startupTime = millis();
+
+  // Runs start at the beginning of the schedule week, in UTC
+  setenv("TZ", "UTC0", 1);
+  tzset();
+  hostEpoch = SIM_START_TIME - hostMillis / 1000;
+  setupSchedule();
+
+  Plant plant(options.plant);
+  plant.cabinet = plant.coil = settings.SEt + settings.Hy / 2;
+  std::mt19937 random(options.seed);
+  std::uniform_real_distribution<float> uniform(0, 1);
+
+  float bandLow = settings.SEt - 1;
+  float bandHigh = settings.SEt + settings.Hy + 1;
+  uint64_t steps = (uint64_t)(options.days * 86400000.0 / options.stepMillis);
+  uint64_t subSteps = max(1UL, options.stepMillis / 1000);
+  float subSeconds = options.stepMillis / 1000.0 / subSteps;
+  double doorOpenUntil = 0;
+  double mean = 0, squares = 0;
+  uint64_t outside = 0, compressorSteps = 0;
+  bool lastCompressor = false, lastDefrost = false;
+  uint64_t defrostStart = 0, defrostMillis = 0;
+  uint32_t completedDefrosts = 0;
+  double frostAtDefrost = 0;
+  report.minCabinet = INFINITY;
+  report.maxCabinet = -INFINITY;
+  report.detectionHours = -1;
+  double faultSeconds = options.fault == SIM_FAULT_NONE ? INFINITY
+                        : (options.faultHours < 0 ? options.days * 43200.0 : options.faultHours * 3600.0);
+  bool injected = false;
+  unsigned long injectedAt = 0;
+  uint8_t lastFaults = 0;
+
+  for (uint64_t step = 0; step < steps; step++) {
+    PlantInputs inputs;
+    inputs.compressor = hostPins[COMPRESSOR_RELAY_PIN] == HIGH;
+    inputs.heater = hostPins[DEFROST_RELAY_PIN] == HIGH && settings.tdF != "in";
+    inputs.hotGas = hostPins[DEFROST_RELAY_PIN] == HIGH && settings.tdF == "in";
+    inputs.fan = hostPins[FAN_RELAY_PIN] == HIGH;
+    if (injected && options.fault == SIM_FAULT_RELAY_OPEN) inputs.compressor = false;
+    if (injected && options.fault == SIM_FAULT_RELAY_CLOSED) inputs.compressor = true;
+
+    for (uint64_t i = 0; i < subSteps; i++) {
+      double seconds = (step * subSteps + i) * (double)subSeconds;
+      if (!injected && seconds >= faultSeconds) {
+        injected = true;
+        injectedAt = hostMillis;
+        injectFault(options.fault, plant);
+        if (options.fault == SIM_FAULT_DOOR_AJAR) {
+          doorOpenUntil = seconds + 1800;
+          plant.openDoor();
+        }
+      }
+      if (seconds >= doorOpenUntil && uniform(random) < openingsPerHour(options, seconds) * subSeconds / 3600) {
+        doorOpenUntil = seconds + options.doorSeconds;
+        plant.openDoor();
+        report.doorOpenings++;
+      }
+      inputs.doorOpen = seconds < doorOpenUntil;
+      plant.step(inputs, subSeconds);
+    }
+    hostPins[DOOR_SENSOR_PIN] = inputs.doorOpen ? LOW : HIGH;
+    report.maxFrost = max(report.maxFrost, (double)plant.frost);
+
+    double hours = options.stepMillis / 3600000.0;
+    report.compressorWh += inputs.compressor ? options.plant.compressorPower * hours : 0;
+    report.heaterWh += inputs.heater ? options.plant.heaterPower * hours : 0;
+    report.fanWh += inputs.fan ? options.plant.fanPower * hours : 0;
+
+    // Welford's running mean and variance of the true cabinet temperature
+    double delta = plant.cabinet - mean;
+    mean += delta / (step + 1);
+    squares += delta * (plant.cabinet - mean);
+    report.minCabinet = min(report.minCabinet, (double)plant.cabinet);
+    report.maxCabinet = max(report.maxCabinet, (double)plant.cabinet);
+    outside += plant.cabinet < bandLow || plant.cabinet > bandHigh;
+
+    // Same order as loop(); logging, journal and network are left out
+    hostMillis += options.stepMillis;
+    hostAnalog[NTC_PIN] = ntcReading(plant.cabinet);
+    hostAnalog[EVAP_SENSOR_PIN] = ntcReading(plant.coil);
+    updateProbes();
+    updateSchedule();
+    currentTemperature = readTemperature(false);
+    if (settings.P2P == "y") {
+      evaporatorTemperature = readTemperature(true);
+    }
+    checkAlerts(currentTemperature);
+    controlCompressor();
+    handleDefrost();
+    controlFan();
+    updateFaultDetector();
+
+    if (!injected) {
+      report.falseRaises += __builtin_popcount(faultFlags & ~lastFaults);
+      report.falseFaultHours += faultFlags ? hours : 0;
+    } else {
+      report.faultsAfter |= faultFlags;
+      if (report.detectionHours < 0 && (faultFlags & expectedFaults(options.fault))) {
+        report.detectionHours = (hostMillis - injectedAt) / 3600000.0;
+      }
+    }
+    lastFaults = faultFlags;
+    compressorSteps += isCompressorOn;
+    report.compressorStarts += isCompressorOn && !lastCompressor;
+    if (isDefrostOn && !lastDefrost) {
+      report.defrosts++;
+      defrostStart = hostMillis;
+      frostAtDefrost += plant.frost;
+    } else if (!isDefrostOn && lastDefrost) {
+      defrostMillis += hostMillis - defrostStart;
+      completedDefrosts++;
+    }
+    lastCompressor = isCompressorOn;
+    lastDefrost = isDefrostOn;
+  }
+
+  report.days = steps * options.stepMillis / 86400000.0;
+  report.cleanDays = injected ? faultSeconds / 86400 : report.days;
+  report.compressorDuty = steps ? (double)compressorSteps / steps : 0;
+  report.defrostMinutes = completedDefrosts ? defrostMillis / 60000.0 / completedDefrosts : 0;
+  report.frostAtDefrost = report.defrosts ? frostAtDefrost / report.defrosts : 0;
+  report.meanCabinet = mean;
+  report.stddevCabinet = steps > 1 ? sqrt(squares / (steps - 1)) : 0;
+  report.outsideBand = steps ? (double)outside / steps : 0;
+  report.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "Plant.h"
+
+// Runs the firmware control loop in closed loop against the plant on a
+// virtual clock. Probe readings go through the NTC conversion of the probe
+// registry (the plant temperatures become ADC readings), relay outputs are
+// read back from the pins. Door openings are drawn from a seeded random
+// process, busy or quiet per day. Runs start on a Monday at midnight, which
+// lines the door openings up with the weekly schedule.
+//
+// A fault can be injected into the plant part way through a run; the report
+// then says how long the fault detector took to raise the matching finding,
+// and counts findings raised before the injection as false positives.
+
+enum SimLoad : uint8_t {
+  LOAD_WEEKLY,   // Monday to Friday busy, the weekend quiet
+  LOAD_BUSY,
+  LOAD_QUIET
+};
+
+enum SimFault : uint8_t {
+  SIM_FAULT_NONE,
+  SIM_FAULT_CAPACITY,       // Refrigeration capacity halved: refrigerant loss, dirty condenser
+  SIM_FAULT_RELAY_OPEN,     // The compressor never runs although commanded
+  SIM_FAULT_RELAY_CLOSED,   // The compressor runs whatever the relay is commanded
+  SIM_FAULT_GASKET,         // Leaking door gasket: more heat and moisture with the door shut
+  SIM_FAULT_DOOR_AJAR,      // The door left open for half an hour
+  SIM_FAULT_COUNT
+};
+
+struct SimOptions {
+  float days = 14;
+  uint32_t seed = 1;
+  SimLoad load = LOAD_WEEKLY;
+  unsigned long stepMillis = 3000;  // Loop period, like the delay() at the end of loop()
+  float busyOpenings = 20;          // Door openings per hour, 07:00 to 19:00 on busy days
+  float quietOpenings = 3;          // Door openings per hour, 07:00 to 19:00 on quiet days
+  float nightOpenings = 0.5;        // Door openings per hour outside those hours
+  float doorSeconds = 20;           // Duration of an opening
+  SimFault fault = SIM_FAULT_NONE;
+  float faultHours = -1;            // Injection time, half way through the run when negative
+  PlantParameters plant;
+};
+
+struct SimReport {
+  double days;
+  double compressorWh;
+  double heaterWh;
+  double fanWh;
+  double compressorDuty;
+  uint32_t compressorStarts;
+  uint32_t defrosts;
+  double defrostMinutes;            // Mean duration
+  double frostAtDefrost;            // Mean g on the coil when a defrost starts
+  double maxFrost;
+  double meanCabinet;
+  double stddevCabinet;
+  double minCabinet;
+  double maxCabinet;
+  double outsideBand;               // Share of time outside SEt - 1 .. SEt + Hy + 1
+  uint32_t doorOpenings;
+  double cleanDays;                 // Time before the fault injection, all of it without a fault
+  uint32_t falseRaises;             // Findings raised before the injection
+  double falseFaultHours;           // Time with any finding raised before the injection
+  double detectionHours;            // From the injection to an expected finding, negative if missed
+  uint8_t faultsAfter;              // FaultFlag bits raised at any time after the injection
+  double wallSeconds;
+};
+
+const char *loadName(SimLoad load);
+const char *simFaultName(SimFault fault);
+bool parseSimFault(const char *name, SimFault &fault);
+uint8_t expectedFaults(SimFault fault);  // FaultFlag bits that count as detecting the fault
+void runSimulation(const SimOptions &options, SimReport &report);
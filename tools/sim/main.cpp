@@ -0,0 +1,366 @@
+// Runs the firmware control logic against a simulated cooler and compares
+// configurations on energy and temperature stability.
+//
+//   pio run -e sim
+//   .pio/build/sim/program [options]
+//
+// Every variant runs the same plant, load and door openings from the same
+// seed, one process per variant. Without --variant the fixed defrost
+// interval is compared with demand defrost.
+//
+// --faults validates the fault detector instead: every fault scenario, and a
+// run without a fault, over several door opening seeds with the settings of
+// the first variant.
+
+#include "Simulation.h"
+#include "HostSettings.h"
+#include "Settings.h"
+#include "FaultDetector.h"
+#include "Schedule.h"
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <Preferences.h>
+#include <fstream>
+#include <limits.h>
+#include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+static_assert(sizeof(SimReport) <= PIPE_BUF, "a report has to fit into one atomic pipe write");
+
+struct Variant {
+  std::string name;
+  std::vector<std::string> settings;
+};
+
+static void usage() {
+  fprintf(stderr,
+          "usage: sim [options]\n"
+          "  --days N           simulated days (default 14)\n"
+          "  --load L           weekly, busy or quiet (default weekly: 5 busy, 2 quiet days)\n"
+          "  --seed N           door opening seed (default 1)\n"
+          "  --ambient T        ambient temperature in degC (default 25)\n"
+          "  --set K=V          override a setting in every variant\n"
+          "  --variant N:K=V,.. add a variant with its own settings; the first one is\n"
+          "                     the reference (default interval:dEM=n demand:dEM=y,IdF=12)\n"
+          "                     schedule=FILE loads a weekly schedule in the /update_schedule\n"
+          "                     format, e.g. tools/sim/night-setback.json\n"
+          "  --fault F          inject a fault into every variant: capacity, relay-open,\n"
+          "                     relay-closed, gasket or door-ajar\n"
+          "  --fault-hours H    injection time (default half way through the run)\n"
+          "  --faults           run every fault scenario and report detection latency\n"
+          "                     and false positives instead of comparing variants\n"
+          "  --seeds N          seeds per scenario with --faults (default 5)\n"
+          "  -v                 echo the firmware's serial output to stderr\n");
+}
+
+static bool parseVariant(const char *text, Variant &variant) {
+  const char *colon = strchr(text, ':');
+  variant.name = colon ? std::string(text, colon - text) : std::string(text);
+  if (variant.name.empty()) return false;
+  std::string list = colon ? colon + 1 : "";
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) end = list.size();
+    if (end > start) variant.settings.push_back(list.substr(start, end - start));
+    start = end + 1;
+  }
+  return true;
+}
+
+static bool loadScheduleFile(const char *path) {
+  std::ifstream file(path);
+  std::stringstream text;
+  text << file.rdbuf();
+  JsonDocument doc;
+  if (!file || deserializeJson(doc, text.str()) || !updateScheduleFromJSON(doc)) {
+    fprintf(stderr, "sim: cannot load schedule %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+static bool applyAll(const std::vector<std::string> &assignments) {
+  for (const std::string &assignment : assignments) {
+    if (assignment.compare(0, 9, "schedule=") == 0) {
+      if (!loadScheduleFile(assignment.c_str() + 9)) return false;
+      continue;
+    }
+    if (!applySettingOverride(assignment.c_str())) {
+      fprintf(stderr, "sim: unknown setting %s\n", assignment.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+static std::string joined(const std::vector<std::string> &assignments) {
+  std::string text;
+  for (const std::string &assignment : assignments) {
+    text += (text.empty() ? "" : ",") + assignment;
+  }
+  return text.empty() ? "-" : text;
+}
+
+// Each variant starts from the default settings in a fresh process
+static void runVariant(const SimOptions &options, const std::vector<std::string> &common, const Variant &variant,
+                       SimReport &report) {
+  loadSettings();
+  // Checking the variants left the last schedule in the NVS the worker inherits
+  Preferences schedule;
+  schedule.begin("schedule", false);
+  schedule.clear();
+  schedule.end();
+  // The default FnC "o-n" matches no fan mode and leaves the fan off
+  applySettingOverride("FnC=C_n");
+  applyAll(common);
+  applyAll(variant.settings);
+  runSimulation(options, report);
+}
+
+// One worker process per run, options[i] with variants[i]
+static void runAll(const std::vector<SimOptions> &options, const std::vector<std::string> &common,
+                   const std::vector<Variant> &variants, std::vector<SimReport> &reports) {
+  std::vector<pid_t> workers(variants.size(), -1);
+  std::vector<int> pipes(variants.size(), -1);
+
+  for (size_t i = 0; i < variants.size(); i++) {
+    int fds[2];
+    pid_t pid = pipe(fds) == 0 ? fork() : -1;
+    if (pid == 0) {
+      close(fds[0]);
+      SimReport report;
+      runVariant(options[i], common, variants[i], report);
+      ssize_t written = write(fds[1], &report, sizeof(report));
+      _exit(written == (ssize_t)sizeof(report) ? 0 : 1);
+    }
+    if (pid < 0) {
+      fprintf(stderr, "sim: cannot start a worker for %s\n", variants[i].name.c_str());
+      exit(1);
+    }
+    close(fds[1]);
+    workers[i] = pid;
+    pipes[i] = fds[0];
+  }
+  for (size_t i = 0; i < variants.size(); i++) {
+    if (read(pipes[i], &reports[i], sizeof(SimReport)) != (ssize_t)sizeof(SimReport)) {
+      fprintf(stderr, "sim: worker for %s failed\n", variants[i].name.c_str());
+      exit(1);
+    }
+    close(pipes[i]);
+    waitpid(workers[i], nullptr, 0);
+  }
+}
+
+static void printRow(const char *label, const char *format, const std::vector<SimReport> &reports,
+                     double SimReport::*field, double scale = 1, bool change = true) {
+  printf("%-24s", label);
+  double reference = reports[0].*field * scale;
+  for (size_t i = 0; i < reports.size(); i++) {
+    double value = reports[i].*field * scale;
+    char text[48];
+    int length = snprintf(text, sizeof(text), format, value);
+    if (i > 0 && change && reference != 0) {
+      snprintf(text + length, sizeof(text) - length, " (%+.1f%%)", 100 * (value - reference) / fabs(reference));
+    }
+    printf(" %22s", text);
+  }
+  printf("\n");
+}
+
+static void printCount(const char *label, const std::vector<SimReport> &reports, uint32_t SimReport::*field) {
+  printf("%-24s", label);
+  for (const SimReport &report : reports) {
+    printf(" %22u", report.*field);
+  }
+  printf("\n");
+}
+
+static std::string faultNames(uint8_t flags) {
+  std::string text;
+  for (int i = 0; i < FAULT_COUNT; i++) {
+    if (flags & (1 << i)) text += (text.empty() ? "" : ",") + std::string(faultName(i));
+  }
+  return text.empty() ? "-" : text;
+}
+
+static void validateFaults(const SimOptions &options, const std::vector<std::string> &common, const Variant &variant,
+                           uint32_t seeds) {
+  std::vector<SimOptions> runs;
+  for (int fault = 0; fault < SIM_FAULT_COUNT; fault++) {
+    for (uint32_t seed = 0; seed < seeds; seed++) {
+      SimOptions run = options;
+      run.fault = (SimFault)fault;
+      run.seed = options.seed + seed;
+      runs.push_back(run);
+    }
+  }
+  std::vector<Variant> variants(runs.size(), variant);
+  std::vector<SimReport> reports(runs.size());
+  runAll(runs, common, variants, reports);
+
+  printf("%.1f days, %s load, seeds %u..%u, ambient %.1f degC, settings %s\n\n", reports[0].days,
+         loadName(options.load), options.seed, options.seed + seeds - 1, options.plant.ambient,
+         joined(common).c_str());
+  printf("%-14s %-18s %9s %10s %10s %13s %10s  %s\n", "scenario", "expected", "detected", "latency h", "max h",
+         "false/day", "false h", "raised after injection");
+  double falseRaises = 0, falseHours = 0, cleanDays = 0;
+  for (int fault = 0; fault < SIM_FAULT_COUNT; fault++) {
+    uint32_t detected = 0;
+    double latency = 0, maxLatency = 0, scenarioRaises = 0, scenarioHours = 0, scenarioDays = 0;
+    uint8_t after = 0;
+    for (uint32_t seed = 0; seed < seeds; seed++) {
+      const SimReport &report = reports[fault * seeds + seed];
+      if (report.detectionHours >= 0) {
+        detected++;
+        latency += report.detectionHours;
+        maxLatency = max(maxLatency, report.detectionHours);
+      }
+      scenarioRaises += report.falseRaises;
+      scenarioHours += report.falseFaultHours;
+      scenarioDays += report.cleanDays;
+      after |= report.faultsAfter;
+    }
+    falseRaises += scenarioRaises;
+    falseHours += scenarioHours;
+    cleanDays += scenarioDays;
+
+    char rate[16] = "-", mean[16] = "-", worst[16] = "-";
+    if (fault != SIM_FAULT_NONE) {
+      snprintf(rate, sizeof(rate), "%u/%u", detected, seeds);
+      if (detected) {
+        snprintf(mean, sizeof(mean), "%.2f", latency / detected);
+        snprintf(worst, sizeof(worst), "%.2f", maxLatency);
+      }
+    }
+    printf("%-14s %-18s %9s %10s %10s %13.3f %10.1f  %s\n", simFaultName((SimFault)fault),
+           faultNames(expectedFaults((SimFault)fault)).c_str(), rate, mean, worst,
+           scenarioDays ? scenarioRaises / scenarioDays : 0, scenarioHours,
+           fault != SIM_FAULT_NONE ? faultNames(after).c_str() : "-");
+  }
+  printf("\nfalse positives: %.0f raised in %.1f fault-free days (%.3f/day), %.1f h flagged\n", falseRaises,
+         cleanDays, cleanDays ? falseRaises / cleanDays : 0, falseHours);
+}
+
+int main(int argc, char **argv) {
+  SimOptions options;
+  std::vector<std::string> common;
+  std::vector<Variant> variants;
+  bool faults = false;
+  uint32_t seeds = 5;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (strcmp(arg, "--days") == 0 && hasValue) {
+      options.days = atof(argv[++i]);
+    } else if (strcmp(arg, "--load") == 0 && hasValue) {
+      const char *load = argv[++i];
+      if (strcmp(load, "weekly") == 0) options.load = LOAD_WEEKLY;
+      else if (strcmp(load, "busy") == 0) options.load = LOAD_BUSY;
+      else if (strcmp(load, "quiet") == 0) options.load = LOAD_QUIET;
+      else {
+        usage();
+        return 2;
+      }
+    } else if (strcmp(arg, "--seed") == 0 && hasValue) {
+      options.seed = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(arg, "--ambient") == 0 && hasValue) {
+      options.plant.ambient = atof(argv[++i]);
+    } else if (strcmp(arg, "--set") == 0 && hasValue) {
+      common.push_back(argv[++i]);
+    } else if (strcmp(arg, "--variant") == 0 && hasValue) {
+      Variant variant;
+      if (!parseVariant(argv[++i], variant)) {
+        usage();
+        return 2;
+      }
+      variants.push_back(variant);
+    } else if (strcmp(arg, "--fault") == 0 && hasValue) {
+      if (!parseSimFault(argv[++i], options.fault)) {
+        usage();
+        return 2;
+      }
+    } else if (strcmp(arg, "--fault-hours") == 0 && hasValue) {
+      options.faultHours = atof(argv[++i]);
+    } else if (strcmp(arg, "--faults") == 0) {
+      faults = true;
+    } else if (strcmp(arg, "--seeds") == 0 && hasValue) {
+      seeds = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(arg, "-v") == 0) {
+      hostSerialEcho = true;
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  if (options.days <= 0 || seeds == 0) {
+    usage();
+    return 2;
+  }
+  if (variants.empty() && faults) {
+    variants.push_back({"default", {}});
+  } else if (variants.empty()) {
+    variants.push_back({"interval", {"dEM=n"}});
+    variants.push_back({"demand", {"dEM=y", "IdF=12"}});
+  }
+
+  // Reject unknown settings before forking
+  loadSettings();
+  if (!applyAll(common)) return 2;
+  for (const Variant &variant : variants) {
+    if (!applyAll(variant.settings)) return 2;
+  }
+
+  if (faults) {
+    validateFaults(options, common, variants[0], seeds);
+    return 0;
+  }
+
+  std::vector<SimReport> reports(variants.size());
+  runAll(std::vector<SimOptions>(variants.size(), options), common, variants, reports);
+
+  printf("%.1f days, %s load, seed %u, ambient %.1f degC, common settings %s\n", reports[0].days,
+         loadName(options.load), options.seed, options.plant.ambient, joined(common).c_str());
+  if (options.fault != SIM_FAULT_NONE) {
+    printf("fault %s injected after %.1f days\n", simFaultName(options.fault), reports[0].cleanDays);
+  }
+  printf("\n");
+  printf("%-24s", "");
+  for (const Variant &variant : variants) printf(" %22s", variant.name.c_str());
+  printf("\n%-24s", "settings");
+  for (const Variant &variant : variants) printf(" %22s", joined(variant.settings).c_str());
+  printf("\n");
+
+  std::vector<SimReport> totals = reports;
+  for (SimReport &report : totals) {
+    report.compressorWh += report.heaterWh + report.fanWh;  // Total energy
+  }
+  printRow("energy kWh/day", "%.3f", totals, &SimReport::compressorWh, 1 / (1000 * reports[0].days));
+  printRow("  compressor kWh/day", "%.3f", reports, &SimReport::compressorWh, 1 / (1000 * reports[0].days));
+  printRow("  heater kWh/day", "%.3f", reports, &SimReport::heaterWh, 1 / (1000 * reports[0].days));
+  printRow("  fan kWh/day", "%.3f", reports, &SimReport::fanWh, 1 / (1000 * reports[0].days));
+  printRow("compressor duty %", "%.1f", reports, &SimReport::compressorDuty, 100);
+  printCount("compressor starts", reports, &SimReport::compressorStarts);
+  printCount("defrosts", reports, &SimReport::defrosts);
+  printRow("defrost minutes", "%.1f", reports, &SimReport::defrostMinutes);
+  printRow("frost at defrost g", "%.0f", reports, &SimReport::frostAtDefrost);
+  printRow("max frost g", "%.0f", reports, &SimReport::maxFrost);
+  printRow("cabinet mean degC", "%.2f", reports, &SimReport::meanCabinet, 1, false);
+  printRow("cabinet stddev K", "%.3f", reports, &SimReport::stddevCabinet);
+  printRow("cabinet min degC", "%.2f", reports, &SimReport::minCabinet, 1, false);
+  printRow("cabinet max degC", "%.2f", reports, &SimReport::maxCabinet, 1, false);
+  printRow("outside band %", "%.2f", reports, &SimReport::outsideBand, 100);
+  printCount("door openings", reports, &SimReport::doorOpenings);
+  printCount("false fault raises", reports, &SimReport::falseRaises);
+  if (options.fault != SIM_FAULT_NONE) {
+    printRow("fault detected after h", "%.2f", reports, &SimReport::detectionHours, 1, false);
+  }
+  printf("\nsimulated in");
+  for (const SimReport &report : reports) printf(" %.2f s", report.wallSeconds);
+  printf("\n");
+  return 0;
+}